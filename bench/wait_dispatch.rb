@@ -0,0 +1,40 @@
+# -*- encoding: binary -*-
+# Measures how kgio_read dispatches to kgio_wait_readable on EAGAIN.
+#
+# A minimal Fiber scheduler makes the socket readable from its io_wait
+# hook, so every iteration is one EAGAIN, one call to the default
+# waiter (which calls io_wait directly) and one successful read,
+# without any thread switches adding noise.
+#
+#   ruby -Ilib -I$EXT_DIR bench/wait_dispatch.rb [iterations]
+require 'kgio'
+require 'benchmark'
+
+class WakeScheduler
+  def initialize(peer)
+    @peer = peer
+  end
+
+  def io_wait(io, events, timeout)
+    @peer.syswrite("x")
+    events
+  end
+
+  def block(blocker, timeout = nil); end
+  def unblock(blocker, fiber); end
+  def kernel_sleep(duration = nil); end
+  def fiber(&blk); Fiber.new(blocking: false, &blk).tap(&:resume); end
+  def close; end
+end
+
+n = (ARGV[0] || 500_000).to_i
+a, b = Kgio::UNIXSocket.pair
+Thread.new do
+  Fiber.set_scheduler(WakeScheduler.new(b))
+  Fiber.schedule do
+    buf = ''.b
+    a.kgio_read(1, buf) # warmup
+    t = Benchmark.realtime { n.times { a.kgio_read(1, buf) } }
+    printf("%d waits: %.3fs (%.0f ns/wait)\n", n, t, t * 1e9 / n)
+  end
+end.join
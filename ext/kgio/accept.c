@@ -1,6 +1,5 @@
 #include "kgio.h"
 #include "missing_accept4.h"
-#include "sock_for_fd.h"
 #include "my_fileno.h"
 #include "nonblock.h"
 
@@ -9,6 +8,9 @@ static VALUE cClientSocket;
 static VALUE cKgio_Socket;
 static VALUE mSocketMethods;
 static VALUE iv_kgio_addr;
+static VALUE iv_kgio_sockaddr;
+static VALUE iv_kgio_incoming_cpu;
+static VALUE sym_wait_readable, sym_timeout;
 
 #if defined(__linux__) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
 static int accept4_flags = SOCK_CLOEXEC;
@@ -23,6 +25,8 @@ struct accept_args {
 	socklen_t *addrlen;
 	VALUE accept_io;
 	VALUE accepted_class;
+	VALUE sniff_table; /* Qfalse unless sniffing */
+	VALUE sniff_default;
 };
 
 /*
@@ -110,6 +114,7 @@ prepare_accept(struct accept_args *a, VALUE self, int argc, const VALUE *argv)
 {
 	a->fd = my_fileno(self);
 	a->accept_io = self;
+	a->sniff_table = Qfalse;
 
 	switch (argc) {
 	case 2:
@@ -163,23 +168,130 @@ static VALUE in_addr_set(VALUE io, struct sockaddr_storage *addr, socklen_t len)
 #  define post_accept(a,b) for(;0;)
 #endif
 
+#ifdef SO_INCOMING_CPU
+/* records the CPU which received the first packets of a new client */
+static void incoming_cpu_set(VALUE io, int fd)
+{
+	socklen_t len = sizeof(int);
+	int cpu;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+	    cpu >= 0)
+		rb_ivar_set(io, iv_kgio_incoming_cpu, INT2FIX(cpu));
+}
+#else /* !SO_INCOMING_CPU */
+#  define incoming_cpu_set(io,fd) for(;0;)
+#endif /* !SO_INCOMING_CPU */
+
+/* flags set by Kgio.accept_cloexec= and Kgio.accept_nonblock= */
+int kgio_accept_flags(void)
+{
+	return accept4_flags;
+}
+
+/*
+ * wraps a newly accepted descriptor in a +klass+ object (the default
+ * accept class if nil) with kgio_addr set from +addr+
+ */
+VALUE kgio_client_new(VALUE accept_io, VALUE klass, int fd,
+                      struct sockaddr *addr, socklen_t addrlen)
+{
+	VALUE client_io;
+
+	if (NIL_P(klass))
+		klass = cClientSocket;
+	client_io = kgio_sock_for_fd(klass, fd);
+	post_accept(accept_io, client_io);
+	kgio_addr_set(client_io, addr, addrlen);
+	return client_io;
+}
+
+/* sets kgio_addr of +io+ from +addr+, Kgio::LOCALHOST if NULL or AF_UNIX */
+void kgio_addr_set(VALUE io, struct sockaddr *addr, socklen_t addrlen)
+{
+	if (addr && addr->sa_family != AF_UNIX)
+		in_addr_set(io, (struct sockaddr_storage *)addr, addrlen);
+	else
+		rb_ivar_set(io, iv_kgio_addr, localhost);
+}
+
+/*
+ * sacrifices the reserved descriptor to accept and close one
+ * connection, returns false with errno set if nothing was shed.
+ * The accept() is non-blocking and made without releasing the GVL,
+ * so no other thread may take the freed descriptor or shed again
+ * before the spare is reacquired.  A blocking listener is only made
+ * non-blocking for this one accept() so kgio_accept keeps sleeping
+ * in accept() afterwards.
+ */
+static int shed_one(struct accept_args *a)
+{
+	int fd, saved_errno = errno;
+	int flags = fcntl(a->fd, F_GETFL);
+
+	if (flags == -1) {
+		errno = saved_errno;
+		return 0;
+	}
+	if (!kgio_reserve_fd_release())
+		return 0;
+	if (!(flags & O_NONBLOCK) &&
+	    fcntl(a->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		errno = saved_errno;
+		kgio_reserve_fd_shed(-1);
+		return 0;
+	}
+	fd = (int)xaccept(a);
+	if (!(flags & O_NONBLOCK)) {
+		saved_errno = errno;
+		(void)fcntl(a->fd, F_SETFL, flags);
+		errno = saved_errno;
+	}
+	kgio_reserve_fd_shed(fd);
+	return fd >= 0;
+}
+
 static VALUE
 my_accept(struct accept_args *a, int force_nonblock)
 {
 	int client_fd;
-	VALUE client_io;
-	int retried = 0;
+	VALUE client_io, adm, klass;
+	int retried = 0, nonblock = force_nonblock;
+	int sniff_pending = 0;
+	VALUE deadline = force_nonblock ? Qnil : kgio_deadline(a->accept_io);
+	struct sockaddr_storage proxy_addr;
+	socklen_t proxy_len, addrlen;
+	int proxy_pending;
+	struct sockaddr *addr;
 
+	/*
+	 * a blocking accept would stall every Fiber of this Thread
+	 * or ignore the deadline
+	 */
+	if (!NIL_P(deadline) || (!nonblock && kgio_scheduler_active()))
+		nonblock = 1;
 retry:
-	client_fd = thread_accept(a, force_nonblock);
+	client_fd = thread_accept(a, nonblock);
 	if (client_fd < 0) {
+		if ((errno == EMFILE || errno == ENFILE) &&
+		    shed_one(a)) {
+			a->fd = my_fileno(a->accept_io);
+			goto retry;
+		}
 		switch (errno) {
 		case EAGAIN:
 			if (force_nonblock)
 				return Qnil;
 			a->fd = my_fileno(a->accept_io);
 			errno = EAGAIN;
-			(void)rb_io_wait_readable(a->fd);
+			if (!NIL_P(deadline)) {
+				if (!kgio_wait_deadline(a->accept_io, 0,
+				                        deadline))
+					return sym_timeout;
+			} else if (!nonblock ||
+			    kgio_scheduler_wait(a->accept_io, 0, Qnil) < 0) {
+				(void)rb_io_wait_readable(a->fd);
+			}
 			/* fall-through to EINTR case */
 #ifdef ECONNABORTED
 		case ECONNABORTED:
@@ -191,13 +303,16 @@ retry:
 			/* raise IOError if closed during sleep */
 			a->fd = my_fileno(a->accept_io);
 			goto retry;
-		case ENOMEM:
 		case EMFILE:
 		case ENFILE:
+			if (kgio_reserve_fd_enabled())
+				rb_sys_fail("accept");
+			/* fall-through */
+		case ENOMEM:
 #ifdef ENOBUFS
 		case ENOBUFS:
 #endif /* ENOBUFS */
-			if (!retried) {
+			if (!retried && !kgio_reserve_fd_enabled()) {
 				retried = 1;
 				errno = 0;
 				rb_gc();
@@ -207,14 +322,45 @@ retry:
 			rb_sys_fail("accept");
 		}
 	}
-	client_io = sock_for_fd(a->accepted_class, client_fd);
-	post_accept(a->accept_io, client_io);
-
-	if (a->addr)
-		in_addr_set(client_io,
-		            (struct sockaddr_storage *)a->addr, *a->addrlen);
-	else
-		rb_ivar_set(client_io, iv_kgio_addr, localhost);
+	addr = a->addr;
+	addrlen = a->addrlen ? *a->addrlen : 0;
+	proxy_pending = kgio_proxy_accept(a->accept_io, client_fd,
+	                                  &proxy_addr, &proxy_len);
+	if (proxy_pending < 0) {
+		a->fd = my_fileno(a->accept_io);
+		goto retry;
+	}
+	if (proxy_len) {
+		addr = (struct sockaddr *)&proxy_addr;
+		addrlen = proxy_len;
+	}
+	/* the address of the load balancer must not be charged */
+	adm = proxy_pending ? Qnil :
+	      kgio_admit(a->accept_io, client_fd, addr, addrlen);
+	if (adm == Qfalse) {
+		a->fd = my_fileno(a->accept_io);
+		goto retry;
+	}
+	/* the PROXY header is in the way, sniffing is up to the caller */
+	klass = a->accepted_class;
+	if (a->sniff_table != Qfalse) {
+		klass = proxy_pending ? Qundef :
+		        kgio_sniff(a->sniff_table, a->sniff_default, client_fd);
+		sniff_pending = klass == Qundef;
+		if (sniff_pending)
+			klass = a->sniff_default;
+	}
+	client_io = kgio_admitted_new(adm, a->accept_io, klass,
+	                              client_fd, addr, addrlen);
+	incoming_cpu_set(client_io, client_fd);
+	if (sniff_pending)
+		kgio_sniff_defer(client_io);
+	if (proxy_pending) {
+		kgio_proxy_defer(client_io);
+		kgio_admission_defer(a->accept_io, client_io);
+	} else if (proxy_len)
+		rb_ivar_set(client_io, iv_kgio_sockaddr,
+		            rb_str_new((const char *)&proxy_addr, proxy_len));
 	return client_io;
 }
 
@@ -238,6 +384,39 @@ static VALUE addr_bang(VALUE io)
 	return in_addr_set(io, &addr, len);
 }
 
+#ifdef SO_INCOMING_CPU
+/*
+ * call-seq:
+ *
+ *	io.kgio_incoming_cpu	-> Integer or nil
+ *
+ * Returns the CPU which processed the packets received for this
+ * socket (SO_INCOMING_CPU), or nil if unknown or unsupported by the
+ * kernel.  Handling a client on this CPU improves cache locality.
+ *
+ * Clients from kgio_accept, kgio_tryaccept and Kgio::Acceptor with
+ * per-CPU queues return the value recorded at accept time, even if
+ * later packets are processed elsewhere.  For other sockets, every
+ * call queries the kernel.
+ */
+static VALUE incoming_cpu(VALUE io)
+{
+	VALUE rv = rb_attr_get(io, iv_kgio_incoming_cpu);
+	socklen_t len = sizeof(int);
+	int cpu;
+
+	if (!NIL_P(rv))
+		return rv;
+	if (getsockopt(my_fileno(io), SOL_SOCKET, SO_INCOMING_CPU,
+	               &cpu, &len) != 0) {
+		if (errno == ENOPROTOOPT)
+			return Qnil;
+		rb_sys_fail("getsockopt(SO_INCOMING_CPU)");
+	}
+	return cpu < 0 ? Qnil : INT2FIX(cpu);
+}
+#endif /* SO_INCOMING_CPU */
+
 /*
  * call-seq:
  *
@@ -287,6 +466,8 @@ static VALUE tcp_tryaccept(int argc, VALUE *argv, VALUE self)
  *
  * On Ruby implementations using native threads, this can use a blocking
  * accept(2) (or accept4(2)) system call to avoid thundering herds.
+ * Non-blocking accept is used instead if a kgio_deadline is set, and
+ * :timeout is returned once the deadline passes.
  *
  * An optional +klass+ argument may be specified to override the
  * Kgio::Socket-class on a successful return value.
@@ -354,6 +535,8 @@ static VALUE unix_tryaccept(int argc, VALUE *argv, VALUE self)
  *
  * On Ruby implementations using native threads, this can use a blocking
  * accept(2) (or accept4(2)) system call to avoid thundering herds.
+ * Non-blocking accept is used instead if a kgio_deadline is set, and
+ * :timeout is returned once the deadline passes.
  *
  * An optional +klass+ argument may be specified to override the
  * Kgio::Socket-class on a successful return value.
@@ -374,6 +557,353 @@ static VALUE unix_accept(int argc, VALUE *argv, VALUE self)
 	return my_accept(&a, 0);
 }
 
+/*
+ * scratch space for the first read of kgio_tryaccept_read, the
+ * non-blocking recv() runs with the GVL held so it may be shared.
+ */
+static char first_read_buf[16384];
+
+static VALUE first_read(VALUE client_io, long len)
+{
+	char *ptr = first_read_buf;
+	VALUE buf = Qnil;
+	int fd = my_fileno(client_io);
+	ssize_t n;
+
+	if (len > (long)sizeof(first_read_buf)) {
+		buf = rb_str_new(NULL, len);
+		ptr = RSTRING_PTR(buf);
+	}
+retry:
+#ifdef MSG_DONTWAIT
+	n = recv(fd, ptr, len, MSG_DONTWAIT);
+#else
+	set_nonblocking(fd);
+	n = read(fd, ptr, len);
+#endif
+	if (n < 0) {
+		switch (errno) {
+		case EINTR:
+			fd = my_fileno(client_io);
+			goto retry;
+		case EAGAIN:
+			return sym_wait_readable;
+		case ECONNRESET: /* treat like EOF, it never sent anything */
+			errno = 0;
+			return Qnil;
+		}
+		rb_sys_fail("recv");
+	}
+	if (n == 0 && len > 0)
+		return Qnil;
+	if (NIL_P(buf))
+		return rb_str_new(ptr, n);
+	rb_str_set_len(buf, n);
+	return buf;
+}
+
+static VALUE
+tryaccept_read(struct accept_args *a, int argc, VALUE *argv, VALUE self)
+{
+	VALUE client_io;
+	long maxlen;
+
+	if (argc < 1)
+		rb_raise(rb_eArgError, "wrong number of arguments (0 for 1)");
+
+	/* raise before a client is accepted, not after */
+	maxlen = NUM2LONG(argv[0]);
+	if (maxlen < 0)
+		rb_raise(rb_eArgError, "negative length %ld given", maxlen);
+	prepare_accept(a, self, argc - 1, argv + 1);
+	client_io = my_accept(a, 1);
+	if (NIL_P(client_io))
+		return Qnil;
+
+	/* the PROXY header is in the way, reading is up to the caller */
+	if (kgio_proxy_pending(client_io))
+		return rb_assoc_new(client_io, sym_wait_readable);
+	return rb_assoc_new(client_io, first_read(client_io, maxlen));
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_read(maxlen) -> [ Kgio::Socket, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, klass) -> [ klass, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, nil, flags) -> [ Kgio::Socket, data ] or nil
+ *
+ * Like kgio_tryaccept, but also attempts a non-blocking read of up
+ * to +maxlen+ bytes from the new socket within the same call.  This
+ * is useful for protocols where clients speak first, especially with
+ * TCP_DEFER_ACCEPT where the request is usually already buffered.
+ *
+ * Returns nil if there is no connection to accept.  Otherwise
+ * returns a two-element Array of the accepted socket and the data
+ * read, :wait_readable if nothing has arrived, yet, or nil if the
+ * client disconnected without sending anything.
+ *
+ * The +klass+ and +flags+ arguments behave as they do for
+ * kgio_tryaccept.
+ *
+ * With kgio_proxy_protocol enabled, nothing is read from clients
+ * whose PROXY header has not fully arrived, yet; they are returned
+ * with :wait_readable and kgio_proxy_pending? set.  Call
+ * kgio_tryproxy on them before reading.
+ */
+static VALUE tcp_tryaccept_read(int argc, VALUE *argv, VALUE self)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+	struct accept_args a;
+
+	a.addr = (struct sockaddr *)&addr;
+	a.addrlen = &addrlen;
+	return tryaccept_read(&a, argc, argv, self);
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_read(maxlen) -> [ Kgio::Socket, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, klass) -> [ klass, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, nil, flags) -> [ Kgio::Socket, data ] or nil
+ *
+ * Same as Kgio::TCPServer#kgio_tryaccept_read, except the
+ * kgio_addr attribute is always Kgio::LOCALHOST.
+ */
+static VALUE unix_tryaccept_read(int argc, VALUE *argv, VALUE self)
+{
+	struct accept_args a;
+
+	a.addr = NULL;
+	a.addrlen = NULL;
+	return tryaccept_read(&a, argc, argv, self);
+}
+
+static VALUE
+tryaccept_sniff(struct accept_args *a, int argc, VALUE *argv, VALUE self)
+{
+	VALUE table, args[2];
+
+	rb_scan_args(argc, argv, "12", &table, &args[0], &args[1]);
+	table = kgio_sniff_table(table);
+	prepare_accept(a, self, NIL_P(args[1]) ? 1 : 2, args);
+	a->sniff_table = table;
+	a->sniff_default = a->accepted_class;
+	return my_accept(a, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_sniff(table) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass, flags) -> socket or nil
+ *
+ * Like kgio_tryaccept, but picks the class of the accepted socket
+ * by peeking at the first bytes sent by the client.  +table+ is a
+ * Hash mapping byte prefixes to classes, checked in insertion order:
+ *
+ *	table = {
+ *	  "\x16\x03" => TLSClient,
+ *	  "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" => H2Client,
+ *	}
+ *	client = srv.kgio_tryaccept_sniff(table, HTTPClient)
+ *
+ * The peeked data is not consumed.  Only data which already arrived
+ * is looked at, this never waits for more.  Clients matching no
+ * prefix get +klass+, which defaults to Kgio.accept_class.  So do
+ * clients which have not sent enough to decide, yet (nothing at all,
+ * or a partial match for a prefix ahead of any full match), so one
+ * slow client cannot hold up the others, but those also have
+ * Kgio::SocketMethods#kgio_sniff_pending? set.  Once such a client is
+ * readable, Kgio::SocketMethods#kgio_trysniff with the same +table+
+ * tells which class it would have gotten.  Prefixes may be up to 256
+ * bytes long.
+ *
+ * With kgio_proxy_protocol enabled, clients whose PROXY header has not
+ * fully arrived, yet, are not sniffed either and get +klass+ with
+ * both kgio_proxy_pending? and kgio_sniff_pending? set.  kgio_trysniff
+ * consumes the header before looking at the payload.
+ *
+ * Returns nil if there is no connection to accept.
+ */
+static VALUE tcp_tryaccept_sniff(int argc, VALUE *argv, VALUE self)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+	struct accept_args a;
+
+	a.addr = (struct sockaddr *)&addr;
+	a.addrlen = &addrlen;
+	return tryaccept_sniff(&a, argc, argv, self);
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_sniff(table) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass, flags) -> socket or nil
+ *
+ * Same as Kgio::TCPServer#kgio_tryaccept_sniff, except the
+ * kgio_addr attribute is always Kgio::LOCALHOST.
+ */
+static VALUE unix_tryaccept_sniff(int argc, VALUE *argv, VALUE self)
+{
+	struct accept_args a;
+
+	a.addr = NULL;
+	a.addrlen = NULL;
+	return tryaccept_sniff(&a, argc, argv, self);
+}
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+#include <sys/epoll.h>
+#include "broken_system_compat.h"
+#ifndef EPOLLEXCLUSIVE
+#  define EPOLLEXCLUSIVE (1U << 28) /* Linux 4.5+, ignored by older */
+#endif
+
+struct accept_any_args {
+	VALUE servers;
+	int epfd;
+	int timeout;
+	struct timespec deadline;
+	struct epoll_event ev;
+	struct accept_args a;
+};
+
+static VALUE nogvl_epoll_wait(void *ptr)
+{
+	struct accept_any_args *x = ptr;
+
+	return (VALUE)epoll_wait(x->epfd, &x->ev, 1, x->timeout);
+}
+
+/* updates x->timeout with the milliseconds left until x->deadline */
+static void accept_any_timeout(struct accept_any_args *x)
+{
+	struct timespec now;
+	long ms;
+
+	if (x->timeout <= 0)
+		return;
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	ms = (x->deadline.tv_sec - now.tv_sec) * 1000;
+	ms += (x->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	x->timeout = ms < 0 ? 0 : (int)ms;
+}
+
+static VALUE accept_any_wait(VALUE ptr)
+{
+	struct accept_any_args *x = (struct accept_any_args *)ptr;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	long i, n = RARRAY_LEN(x->servers);
+
+	for (i = 0; i < n; i++) {
+		int fd = my_fileno(rb_ary_entry(x->servers, i));
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.u64 = (uint64_t)i;
+		if (epoll_ctl(x->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			rb_sys_fail("epoll_ctl");
+	}
+
+	for (;;) {
+		long nr = (long)rb_thread_blocking_region(nogvl_epoll_wait, x,
+		                                          RUBY_UBF_IO, 0);
+		VALUE rv;
+
+		if (nr < 0) {
+			if (errno != EINTR)
+				rb_sys_fail("epoll_wait");
+			accept_any_timeout(x);
+			continue;
+		}
+		if (nr == 0)
+			return Qnil;
+
+		i = (long)x->ev.data.u64;
+		if (i >= RARRAY_LEN(x->servers))
+			rb_raise(rb_eRuntimeError, "servers modified during wait");
+		x->a.accept_io = rb_ary_entry(x->servers, i);
+		x->a.fd = my_fileno(x->a.accept_io);
+		addrlen = sizeof(struct sockaddr_storage);
+		x->a.addr = (struct sockaddr *)&addr;
+		x->a.addrlen = &addrlen;
+
+		/* another process may have won the race for this client */
+		rv = my_accept(&x->a, 1);
+		if (!NIL_P(rv))
+			return rv;
+		accept_any_timeout(x);
+	}
+}
+
+static VALUE accept_any_close(VALUE ptr)
+{
+	struct accept_any_args *x = (struct accept_any_args *)ptr;
+
+	(void)close(x->epfd);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.accept_any([tcp_srv, unix_srv], 1000) -> Kgio::Socket or nil
+ *	Kgio.accept_any(servers, timeout, klass = MySocket) -> MySocket or nil
+ *	Kgio.accept_any(servers, timeout, nil, flags) -> Kgio::Socket or nil
+ *
+ * Waits on every listener in the +servers+ Array at once and accepts
+ * a connection from whichever is ready first.  The returned socket
+ * has the kgio_addr attribute set like kgio_accept would.
+ *
+ * On Linux 4.5+, listeners are registered with EPOLLEXCLUSIVE, so
+ * only one of many processes waiting on the same listeners is woken
+ * for each new connection, avoiding thundering herds.  The wait is
+ * done without holding the GVL.
+ *
+ * Timeout is specified in Integer milliseconds like Kgio.poll, nil
+ * waits forever.  Returns nil if +timeout+ expires.
+ *
+ * The optional +klass+ and +flags+ arguments behave like they do for
+ * kgio_accept.
+ */
+static VALUE s_accept_any(int argc, VALUE *argv, VALUE mod)
+{
+	struct accept_any_args x;
+	VALUE timeout, klass, flags;
+
+	rb_scan_args(argc, argv, "13", &x.servers, &timeout, &klass, &flags);
+	Check_Type(x.servers, T_ARRAY);
+	x.timeout = NIL_P(timeout) ? -1 : NUM2INT(timeout);
+	if (x.timeout > 0) {
+		clock_gettime(hopefully_CLOCK_MONOTONIC, &x.deadline);
+		x.deadline.tv_sec += x.timeout / 1000;
+		x.deadline.tv_nsec += (x.timeout % 1000) * 1000000;
+		if (x.deadline.tv_nsec >= 1000000000) {
+			x.deadline.tv_sec++;
+			x.deadline.tv_nsec -= 1000000000;
+		}
+	}
+	x.a.flags = NIL_P(flags) ? accept4_flags : NUM2INT(flags);
+	x.a.accepted_class = NIL_P(klass) ? cClientSocket : klass;
+	x.a.sniff_table = Qfalse;
+
+	x.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (x.epfd < 0)
+		rb_sys_fail("epoll_create1");
+
+	return rb_ensure(accept_any_wait, (VALUE)&x,
+	                 accept_any_close, (VALUE)&x);
+}
+#endif /* HAVE_SYS_EPOLL_H && KGIO_HAVE_THREAD_CALL_WITHOUT_GVL */
+
 /*
  * call-seq:
  *
@@ -500,6 +1030,9 @@ void init_kgio_accept(void)
 	mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
 
 	rb_define_method(mSocketMethods, "kgio_addr!", addr_bang, 0);
+#ifdef SO_INCOMING_CPU
+	rb_define_method(mSocketMethods, "kgio_incoming_cpu", incoming_cpu, 0);
+#endif
 
 	rb_define_singleton_method(mKgio, "accept_cloexec?", get_cloexec, 0);
 	rb_define_singleton_method(mKgio, "accept_cloexec=", set_cloexec, 1);
@@ -507,6 +1040,11 @@ void init_kgio_accept(void)
 	rb_define_singleton_method(mKgio, "accept_nonblock=", set_nonblock, 1);
 	rb_define_singleton_method(mKgio, "accept_class=", set_accepted, 1);
 	rb_define_singleton_method(mKgio, "accept_class", get_accepted, 0);
+#if defined(HAVE_SYS_EPOLL_H) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+	if (check_clock() >= 0)
+		rb_define_singleton_method(mKgio, "accept_any",
+		                           s_accept_any, -1);
+#endif
 
 	/*
 	 * Document-class: Kgio::UNIXServer
@@ -518,6 +1056,12 @@ void init_kgio_accept(void)
 	cUNIXServer = rb_define_class_under(mKgio, "UNIXServer", cUNIXServer);
 	rb_define_method(cUNIXServer, "kgio_tryaccept", unix_tryaccept, -1);
 	rb_define_method(cUNIXServer, "kgio_accept", unix_accept, -1);
+	rb_define_method(cUNIXServer, "kgio_tryaccept_read",
+	                 unix_tryaccept_read, -1);
+	rb_define_method(cUNIXServer, "kgio_tryaccept_sniff",
+	                 unix_tryaccept_sniff, -1);
+	rb_define_method(cUNIXServer, "kgio_deadline=", kgio_set_deadline, 1);
+	rb_define_method(cUNIXServer, "kgio_deadline", kgio_deadline, 0);
 
 	/*
 	 * Document-class: Kgio::TCPServer
@@ -530,6 +1074,15 @@ void init_kgio_accept(void)
 
 	rb_define_method(cTCPServer, "kgio_tryaccept", tcp_tryaccept, -1);
 	rb_define_method(cTCPServer, "kgio_accept", tcp_accept, -1);
-	init_sock_for_fd();
+	rb_define_method(cTCPServer, "kgio_tryaccept_read",
+	                 tcp_tryaccept_read, -1);
+	rb_define_method(cTCPServer, "kgio_tryaccept_sniff",
+	                 tcp_tryaccept_sniff, -1);
+	rb_define_method(cTCPServer, "kgio_deadline=", kgio_set_deadline, 1);
+	rb_define_method(cTCPServer, "kgio_deadline", kgio_deadline, 0);
 	iv_kgio_addr = rb_intern("@kgio_addr");
+	iv_kgio_sockaddr = rb_intern("@kgio_sockaddr");
+	iv_kgio_incoming_cpu = rb_intern("@kgio_incoming_cpu");
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+	sym_timeout = ID2SYM(rb_intern("timeout"));
 }
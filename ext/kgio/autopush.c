@@ -191,6 +191,13 @@ void kgio_autopush_accept(VALUE accept_io, VALUE client_io)
 		state_set(client_io, AUTOPUSH_STATE_IGNORE);
 }
 
+/* forgets the state of a closed socket before it is reused */
+void kgio_autopush_reset(VALUE io)
+{
+	if (state_get(io) != AUTOPUSH_STATE_IGNORE)
+		state_set(io, AUTOPUSH_STATE_IGNORE);
+}
+
 void kgio_autopush_recv(VALUE io)
 {
 	if (enabled && (state_get(io) == AUTOPUSH_STATE_WRITTEN)) {
@@ -241,6 +248,7 @@ static void push_pending_data(VALUE io)
 #else /* !KGIO_NOPUSH */
 void kgio_autopush_recv(VALUE io){}
 void kgio_autopush_send(VALUE io){}
+void kgio_autopush_reset(VALUE io){}
 void init_kgio_autopush(void)
 {
 }
@@ -3,6 +3,11 @@
 #include "sock_for_fd.h"
 #include "blocking_io_region.h"
 
+static VALUE sym_wait_writable, sym_timeout;
+#ifndef HAVE_RB_STR_SUBSEQ
+#define rb_str_subseq rb_str_substr
+#endif
+
 static void close_fail(int fd, const char *msg)
 {
 	int saved_errno = errno;
@@ -11,30 +16,25 @@ static void close_fail(int fd, const char *msg)
 	rb_sys_fail(msg);
 }
 
-static int MY_SOCK_STREAM =
+static int MY_SOCK_FLAGS =
 #if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
 #  ifdef HAVE_RB_FD_FIX_CLOEXEC
-  (SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC)
+  (SOCK_NONBLOCK|SOCK_CLOEXEC)
 #  else
-  (SOCK_STREAM|SOCK_NONBLOCK)
+  (SOCK_NONBLOCK)
 #  endif
 #else
-  SOCK_STREAM
+  0
 #endif /* ! SOCK_NONBLOCK */
 ;
 
-/* do not set close-on-exec by default on Ruby <2.0.0 */
-#ifndef HAVE_RB_FD_FIX_CLOEXEC
-#  define rb_fd_fix_cloexec(fd) for (;0;)
-#endif /* HAVE_RB_FD_FIX_CLOEXEC */
-
 /* try to use SOCK_NONBLOCK and SOCK_CLOEXEC */
-static int my_socket(int domain)
+static int my_socket(int domain, int type)
 {
 	int fd;
 
 retry:
-	fd = socket(domain, MY_SOCK_STREAM, 0);
+	fd = socket(domain, type | MY_SOCK_FLAGS, 0);
 
 	if (fd < 0) {
 		switch (errno) {
@@ -43,13 +43,16 @@ retry:
 #ifdef ENOBUFS
 		case ENOBUFS:
 #endif /* ENOBUFS */
+			/* fail fast when shedding load, see Kgio.reserve_fd= */
+			if (kgio_reserve_fd_enabled())
+				break;
 			errno = 0;
 			rb_gc();
-			fd = socket(domain, MY_SOCK_STREAM, 0);
+			fd = socket(domain, type | MY_SOCK_FLAGS, 0);
 			break;
 		case EINVAL:
-			if (MY_SOCK_STREAM != SOCK_STREAM) {
-				MY_SOCK_STREAM = SOCK_STREAM;
+			if (MY_SOCK_FLAGS != 0) {
+				MY_SOCK_FLAGS = 0;
 				goto retry;
 			}
 		}
@@ -57,7 +60,7 @@ retry:
 			rb_sys_fail("socket");
 	}
 
-	if (MY_SOCK_STREAM == SOCK_STREAM) {
+	if (MY_SOCK_FLAGS == 0) {
 		if (fcntl(fd, F_SETFL, O_RDWR | O_NONBLOCK) < 0)
 			close_fail(fd, "fcntl(F_SETFL, O_RDWR | O_NONBLOCK)");
 		rb_fd_fix_cloexec(fd);
@@ -66,24 +69,102 @@ retry:
 	return fd;
 }
 
+#ifdef TCP_FASTOPEN_CONNECT
+/*
+ * With TCP_FASTOPEN_CONNECT, connect(2) returns immediately and the
+ * SYN is deferred until the first write so it may carry data.  Older
+ * kernels reject the option, so we fall back to a regular connect.
+ */
+static void tfo_connect_maybe(int fd)
+{
+	int val = 1;
+
+	if (!kgio_tfo)
+		return;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+	               &val, sizeof(val)) == 0)
+		return;
+	switch (errno) {
+	case ENOPROTOOPT:
+	case EOPNOTSUPP:
+	case EINVAL:
+		errno = 0;
+		return;
+	}
+	close_fail(fd, "setsockopt(TCP_FASTOPEN_CONNECT)");
+}
+#else /* ! TCP_FASTOPEN_CONNECT */
+#  define tfo_connect_maybe(fd) for (;0;)
+#endif /* ! TCP_FASTOPEN_CONNECT */
+
+/*
+ * maps the optional socket type argument of Kgio::UNIXSocket.new and
+ * Kgio::UNIXServer.new to SOCK_STREAM or SOCK_SEQPACKET
+ */
+int kgio_unix_socktype(VALUE type)
+{
+	int t;
+
+	if (NIL_P(type))
+		return SOCK_STREAM;
+	if (SYMBOL_P(type) || TYPE(type) == T_STRING) {
+		const char *name = SYMBOL_P(type) ?
+		                   rb_id2name(SYM2ID(type)) :
+		                   StringValueCStr(type);
+
+		if (!strcmp(name, "STREAM"))
+			return SOCK_STREAM;
+#ifdef SOCK_SEQPACKET
+		if (!strcmp(name, "SEQPACKET"))
+			return SOCK_SEQPACKET;
+#endif
+		rb_raise(rb_eArgError, "unsupported socket type: %s", name);
+	}
+	t = NUM2INT(type);
+	if (t == SOCK_STREAM)
+		return t;
+#ifdef SOCK_SEQPACKET
+	if (t == SOCK_SEQPACKET)
+		return t;
+#endif
+	rb_raise(rb_eArgError, "unsupported socket type: %d", t);
+	return -1;
+}
+
+/*
+ * a blocking connect with +deadline+ (a monotonic time or nil) returns
+ * :timeout and closes the socket if the deadline passes first
+ */
 static VALUE
-my_connect(VALUE klass, int io_wait, int domain, void *addr, socklen_t addrlen)
+my_connect(VALUE klass, int io_wait, int domain, int type,
+           void *addr, socklen_t addrlen, int fastopen, VALUE deadline)
 {
-	int fd = my_socket(domain);
+	int fd = my_socket(domain, type);
+	VALUE io;
+
+	if (fastopen)
+		tfo_connect_maybe(fd);
 
 	if (connect(fd, addr, addrlen) < 0) {
 		if (errno == EINPROGRESS) {
-			VALUE io = sock_for_fd(klass, fd);
-
+			io = sock_for_fd(klass, fd);
+			if (!NIL_P(deadline))
+				kgio_set_deadline(io, deadline);
 			if (io_wait) {
 				errno = EAGAIN;
-				(void)kgio_call_wait_writable(io);
+				if (kgio_call_wait_writable(io) == Qundef) {
+					rb_io_close(io);
+					return sym_timeout;
+				}
 			}
 			return io;
 		}
 		close_fail(fd, "connect");
 	}
-	return sock_for_fd(klass, fd);
+	io = sock_for_fd(klass, fd);
+	if (!NIL_P(deadline))
+		kgio_set_deadline(io, deadline);
+	return io;
 }
 
 static void
@@ -122,15 +203,17 @@ tcp_getaddr(struct addrinfo *hints, struct sockaddr_storage *addr,
 	freeaddrinfo(res);
 }
 
-static VALUE tcp_connect(VALUE klass, VALUE ip, VALUE port, int io_wait)
+static VALUE
+tcp_connect(VALUE klass, VALUE ip, VALUE port, int io_wait, int fastopen,
+            VALUE deadline)
 {
 	struct addrinfo hints;
 	struct sockaddr_storage addr;
 
 	tcp_getaddr(&hints, &addr, ip, port);
 
-	return my_connect(klass, io_wait, hints.ai_family,
-	                  &addr, hints.ai_addrlen);
+	return my_connect(klass, io_wait, hints.ai_family, SOCK_STREAM,
+	                  &addr, hints.ai_addrlen, fastopen, deadline);
 }
 
 static struct sockaddr *sockaddr_from(socklen_t *addrlen, VALUE addr)
@@ -144,9 +227,6 @@ static struct sockaddr *sockaddr_from(socklen_t *addrlen, VALUE addr)
 }
 
 #if defined(MSG_FASTOPEN) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
-#ifndef HAVE_RB_STR_SUBSEQ
-#define rb_str_subseq rb_str_substr
-#endif
 struct tfo_args {
 	int fd;
 	void *buf;
@@ -202,10 +282,71 @@ static VALUE fastopen(VALUE sock, VALUE buf, VALUE addr)
 }
 #endif /* MSG_FASTOPEN */
 
+#if defined(MSG_FASTOPEN) && defined(MSG_DONTWAIT)
+/*
+ * call-seq:
+ *
+ *	s = Kgio::Socket.new(:INET, :STREAM)
+ *	addr = Socket.pack_sockaddr_in(80, "example.com")
+ *	s.kgio_tryfastopen("hello world", addr) -> nil, String or :wait_writable
+ *
+ * Starts a TCP connection using TCP Fast Open without blocking.
+ * This uses sendto() with the MSG_DONTWAIT flag, so it is suitable
+ * for event-driven clients.
+ *
+ * Returns nil if the entire buffer was sent (possibly in the SYN).
+ *
+ * Returns a String containing the unsent portion if only part of
+ * the buffer could be sent.
+ *
+ * Returns :wait_writable if the connection is still being established
+ * or if the socket buffer is full and nothing was sent.  The caller
+ * should wait for writability and call this method again with the
+ * same arguments; subsequent calls on an established connection
+ * behave like kgio_trywrite.
+ */
+static VALUE tryfastopen(VALUE sock, VALUE buf, VALUE addr)
+{
+	VALUE str = (TYPE(buf) == T_STRING) ? buf : rb_obj_as_string(buf);
+	int fd = my_fileno(sock);
+	int flags = MSG_FASTOPEN | MSG_DONTWAIT;
+	size_t buflen = (size_t)RSTRING_LEN(str);
+	socklen_t addrlen;
+	struct sockaddr *sa = sockaddr_from(&addrlen, addr);
+	ssize_t w;
+
+retry:
+	w = sendto(fd, RSTRING_PTR(str), buflen, flags, sa, addrlen);
+	if (w < 0) {
+		switch (errno) {
+		case EINTR:
+			fd = my_fileno(sock);
+			goto retry;
+		case EISCONN: /* connected by a previous call */
+			flags = MSG_DONTWAIT;
+			sa = NULL;
+			addrlen = 0;
+			goto retry;
+		case EINPROGRESS: /* SYN sent without data (no cookie, yet) */
+		case EALREADY:
+		case EAGAIN:
+			errno = 0;
+			return sym_wait_writable;
+		}
+		rb_sys_fail("sendto");
+	}
+	if ((size_t)w == buflen)
+		return Qnil;
+
+	return rb_str_subseq(str, w, buflen - w);
+}
+#endif /* MSG_FASTOPEN && MSG_DONTWAIT */
+
 /*
  * call-seq:
  *
  *	Kgio::TCPSocket.new('127.0.0.1', 80) -> socket
+ *	Kgio::TCPSocket.new('127.0.0.1', 80, deadline) -> socket or :timeout
  *
  * Creates a new Kgio::TCPSocket object and initiates a
  * non-blocking connection.
@@ -213,19 +354,29 @@ static VALUE fastopen(VALUE sock, VALUE buf, VALUE addr)
  * This may block and call any method defined to +kgio_wait_writable+
  * for the class.
  *
+ * If a +deadline+ (a monotonic time, see
+ * Kgio::SocketMethods#kgio_deadline=) is given, :timeout is returned
+ * if it passes before the socket is writable, and the socket is
+ * closed.  Otherwise, +deadline+ becomes the kgio_deadline of the
+ * new socket.
+ *
  * Unlike the TCPSocket.new in Ruby, this does NOT perform DNS
  * lookups (which is subject to a different set of timeouts and
  * best handled elsewhere).
  */
-static VALUE kgio_tcp_connect(VALUE klass, VALUE ip, VALUE port)
+static VALUE kgio_tcp_connect(int argc, VALUE *argv, VALUE klass)
 {
-	return tcp_connect(klass, ip, port, 1);
+	VALUE ip, port, deadline;
+
+	rb_scan_args(argc, argv, "21", &ip, &port, &deadline);
+	return tcp_connect(klass, ip, port, 1, 0, deadline);
 }
 
 /*
  * call-seq:
  *
  *	Kgio::TCPSocket.start('127.0.0.1', 80) -> socket
+ *	Kgio::TCPSocket.start('127.0.0.1', 80, true) -> socket
  *
  * Creates a new Kgio::TCPSocket object and initiates a
  * non-blocking connection.  The caller should select/poll
@@ -233,20 +384,31 @@ static VALUE kgio_tcp_connect(VALUE klass, VALUE ip, VALUE port)
  * or optimistically attempt a write and handle :wait_writable
  * or Errno::EAGAIN.
  *
+ * If the optional third argument is true and the system supports
+ * TCP_FASTOPEN_CONNECT (Linux 4.11+), the SYN is deferred until the
+ * first kgio_write/kgio_trywrite so it may carry data and save a
+ * round trip.  The connection is started normally on systems without
+ * TCP_FASTOPEN_CONNECT.
+ *
  * Unlike the TCPSocket.new in Ruby, this does NOT perform DNS
  * lookups (which is subject to a different set of timeouts and
  * best handled elsewhere).
  */
-static VALUE kgio_tcp_start(VALUE klass, VALUE ip, VALUE port)
+static VALUE kgio_tcp_start(int argc, VALUE *argv, VALUE klass)
 {
-	return tcp_connect(klass, ip, port, 0);
+	VALUE ip, port, fastopen;
+
+	rb_scan_args(argc, argv, "21", &ip, &port, &fastopen);
+	return tcp_connect(klass, ip, port, 0, RTEST(fastopen), Qnil);
 }
 
-static VALUE unix_connect(VALUE klass, VALUE path, int io_wait)
+static VALUE unix_connect(int argc, VALUE *argv, VALUE klass, int io_wait)
 {
 	struct sockaddr_un addr = { 0 };
+	VALUE path, type;
 	long len;
 
+	rb_scan_args(argc, argv, "11", &path, &type);
 	StringValue(path);
 	len = RSTRING_LEN(path);
 	if ((long)sizeof(addr.sun_path) <= len)
@@ -257,39 +419,52 @@ static VALUE unix_connect(VALUE klass, VALUE path, int io_wait)
 	memcpy(addr.sun_path, RSTRING_PTR(path), len);
 	addr.sun_family = AF_UNIX;
 
-	return my_connect(klass, io_wait, PF_UNIX, &addr, sizeof(addr));
+	return my_connect(klass, io_wait, PF_UNIX, kgio_unix_socktype(type),
+	                  &addr, sizeof(addr), 0, Qnil);
 }
 
 /*
  * call-seq:
  *
  *	Kgio::UNIXSocket.new("/path/to/unix/socket") -> socket
+ *	Kgio::UNIXSocket.new("/path/to/unix/socket", :SEQPACKET) -> socket
  *
  * Creates a new Kgio::UNIXSocket object and initiates a
  * non-blocking connection.
  *
+ * The optional socket type may be :STREAM (the default) or
+ * :SEQPACKET (or the matching Socket::SOCK_* constant) to connect
+ * to a Kgio::UNIXServer created with the same type.  With
+ * :SEQPACKET, every kgio_write or kgio_trywrite sends one message
+ * which is never split, and every kgio_read or kgio_tryread returns
+ * at most one message.  A message longer than the +maxlen+ given to
+ * kgio_read or kgio_tryread raises Errno::EMSGSIZE (the rest of it is
+ * lost), and empty messages are indistinguishable from EOF.
+ *
  * This may block and call any method defined to +kgio_wait_writable+
  * for the class.
  */
-static VALUE kgio_unix_connect(VALUE klass, VALUE path)
+static VALUE kgio_unix_connect(int argc, VALUE *argv, VALUE klass)
 {
-	return unix_connect(klass, path, 1);
+	return unix_connect(argc, argv, klass, 1);
 }
 
 /*
  * call-seq:
  *
  *	Kgio::UNIXSocket.start("/path/to/unix/socket") -> socket
+ *	Kgio::UNIXSocket.start("/path/to/unix/socket", :SEQPACKET) -> socket
  *
  * Creates a new Kgio::UNIXSocket object and initiates a
  * non-blocking connection.  The caller should select/poll
  * on the socket for writability before attempting to write
  * or optimistically attempt a write and handle :wait_writable
- * or Errno::EAGAIN.
+ * or Errno::EAGAIN.  See Kgio::UNIXSocket.new for the optional
+ * socket type.
  */
-static VALUE kgio_unix_start(VALUE klass, VALUE path)
+static VALUE kgio_unix_start(int argc, VALUE *argv, VALUE klass)
 {
-	return unix_connect(klass, path, 0);
+	return unix_connect(argc, argv, klass, 0);
 }
 
 static VALUE stream_connect(VALUE klass, VALUE addr, int io_wait)
@@ -306,7 +481,8 @@ static VALUE stream_connect(VALUE klass, VALUE addr, int io_wait)
 		rb_raise(rb_eArgError, "invalid address family");
 	}
 
-	return my_connect(klass, io_wait, domain, sockaddr, addrlen);
+	return my_connect(klass, io_wait, domain, SOCK_STREAM,
+	                  sockaddr, addrlen, 0, Qnil);
 }
 
 /* call-seq:
@@ -383,6 +559,9 @@ void init_kgio_connect(void)
 	rb_define_singleton_method(cKgio_Socket, "start", kgio_start, 1);
 #if defined(MSG_FASTOPEN) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
 	rb_define_method(cKgio_Socket, "kgio_fastopen", fastopen, 2);
+#endif
+#if defined(MSG_FASTOPEN) && defined(MSG_DONTWAIT)
+	rb_define_method(cKgio_Socket, "kgio_tryfastopen", tryfastopen, 2);
 #endif
 	/*
 	 * Document-class: Kgio::TCPSocket
@@ -393,8 +572,8 @@ void init_kgio_connect(void)
 	cTCPSocket = rb_const_get(rb_cObject, rb_intern("TCPSocket"));
 	cTCPSocket = rb_define_class_under(mKgio, "TCPSocket", cTCPSocket);
 	rb_include_module(cTCPSocket, mSocketMethods);
-	rb_define_singleton_method(cTCPSocket, "new", kgio_tcp_connect, 2);
-	rb_define_singleton_method(cTCPSocket, "start", kgio_tcp_start, 2);
+	rb_define_singleton_method(cTCPSocket, "new", kgio_tcp_connect, -1);
+	rb_define_singleton_method(cTCPSocket, "start", kgio_tcp_start, -1);
 
 	/*
 	 * Document-class: Kgio::UNIXSocket
@@ -405,7 +584,9 @@ void init_kgio_connect(void)
 	cUNIXSocket = rb_const_get(rb_cObject, rb_intern("UNIXSocket"));
 	cUNIXSocket = rb_define_class_under(mKgio, "UNIXSocket", cUNIXSocket);
 	rb_include_module(cUNIXSocket, mSocketMethods);
-	rb_define_singleton_method(cUNIXSocket, "new", kgio_unix_connect, 1);
-	rb_define_singleton_method(cUNIXSocket, "start", kgio_unix_start, 1);
+	rb_define_singleton_method(cUNIXSocket, "new", kgio_unix_connect, -1);
+	rb_define_singleton_method(cUNIXSocket, "start", kgio_unix_start, -1);
 	init_sock_for_fd();
+	sym_wait_writable = ID2SYM(rb_intern("wait_writable"));
+	sym_timeout = ID2SYM(rb_intern("timeout"));
 }
@@ -21,7 +21,26 @@ have_func("getnameinfo", %w(sys/types.h sys/socket.h netdb.h)) or
 have_type("struct sockaddr_storage", %w(sys/types.h sys/socket.h)) or
   abort "struct sockaddr_storage required"
 have_func('accept4', %w(sys/socket.h))
+have_func('recvmmsg', %w(sys/socket.h))
+have_func('sendmmsg', %w(sys/socket.h))
+have_header('linux/filter.h')
+have_header('linux/unix_diag.h')
+have_header('linux/inet_diag.h')
+have_header('sys/epoll.h')
+have_header('linux/io_uring.h')
 have_header("sys/select.h")
+have_header('sys/eventfd.h')
+have_header('pthread.h')
+if try_link(<<EOS)
+int main(void)
+{
+	unsigned long x = 0;
+	__atomic_store_n(&x, 1, __ATOMIC_RELEASE);
+	return (int)__atomic_fetch_add(&x, 1, __ATOMIC_RELAXED);
+}
+EOS
+  $defs << '-DHAVE_GCC_ATOMIC_BUILTINS'
+end
 
 have_func("writev", "sys/uio.h")
 
@@ -53,6 +72,7 @@ have_func('rb_thread_io_blocking_region')
 have_func('rb_str_set_len')
 have_func('rb_time_interval')
 have_func('rb_wait_for_single_fd')
+have_func('rb_fiber_scheduler_current', %w(ruby.h ruby/fiber/scheduler.h))
 have_func('rb_str_subseq')
 have_func('rb_ary_subseq')
 
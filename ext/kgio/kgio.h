@@ -38,13 +38,60 @@ void init_kgio_connect(void);
 void init_kgio_autopush(void);
 void init_kgio_poll(void);
 void init_kgio_tryopen(void);
+void init_kgio_listen(void);
+void init_kgio_reserve_fd(void);
+void init_kgio_admission(void);
+void init_kgio_proxy_protocol(void);
+void init_kgio_sniff(void);
+void init_kgio_pool(void);
+void init_kgio_acceptor(void);
+void init_kgio_fdpass(void);
+void init_kgio_udp(void);
+void init_kgio_reactor(void);
+void init_kgio_ring(void);
+void init_kgio_timer_wheel(void);
+void init_kgio_notifier(void);
 
 void kgio_autopush_accept(VALUE, VALUE);
 void kgio_autopush_recv(VALUE);
 void kgio_autopush_send(VALUE);
+void kgio_autopush_reset(VALUE);
+
+int kgio_reserve_fd_enabled(void);
+int kgio_reserve_fd_release(void);
+void kgio_reserve_fd_shed(int fd);
+
+VALUE kgio_admit(VALUE srv, int fd, const struct sockaddr *, socklen_t);
+VALUE kgio_admitted_new(VALUE adm, VALUE srv, VALUE klass, int fd,
+                        struct sockaddr *, socklen_t);
+void kgio_admission_done(VALUE io);
+void kgio_admission_defer(VALUE srv, VALUE io);
+int kgio_admission_resume(VALUE io, struct sockaddr_storage *, socklen_t);
+int kgio_proxy_accept(VALUE srv, int fd,
+                      struct sockaddr_storage *, socklen_t *);
+void kgio_proxy_defer(VALUE client);
+int kgio_proxy_pending(VALUE io);
+VALUE kgio_tryproxy(VALUE io);
+VALUE kgio_sniff_table(VALUE table);
+VALUE kgio_sniff(VALUE table, VALUE dflt, int fd);
+void kgio_sniff_defer(VALUE client);
+VALUE kgio_sock_for_fd(VALUE klass, int fd);
+VALUE kgio_client_new(VALUE accept_io, VALUE klass, int fd,
+                      struct sockaddr *addr, socklen_t addrlen);
+int kgio_accept_flags(void);
+void kgio_addr_set(VALUE io, struct sockaddr *, socklen_t);
+
+int kgio_unix_socktype(VALUE type);
 
 VALUE kgio_call_wait_writable(VALUE io);
 VALUE kgio_call_wait_readable(VALUE io);
+int kgio_scheduler_active(void);
+int kgio_scheduler_wait(VALUE io, int write_p, VALUE timeout);
+VALUE kgio_deadline(VALUE io);
+VALUE kgio_set_deadline(VALUE io, VALUE deadline);
+int kgio_wait_deadline(VALUE io, int write_p, VALUE deadline);
+int kgio_timer_wheel_timeout(VALUE wheel);
+VALUE kgio_timer_wheel_expire(VALUE wheel, VALUE keep);
 #if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
 #  define KGIO_HAVE_THREAD_CALL_WITHOUT_GVL 1
 typedef  void *(*kgio_blocking_fn_t)(void*);
@@ -62,6 +109,11 @@ typedef  void *(*kgio_blocking_fn_t)(void*);
 #  define rb_update_max_fd(fd) for (;0;)
 #endif
 
+/* do not set close-on-exec by default on Ruby <2.0.0 */
+#ifndef HAVE_RB_FD_FIX_CLOEXEC
+#  define rb_fd_fix_cloexec(fd) for (;0;)
+#endif /* HAVE_RB_FD_FIX_CLOEXEC */
+
 /*
  * 2012/12/13 - Linux 3.7 was released on 2012/12/10 with TFO.
  * Headers distributed with glibc will take some time to catch up and
@@ -75,6 +127,12 @@ typedef  void *(*kgio_blocking_fn_t)(void*);
 #  endif
 #  ifndef TCP_FASTOPEN
 #    define TCP_FASTOPEN	23 /* for listeners */
+#  endif
+#  ifndef TCP_FASTOPEN_CONNECT
+#    define TCP_FASTOPEN_CONNECT	30 /* for clients, Linux 4.11+ */
+#  endif
+#  ifndef SO_INCOMING_CPU
+#    define SO_INCOMING_CPU	49 /* Linux 3.19+ */
 #  endif
    /* we _may_ have TFO support */
 #  define KGIO_TFO_MAYBE (1)
@@ -32,16 +32,33 @@ static void tfo_maybe(void)
 	rb_define_const(mKgio, "MSG_FASTOPEN", INT2NUM(MSG_FASTOPEN));
 	kgio_tfo = 1;
 #endif
+#if defined(TCP_FASTOPEN_CONNECT)
+	rb_define_const(mKgio, "TCP_FASTOPEN_CONNECT",
+	                INT2NUM(TCP_FASTOPEN_CONNECT));
+#endif
 }
 
 void Init_kgio_ext(void)
 {
 	tfo_maybe();
+	init_kgio_reserve_fd();
 	init_kgio_wait();
 	init_kgio_read_write();
 	init_kgio_connect();
 	init_kgio_accept();
+	init_kgio_listen();
+	init_kgio_admission();
+	init_kgio_proxy_protocol();
+	init_kgio_sniff();
+	init_kgio_pool();
+	init_kgio_acceptor();
+	init_kgio_fdpass();
+	init_kgio_udp();
+	init_kgio_reactor();
+	init_kgio_ring();
 	init_kgio_autopush();
+	init_kgio_timer_wheel();
+	init_kgio_notifier();
 	init_kgio_poll();
 	init_kgio_tryopen();
 }
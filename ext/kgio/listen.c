@@ -0,0 +1,750 @@
+/*
+ * Listener setup, tuning and statistics for Kgio::TCPServer (and
+ * Kgio::UNIXServer).  These only wrap socket(2), setsockopt(2),
+ * listen(2) and sock_diag(7) so operators do not need to know the raw
+ * option numbers for their platform.
+ */
+#include "kgio.h"
+#include "my_fileno.h"
+#include "sock_for_fd.h"
+#include <netinet/tcp.h>
+#include <stdio.h>
+#ifdef HAVE_LINUX_FILTER_H
+#  include <linux/filter.h>
+#  ifndef SO_ATTACH_REUSEPORT_CBPF
+#    define SO_ATTACH_REUSEPORT_CBPF 51 /* Linux 4.5+ */
+#  endif
+#endif
+#if defined(HAVE_LINUX_UNIX_DIAG_H) || defined(HAVE_LINUX_INET_DIAG_H)
+#  include <linux/netlink.h>
+#  include <linux/rtnetlink.h>
+#  include <linux/sock_diag.h>
+#endif
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+#  include <sys/stat.h>
+#  include <linux/unix_diag.h>
+#endif
+#ifdef HAVE_LINUX_INET_DIAG_H
+#  include <linux/inet_diag.h>
+#endif
+
+static ID id_fastopen, id_defer_accept, id_backlog;
+static VALUE sym_queued, sym_backlog, sym_overflows, sym_drops;
+static VALUE sym_syn_queued;
+
+static void set_int_opt(int fd, int level, int optname, VALUE val,
+                        const char *msg)
+{
+	int ival = NUM2INT(val);
+
+	if (setsockopt(fd, level, optname, &ival, sizeof(ival)) != 0)
+		rb_sys_fail(msg);
+}
+
+static int tune_i(VALUE key, VALUE val, VALUE io)
+{
+	int fd = my_fileno(io);
+	ID id;
+
+	if (TYPE(key) != T_SYMBOL)
+		rb_raise(rb_eArgError, "tuning option must be a Symbol");
+	id = SYM2ID(key);
+
+	if (id == id_fastopen) {
+		if (!kgio_tfo)
+			rb_raise(rb_eNotImpError, "TCP Fast Open not supported");
+		set_int_opt(fd, IPPROTO_TCP, TCP_FASTOPEN, val,
+		            "setsockopt(TCP_FASTOPEN)");
+	} else if (id == id_defer_accept) {
+#ifdef TCP_DEFER_ACCEPT
+		set_int_opt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, val,
+		            "setsockopt(TCP_DEFER_ACCEPT)");
+#else
+		rb_raise(rb_eNotImpError, "TCP_DEFER_ACCEPT not supported");
+#endif
+	} else if (id == id_backlog) {
+		/* listen(2) on a listening socket only updates the backlog */
+		if (listen(fd, NUM2INT(val)) != 0)
+			rb_sys_fail("listen");
+	} else {
+		rb_raise(rb_eArgError, "unknown tuning option: %s",
+		         rb_id2name(id));
+	}
+	return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tune(:fastopen => 1024, :defer_accept => 5) -> srv
+ *
+ * Applies tuning options to a listening Kgio::TCPServer.  Recognized
+ * options are:
+ *
+ * - :fastopen - TCP Fast Open queue length (TCP_FASTOPEN)
+ * - :defer_accept - seconds to wait for data before waking the
+ *   acceptor (TCP_DEFER_ACCEPT, Linux-only)
+ * - :backlog - new listen(2) backlog
+ *
+ * With :defer_accept, kgio_accept and kgio_tryaccept only return
+ * connections which already have data to read.
+ */
+static VALUE kgio_tune(VALUE io, VALUE opts)
+{
+	Check_Type(opts, T_HASH);
+	rb_hash_foreach(opts, tune_i, io);
+
+	return io;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::TCPServer.new(host, port) -> srv
+ *	Kgio::TCPServer.new(host, port, :fastopen => 1024) -> srv
+ *
+ * Identical to TCPServer.new, except a trailing Hash of tuning
+ * options may be passed to Kgio::TCPServer#kgio_tune.
+ */
+static VALUE tcp_server_init(int argc, VALUE *argv, VALUE io)
+{
+	VALUE opts = Qnil;
+
+	if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH)
+		opts = argv[--argc];
+	rb_call_super(argc, argv);
+	if (!NIL_P(opts))
+		kgio_tune(io, opts);
+
+	return io;
+}
+
+#ifdef __linux__
+/*
+ * reads the requested TcpExt counters from /proc/net/netstat, these
+ * are per network namespace since Linux does not track them per socket
+ */
+static int tcpext_read(const char *const *names, unsigned long *vals, int n)
+{
+	char *hdr = NULL, *nums = NULL;
+	size_t hdr_len = 0, nums_len = 0;
+	FILE *fp = fopen("/proc/net/netstat", "r");
+	int found = 0;
+
+	if (!fp)
+		return -1;
+	while (getline(&hdr, &hdr_len, fp) > 0) {
+		char *k, *v, *ksave, *vsave;
+
+		if (strncmp(hdr, "TcpExt:", 7) != 0)
+			continue;
+		if (getline(&nums, &nums_len, fp) <= 0)
+			break;
+
+		k = strtok_r(hdr + 7, " \n", &ksave);
+		v = strtok_r(nums + 7, " \n", &vsave);
+		for (; k && v; k = strtok_r(NULL, " \n", &ksave),
+		               v = strtok_r(NULL, " \n", &vsave)) {
+			int i;
+
+			for (i = 0; i < n; i++) {
+				if (strcmp(k, names[i]) == 0) {
+					vals[i] = strtoul(v, NULL, 10);
+					found++;
+				}
+			}
+		}
+		break;
+	}
+	free(hdr);
+	free(nums);
+	fclose(fp);
+
+	return found;
+}
+
+static const char *const tune_counters[] = {
+	"TCPFastOpenPassive",
+	"TCPFastOpenPassiveFail",
+	"TCPFastOpenListenOverflow",
+	"TCPDeferAcceptDrop"
+};
+
+static const char *const tune_keys[] = {
+	"fastopen_passive",
+	"fastopen_passive_fail",
+	"fastopen_listen_overflow",
+	"defer_accept_drop"
+};
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tune_stats -> Hash or nil
+ *
+ * Returns a Hash of kernel counters relevant to kgio_tune options:
+ *
+ * - :fastopen_passive - connections accepted with data in the SYN
+ * - :fastopen_passive_fail - TFO attempts that fell back to 3WHS
+ * - :fastopen_listen_overflow - TFO requests over the queue length
+ * - :defer_accept_drop - connections dropped by TCP_DEFER_ACCEPT
+ *
+ * The kernel tracks these per network namespace, not per listener,
+ * so they cover every listener in the namespace.  Returns nil if the
+ * counters are unavailable.  Linux-only.
+ */
+static VALUE kgio_tune_stats(VALUE io)
+{
+	unsigned long vals[ARRAY_SIZE(tune_counters)] = { 0 };
+	VALUE rv;
+	size_t i;
+
+	if (tcpext_read(tune_counters, vals, ARRAY_SIZE(tune_counters)) <= 0)
+		return Qnil;
+
+	rv = rb_hash_new();
+	for (i = 0; i < ARRAY_SIZE(tune_counters); i++)
+		rb_hash_aset(rv, ID2SYM(rb_intern(tune_keys[i])),
+		             ULONG2NUM(vals[i]));
+	return rv;
+}
+
+static const char *const listen_counters[] = {
+	"ListenOverflows",
+	"ListenDrops"
+};
+
+#ifdef HAVE_LINUX_INET_DIAG_H
+/* true if the local address +src+ of a request is bound to +addr+ */
+static int src_match(const struct sockaddr_storage *addr, int family,
+                     const __be32 *src)
+{
+	if (addr->ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const void *)addr;
+
+		return sin->sin_addr.s_addr == INADDR_ANY ||
+		       sin->sin_addr.s_addr == src[0];
+	} else {
+		const struct sockaddr_in6 *sin6 = (const void *)addr;
+
+		if (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr))
+			return 1;
+		return family == AF_INET6 &&
+		       memcmp(&sin6->sin6_addr, src, 16) == 0;
+	}
+}
+
+/*
+ * counts SYN_RECV requests of +family+ for the listener bound to
+ * +addr+ with a sock_diag(7) dump, returns -1 with errno on failure
+ */
+static long syn_recv_count(const struct sockaddr_storage *addr, int family)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} msg;
+	union {
+		struct nlmsghdr nlh;
+		char buf[8192];
+	} rsp;
+	struct sockaddr_nl nladdr;
+	unsigned short port = ((const struct sockaddr_in *)addr)->sin_port;
+	long count = 0;
+	int fd, err = 0;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	msg.req.sdiag_family = family;
+	msg.req.sdiag_protocol = IPPROTO_TCP;
+	msg.req.idiag_states = 1 << TCP_SYN_RECV;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	if (sendto(fd, &msg, sizeof(msg), 0,
+	           (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		err = errno;
+		goto out;
+	}
+	for (;;) {
+		struct nlmsghdr *nlh = &rsp.nlh;
+		ssize_t n = recv(fd, &rsp, sizeof(rsp), 0);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			goto out;
+		}
+		for (; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+			struct inet_diag_msg *r;
+
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				goto out;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+				err = -e->error;
+				goto out;
+			}
+			r = NLMSG_DATA(nlh);
+			if (r->id.idiag_sport == port &&
+			    src_match(addr, family, r->id.idiag_src))
+				count++;
+		}
+		if (n == 0) {
+			err = EPROTO;
+			goto out;
+		}
+	}
+out:
+	(void)close(fd);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return count;
+}
+
+/*
+ * returns the number of connections in the SYN queue of the listener
+ * +fd+, IPv4 requests to dual-stack IPv6 listeners are reported in
+ * the IPv4 family so both are dumped
+ */
+static long syn_queued(int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	long v4 = 0, v6 = 0;
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+		return -1;
+	if (addr.ss_family == AF_INET6) {
+		v6 = syn_recv_count(&addr, AF_INET6);
+		if (v6 < 0)
+			return -1;
+	}
+	v4 = syn_recv_count(&addr, AF_INET);
+	return v4 < 0 ? -1 : v4 + v6;
+}
+#endif /* HAVE_LINUX_INET_DIAG_H */
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_listener_stats		-> Hash
+ *	srv.kgio_listener_stats(true)	-> Hash
+ *
+ * Returns the state of the accept queue of a listening socket:
+ *
+ * - :queued - connections waiting to be accepted
+ * - :backlog - the maximum number of connections which may wait
+ *
+ * These come from TCP_INFO for this socket, so this is a single
+ * getsockopt(2) cheap enough to call periodically from a supervisor.
+ *
+ * If +true+ is given, the following are also returned:
+ *
+ * - :syn_queued - connections which have not completed the handshake
+ * - :overflows - connections dropped because the accept queue was full
+ * - :drops - SYNs and connections dropped for any reason
+ *
+ * Linux only exposes the SYN queue as SYN_RECV request sockets, so
+ * :syn_queued is counted with a sock_diag(7) dump of every SYN_RECV
+ * request in the network namespace (like <tt>ss state syn-recv</tt>),
+ * which costs time proportional to the number of half-open connections.
+ * Requests answered with SYN cookies are not queued and not counted.
+ * It covers every listener bound to the same address and port, such
+ * as the members of a reuseport_group.  Linux does not track overflows
+ * and drops per socket, so those are the ListenOverflows and
+ * ListenDrops counters of the network namespace read from
+ * /proc/net/netstat, as shown by <tt>nstat</tt>; compare successive
+ * calls to see rates.
+ */
+static VALUE tcp_listener_stats(int argc, VALUE *argv, VALUE io)
+{
+	unsigned long vals[ARRAY_SIZE(listen_counters)] = { 0 };
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int fd = my_fileno(io);
+	VALUE rv, all;
+
+	rb_scan_args(argc, argv, "01", &all);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		rb_sys_fail("getsockopt(TCP_INFO)");
+	if (info.tcpi_state != TCP_LISTEN)
+		rb_raise(rb_eArgError, "not a listening socket");
+
+	rv = rb_hash_new();
+	rb_hash_aset(rv, sym_queued, UINT2NUM(info.tcpi_unacked));
+	rb_hash_aset(rv, sym_backlog, UINT2NUM(info.tcpi_sacked));
+	if (!RTEST(all))
+		return rv;
+#ifdef HAVE_LINUX_INET_DIAG_H
+	{
+		long n = syn_queued(fd);
+
+		if (n < 0)
+			rb_sys_fail("sock_diag");
+		rb_hash_aset(rv, sym_syn_queued, LONG2NUM(n));
+	}
+#endif /* HAVE_LINUX_INET_DIAG_H */
+	if (tcpext_read(listen_counters, vals, ARRAY_SIZE(vals)) > 0) {
+		rb_hash_aset(rv, sym_overflows, ULONG2NUM(vals[0]));
+		rb_hash_aset(rv, sym_drops, ULONG2NUM(vals[1]));
+	}
+	return rv;
+}
+
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+/* asks sock_diag for the receive queue info of the socket at +ino+ */
+static int unix_diag_rqlen(unsigned ino, struct unix_diag_rqlen *out)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct unix_diag_req req;
+	} msg;
+	union {
+		struct nlmsghdr nlh;
+		char buf[1024];
+	} rsp;
+	struct sockaddr_nl nladdr;
+	struct unix_diag_msg *udm;
+	struct rtattr *rta;
+	ssize_t n;
+	int len, fd, err, rc = -1;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (fd < 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	msg.nlh.nlmsg_flags = NLM_F_REQUEST;
+	msg.req.sdiag_family = AF_UNIX;
+	msg.req.udiag_states = ~0U;
+	msg.req.udiag_ino = ino;
+	msg.req.udiag_show = UDIAG_SHOW_RQLEN;
+	msg.req.udiag_cookie[0] = msg.req.udiag_cookie[1] = ~0U;
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	errno = 0;
+	if (sendto(fd, &msg, sizeof(msg), 0,
+	           (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0)
+		goto out;
+	do {
+		n = recv(fd, &rsp, sizeof(rsp), 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0 || !NLMSG_OK(&rsp.nlh, n))
+		goto out;
+	if (rsp.nlh.nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *e = NLMSG_DATA(&rsp.nlh);
+
+		errno = -e->error;
+		goto out;
+	}
+	if (rsp.nlh.nlmsg_type != SOCK_DIAG_BY_FAMILY)
+		goto out;
+
+	udm = NLMSG_DATA(&rsp.nlh);
+	len = rsp.nlh.nlmsg_len - NLMSG_LENGTH(sizeof(*udm));
+	for (rta = (struct rtattr *)(udm + 1); RTA_OK(rta, len);
+	     rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == UNIX_DIAG_RQLEN) {
+			memcpy(out, RTA_DATA(rta), sizeof(*out));
+			rc = 0;
+			break;
+		}
+	}
+out:
+	err = rc ? (errno ? errno : ENOENT) : 0;
+	(void)close(fd);
+	errno = err;
+	return rc;
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_listener_stats -> Hash
+ *
+ * Returns the state of the accept queue of a listening socket:
+ *
+ * - :queued - connections waiting to be accepted
+ * - :backlog - the maximum number of connections which may wait
+ *
+ * These are queried from the kernel with a sock_diag(7) netlink
+ * request, which requires the unix_diag module on Linux.
+ */
+static VALUE unix_listener_stats(VALUE io)
+{
+	struct unix_diag_rqlen rqlen;
+	struct stat st;
+	VALUE rv;
+
+	if (fstat(my_fileno(io), &st) < 0)
+		rb_sys_fail("fstat");
+	if (unix_diag_rqlen((unsigned)st.st_ino, &rqlen) < 0)
+		rb_sys_fail("sock_diag");
+
+	rv = rb_hash_new();
+	rb_hash_aset(rv, sym_queued, UINT2NUM(rqlen.udiag_rqueue));
+	rb_hash_aset(rv, sym_backlog, UINT2NUM(rqlen.udiag_wqueue));
+	return rv;
+}
+#endif /* HAVE_LINUX_UNIX_DIAG_H */
+#endif /* __linux__ */
+
+#ifdef SO_REUSEPORT
+static void listen_addr(struct sockaddr_storage *addr, socklen_t *addrlen,
+                        VALUE ip, VALUE port)
+{
+	struct addrinfo hints, *res;
+	char ipport[6];
+	int rc;
+
+	rc = snprintf(ipport, sizeof(ipport), "%u", (unsigned)NUM2UINT(port));
+	if (rc >= (int)sizeof(ipport) || rc <= 0)
+		rb_raise(rb_eArgError, "invalid TCP port");
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	/* disallow non-deterministic DNS lookups */
+	hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+
+	rc = getaddrinfo(StringValueCStr(ip), ipport, &hints, &res);
+	if (rc != 0)
+		rb_raise(rb_eArgError, "getaddrinfo(%s:%s): %s",
+		         StringValueCStr(ip), ipport, gai_strerror(rc));
+	*addrlen = res->ai_addrlen;
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+}
+
+static int reuseport_listener(struct sockaddr_storage *addr, socklen_t len)
+{
+	int val = 1;
+	int fd = socket(addr->ss_family, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		return -1;
+	rb_fd_fix_cloexec(fd);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0 ||
+	    bind(fd, (struct sockaddr *)addr, len) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		int saved_errno = errno;
+
+		(void)close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+#if defined(HAVE_LINUX_FILTER_H) && defined(SKF_AD_CPU)
+/*
+ * steers each new connection to listener (receiving CPU % n), the
+ * program applies to the entire SO_REUSEPORT group
+ */
+static int attach_cpu_cbpf(int fd, long n)
+{
+	struct sock_filter code[] = {
+		/* A = raw_smp_processor_id() */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		/* A = A % n */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned)n },
+		/* return A */
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog;
+
+	prog.len = (unsigned short)(sizeof(code) / sizeof(code[0]));
+	prog.filter = code;
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	                  &prog, sizeof(prog));
+}
+#else /* !SKF_AD_CPU */
+static int attach_cpu_cbpf(int fd, long n)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif /* !SKF_AD_CPU */
+
+struct group_args {
+	VALUE klass;
+	VALUE rv;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	long n;
+	int cpu;
+};
+
+/* wraps each listener as soon as it exists, so failures may close it */
+static VALUE group_create(VALUE ptr)
+{
+	struct group_args *g = (struct group_args *)ptr;
+	long i;
+	int fd;
+
+	for (i = 0; i < g->n; i++) {
+		fd = reuseport_listener(&g->addr, g->addrlen);
+		if (fd < 0)
+			rb_sys_fail("reuseport_group");
+		rb_ary_push(g->rv, sock_for_fd(g->klass, fd));
+
+		/* the remaining listeners must share the ephemeral port */
+		if (i == 0 && getsockname(fd, (struct sockaddr *)&g->addr,
+		                          &g->addrlen) < 0)
+			rb_sys_fail("getsockname");
+	}
+
+	if (g->cpu && attach_cpu_cbpf(my_fileno(rb_ary_entry(g->rv, 0)),
+	                              g->n) < 0)
+		rb_sys_fail("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+	return g->rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::TCPServer.reuseport_group('0.0.0.0', 80, 4) -> [ srv, ... ]
+ *	Kgio::TCPServer.reuseport_group('0.0.0.0', 80, 4, true) -> [ srv, ... ]
+ *
+ * Creates an Array of +n+ listeners bound to the same address with
+ * SO_REUSEPORT, so each worker may accept from its own queue instead
+ * of contending on a single shared listener.  Workers should close
+ * the members of the group they do not use.
+ *
+ * If +port+ is zero, all listeners share the port picked by the
+ * kernel for the first one.
+ *
+ * If the optional fourth argument is true, a classic BPF program is
+ * attached (SO_ATTACH_REUSEPORT_CBPF, Linux 4.5+) which steers each
+ * connection to the listener at index (receiving CPU % n).  With +n+
+ * equal to the number of CPUs and each worker pinned to its CPU,
+ * connections are handled on the CPU which received them.
+ */
+static VALUE reuseport_group(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE ip, port, nr, cpu;
+	struct group_args g;
+	long i;
+	int state;
+
+	rb_scan_args(argc, argv, "31", &ip, &port, &nr, &cpu);
+	g.n = NUM2LONG(nr);
+	if (g.n <= 0 || g.n > 65536)
+		rb_raise(rb_eArgError, "invalid listener count: %ld", g.n);
+	listen_addr(&g.addr, &g.addrlen, ip, port);
+	g.klass = klass;
+	g.cpu = RTEST(cpu);
+	g.rv = rb_ary_new();
+
+	rb_protect(group_create, (VALUE)&g, &state);
+	if (state) {
+		for (i = 0; i < RARRAY_LEN(g.rv); i++)
+			rb_io_close(rb_ary_entry(g.rv, i));
+		rb_jump_tag(state);
+	}
+	return g.rv;
+}
+#endif /* SO_REUSEPORT */
+
+/*
+ * call-seq:
+ *
+ *	Kgio::UNIXServer.new("/path/to/unix/socket") -> srv
+ *	Kgio::UNIXServer.new("/path/to/unix/socket", :SEQPACKET) -> srv
+ *
+ * Identical to UNIXServer.new, except an optional socket type of
+ * :STREAM (the default) or :SEQPACKET may be given.  Clients
+ * accepted from a :SEQPACKET server preserve message boundaries,
+ * see Kgio::UNIXSocket.new.
+ */
+static VALUE unix_server_new(int argc, VALUE *argv, VALUE klass)
+{
+	struct sockaddr_un addr = { 0 };
+	VALUE path, type;
+	int fd, socktype;
+	long len;
+
+	rb_scan_args(argc, argv, "11", &path, &type);
+	socktype = kgio_unix_socktype(type);
+	if (socktype == SOCK_STREAM)
+		return rb_call_super(1, &path);
+
+	StringValue(path);
+	len = RSTRING_LEN(path);
+	if ((long)sizeof(addr.sun_path) <= len)
+		rb_raise(rb_eArgError,
+		         "too long unix socket path (max: %dbytes)",
+		         (int)sizeof(addr.sun_path)-1);
+	memcpy(addr.sun_path, RSTRING_PTR(path), len);
+	addr.sun_family = AF_UNIX;
+
+#ifdef SOCK_CLOEXEC
+	fd = socket(AF_UNIX, socktype | SOCK_CLOEXEC, 0);
+	if (fd < 0 && errno == EINVAL)
+#endif
+		fd = socket(AF_UNIX, socktype, 0);
+	if (fd < 0)
+		rb_sys_fail("socket");
+	rb_fd_fix_cloexec(fd);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		int saved_errno = errno;
+
+		(void)close(fd);
+		errno = saved_errno;
+		rb_sys_fail(RSTRING_PTR(path));
+	}
+	return sock_for_fd(klass, fd);
+}
+
+void init_kgio_listen(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cTCPServer = rb_const_get(mKgio, rb_intern("TCPServer"));
+	VALUE cUNIXServer = rb_const_get(mKgio, rb_intern("UNIXServer"));
+
+	id_fastopen = rb_intern("fastopen");
+	id_defer_accept = rb_intern("defer_accept");
+	id_backlog = rb_intern("backlog");
+	sym_queued = ID2SYM(rb_intern("queued"));
+	sym_backlog = ID2SYM(id_backlog);
+	sym_overflows = ID2SYM(rb_intern("overflows"));
+	sym_drops = ID2SYM(rb_intern("drops"));
+	sym_syn_queued = ID2SYM(rb_intern("syn_queued"));
+	init_sock_for_fd();
+
+	rb_define_method(cTCPServer, "initialize", tcp_server_init, -1);
+	rb_define_method(cTCPServer, "kgio_tune", kgio_tune, 1);
+	rb_define_singleton_method(cUNIXServer, "new", unix_server_new, -1);
+#ifdef SO_REUSEPORT
+	rb_define_singleton_method(cTCPServer, "reuseport_group",
+	                           reuseport_group, -1);
+#endif
+#ifdef __linux__
+	rb_define_method(cTCPServer, "kgio_tune_stats", kgio_tune_stats, 0);
+	rb_define_method(cTCPServer, "kgio_listener_stats",
+	                 tcp_listener_stats, -1);
+#  ifdef HAVE_LINUX_UNIX_DIAG_H
+	rb_define_method(cUNIXServer, "kgio_listener_stats",
+	                 unix_listener_stats, 0);
+#  endif
+#endif
+}
@@ -11,7 +11,7 @@
 #  include <st.h>
 #endif
 
-static VALUE sym_wait_readable, sym_wait_writable;
+static VALUE sym_wait_readable, sym_wait_writable, sym_timeout;
 static ID id_clear;
 
 struct poll_args {
@@ -19,6 +19,7 @@ struct poll_args {
 	nfds_t nfds;
 	int timeout;
 	VALUE ios;
+	VALUE wheel;
 	st_table *fd_to_io;
 	struct timespec start;
 };
@@ -136,6 +137,18 @@ static VALUE poll_result(int nr, struct poll_args *a)
 	return a->ios;
 }
 
+/* ready IOs keep their events and their timers, the rest time out */
+static VALUE add_expired(struct poll_args *a)
+{
+	VALUE expired = kgio_timer_wheel_expire(a->wheel, a->ios);
+	long i;
+
+	for (i = 0; i < RARRAY_LEN(expired); i++) {
+		rb_hash_aset(a->ios, rb_ary_entry(expired, i), sym_timeout);
+	}
+	return RHASH_SIZE(a->ios) ? a->ios : Qnil;
+}
+
 static VALUE do_poll(VALUE args)
 {
 	struct poll_args *a = (struct poll_args *)args;
@@ -156,9 +169,16 @@ retry:
 		}
 		rb_sys_fail("poll");
 	}
-	if (nr == 0) return Qnil;
+	if (NIL_P(a->wheel)) {
+		if (nr == 0) return Qnil;
+		return poll_result(nr, a);
+	}
 
-	return poll_result(nr, a);
+	if (nr == 0)
+		rb_funcall(a->ios, id_clear, 0);
+	else
+		poll_result(nr, a);
+	return add_expired(a);
 }
 
 /*
@@ -166,6 +186,7 @@ retry:
  *
  *	Kgio.poll({ $stdin => :wait_readable }, 100)  -> hash or nil
  *	Kgio.poll({ $stdin => Kgio::POLLIN }, 100)  -> hash or nil
+ *	Kgio.poll({ $stdin => :wait_readable }, nil, wheel)  -> hash or nil
  *
  * Accepts an input hash with IO objects to wait for as the key and
  * the events to wait for as its value.  The events may either be
@@ -190,6 +211,14 @@ retry:
  *	Kgio::POLLHUP     - hang up
  *	Kgio::POLLNVAL    - invalid request (bad file descriptor)
  *
+ * If a Kgio::TimerWheel is given as +wheel+, poll(2) waits no longer
+ * than the nearest timer in it.  Every IO whose timer expired by the
+ * time poll(2) returns and which is not ready is disarmed and added to
+ * the returned hash with +:timeout+ as its value.  Expired IOs do not
+ * need to be in the input hash.  Ready IOs keep their timers armed,
+ * so they may be rearmed or cancelled after being serviced; if they
+ * are not, they are reported as expired by the next call.
+ *
  * This method is only available under Ruby 1.9 or any other
  * implementations that uses native threads and rb_thread_blocking_region()
  */
@@ -198,8 +227,14 @@ static VALUE s_poll(int argc, VALUE *argv, VALUE self)
 	VALUE timeout;
 	struct poll_args a;
 
-	rb_scan_args(argc, argv, "11", &a.ios, &timeout);
+	rb_scan_args(argc, argv, "12", &a.ios, &timeout, &a.wheel);
 	a.timeout = num2timeout(timeout);
+	if (!NIL_P(a.wheel)) {
+		int ms = kgio_timer_wheel_timeout(a.wheel);
+
+		if (ms >= 0 && (a.timeout < 0 || ms < a.timeout))
+			a.timeout = ms;
+	}
 	a.fds = NULL;
 	a.fd_to_io = NULL;
 
@@ -216,6 +251,7 @@ void init_kgio_poll(void)
 
 	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
 	sym_wait_writable = ID2SYM(rb_intern("wait_writable"));
+	sym_timeout = ID2SYM(rb_intern("timeout"));
 	id_clear = rb_intern("clear");
 
 #define c(x) rb_define_const(mKgio,#x,INT2NUM((int)x))
@@ -0,0 +1,456 @@
+/*
+ * Kgio::Reactor owns a set of epoll(7) registrations and does the
+ * non-blocking reads and buffered writes for ready descriptors itself,
+ * so Ruby code only sees one block call per event with the data
+ * already read (or the news that pending writes were flushed).
+ * Registrations are level-triggered, and the wait is done without
+ * the GVL.
+ */
+#include "kgio.h"
+#if defined(HAVE_SYS_EPOLL_H) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+#include <sys/epoll.h>
+#include "my_fileno.h"
+#include "nonblock.h"
+
+struct reactor {
+	int epfd;
+	int maxevents;
+	int running; /* inside run_once, events[] is in use */
+	struct epoll_event *events;
+	char *buf;
+	long buflen;
+	VALUE ios; /* { fd => io } */
+	VALUE pending; /* { fd => unwritten String } */
+};
+
+struct wait_args {
+	struct reactor *r;
+	int timeout;
+	long maxlen;
+};
+
+static VALUE sym_flushed, sym_queued;
+#ifndef HAVE_RB_STR_SUBSEQ
+#define rb_str_subseq rb_str_substr
+#endif
+
+static void reactor_mark(void *ptr)
+{
+	struct reactor *r = ptr;
+
+	rb_gc_mark(r->ios);
+	rb_gc_mark(r->pending);
+}
+
+static void reactor_free(void *ptr)
+{
+	struct reactor *r = ptr;
+
+	if (r->epfd >= 0)
+		(void)close(r->epfd);
+	xfree(r->events);
+	xfree(r->buf);
+	xfree(r);
+}
+
+static VALUE reactor_alloc(VALUE klass)
+{
+	struct reactor *r;
+	VALUE self = Data_Make_Struct(klass, struct reactor,
+	                              reactor_mark, reactor_free, r);
+
+	memset(r, 0, sizeof(struct reactor));
+	r->epfd = -1;
+	r->ios = Qnil;
+	r->pending = Qnil;
+	return self;
+}
+
+static struct reactor *reactor_of(VALUE self)
+{
+	struct reactor *r;
+
+	Data_Get_Struct(self, struct reactor, r);
+	if (r->epfd < 0)
+		rb_raise(rb_eIOError, "closed reactor");
+	return r;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Reactor.new		-> reactor
+ *	Kgio::Reactor.new(maxevents)	-> reactor
+ *
+ * Creates a new reactor which handles up to +maxevents+ (default: 64)
+ * ready descriptors per Kgio::Reactor#run_once call.
+ */
+static VALUE reactor_init(int argc, VALUE *argv, VALUE self)
+{
+	struct reactor *r;
+	VALUE maxevents;
+	int n;
+
+	Data_Get_Struct(self, struct reactor, r);
+	rb_scan_args(argc, argv, "01", &maxevents);
+	n = NIL_P(maxevents) ? 64 : NUM2INT(maxevents);
+	if (n <= 0)
+		rb_raise(rb_eArgError, "maxevents must be positive");
+	if (r->epfd >= 0)
+		rb_raise(rb_eRuntimeError, "already initialized");
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0)
+		rb_sys_fail("epoll_create1");
+	r->maxevents = n;
+	r->events = ALLOC_N(struct epoll_event, n);
+	r->ios = rb_hash_new();
+	r->pending = rb_hash_new();
+	return self;
+}
+
+static void reactor_ctl(struct reactor *r, int op, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.u64 = (uint64_t)fd;
+	if (epoll_ctl(r->epfd, op, fd, &ev) < 0)
+		rb_sys_fail("epoll_ctl");
+}
+
+/*
+ * call-seq:
+ *
+ *	reactor.add(io)	-> reactor
+ *
+ * Registers +io+ (a socket or pipe) for reading.  +io+ is made
+ * non-blocking.  Kgio::Reactor#delete must be called before +io+ is
+ * closed, unless it reached EOF, which deregisters it automatically.
+ */
+static VALUE reactor_add(VALUE self, VALUE io)
+{
+	struct reactor *r = reactor_of(self);
+	int fd = my_fileno(io);
+
+	set_nonblocking(fd);
+	reactor_ctl(r, EPOLL_CTL_ADD, fd, EPOLLIN);
+	rb_hash_aset(r->ios, INT2FIX(fd), io);
+	return self;
+}
+
+static void reactor_forget(struct reactor *r, int fd)
+{
+	(void)epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+	rb_hash_delete(r->ios, INT2FIX(fd));
+	rb_hash_delete(r->pending, INT2FIX(fd));
+}
+
+/*
+ * call-seq:
+ *
+ *	reactor.delete(io)	-> io or nil
+ *
+ * Deregisters +io+ and discards any writes still queued for it.
+ * Returns +io+, or +nil+ if it was not registered.
+ */
+static VALUE reactor_delete(VALUE self, VALUE io)
+{
+	struct reactor *r = reactor_of(self);
+	int fd = my_fileno(io);
+	VALUE cur = rb_hash_lookup(r->ios, INT2FIX(fd));
+
+	if (cur != io)
+		return Qnil;
+	reactor_forget(r, fd);
+	return io;
+}
+
+/*
+ * writes as much of +str+ as possible to +fd+, returns the unwritten
+ * portion (+nil+ if everything was written) or +Qundef+ with errno set
+ */
+static VALUE try_write(int fd, VALUE str)
+{
+	long len = RSTRING_LEN(str);
+	long off = 0;
+
+	while (off < len) {
+		ssize_t n = write(fd, RSTRING_PTR(str) + off, len - off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return Qundef;
+		}
+		off += n;
+	}
+	if (off == len)
+		return Qnil;
+	return off ? rb_str_subseq(str, off, len - off) : str;
+}
+
+/*
+ * call-seq:
+ *
+ *	reactor.write(io, str)	-> nil or :queued
+ *
+ * Writes +str+ to the registered +io+ right away if possible and
+ * returns +nil+.  Whatever cannot be written without blocking is
+ * queued and :queued is returned; Kgio::Reactor#run_once writes the
+ * queue out once +io+ is writable and yields :flushed when it is
+ * empty.  Writes queued for the same +io+ are kept in order.
+ */
+static VALUE reactor_write(VALUE self, VALUE io, VALUE str)
+{
+	struct reactor *r = reactor_of(self);
+	int fd = my_fileno(io);
+	VALUE key = INT2FIX(fd);
+	VALUE queued, rest;
+
+	if (rb_hash_lookup(r->ios, key) != io)
+		rb_raise(rb_eArgError, "IO not registered with this reactor");
+	StringValue(str);
+
+	queued = rb_hash_lookup(r->pending, key);
+	if (!NIL_P(queued)) {
+		rb_str_buf_append(queued, str);
+		return sym_queued;
+	}
+
+	rest = try_write(fd, str);
+	if (rest == Qundef)
+		rb_sys_fail("write");
+	if (NIL_P(rest))
+		return Qnil;
+
+	/* keep our own copy, the caller may modify str */
+	rb_hash_aset(r->pending, key, rb_str_dup(rest));
+	reactor_ctl(r, EPOLL_CTL_MOD, fd, EPOLLIN | EPOLLOUT);
+	return sym_queued;
+}
+
+static VALUE nogvl_epoll_wait(void *ptr)
+{
+	struct wait_args *w = ptr;
+
+	return (VALUE)epoll_wait(w->r->epfd, w->r->events,
+	                         w->r->maxevents, w->timeout);
+}
+
+/* forgets +fd+ and yields the error from errno instead of raising it */
+static void yield_error(struct reactor *r, int fd, VALUE io, const char *msg)
+{
+	VALUE exc = rb_syserr_new(errno, msg);
+
+	reactor_forget(r, fd);
+	rb_yield_values(2, io, exc);
+}
+
+/* writes out the queue for +fd+, returns false if +fd+ was dropped */
+static int flush_pending(struct reactor *r, int fd, VALUE io)
+{
+	VALUE key = INT2FIX(fd);
+	VALUE queued = rb_hash_lookup(r->pending, key);
+	VALUE rest;
+
+	if (NIL_P(queued))
+		return 1;
+	rest = try_write(fd, queued);
+	if (rest == Qundef) {
+		yield_error(r, fd, io, "write");
+		return 0;
+	}
+	if (!NIL_P(rest)) {
+		if (rest != queued)
+			rb_hash_aset(r->pending, key, rest);
+		return 1;
+	}
+	rb_hash_delete(r->pending, key);
+	reactor_ctl(r, EPOLL_CTL_MOD, fd, EPOLLIN);
+	rb_yield_values(2, io, sym_flushed);
+
+	/* the block may have deleted or replaced io */
+	return rb_hash_lookup(r->ios, key) == io;
+}
+
+static void read_ready(struct reactor *r, int fd, VALUE io, long maxlen)
+{
+	ssize_t n;
+
+	do {
+		n = read(fd, r->buf, maxlen);
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0) {
+		rb_yield_values(2, io, rb_str_new(r->buf, n));
+	} else if (n == 0) {
+		reactor_forget(r, fd);
+		rb_yield_values(2, io, Qnil);
+	} else if (errno != EAGAIN) {
+		yield_error(r, fd, io, "read");
+	}
+}
+
+static VALUE run_events(VALUE ptr)
+{
+	struct wait_args *w = (struct wait_args *)ptr;
+	struct reactor *r = w->r;
+	int i, nr;
+
+	nr = (int)(long)rb_thread_blocking_region(nogvl_epoll_wait, w,
+	                                    RUBY_UBF_IO, 0);
+	if (nr < 0) {
+		if (errno == EINTR)
+			return INT2FIX(0);
+		rb_sys_fail("epoll_wait");
+	}
+
+	for (i = 0; i < nr; i++) {
+		uint32_t events = r->events[i].events;
+		int fd = (int)r->events[i].data.u64;
+		VALUE io = rb_hash_lookup(r->ios, INT2FIX(fd));
+
+		/* deregistered by the block for an earlier event */
+		if (NIL_P(io))
+			continue;
+		if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+		    !flush_pending(r, fd, io))
+			continue;
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			read_ready(r, fd, io, w->maxlen);
+	}
+	return INT2FIX(nr);
+}
+
+static VALUE run_done(VALUE ptr)
+{
+	struct wait_args *w = (struct wait_args *)ptr;
+
+	w->r->running = 0;
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	reactor.run_once { |io, data| ... }			-> Integer
+ *	reactor.run_once(timeout_ms, maxlen) { |io, data| ... }	-> Integer
+ *
+ * Waits up to +timeout_ms+ milliseconds (forever if +nil+, the
+ * default) for registered IOs to become ready, then handles every
+ * ready IO and calls the block for each event with one of:
+ *
+ * - a String of up to +maxlen+ (default: 16384) bytes read from +io+
+ * - +nil+ if +io+ reached EOF, it is no longer registered
+ * - :flushed if all writes queued for +io+ were written
+ * - an Errno exception if reading or writing failed, +io+ is no
+ *   longer registered
+ *
+ * Returns the number of ready IOs, zero if +timeout_ms+ expired or
+ * the wait was interrupted.  The block may add, delete and write to
+ * IOs, but may not call run_once on the same reactor.
+ */
+static VALUE reactor_run_once(int argc, VALUE *argv, VALUE self)
+{
+	struct reactor *r = reactor_of(self);
+	struct wait_args w;
+	VALUE timeout, maxlen;
+	long len;
+
+	rb_need_block();
+	rb_scan_args(argc, argv, "02", &timeout, &maxlen);
+	len = NIL_P(maxlen) ? 16384 : NUM2LONG(maxlen);
+	if (len <= 0)
+		rb_raise(rb_eArgError, "maxlen must be positive");
+	if (r->running)
+		rb_raise(rb_eRuntimeError, "run_once called recursively");
+	if (r->buflen < len) {
+		REALLOC_N(r->buf, char, len);
+		r->buflen = len;
+	}
+
+	w.r = r;
+	w.timeout = NIL_P(timeout) ? -1 : NUM2INT(timeout);
+	w.maxlen = len;
+	r->running = 1;
+	return rb_ensure(run_events, (VALUE)&w, run_done, (VALUE)&w);
+}
+
+/*
+ * call-seq:
+ *
+ *	reactor.size	-> Integer
+ *
+ * Returns the number of registered IOs
+ */
+static VALUE reactor_size(VALUE self)
+{
+	return LONG2NUM(RHASH_SIZE(reactor_of(self)->ios));
+}
+
+/*
+ * call-seq:
+ *
+ *	reactor.close	-> nil
+ *
+ * Releases the epoll descriptor and forgets every registered IO
+ * (without closing them) and any queued writes.
+ */
+static VALUE reactor_close(VALUE self)
+{
+	struct reactor *r = reactor_of(self);
+
+	if (r->running)
+		rb_raise(rb_eRuntimeError, "close called inside run_once");
+	(void)close(r->epfd);
+	r->epfd = -1;
+	rb_hash_clear(r->ios);
+	rb_hash_clear(r->pending);
+	return Qnil;
+}
+
+void init_kgio_reactor(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cReactor;
+
+	sym_flushed = ID2SYM(rb_intern("flushed"));
+	sym_queued = ID2SYM(rb_intern("queued"));
+
+	/*
+	 * Document-class: Kgio::Reactor
+	 *
+	 * An epoll-based event loop which reads from ready IOs and
+	 * flushes queued writes natively, calling Ruby once per event.
+	 *
+	 *	reactor = Kgio::Reactor.new
+	 *	reactor.add(client)
+	 *	loop do
+	 *	  reactor.run_once(1000) do |io, data|
+	 *	    case data
+	 *	    when String then reactor.write(io, data) # echo
+	 *	    when nil, Exception then io.close
+	 *	    end
+	 *	  end
+	 *	end
+	 *
+	 * This is only available on Linux.
+	 */
+	cReactor = rb_define_class_under(mKgio, "Reactor", rb_cObject);
+	rb_define_alloc_func(cReactor, reactor_alloc);
+	rb_define_method(cReactor, "initialize", reactor_init, -1);
+	rb_define_method(cReactor, "add", reactor_add, 1);
+	rb_define_method(cReactor, "delete", reactor_delete, 1);
+	rb_define_method(cReactor, "write", reactor_write, 2);
+	rb_define_method(cReactor, "run_once", reactor_run_once, -1);
+	rb_define_method(cReactor, "size", reactor_size, 0);
+	rb_define_method(cReactor, "close", reactor_close, 0);
+}
+#else /* ! (HAVE_SYS_EPOLL_H && KGIO_HAVE_THREAD_CALL_WITHOUT_GVL) */
+void init_kgio_reactor(void)
+{
+}
+#endif /* ! (HAVE_SYS_EPOLL_H && KGIO_HAVE_THREAD_CALL_WITHOUT_GVL) */
@@ -13,7 +13,7 @@ static ssize_t assert_writev(int fd, void* iov, int len)
 }
 #  define writev assert_writev
 #endif
-static VALUE sym_wait_readable, sym_wait_writable;
+static VALUE sym_wait_readable, sym_wait_writable, sym_timeout;
 static VALUE eErrno_EPIPE, eErrno_ECONNRESET;
 static ID id_set_backtrace;
 #ifndef HAVE_RB_STR_SUBSEQ
@@ -53,6 +53,99 @@ NORETURN(static void my_eof_error(void));
 NORETURN(static void wr_sys_fail(const char *));
 NORETURN(static void rd_sys_fail(const char *));
 
+#ifdef KGIO_HAVE_THREAD_CALL_WITHOUT_GVL
+#  include "blocking_io_region.h"
+/* set by Kgio.nogvl_threshold=, a negative value disables */
+static long nogvl_threshold = 64 * 1024;
+#else
+static const long nogvl_threshold = -1;
+#endif
+
+/* transfers of at least nogvl_threshold bytes are made without the GVL */
+static int use_nogvl(size_t len)
+{
+	return nogvl_threshold >= 0 && len >= (size_t)nogvl_threshold;
+}
+
+typedef VALUE (*io_fn_t)(void *);
+
+struct io_call {
+	io_fn_t fn;
+	void *args;
+	int fd;
+};
+
+#ifdef KGIO_HAVE_THREAD_CALL_WITHOUT_GVL
+static VALUE io_call_nogvl(VALUE ptr)
+{
+	struct io_call *c = (struct io_call *)ptr;
+
+	return rb_thread_io_blocking_region(c->fn, c->args, c->fd);
+}
+
+/*
+ * rb_thread_io_blocking_region makes IO#close from another thread
+ * interrupt us with IOError instead of racing with fd reuse.
+ * +buf+ is locked so it cannot be resized or freed meanwhile.
+ */
+static long read_nogvl(io_fn_t fn, struct io_args *a)
+{
+	struct io_call c;
+
+	c.fn = fn;
+	c.args = a;
+	c.fd = a->fd;
+	rb_str_locktmp(a->buf);
+	return (long)rb_ensure(io_call_nogvl, (VALUE)&c,
+	                       rb_str_unlocktmp, a->buf);
+}
+
+/* callers make sure the strings written are frozen */
+static long write_nogvl(io_fn_t fn, void *args, int fd)
+{
+	struct io_call c;
+
+	c.fn = fn;
+	c.args = args;
+	c.fd = fd;
+	return (long)io_call_nogvl((VALUE)&c);
+}
+#else /* ! KGIO_HAVE_THREAD_CALL_WITHOUT_GVL */
+static long read_nogvl(io_fn_t fn, struct io_args *a)
+{
+	return (long)fn(a);
+}
+
+static long write_nogvl(io_fn_t fn, void *args, int fd)
+{
+	return (long)fn(args);
+}
+#endif /* ! KGIO_HAVE_THREAD_CALL_WITHOUT_GVL */
+
+static VALUE do_read(void *ptr)
+{
+	struct io_args *a = ptr;
+
+	return (VALUE)read(a->fd, a->ptr, a->len);
+}
+
+static VALUE do_write(void *ptr)
+{
+	struct io_args *a = ptr;
+
+	return (VALUE)write(a->fd, a->ptr, a->len);
+}
+
+static long io_read(io_fn_t fn, struct io_args *a)
+{
+	return use_nogvl(a->len) ? read_nogvl(fn, a) : (long)fn(a);
+}
+
+static long io_write(io_fn_t fn, struct io_args *a)
+{
+	return use_nogvl(a->len) ? write_nogvl(fn, a, a->fd) : (long)fn(a);
+}
+
 static void raise_empty_bt(VALUE err, const char *msg)
 {
 	VALUE exc = rb_exc_new2(err, msg);
@@ -117,7 +210,10 @@ static int read_check(struct io_args *a, long n, const char *msg, int io_wait)
 		rb_str_set_len(a->buf, 0);
 		if (errno == EAGAIN) {
 			if (io_wait) {
-				(void)kgio_call_wait_readable(a->io);
+				if (kgio_call_wait_readable(a->io) == Qundef) {
+					a->buf = sym_timeout;
+					return 0;
+				}
 
 				/* buf may be modified in other thread/fiber */
 				rb_str_modify(a->buf);
@@ -148,7 +244,7 @@ static VALUE my_read(int io_wait, int argc, VALUE *argv, VALUE io)
 	if (a.len > 0) {
 		set_nonblocking(a.fd);
 retry:
-		n = (long)read(a.fd, a.ptr, a.len);
+		n = io_read(do_read, &a);
 		if (read_check(&a, n, "read", io_wait) != 0)
 			goto retry;
 	}
@@ -167,7 +263,7 @@ retry:
  * This may block and call any method defined to +kgio_wait_readable+
  * for the class.
  *
- * Returns nil on EOF.
+ * Returns nil on EOF, and :timeout if kgio_deadline passes first.
  *
  * This behaves like read(2) and IO#readpartial, NOT fread(3) or
  * IO#read which possess read-in-full behavior.
@@ -210,6 +306,36 @@ static VALUE kgio_tryread(int argc, VALUE *argv, VALUE io)
 }
 
 #ifdef USE_MSG_DONTWAIT
+#  define RECV_FLAGS MSG_DONTWAIT
+#else
+#  define RECV_FLAGS 0
+#endif
+
+/*
+ * recvmsg(2) instead of recv(2) so a SOCK_SEQPACKET message longer
+ * than the buffer fails with EMSGSIZE instead of being silently
+ * truncated.  Stream sockets never set MSG_TRUNC.
+ */
+static VALUE do_recv(void *ptr)
+{
+	struct io_args *a = ptr;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t n;
+
+	iov.iov_base = a->ptr;
+	iov.iov_len = a->len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	n = recvmsg(a->fd, &msg, RECV_FLAGS);
+	if (n >= 0 && (msg.msg_flags & MSG_TRUNC)) {
+		errno = EMSGSIZE;
+		return (VALUE)-1;
+	}
+	return (VALUE)n;
+}
+
 static VALUE my_recv(int io_wait, int argc, VALUE *argv, VALUE io)
 {
 	struct io_args a;
@@ -219,18 +345,24 @@ static VALUE my_recv(int io_wait, int argc, VALUE *argv, VALUE io)
 	kgio_autopush_recv(io);
 
 	if (a.len > 0) {
+#ifndef USE_MSG_DONTWAIT
+		set_nonblocking(a.fd);
+#endif
 retry:
-		n = (long)recv(a.fd, a.ptr, a.len, MSG_DONTWAIT);
-		if (read_check(&a, n, "recv", io_wait) != 0)
+		n = io_read(do_recv, &a);
+		if (read_check(&a, n, "recvmsg", io_wait) != 0)
 			goto retry;
 	}
 	return a.buf;
 }
 
 /*
- * This method may be optimized on some systems (e.g. GNU/Linux) to use
+ * Same as Kgio::PipeMethods#kgio_read, except a SOCK_SEQPACKET
+ * message longer than +maxlen+ raises Errno::EMSGSIZE instead of
+ * being truncated.  The message is discarded by the kernel either
+ * way, so callers should size +maxlen+ for the largest message.
+ * This may be optimized on some systems (e.g. GNU/Linux) to use
  * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
- * Otherwise this is the same as Kgio::PipeMethods#kgio_read
  */
 static VALUE kgio_recv(int argc, VALUE *argv, VALUE io)
 {
@@ -250,19 +382,14 @@ static VALUE kgio_recv_bang(int argc, VALUE *argv, VALUE io)
 }
 
 /*
- * This method may be optimized on some systems (e.g. GNU/Linux) to use
- * MSG_DONTWAIT to avoid explicitly setting the O_NONBLOCK flag via fcntl.
- * Otherwise this is the same as Kgio::PipeMethods#kgio_tryread
+ * Same as Kgio::PipeMethods#kgio_tryread, except a SOCK_SEQPACKET
+ * message longer than +maxlen+ raises Errno::EMSGSIZE as it does
+ * for Kgio::SocketMethods#kgio_read.
  */
 static VALUE kgio_tryrecv(int argc, VALUE *argv, VALUE io)
 {
 	return my_recv(0, argc, argv, io);
 }
-#else /* ! USE_MSG_DONTWAIT */
-#  define kgio_recv kgio_read
-#  define kgio_recv_bang kgio_read_bang
-#  define kgio_tryrecv kgio_tryread
-#endif /* USE_MSG_DONTWAIT */
 
 static VALUE my_peek(int io_wait, int argc, VALUE *argv, VALUE io)
 {
@@ -333,8 +460,12 @@ static VALUE s_trypeek(int argc, VALUE *argv, VALUE mod)
 static void prepare_write(struct io_args *a, VALUE io, VALUE str)
 {
 	a->buf = (TYPE(str) == T_STRING) ? str : rb_obj_as_string(str);
-	a->ptr = RSTRING_PTR(a->buf);
 	a->len = RSTRING_LEN(a->buf);
+
+	/* other threads may modify str while we're without the GVL */
+	if (use_nogvl(a->len))
+		a->buf = rb_str_new_frozen(a->buf);
+	a->ptr = RSTRING_PTR(a->buf);
 	a->io = io;
 	a->fd = my_fileno(io);
 }
@@ -349,11 +480,19 @@ done:
 			a->fd = my_fileno(a->io);
 			return -1;
 		}
+		if (errno == EINPROGRESS) /* TCP_FASTOPEN_CONNECT, no cookie */
+			errno = EAGAIN;
 		if (errno == EAGAIN) {
 			long written = RSTRING_LEN(a->buf) - a->len;
 
 			if (io_wait) {
-				(void)kgio_call_wait_writable(a->io);
+				if (kgio_call_wait_writable(a->io) == Qundef) {
+					a->buf = written > 0 ?
+					         rb_str_subseq(a->buf, written,
+					                       a->len) :
+					         sym_timeout;
+					return 0;
+				}
 
 				/* buf may be modified in other thread/fiber */
 				a->len = RSTRING_LEN(a->buf) - written;
@@ -386,7 +525,7 @@ static VALUE my_write(VALUE io, VALUE str, int io_wait)
 	prepare_write(&a, io, str);
 	set_nonblocking(a.fd);
 retry:
-	n = (long)write(a.fd, a.ptr, a.len);
+	n = io_write(do_write, &a);
 	if (write_check(&a, n, "write", io_wait) != 0)
 		goto retry;
 	if (TYPE(a.buf) != T_SYMBOL)
@@ -397,9 +536,11 @@ retry:
 /*
  * call-seq:
  *
- *	io.kgio_write(str)	-> nil
+ *	io.kgio_write(str)	-> nil, String or :timeout
  *
- * Returns nil when the write completes.
+ * Returns nil when the write completes.  If kgio_deadline passes
+ * first, returns a String containing the unwritten portion if some
+ * of +str+ was written, and :timeout if nothing was.
  *
  * This may block and call any method defined to +kgio_wait_writable+
  * for the class.
@@ -543,6 +684,19 @@ static void fill_iovec(struct io_args_v *a)
 		curvec->iov_base = RSTRING_PTR(str);
 		curvec->iov_len = str_len;
 	}
+
+	/* other threads may modify the strings while we're without GVL */
+	if (!use_nogvl(a->batch_len))
+		return;
+	for (i = 0, curvec = a->vec; i < a->iov_cnt; i++, curvec++) {
+		VALUE str = rb_ary_entry(a->buf, i);
+
+		if (!OBJ_FROZEN(str)) {
+			str = rb_str_new_frozen(str);
+			rb_ary_store(a->buf, i, str);
+			curvec->iov_base = RSTRING_PTR(str);
+		}
+	}
 }
 
 static long trim_writev_buffer(struct io_args_v *a, long n)
@@ -592,10 +746,15 @@ static int writev_check(struct io_args_v *a, long n, const char *msg, int io_wai
 			a->fd = my_fileno(a->io);
 			return -1;
 		}
+		if (errno == EINPROGRESS) /* TCP_FASTOPEN_CONNECT, no cookie */
+			errno = EAGAIN;
 		if (errno == EAGAIN) {
 			if (io_wait) {
-				(void)kgio_call_wait_writable(a->io);
-				return -1;
+				if (kgio_call_wait_writable(a->io) != Qundef)
+					return -1;
+				/* a->buf holds what is left, like trywritev */
+				if (!a->something_written)
+					a->buf = sym_timeout;
 			} else if (!a->something_written) {
 				a->buf = sym_wait_writable;
 			}
@@ -606,6 +765,19 @@ static int writev_check(struct io_args_v *a, long n, const char *msg, int io_wai
 	return 0;
 }
 
+static VALUE do_writev(void *ptr)
+{
+	struct io_args_v *a = ptr;
+
+	if (a->iov_cnt == 1)
+		return (VALUE)write(a->fd, a->vec[0].iov_base,
+		                    a->vec[0].iov_len);
+	/* for big strings use library function */
+	if (USE_WRITEV && ((a->batch_len / WRITEV_IMPL_THRESHOLD) > a->iov_cnt))
+		return (VALUE)writev(a->fd, a->vec, a->iov_cnt);
+	return (VALUE)custom_writev(a->fd, a->vec, a->iov_cnt, a->batch_len);
+}
+
 static VALUE my_writev(VALUE io, VALUE ary, int io_wait)
 {
 	struct io_args_v a;
@@ -618,16 +790,10 @@ static VALUE my_writev(VALUE io, VALUE ary, int io_wait)
 		fill_iovec(&a);
 		if (a.iov_cnt == 0)
 			n = 0;
-		else if (a.iov_cnt == 1)
-			n = (long)write(a.fd, a.vec[0].iov_base,
-			                a.vec[0].iov_len);
-		/* for big strings use library function */
-		else if (USE_WRITEV &&
-		        ((a.batch_len / WRITEV_IMPL_THRESHOLD) > a.iov_cnt))
-			n = (long)writev(a.fd, a.vec, a.iov_cnt);
+		else if (use_nogvl(a.batch_len))
+			n = write_nogvl(do_writev, &a, a.fd);
 		else
-			n = (long)custom_writev(a.fd, a.vec, a.iov_cnt,
-			                        a.batch_len);
+			n = (long)do_writev(&a);
 	} while (writev_check(&a, n, "writev", io_wait) != 0);
 	rb_str_resize(a.vec_buf, 0);
 
@@ -639,9 +805,11 @@ static VALUE my_writev(VALUE io, VALUE ary, int io_wait)
 /*
  * call-seq:
  *
- *	io.kgio_writev(array)	-> nil
+ *	io.kgio_writev(array)	-> nil, Array or :timeout
  *
- * Returns nil when the write completes.
+ * Returns nil when the write completes.  If kgio_deadline passes
+ * first, returns an Array of strings containing the unwritten portion
+ * if some of +array+ was written, and :timeout if nothing was.
  *
  * This may block and call any method defined to +kgio_wait_writable+
  * for the class.
@@ -681,6 +849,13 @@ static VALUE kgio_trywritev(VALUE io, VALUE ary)
  * it will use send(2) with the MSG_DONTWAIT flag on sockets to
  * avoid unnecessary calls to fcntl(2).
  */
+static VALUE do_send(void *ptr)
+{
+	struct io_args *a = ptr;
+
+	return (VALUE)send(a->fd, a->ptr, a->len, MSG_DONTWAIT);
+}
+
 static VALUE my_send(VALUE io, VALUE str, int io_wait)
 {
 	struct io_args a;
@@ -688,7 +863,7 @@ static VALUE my_send(VALUE io, VALUE str, int io_wait)
 
 	prepare_write(&a, io, str);
 retry:
-	n = (long)send(a.fd, a.ptr, a.len, MSG_DONTWAIT);
+	n = io_write(do_send, &a);
 	if (write_check(&a, n, "send", io_wait) != 0)
 		goto retry;
 	if (TYPE(a.buf) != T_SYMBOL)
@@ -778,6 +953,45 @@ static VALUE s_trywritev(VALUE mod, VALUE io, VALUE ary)
 	return kgio_trywritev(io, ary);
 }
 
+/*
+ * call-seq:
+ *
+ *	Kgio.nogvl_threshold	-> Integer or nil
+ *
+ * Returns the size in bytes at which kgio_read, kgio_write,
+ * kgio_writev and their try* variants release the GVL, or +nil+ if
+ * they never do.
+ */
+static VALUE get_nogvl_threshold(VALUE mod)
+{
+	return nogvl_threshold < 0 ? Qnil : LONG2NUM(nogvl_threshold);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.nogvl_threshold = 64 * 1024
+ *	Kgio.nogvl_threshold = nil
+ *
+ * Sets the size in bytes of a single read or write at which the
+ * GVL is released while the kernel (or the copy made to coalesce
+ * small kgio_writev strings) moves the data, so other threads are
+ * not stalled behind large responses.  Smaller transfers are cheaper
+ * with the GVL held.  The default is 65536, +nil+ disables it.
+ * This has no effect on Rubies without native threads.
+ */
+static VALUE set_nogvl_threshold(VALUE mod, VALUE bytes)
+{
+	long n = NIL_P(bytes) ? -1 : NUM2LONG(bytes);
+
+	if (!NIL_P(bytes) && n < 0)
+		rb_raise(rb_eArgError, "threshold must not be negative");
+#ifdef KGIO_HAVE_THREAD_CALL_WITHOUT_GVL
+	nogvl_threshold = n;
+#endif
+	return bytes;
+}
+
 void init_kgio_read_write(void)
 {
 	VALUE mPipeMethods, mSocketMethods;
@@ -786,11 +1000,16 @@ void init_kgio_read_write(void)
 
 	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
 	sym_wait_writable = ID2SYM(rb_intern("wait_writable"));
+	sym_timeout = ID2SYM(rb_intern("timeout"));
 
 	rb_define_singleton_method(mKgio, "tryread", s_tryread, -1);
 	rb_define_singleton_method(mKgio, "trywrite", s_trywrite, 2);
 	rb_define_singleton_method(mKgio, "trywritev", s_trywritev, 2);
 	rb_define_singleton_method(mKgio, "trypeek", s_trypeek, -1);
+	rb_define_singleton_method(mKgio, "nogvl_threshold",
+	                           get_nogvl_threshold, 0);
+	rb_define_singleton_method(mKgio, "nogvl_threshold=",
+	                           set_nogvl_threshold, 1);
 
 	/*
 	 * Document-module: Kgio::PipeMethods
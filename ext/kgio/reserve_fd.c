@@ -0,0 +1,166 @@
+/*
+ * Load shedding for descriptor exhaustion.  When enabled, we hold a
+ * spare descriptor open.  If accept() fails with EMFILE or ENFILE,
+ * the spare is closed so the pending connection can be accepted and
+ * immediately closed (or reset), then the spare is reopened.  Clients
+ * get a fast failure instead of sitting in an overflowing listen queue
+ * while every worker runs the GC in hopes of finding leaked IO objects.
+ *
+ * All of the state here is protected by the GVL, callers must not
+ * release it between kgio_reserve_fd_release and kgio_reserve_fd_shed.
+ */
+#include "kgio.h"
+
+enum reserve_mode {
+	RESERVE_OFF = 0,
+	RESERVE_CLOSE = 1,
+	RESERVE_RESET = 2
+};
+
+static enum reserve_mode mode;
+static int spare_fd = -1;
+static unsigned long shed_count;
+static VALUE sym_reset;
+
+static int spare_open(void)
+{
+	if (spare_fd < 0) {
+		spare_fd = open("/dev/null", O_RDONLY);
+		if (spare_fd >= 0) {
+			rb_update_max_fd(spare_fd);
+			rb_fd_fix_cloexec(spare_fd);
+		}
+	}
+	return spare_fd;
+}
+
+static void spare_close(void)
+{
+	if (spare_fd >= 0) {
+		(void)close(spare_fd);
+		spare_fd = -1;
+	}
+}
+
+/* returns true if callers should fail fast instead of running the GC */
+int kgio_reserve_fd_enabled(void)
+{
+	return mode != RESERVE_OFF;
+}
+
+/*
+ * closes the spare descriptor to make room for one accept(),
+ * returns false if there was no spare to release
+ */
+int kgio_reserve_fd_release(void)
+{
+	if (spare_fd < 0)
+		return 0;
+	spare_close();
+	return 1;
+}
+
+/*
+ * disposes of a connection accepted with the released spare (+fd+
+ * may be negative if another process won the race) and reacquires
+ * the spare descriptor
+ */
+void kgio_reserve_fd_shed(int fd)
+{
+	int saved_errno = errno;
+
+	if (fd >= 0) {
+		if (mode == RESERVE_RESET) {
+			struct linger l;
+
+			l.l_onoff = 1;
+			l.l_linger = 0;
+			(void)setsockopt(fd, SOL_SOCKET, SO_LINGER,
+			                 &l, sizeof(l));
+		}
+		(void)close(fd);
+		shed_count++;
+	}
+	(void)spare_open();
+	errno = saved_errno;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.reserve_fd = true
+ *	Kgio.reserve_fd = :reset
+ *	Kgio.reserve_fd = false
+ *
+ * Enables or disables descriptor reservation for load shedding.
+ * When enabled, a spare descriptor is held open and sacrificed
+ * whenever kgio_accept or kgio_tryaccept fail with EMFILE or ENFILE:
+ * the pending connection is accepted and closed immediately
+ * (or reset with :reset), and the spare is reacquired.
+ *
+ * When enabled, Kgio::Socket.new, Kgio::TCPSocket.new,
+ * Kgio::UNIXSocket.new, Kgio::File.tryopen and accept no longer
+ * run the GC and retry on descriptor exhaustion, they fail right away.
+ *
+ * This is disabled by default.  The reservation is process-wide;
+ * each forked child should set it again if it closes the
+ * inherited spare.
+ */
+static VALUE s_set_reserve_fd(VALUE mod, VALUE val)
+{
+	if (val == sym_reset)
+		mode = RESERVE_RESET;
+	else if (RTEST(val))
+		mode = RESERVE_CLOSE;
+	else
+		mode = RESERVE_OFF;
+
+	if (mode == RESERVE_OFF) {
+		spare_close();
+	} else if (spare_open() < 0) {
+		mode = RESERVE_OFF;
+		rb_sys_fail("open(/dev/null)");
+	}
+	return val;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.reserve_fd -> true, :reset or false
+ *
+ * Returns the current descriptor reservation mode,
+ * see Kgio.reserve_fd=
+ */
+static VALUE s_get_reserve_fd(VALUE mod)
+{
+	switch (mode) {
+	case RESERVE_OFF: return Qfalse;
+	case RESERVE_CLOSE: return Qtrue;
+	case RESERVE_RESET: return sym_reset;
+	}
+	return Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.shed_count -> Integer
+ *
+ * Returns the number of connections closed by this process because
+ * of descriptor exhaustion, see Kgio.reserve_fd=
+ */
+static VALUE s_shed_count(VALUE mod)
+{
+	return ULONG2NUM(shed_count);
+}
+
+void init_kgio_reserve_fd(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+
+	sym_reset = ID2SYM(rb_intern("reset"));
+	rb_define_singleton_method(mKgio, "reserve_fd=", s_set_reserve_fd, 1);
+	rb_define_singleton_method(mKgio, "reserve_fd", s_get_reserve_fd, 0);
+	rb_define_singleton_method(mKgio, "shed_count", s_shed_count, 0);
+}
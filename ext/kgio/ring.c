@@ -0,0 +1,1150 @@
+/*
+ * Kgio::Ring queues socket operations on an io_uring(7) instance so
+ * many of them are submitted, and their completions collected, with
+ * a single io_uring_enter(2) call.  liburing is not used, the rings
+ * are mapped directly so there is nothing to install besides kernel
+ * headers.  Completions are returned with the same values the try*
+ * methods return.
+ *
+ * All of the state here is protected by the GVL, the ring is marked
+ * busy while a thread waits for completions without it.
+ */
+#include "kgio.h"
+#if defined(HAVE_LINUX_IO_URING_H) && \
+    defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <limits.h>
+#include "my_fileno.h"
+
+#ifdef __NR_io_uring_setup
+
+/* Linux 5.11+ and 5.19+, system headers may not have caught up */
+#ifndef IORING_FEAT_EXT_ARG
+#  define IORING_FEAT_EXT_ARG (1U << 8)
+#endif
+#ifndef IORING_ENTER_EXT_ARG
+#  define IORING_ENTER_EXT_ARG (1U << 3)
+#endif
+#ifndef IORING_ACCEPT_MULTISHOT
+#  define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#ifndef IORING_CQE_F_MORE
+#  define IORING_CQE_F_MORE (1U << 1)
+#endif
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+/* struct io_uring_getevents_arg */
+struct ring_getevents_arg {
+	uint64_t sigmask;
+	uint32_t sigmask_sz;
+	uint32_t pad;
+	uint64_t ts;
+};
+
+#define RING_FEATURES \
+	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+/* user_data for cancelations, their completions are not reported */
+#define RING_INTERNAL (~(uint64_t)0)
+
+enum ring_kind {
+	RING_RECV,
+	RING_SEND,
+	RING_WRITEV,
+	RING_ACCEPT,
+	RING_CONNECT
+};
+
+struct ring_op {
+	VALUE io; /* Qfalse if the slot is free */
+	VALUE tag;
+	char *buf; /* private copy of outgoing data, or the read buffer */
+	struct iovec *iov;
+	long len;
+	int kind;
+	int fixed; /* index of the registered buffer in use, or -1 */
+	int iovcnt;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+struct ring {
+	int fd;
+	int busy; /* a thread is inside io_uring_enter without the GVL */
+	int cancel_failed; /* an op may never complete */
+	unsigned queued; /* SQEs not yet submitted */
+	unsigned inflight; /* ops slots in use */
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	struct ring_op *ops;
+	unsigned nops;
+	unsigned *free_ops;
+	unsigned nfree_ops;
+	char *fixed_mem;
+	long fixed_size;
+	unsigned nfixed;
+	unsigned *free_fixed;
+	unsigned nfree_fixed;
+	VALUE io; /* from Kgio::Ring#to_io */
+};
+
+struct enter_args {
+	int fd;
+	unsigned to_submit;
+	unsigned min_complete;
+	unsigned flags;
+	struct ring_getevents_arg *arg;
+};
+
+static int ring_usable = -1;
+static ID id_for_fd, id_autoclose_set;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(struct enter_args *e)
+{
+	return (int)syscall(__NR_io_uring_enter, e->fd, e->to_submit,
+	                    e->min_complete, e->flags, e->arg,
+	                    e->arg ? sizeof(*e->arg) : 0);
+}
+
+static int io_uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void ring_mark(void *ptr)
+{
+	struct ring *r = ptr;
+	unsigned i;
+
+	rb_gc_mark(r->io);
+	for (i = 0; i < r->nops; i++) {
+		if (r->ops[i].io == Qfalse)
+			continue;
+		rb_gc_mark(r->ops[i].io);
+		rb_gc_mark(r->ops[i].tag);
+	}
+}
+
+static void op_free_bufs(struct ring_op *op)
+{
+	xfree(op->buf);
+	xfree(op->iov);
+	op->buf = NULL;
+	op->iov = NULL;
+}
+
+static void ring_release(struct ring *r)
+{
+	unsigned i;
+
+	if (r->fd < 0)
+		return;
+	(void)close(r->fd);
+	r->fd = -1;
+	if (r->rings)
+		(void)munmap(r->rings, r->rings_size);
+	if (r->sqes)
+		(void)munmap(r->sqes, r->sqes_size);
+	r->rings = NULL;
+	r->sqes = NULL;
+
+	/*
+	 * the kernel may still write into buffers of operations which
+	 * were never reaped, leak them rather than hand them to malloc
+	 */
+	if (r->inflight)
+		return;
+	for (i = 0; i < r->nops; i++)
+		op_free_bufs(&r->ops[i]);
+	if (r->fixed_mem)
+		(void)munmap(r->fixed_mem, r->fixed_size * r->nfixed);
+	r->fixed_mem = NULL;
+}
+
+static void ring_free(void *ptr)
+{
+	struct ring *r = ptr;
+
+	ring_release(r);
+	if (!r->inflight) {
+		xfree(r->ops);
+		xfree(r->free_ops);
+		xfree(r->free_fixed);
+	}
+	xfree(r);
+}
+
+static VALUE ring_alloc(VALUE klass)
+{
+	struct ring *r;
+	VALUE self = Data_Make_Struct(klass, struct ring,
+	                              ring_mark, ring_free, r);
+
+	memset(r, 0, sizeof(struct ring));
+	r->fd = -1;
+	r->io = Qnil;
+	return self;
+}
+
+static struct ring *ring_of(VALUE self)
+{
+	struct ring *r;
+
+	Data_Get_Struct(self, struct ring, r);
+	if (r->fd < 0)
+		rb_raise(rb_eIOError, "closed ring");
+	if (r->busy)
+		rb_raise(rb_eRuntimeError, "ring is in use by another thread");
+	return r;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Ring.available?	-> true or false
+ *
+ * Returns true if the running kernel supports everything Kgio::Ring
+ * needs (Linux 5.11 or later, and io_uring not disabled by the
+ * administrator or a seccomp filter).  Multishot accept needs
+ * Linux 5.19.
+ */
+static VALUE ring_available_p(VALUE klass)
+{
+	if (ring_usable < 0) {
+		struct io_uring_params p;
+		int fd;
+
+		memset(&p, 0, sizeof(p));
+		fd = io_uring_setup(2, &p);
+		ring_usable = fd >= 0 &&
+		              (p.features & RING_FEATURES) == RING_FEATURES;
+		if (fd >= 0)
+			(void)close(fd);
+	}
+	return ring_usable ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Ring.new		-> ring
+ *	Kgio::Ring.new(entries)	-> ring
+ *
+ * Creates a ring which queues up to +entries+ (default: 256) operations
+ * between submissions.  Twice as many operations may be in flight.
+ * Raises NotImplementedError if the kernel is too old, see
+ * Kgio::Ring.available?
+ */
+static VALUE ring_init(int argc, VALUE *argv, VALUE self)
+{
+	struct io_uring_params p;
+	struct ring *r;
+	VALUE entries;
+	size_t sq_size, cq_size;
+	char *base;
+	unsigned i, *array;
+	int n;
+
+	Data_Get_Struct(self, struct ring, r);
+	rb_scan_args(argc, argv, "01", &entries);
+	n = NIL_P(entries) ? 256 : NUM2INT(entries);
+	if (n <= 0)
+		rb_raise(rb_eArgError, "entries must be positive");
+	if (r->fd >= 0)
+		rb_raise(rb_eRuntimeError, "already initialized");
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+	r->fd = io_uring_setup((unsigned)n, &p);
+	if (r->fd < 0)
+		rb_sys_fail("io_uring_setup");
+	rb_update_max_fd(r->fd);
+	if ((p.features & RING_FEATURES) != RING_FEATURES) {
+		ring_release(r);
+		rb_raise(rb_eNotImpError, "io_uring is too old on this kernel");
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->rings == MAP_FAILED) {
+		r->rings = NULL;
+		ring_release(r);
+		rb_sys_fail("mmap");
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		ring_release(r);
+		rb_sys_fail("mmap");
+	}
+
+	base = r->rings;
+	r->sq_head = (unsigned *)(base + p.sq_off.head);
+	r->sq_tail = (unsigned *)(base + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	array = (unsigned *)(base + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	r->cq_head = (unsigned *)(base + p.cq_off.head);
+	r->cq_tail = (unsigned *)(base + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+
+	r->nops = p.cq_entries;
+	r->ops = ALLOC_N(struct ring_op, r->nops);
+	r->free_ops = ALLOC_N(unsigned, r->nops);
+	memset(r->ops, 0, sizeof(struct ring_op) * r->nops);
+	for (i = 0; i < r->nops; i++) {
+		r->ops[i].io = Qfalse;
+		r->free_ops[i] = r->nops - i - 1;
+	}
+	r->nfree_ops = r->nops;
+	return self;
+}
+
+/* submits queued SQEs without waiting, returns the number submitted */
+static unsigned ring_submit(struct ring *r)
+{
+	struct enter_args e;
+	int n;
+
+	if (!r->queued)
+		return 0;
+	e.fd = r->fd;
+	e.to_submit = r->queued;
+	e.min_complete = 0;
+	e.flags = 0;
+	e.arg = NULL;
+	do {
+		n = io_uring_enter(&e);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EBUSY)
+			return 0;
+		rb_sys_fail("io_uring_enter");
+	}
+	r->queued -= (unsigned)n;
+	return (unsigned)n;
+}
+
+/*
+ * returns the next free SQE, submitting the queue if it is full.
+ * Nothing is queued until sqe_commit is called.
+ */
+static struct io_uring_sqe *sqe_get(struct ring *r)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= r->sq_entries) {
+		ring_submit(r);
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= r->sq_entries)
+			rb_raise(rb_eRuntimeError, "submission queue is full");
+	}
+	sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void sqe_commit(struct ring *r)
+{
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+/* returns the next free operation slot without claiming it */
+static struct ring_op *op_peek(struct ring *r)
+{
+	struct ring_op *op;
+
+	if (!r->nfree_ops)
+		rb_raise(rb_eRuntimeError, "too many operations in flight (%u)",
+		         r->nops);
+	op = &r->ops[r->free_ops[r->nfree_ops - 1]];
+	op->buf = NULL;
+	op->iov = NULL;
+	op->fixed = -1;
+	return op;
+}
+
+/* claims the slot from op_peek and queues +sqe+ for it */
+static void op_commit(struct ring *r, struct ring_op *op,
+                      struct io_uring_sqe *sqe, int kind, VALUE io,
+                      VALUE tag)
+{
+	op->kind = kind;
+	op->io = io;
+	op->tag = tag;
+	r->nfree_ops--;
+	r->inflight++;
+	sqe->user_data = (uint64_t)(op - r->ops);
+	sqe_commit(r);
+}
+
+static void op_done(struct ring *r, struct ring_op *op)
+{
+	if (op->fixed >= 0)
+		r->free_fixed[r->nfree_fixed++] = (unsigned)op->fixed;
+	op_free_bufs(op);
+	op->fixed = -1;
+	op->io = Qfalse;
+	op->tag = Qnil;
+	r->free_ops[r->nfree_ops++] = (unsigned)(op - r->ops);
+	r->inflight--;
+}
+
+/* claims a registered buffer of at least +len+ bytes, if possible */
+static char *fixed_get(struct ring *r, struct ring_op *op, long len)
+{
+	if (!r->nfree_fixed || len > r->fixed_size)
+		return NULL;
+	op->fixed = (int)r->free_fixed[--r->nfree_fixed];
+	return r->fixed_mem + op->fixed * r->fixed_size;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.register_buffers(count, size)	-> ring
+ *
+ * Allocates +count+ buffers of +size+ bytes each and registers them
+ * with the kernel, which avoids mapping user memory for every
+ * operation.  Afterwards, Kgio::Ring#recv and Kgio::Ring#send use a
+ * registered buffer whenever one is free (and large enough, for
+ * send), reads are then limited to +size+ bytes.  This may only be
+ * done once per ring.
+ */
+static VALUE ring_register_buffers(VALUE self, VALUE count, VALUE size)
+{
+	struct ring *r = ring_of(self);
+	int n = NUM2INT(count);
+	long len = NUM2LONG(size);
+	struct iovec *iov;
+	unsigned i;
+	int rc;
+
+	if (r->fixed_mem)
+		rb_raise(rb_eRuntimeError, "buffers already registered");
+	if (n <= 0 || n > 16384)
+		rb_raise(rb_eArgError, "count must be between 1 and 16384");
+	if (len <= 0 || len > 1024 * 1024 * 1024 / n)
+		rb_raise(rb_eArgError, "invalid buffer size: %ld", len);
+
+	r->fixed_mem = mmap(NULL, (size_t)len * n, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->fixed_mem == MAP_FAILED) {
+		r->fixed_mem = NULL;
+		rb_sys_fail("mmap");
+	}
+	iov = ALLOCA_N(struct iovec, n);
+	for (i = 0; i < (unsigned)n; i++) {
+		iov[i].iov_base = r->fixed_mem + i * len;
+		iov[i].iov_len = (size_t)len;
+	}
+	rc = io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, n);
+	if (rc < 0) {
+		int saved_errno = errno;
+
+		(void)munmap(r->fixed_mem, (size_t)len * n);
+		r->fixed_mem = NULL;
+		errno = saved_errno;
+		rb_sys_fail("io_uring_register");
+	}
+	r->fixed_size = len;
+	r->nfixed = (unsigned)n;
+	r->free_fixed = ALLOC_N(unsigned, n);
+	for (i = 0; i < r->nfixed; i++)
+		r->free_fixed[i] = r->nfixed - i - 1;
+	r->nfree_fixed = r->nfixed;
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.recv(io, maxlen)		-> ring
+ *	ring.recv(io, maxlen, tag)	-> ring
+ *
+ * Queues a read of up to +maxlen+ bytes from +io+, which may be a
+ * socket or a pipe.  Its completion is a String like the one
+ * kgio_tryread returns, or +nil+ on EOF.
+ * +tag+ (default: +io+) identifies the completion.
+ */
+static VALUE ring_recv(int argc, VALUE *argv, VALUE self)
+{
+	struct ring *r = ring_of(self);
+	struct io_uring_sqe *sqe;
+	struct ring_op *op;
+	VALUE io, maxlen, tag;
+	char *buf;
+	long len;
+
+	rb_scan_args(argc, argv, "21", &io, &maxlen, &tag);
+	if (argc < 3)
+		tag = io;
+	len = NUM2LONG(maxlen);
+	if (len <= 0 || len > INT_MAX)
+		rb_raise(rb_eArgError, "invalid maxlen: %ld", len);
+
+	sqe = sqe_get(r);
+	op = op_peek(r);
+	sqe->fd = my_fileno(io);
+	if (r->fixed_mem && len > r->fixed_size)
+		len = r->fixed_size;
+	buf = fixed_get(r, op, len);
+	if (buf) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = (uint16_t)op->fixed;
+	} else {
+		buf = op->buf = ALLOC_N(char, len);
+		sqe->opcode = IORING_OP_READ;
+	}
+	sqe->off = (uint64_t)-1; /* pipes and sockets have no offset */
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	op->len = len;
+	op_commit(r, op, sqe, RING_RECV, io, tag);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.send(io, str)		-> ring
+ *	ring.send(io, str, tag)		-> ring
+ *
+ * Queues a write of +str+ to +io+.  +str+ is copied, so it may be
+ * modified right away.  Like kgio_trywrite, the completion is +nil+
+ * if everything was written, or a String with the unwritten portion.
+ * +tag+ (default: +io+) identifies the completion.
+ */
+static VALUE ring_send(int argc, VALUE *argv, VALUE self)
+{
+	struct ring *r = ring_of(self);
+	struct io_uring_sqe *sqe;
+	struct ring_op *op;
+	VALUE io, str, tag;
+	char *buf;
+	long len;
+
+	rb_scan_args(argc, argv, "21", &io, &str, &tag);
+	if (argc < 3)
+		tag = io;
+	StringValue(str);
+	len = RSTRING_LEN(str);
+	if (len > INT_MAX)
+		rb_raise(rb_eArgError, "String too large: %ld", len);
+
+	sqe = sqe_get(r);
+	op = op_peek(r);
+	sqe->fd = my_fileno(io);
+	buf = fixed_get(r, op, len);
+	if (buf) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = (uint16_t)op->fixed;
+	} else {
+		buf = op->buf = ALLOC_N(char, len ? len : 1);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	memcpy(buf, RSTRING_PTR(str), len);
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	op->len = len;
+	op_commit(r, op, sqe, RING_SEND, io, tag);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.writev(io, array)		-> ring
+ *	ring.writev(io, array, tag)	-> ring
+ *
+ * Queues a gathered write of the Strings in +array+ to +io+.  The
+ * Strings are copied, so they may be modified right away.  Like
+ * kgio_trywritev, the completion is +nil+ if everything was written,
+ * or an Array with the unwritten Strings.
+ * +tag+ (default: +io+) identifies the completion.
+ */
+static VALUE ring_writev(int argc, VALUE *argv, VALUE self)
+{
+	struct ring *r = ring_of(self);
+	struct io_uring_sqe *sqe;
+	struct ring_op *op;
+	VALUE io, ary, tag, strs;
+	long i, n, total = 0;
+	char *dst;
+
+	rb_scan_args(argc, argv, "21", &io, &ary, &tag);
+	if (argc < 3)
+		tag = io;
+	ary = rb_convert_type(ary, T_ARRAY, "Array", "to_ary");
+	n = RARRAY_LEN(ary);
+	if (n > IOV_MAX)
+		rb_raise(rb_eArgError, "too many Strings (%ld > %d)",
+		         n, IOV_MAX);
+
+	/* to_str may return a new String each time, so convert just once */
+	strs = rb_ary_new2(n);
+	for (i = 0; i < n; i++) {
+		VALUE str = rb_ary_entry(ary, i);
+
+		StringValue(str);
+		rb_ary_push(strs, str);
+		total += RSTRING_LEN(str);
+		if (total > INT_MAX)
+			rb_raise(rb_eArgError, "Strings too large");
+	}
+
+	sqe = sqe_get(r);
+	op = op_peek(r);
+	sqe->fd = my_fileno(io);
+	op->iov = ALLOC_N(struct iovec, n ? n : 1);
+	op->buf = dst = ALLOC_N(char, total ? total : 1);
+	for (i = 0; i < n; i++) {
+		VALUE str = rb_ary_entry(strs, i);
+		long len = RSTRING_LEN(str);
+
+		memcpy(dst, RSTRING_PTR(str), len);
+		op->iov[i].iov_base = dst;
+		op->iov[i].iov_len = (size_t)len;
+		dst += len;
+	}
+	RB_GC_GUARD(strs);
+	op->iovcnt = (int)n;
+	op->len = total;
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->addr = (uint64_t)(uintptr_t)op->iov;
+	sqe->len = (uint32_t)n;
+	op_commit(r, op, sqe, RING_WRITEV, io, tag);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.accept(listener)				-> ring
+ *	ring.accept(listener, tag)			-> ring
+ *	ring.accept(listener, tag, multishot)		-> ring
+ *
+ * Queues an accept on +listener+.  Its completion is a
+ * Kgio.accept_class instance with kgio_addr set, just like the one
+ * kgio_tryaccept returns.  If +multishot+ is true, one completion is
+ * returned for every accepted client until Kgio::Ring#cancel is
+ * called for +listener+ (or an error completion is returned).
+ * +tag+ (default: +listener+) identifies the completions.
+ */
+static VALUE ring_accept(int argc, VALUE *argv, VALUE self)
+{
+	struct ring *r = ring_of(self);
+	struct io_uring_sqe *sqe;
+	struct ring_op *op;
+	VALUE io, tag, multishot;
+
+	rb_scan_args(argc, argv, "12", &io, &tag, &multishot);
+	if (argc < 2)
+		tag = io;
+
+	sqe = sqe_get(r);
+	op = op_peek(r);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = my_fileno(io);
+	sqe->accept_flags = kgio_accept_flags();
+	if (RTEST(multishot)) {
+		/* the address would be overwritten by the next client */
+		sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+		op->addrlen = 0;
+	} else {
+		op->addrlen = (socklen_t)sizeof(op->addr);
+		sqe->addr = (uint64_t)(uintptr_t)&op->addr;
+		sqe->addr2 = (uint64_t)(uintptr_t)&op->addrlen;
+	}
+	op_commit(r, op, sqe, RING_ACCEPT, io, tag);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.connect(io, sockaddr)		-> ring
+ *	ring.connect(io, sockaddr, tag)		-> ring
+ *
+ * Queues a connect of the socket +io+ to +sockaddr+, a packed address
+ * as returned by Socket.pack_sockaddr_in or Addrinfo#to_sockaddr.  Its
+ * completion is +nil+ once connected.
+ * +tag+ (default: +io+) identifies the completion.
+ */
+static VALUE ring_connect(int argc, VALUE *argv, VALUE self)
+{
+	struct ring *r = ring_of(self);
+	struct io_uring_sqe *sqe;
+	struct ring_op *op;
+	VALUE io, addr, tag;
+
+	rb_scan_args(argc, argv, "21", &io, &addr, &tag);
+	if (argc < 3)
+		tag = io;
+	StringValue(addr);
+	if (RSTRING_LEN(addr) > (long)sizeof(struct sockaddr_storage))
+		rb_raise(rb_eArgError, "invalid sockaddr");
+
+	sqe = sqe_get(r);
+	op = op_peek(r);
+	memcpy(&op->addr, RSTRING_PTR(addr), RSTRING_LEN(addr));
+	op->addrlen = (socklen_t)RSTRING_LEN(addr);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = my_fileno(io);
+	sqe->addr = (uint64_t)(uintptr_t)&op->addr;
+	sqe->off = op->addrlen;
+	op_commit(r, op, sqe, RING_CONNECT, io, tag);
+	return self;
+}
+
+/*
+ * queues the cancelation of every operation in flight on +io+ (or all
+ * of them if Qundef).  Each one is canceled by its user_data, since
+ * IORING_ASYNC_CANCEL_FD and IORING_ASYNC_CANCEL_ANY need Linux 5.19.
+ * A slot cannot be reused before the cancelation is submitted, since
+ * it is only freed by ring_reap after the next io_uring_enter.
+ */
+static void queue_cancel(struct ring *r, VALUE io)
+{
+	unsigned i;
+
+	for (i = 0; i < r->nops; i++) {
+		struct io_uring_sqe *sqe;
+
+		if (r->ops[i].io == Qfalse ||
+		    (io != Qundef && r->ops[i].io != io))
+			continue;
+		sqe = sqe_get(r);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)i;
+		sqe->user_data = RING_INTERNAL;
+		sqe_commit(r);
+	}
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.cancel(io)	-> ring
+ *
+ * Queues the cancelation of every operation in flight for +io+,
+ * including multishot accepts.  Canceled operations complete with
+ * Errno::ECANCELED, operations which were already finishing complete
+ * as usual.
+ */
+static VALUE ring_cancel(VALUE self, VALUE io)
+{
+	struct ring *r = ring_of(self);
+
+	queue_cancel(r, io);
+	return self;
+}
+
+static VALUE op_remainder(struct ring_op *op, long n)
+{
+	VALUE rv = rb_ary_new();
+	int i;
+
+	for (i = 0; i < op->iovcnt; i++) {
+		long len = (long)op->iov[i].iov_len;
+
+		if (n >= len) {
+			n -= len;
+			continue;
+		}
+		rb_ary_push(rv, rb_str_new((char *)op->iov[i].iov_base + n,
+		                           len - n));
+		n = 0;
+	}
+	return rv;
+}
+
+static VALUE accepted(struct ring_op *op, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = op->addrlen;
+
+	rb_update_max_fd(fd);
+	if (addrlen) {
+		memcpy(&addr, &op->addr, addrlen);
+	} else {
+		addrlen = sizeof(addr);
+		if (getpeername(fd, (struct sockaddr *)&addr, &addrlen) < 0)
+			addrlen = 0;
+	}
+	return kgio_client_new(op->io, Qnil, fd,
+	                       addrlen ? (struct sockaddr *)&addr : NULL,
+	                       addrlen);
+}
+
+static const char *op_name(int kind)
+{
+	switch (kind) {
+	case RING_RECV: return "recv";
+	case RING_SEND: return "send";
+	case RING_WRITEV: return "writev";
+	case RING_ACCEPT: return "accept";
+	}
+	return "connect";
+}
+
+static VALUE op_result(struct ring *r, struct ring_op *op, int res)
+{
+	const char *buf;
+
+	if (res < 0)
+		return rb_syserr_new(-res, op_name(op->kind));
+	switch (op->kind) {
+	case RING_RECV:
+		if (res == 0)
+			return Qnil;
+		buf = op->fixed >= 0 ? r->fixed_mem + op->fixed * r->fixed_size
+		                     : op->buf;
+		return rb_str_new(buf, res);
+	case RING_SEND:
+		if (res == op->len)
+			return Qnil;
+		buf = op->fixed >= 0 ? r->fixed_mem + op->fixed * r->fixed_size
+		                     : op->buf;
+		return rb_str_new(buf + res, op->len - res);
+	case RING_WRITEV:
+		return res == op->len ? Qnil : op_remainder(op, res);
+	case RING_ACCEPT:
+		return accepted(op, res);
+	}
+	return Qnil;
+}
+
+struct result_args {
+	struct ring *r;
+	struct ring_op *op;
+	int res;
+};
+
+static VALUE do_result(VALUE ptr)
+{
+	struct result_args *a = (struct result_args *)ptr;
+
+	return op_result(a->r, a->op, a->res);
+}
+
+/*
+ * appends [ tag, result ] pairs for every completion to +ary+,
+ * an exception raised while converting a result becomes the result
+ * so the operation is still retired and no completion is lost
+ */
+static long ring_reap(struct ring *r, VALUE ary)
+{
+	unsigned head = *r->cq_head;
+	long n = 0;
+	struct result_args a;
+	int state;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+		uint64_t user_data = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		struct ring_op *op;
+		VALUE tag, rv;
+
+		__atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+		if (user_data == RING_INTERNAL) {
+			/* ENOENT: completed, EALREADY: about to */
+			if (res < 0 && res != -ENOENT && res != -EALREADY)
+				r->cancel_failed = 1;
+			continue;
+		}
+		if (user_data >= r->nops)
+			continue;
+		op = &r->ops[user_data];
+		tag = op->tag;
+		a.r = r;
+		a.op = op;
+		a.res = res;
+		rv = rb_protect(do_result, (VALUE)&a, &state);
+		if (!(flags & IORING_CQE_F_MORE))
+			op_done(r, op);
+		if (state) {
+			rv = rb_errinfo();
+			/* throw and Thread#kill are not exceptions */
+			if (SPECIAL_CONST_P(rv) ||
+			    BUILTIN_TYPE(rv) != T_OBJECT ||
+			    !rb_obj_is_kind_of(rv, rb_eException))
+				rb_jump_tag(state);
+			rb_set_errinfo(Qnil);
+		}
+		if (!NIL_P(ary))
+			rb_ary_push(ary, rb_assoc_new(tag, rv));
+		n++;
+	}
+	return n;
+}
+
+static VALUE nogvl_enter(void *ptr)
+{
+	return (VALUE)io_uring_enter(ptr);
+}
+
+static VALUE do_enter(VALUE ptr)
+{
+	struct enter_args *e = (struct enter_args *)ptr;
+
+	return (VALUE)rb_thread_blocking_region(nogvl_enter, e,
+	                                        RUBY_UBF_IO, 0);
+}
+
+static VALUE enter_done(VALUE ptr)
+{
+	struct ring *r = (struct ring *)ptr;
+
+	r->busy = 0;
+	return Qnil;
+}
+
+/*
+ * submits everything queued and waits for +min+ completions or
+ * +timeout+ milliseconds (forever if negative), then reaps into +ary+
+ */
+static void ring_wait(struct ring *r, unsigned min, int timeout, VALUE ary)
+{
+	struct ring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct enter_args e;
+	long reaped = ring_reap(r, ary);
+	int n;
+
+	if (min > r->inflight)
+		min = r->inflight;
+	if (reaped >= (long)min && !r->queued)
+		return;
+
+	e.fd = r->fd;
+	e.to_submit = r->queued;
+	e.min_complete = reaped >= (long)min ? 0 : min - (unsigned)reaped;
+	e.flags = e.min_complete ? IORING_ENTER_GETEVENTS : 0;
+	e.arg = NULL;
+	if (e.min_complete && timeout >= 0) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		e.arg = &arg;
+		e.flags |= IORING_ENTER_EXT_ARG;
+	}
+
+	r->busy = 1;
+	n = (int)(long)rb_ensure(do_enter, (VALUE)&e, enter_done, (VALUE)r);
+	if (n >= 0) {
+		r->queued -= (unsigned)n;
+	} else if (errno != EINTR && errno != ETIME &&
+	           errno != EAGAIN && errno != EBUSY) {
+		rb_sys_fail("io_uring_enter");
+	}
+	ring_reap(r, ary);
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.submit	-> Integer
+ *
+ * Submits all queued operations without waiting for any of them and
+ * returns the number submitted.  Kgio::Ring#wait also submits.
+ */
+static VALUE ring_submit_m(VALUE self)
+{
+	return UINT2NUM(ring_submit(ring_of(self)));
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.wait			-> [ [ tag, result ], ... ]
+ *	ring.wait(min, timeout_ms)	-> [ [ tag, result ], ... ]
+ *
+ * Submits all queued operations and waits for at least +min+
+ * (default: 1) of them to complete, or for +timeout_ms+ milliseconds
+ * (forever if +nil+, the default), with a single io_uring_enter call.
+ * Returns every completion available, each as a two-element Array
+ * of the tag given when queueing the operation and its result.
+ * Failed operations have an Errno exception as their result.  If
+ * converting a result raises (e.g. NoMemoryError), the exception is
+ * returned as that operation's result instead.
+ *
+ * With a +min+ of zero, this never blocks and only makes a system call
+ * if there are operations to submit, which makes it suitable for
+ * reaping completions once Kgio::Ring#to_io is readable.
+ */
+static VALUE ring_wait_m(int argc, VALUE *argv, VALUE self)
+{
+	struct ring *r = ring_of(self);
+	VALUE min, timeout;
+	VALUE rv = rb_ary_new();
+	int n;
+
+	rb_scan_args(argc, argv, "02", &min, &timeout);
+	n = NIL_P(min) ? 1 : NUM2INT(min);
+	if (n < 0)
+		rb_raise(rb_eArgError, "min must not be negative");
+	ring_wait(r, (unsigned)n, NIL_P(timeout) ? -1 : NUM2INT(timeout), rv);
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.pending	-> Integer
+ *
+ * Returns the number of operations queued or in flight
+ */
+static VALUE ring_pending(VALUE self)
+{
+	return UINT2NUM(ring_of(self)->inflight);
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.to_io	-> IO
+ *
+ * Returns an IO for the ring descriptor, which is readable whenever
+ * completions are available.  This allows waiting on the ring with
+ * IO#wait_readable (and thus a Fiber scheduler), Kgio.poll or another
+ * event loop and reaping the completions with Kgio::Ring#wait(0).
+ * The IO does not own the descriptor, Kgio::Ring#close closes it.
+ */
+static VALUE ring_to_io(VALUE self)
+{
+	struct ring *r = ring_of(self);
+
+	if (NIL_P(r->io)) {
+		VALUE io = rb_funcall(rb_cIO, id_for_fd, 1, INT2NUM(r->fd));
+
+		rb_funcall(io, id_autoclose_set, 1, Qfalse);
+		r->io = io;
+	}
+	return r->io;
+}
+
+/*
+ * call-seq:
+ *
+ *	ring.close	-> nil
+ *
+ * Cancels all operations still in flight, waits for them to finish
+ * and releases the ring.  Their completions are discarded, and IOs
+ * used with the ring are not closed.  If the kernel refuses to cancel
+ * an operation, close stops waiting and the memory of the operations
+ * left in flight is never freed.
+ */
+static VALUE ring_close(VALUE self)
+{
+	struct ring *r = ring_of(self);
+
+	if (r->inflight) {
+		r->cancel_failed = 0;
+		queue_cancel(r, Qundef);
+		while (r->inflight && !r->cancel_failed)
+			ring_wait(r, r->inflight, -1, Qnil);
+	}
+	if (!NIL_P(r->io)) {
+		rb_io_close(r->io);
+		r->io = Qnil;
+	}
+	ring_release(r);
+	return Qnil;
+}
+
+void init_kgio_ring(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cRing;
+
+	id_for_fd = rb_intern("for_fd");
+	id_autoclose_set = rb_intern("autoclose=");
+
+	/*
+	 * Document-class: Kgio::Ring
+	 *
+	 * A batch of socket operations submitted to the kernel with
+	 * io_uring.  Operations are queued with recv, send, writev,
+	 * accept and connect, then submitted together and their
+	 * completions collected by one Kgio::Ring#wait call.  Results
+	 * are the values the corresponding try* methods return, tagged
+	 * with the object given when queueing:
+	 *
+	 *	ring = Kgio::Ring.new
+	 *	ring.accept(server, :accept, true) # multishot
+	 *	loop do
+	 *	  ring.wait.each do |tag, res|
+	 *	    case tag
+	 *	    when :accept then ring.recv(res, 16384)
+	 *	    else
+	 *	      case res
+	 *	      when String then ring.send(tag, res) # echo
+	 *	      when nil, Exception then tag.close
+	 *	      end
+	 *	    end
+	 *	  end
+	 *	end
+	 *
+	 * This is only available on Linux, check Kgio::Ring.available?
+	 * before using it.
+	 */
+	cRing = rb_define_class_under(mKgio, "Ring", rb_cObject);
+	rb_define_alloc_func(cRing, ring_alloc);
+	rb_define_singleton_method(cRing, "available?", ring_available_p, 0);
+	rb_define_method(cRing, "initialize", ring_init, -1);
+	rb_define_method(cRing, "register_buffers", ring_register_buffers, 2);
+	rb_define_method(cRing, "recv", ring_recv, -1);
+	rb_define_method(cRing, "send", ring_send, -1);
+	rb_define_method(cRing, "writev", ring_writev, -1);
+	rb_define_method(cRing, "accept", ring_accept, -1);
+	rb_define_method(cRing, "connect", ring_connect, -1);
+	rb_define_method(cRing, "cancel", ring_cancel, 1);
+	rb_define_method(cRing, "submit", ring_submit_m, 0);
+	rb_define_method(cRing, "wait", ring_wait_m, -1);
+	rb_define_method(cRing, "pending", ring_pending, 0);
+	rb_define_method(cRing, "to_io", ring_to_io, 0);
+	rb_define_method(cRing, "close", ring_close, 0);
+}
+#else /* ! __NR_io_uring_setup */
+void init_kgio_ring(void)
+{
+}
+#endif /* ! __NR_io_uring_setup */
+#else /* ! (HAVE_LINUX_IO_URING_H && KGIO_HAVE_THREAD_CALL_WITHOUT_GVL) */
+void init_kgio_ring(void)
+{
+}
+#endif /* ! (HAVE_LINUX_IO_URING_H && KGIO_HAVE_THREAD_CALL_WITHOUT_GVL) */
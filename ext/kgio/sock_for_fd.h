@@ -27,13 +27,12 @@
 #endif
 
 #if SOCK_FOR_FD == 19  /* modeled after ext/socket/init.c */
-static VALUE sock_for_fd(VALUE klass, int fd)
+/* attaches +fd+ to +sock+, which may be a new object or a closed one */
+static VALUE sock_set_fd(VALUE sock, int fd)
 {
-	VALUE sock;
 	rb_io_t *fp;
 
 	rb_update_max_fd(fd); /* 1.9.3+ API */
-	sock = rb_obj_alloc(klass);
 	MakeOpenFile(sock, fp);
 	fp->fd = fd;
 	fp->mode = FMODE_READWRITE|FMODE_DUPLEX|FMODE_NOREVLOOKUP;
@@ -41,6 +40,11 @@ static VALUE sock_for_fd(VALUE klass, int fd)
 	rb_io_synchronized(fp);
 	return sock;
 }
+
+static VALUE sock_for_fd(VALUE klass, int fd)
+{
+	return sock_set_fd(rb_obj_alloc(klass), fd);
+}
 #elif SOCK_FOR_FD == 18 /* modeled after init_sock() in ext/socket/socket.c */
 static VALUE sock_for_fd(VALUE klass, int fd)
 {
@@ -0,0 +1,435 @@
+/*
+ * Kgio::TimerWheel keeps one timeout per IO object in a hashed timing
+ * wheel: each slot is a doubly-linked list of the timers which expire
+ * on a tick congruent to it, so arming, rearming and cancelling are
+ * O(1) and expiring only visits the slots for ticks which passed.
+ * Each slot also remembers a lower bound of the ticks it holds so
+ * finding the nearest deadline does not need to walk every timer.
+ */
+#include "kgio.h"
+#include <time.h>
+#include "broken_system_compat.h"
+#ifdef HAVE_RUBY_ST_H
+#  include <ruby/st.h>
+#else
+#  include <st.h>
+#endif
+
+#define TICK_NONE (~(uint64_t)0)
+
+struct tw_node {
+	struct tw_node *prev;
+	struct tw_node *next;
+	VALUE io;
+	uint64_t expire; /* tick */
+	long timeout; /* milliseconds, for rearm */
+};
+
+struct tw_slot {
+	struct tw_node head; /* circular list sentinel */
+	uint64_t min; /* lower bound of head.next...expire */
+};
+
+struct timer_wheel {
+	struct tw_slot *slots;
+	unsigned long nslots;
+	long resolution; /* milliseconds per tick */
+	uint64_t cur; /* every tick up to and including this has expired */
+	st_table *nodes; /* io => struct tw_node * */
+};
+
+static VALUE cTimerWheel;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int mark_i(st_data_t key, st_data_t value, st_data_t ignored)
+{
+	rb_gc_mark((VALUE)key);
+	return ST_CONTINUE;
+}
+
+static void tw_mark(void *ptr)
+{
+	struct timer_wheel *tw = ptr;
+
+	if (tw->nodes)
+		st_foreach(tw->nodes, mark_i, 0);
+}
+
+static int free_i(st_data_t key, st_data_t value, st_data_t ignored)
+{
+	xfree((void *)value);
+	return ST_CONTINUE;
+}
+
+static void tw_free(void *ptr)
+{
+	struct timer_wheel *tw = ptr;
+
+	if (tw->nodes) {
+		st_foreach(tw->nodes, free_i, 0);
+		st_free_table(tw->nodes);
+	}
+	xfree(tw->slots);
+	xfree(tw);
+}
+
+static VALUE tw_alloc(VALUE klass)
+{
+	struct timer_wheel *tw;
+	VALUE self = Data_Make_Struct(klass, struct timer_wheel,
+	                              tw_mark, tw_free, tw);
+
+	memset(tw, 0, sizeof(struct timer_wheel));
+	return self;
+}
+
+static struct timer_wheel *tw_of(VALUE self)
+{
+	struct timer_wheel *tw;
+
+	if (!rb_obj_is_kind_of(self, cTimerWheel))
+		rb_raise(rb_eTypeError, "not a Kgio::TimerWheel");
+	Data_Get_Struct(self, struct timer_wheel, tw);
+	if (!tw->slots)
+		rb_raise(rb_eRuntimeError, "uninitialized timer wheel");
+	return tw;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::TimerWheel.new				-> wheel
+ *	Kgio::TimerWheel.new(resolution, slots)	-> wheel
+ *
+ * Creates a timer wheel with +slots+ (default: 1024) slots which are
+ * +resolution+ (default: 10) milliseconds apart.  Timers fire no
+ * earlier than requested and at most +resolution+ milliseconds late.
+ * Timers further away than one revolution of the wheel are supported,
+ * they are merely skipped over until their turn comes.
+ */
+static VALUE tw_init(int argc, VALUE *argv, VALUE self)
+{
+	struct timer_wheel *tw;
+	VALUE resolution, slots;
+	unsigned long i;
+	long res, n;
+
+	Data_Get_Struct(self, struct timer_wheel, tw);
+	rb_scan_args(argc, argv, "02", &resolution, &slots);
+	res = NIL_P(resolution) ? 10 : NUM2LONG(resolution);
+	n = NIL_P(slots) ? 1024 : NUM2LONG(slots);
+	if (res <= 0)
+		rb_raise(rb_eArgError, "resolution must be positive");
+	if (n <= 0)
+		rb_raise(rb_eArgError, "slots must be positive");
+	if (tw->slots)
+		rb_raise(rb_eRuntimeError, "already initialized");
+
+	tw->slots = ALLOC_N(struct tw_slot, n);
+	tw->nslots = (unsigned long)n;
+	for (i = 0; i < tw->nslots; i++) {
+		struct tw_slot *slot = &tw->slots[i];
+
+		slot->head.next = slot->head.prev = &slot->head;
+		slot->min = TICK_NONE;
+	}
+	tw->resolution = res;
+	tw->cur = now_ms() / res;
+	tw->nodes = st_init_numtable();
+	return self;
+}
+
+static struct tw_slot *slot_of(struct timer_wheel *tw, uint64_t tick)
+{
+	return &tw->slots[tick % tw->nslots];
+}
+
+static void node_unlink(struct tw_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+/* links +node+ to expire on +tick+, or the next tick if it passed */
+static void node_link_tick(struct timer_wheel *tw, struct tw_node *node,
+                           uint64_t tick)
+{
+	struct tw_slot *slot;
+
+	if (tick <= tw->cur)
+		tick = tw->cur + 1;
+	node->expire = tick;
+	slot = slot_of(tw, tick);
+	node->next = &slot->head;
+	node->prev = slot->head.prev;
+	slot->head.prev->next = node;
+	slot->head.prev = node;
+	if (tick < slot->min)
+		slot->min = tick;
+}
+
+static void node_link(struct timer_wheel *tw, struct tw_node *node)
+{
+	uint64_t ms = now_ms() + node->timeout;
+
+	node_link_tick(tw, node, (ms + tw->resolution - 1) / tw->resolution);
+}
+
+/* walks +slot+ to make its lower bound exact */
+static uint64_t slot_tighten(struct tw_slot *slot)
+{
+	struct tw_node *node;
+
+	slot->min = TICK_NONE;
+	for (node = slot->head.next; node != &slot->head; node = node->next)
+		if (node->expire < slot->min)
+			slot->min = node->expire;
+	return slot->min;
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.arm(io, timeout)	-> wheel
+ *
+ * Arms a timer for +io+ which expires in +timeout+ milliseconds.
+ * Any timer already armed for +io+ is replaced.
+ */
+static VALUE tw_arm(VALUE self, VALUE io, VALUE timeout)
+{
+	struct timer_wheel *tw = tw_of(self);
+	long ms = NUM2LONG(timeout);
+	st_data_t value;
+	struct tw_node *node;
+
+	if (ms < 0)
+		rb_raise(rb_eArgError, "timeout must not be negative");
+	if (st_lookup(tw->nodes, (st_data_t)io, &value)) {
+		node = (struct tw_node *)value;
+		node_unlink(node);
+	} else {
+		node = ALLOC(struct tw_node);
+		node->io = io;
+		st_insert(tw->nodes, (st_data_t)io, (st_data_t)node);
+	}
+	node->timeout = ms;
+	node_link(tw, node);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.rearm(io)	-> io or nil
+ *
+ * Pushes the timer for +io+ back by the +timeout+ it was last armed
+ * with, for example after a keepalive client sent another request.
+ * Returns +nil+ if +io+ has no timer armed.
+ */
+static VALUE tw_rearm(VALUE self, VALUE io)
+{
+	struct timer_wheel *tw = tw_of(self);
+	st_data_t value;
+	struct tw_node *node;
+
+	if (!st_lookup(tw->nodes, (st_data_t)io, &value))
+		return Qnil;
+	node = (struct tw_node *)value;
+	node_unlink(node);
+	node_link(tw, node);
+	return io;
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.cancel(io)	-> io or nil
+ *
+ * Disarms the timer for +io+.  This must be called before +io+ is
+ * closed unless its timer already expired.  Returns +nil+ if +io+
+ * has no timer armed.
+ */
+static VALUE tw_cancel(VALUE self, VALUE io)
+{
+	struct timer_wheel *tw = tw_of(self);
+	st_data_t key = (st_data_t)io;
+	st_data_t value;
+
+	if (!st_delete(tw->nodes, &key, &value))
+		return Qnil;
+	node_unlink((struct tw_node *)value);
+	xfree((void *)value);
+	return io;
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.armed?(io)	-> true or false
+ *
+ * Returns whether +io+ has a timer armed.
+ */
+static VALUE tw_armed_p(VALUE self, VALUE io)
+{
+	struct timer_wheel *tw = tw_of(self);
+
+	return st_lookup(tw->nodes, (st_data_t)io, NULL) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.size	-> Integer
+ *
+ * Returns the number of armed timers.
+ */
+static VALUE tw_size(VALUE self)
+{
+	struct timer_wheel *tw = tw_of(self);
+
+	return ULONG2NUM((unsigned long)tw->nodes->num_entries);
+}
+
+/*
+ * returns the number of milliseconds until the nearest timer expires,
+ * 0 if one already expired, or -1 if there are no timers
+ */
+int kgio_timer_wheel_timeout(VALUE self)
+{
+	struct timer_wheel *tw = tw_of(self);
+	uint64_t now = now_ms();
+	uint64_t tick, min = TICK_NONE;
+	unsigned long i;
+
+	if (tw->nodes->num_entries == 0)
+		return -1;
+
+	for (i = 1; i <= tw->nslots; i++) {
+		struct tw_slot *slot;
+
+		tick = tw->cur + i;
+		slot = slot_of(tw, tick);
+		if (slot->min <= tick && slot_tighten(slot) <= tick) {
+			min = slot->min;
+			break;
+		}
+		if (slot->min < min)
+			min = slot->min;
+	}
+
+	/* a timer further away than one revolution, only wake up early */
+	tick = min * tw->resolution;
+	if (tick <= now)
+		return 0;
+	tick -= now;
+	return tick > INT_MAX ? INT_MAX : (int)tick;
+}
+
+static int is_kept(VALUE keep, VALUE io)
+{
+	return !NIL_P(keep) && !NIL_P(rb_hash_lookup(keep, io));
+}
+
+/*
+ * removes every expired timer and returns an array of their IOs.
+ * IOs which are keys of the +keep+ hash (if not nil) stay armed and
+ * are due again on the next tick, so a ready IO does not lose its
+ * deadline before the caller had a chance to rearm or cancel it.
+ */
+VALUE kgio_timer_wheel_expire(VALUE self, VALUE keep)
+{
+	struct timer_wheel *tw = tw_of(self);
+	uint64_t now = now_ms() / tw->resolution;
+	VALUE rv = rb_ary_new();
+	unsigned long i;
+
+	for (i = 1; i <= tw->nslots && tw->cur + i <= now; i++) {
+		struct tw_slot *slot = slot_of(tw, tw->cur + i);
+		struct tw_node *node, *next;
+
+		if (slot->min > now)
+			continue;
+		for (node = slot->head.next; node != &slot->head; node = next) {
+			st_data_t key = (st_data_t)node->io;
+
+			next = node->next;
+			if (node->expire > now)
+				continue;
+			node_unlink(node);
+			if (is_kept(keep, node->io)) {
+				node_link_tick(tw, node, now + 1);
+				continue;
+			}
+			st_delete(tw->nodes, &key, NULL);
+			rb_ary_push(rv, node->io);
+			xfree(node);
+		}
+		slot_tighten(slot);
+	}
+	if (now > tw->cur)
+		tw->cur = now;
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.next_timeout	-> Integer or nil
+ *
+ * Returns the number of milliseconds until the nearest timer expires
+ * (suitable for Kgio.poll), or +nil+ if no timers are armed.  This
+ * may be earlier than the nearest timer if all timers are more than
+ * one revolution of the wheel away.
+ */
+static VALUE tw_next_timeout(VALUE self)
+{
+	int ms = kgio_timer_wheel_timeout(self);
+
+	return ms < 0 ? Qnil : INT2FIX(ms);
+}
+
+/*
+ * call-seq:
+ *
+ *	wheel.expire	-> [ io, ... ]
+ *
+ * Disarms and returns every IO whose timer expired, in the order
+ * they expired.  Kgio.poll calls this itself when given a wheel.
+ */
+static VALUE tw_expire(VALUE self)
+{
+	return kgio_timer_wheel_expire(self, Qnil);
+}
+
+void init_kgio_timer_wheel(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+
+	check_clock();
+
+	/*
+	 * Document-class: Kgio::TimerWheel
+	 *
+	 * Tracks one idle or request timeout per IO object so servers
+	 * do not have to scan every connection to find the expired ones.
+	 * Pass it as the third argument of Kgio.poll to have expired
+	 * IOs returned along with the ready ones.
+	 */
+	cTimerWheel = rb_define_class_under(mKgio, "TimerWheel", rb_cObject);
+	rb_define_alloc_func(cTimerWheel, tw_alloc);
+	rb_define_method(cTimerWheel, "initialize", tw_init, -1);
+	rb_define_method(cTimerWheel, "arm", tw_arm, 2);
+	rb_define_method(cTimerWheel, "rearm", tw_rearm, 1);
+	rb_define_method(cTimerWheel, "cancel", tw_cancel, 1);
+	rb_define_method(cTimerWheel, "armed?", tw_armed_p, 1);
+	rb_define_method(cTimerWheel, "size", tw_size, 0);
+	rb_define_method(cTimerWheel, "next_timeout", tw_next_timeout, 0);
+	rb_define_method(cTimerWheel, "expire", tw_expire, 0);
+}
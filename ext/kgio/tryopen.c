@@ -109,9 +109,10 @@ retry:
 	fd = (long)rb_thread_blocking_region(nogvl_open, &o, RUBY_UBF_IO, 0);
 	if (fd < 0) {
 		if (errno == EMFILE || errno == ENFILE || errno == ENOMEM) {
-			rb_gc();
-			if (retried)
+			/* fail fast when shedding load, see Kgio.reserve_fd= */
+			if (retried || kgio_reserve_fd_enabled())
 				rb_sys_fail(o.pathname);
+			rb_gc();
 			retried = 1;
 			goto retry;
 		}
@@ -370,7 +370,7 @@ module LibReadWriteTest
     end
     buf = "." * 1024 * 1024 * 10
     thr = Thread.new { @wr.kgio_write(buf) }
-    Thread.pass until thr.stop?
+    Thread.pass until thr.stop? && @wr.instance_variable_get(:@nr) > 0
     readed = @rd.read(buf.size)
     thr.join
     assert_nil thr.value
@@ -387,7 +387,7 @@ module LibReadWriteTest
     buf = ["." * 1024] * 1024 * 10
     buf_size = buf.inject(0){|c, s| c + s.size}
     thr = Thread.new { @wr.kgio_writev(buf) }
-    Thread.pass until thr.stop?
+    Thread.pass until thr.stop? && @wr.instance_variable_get(:@nr) > 0
     readed = @rd.read(buf_size)
     thr.join
     assert_nil thr.value
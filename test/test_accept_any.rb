@@ -0,0 +1,65 @@
+require 'test/unit'
+require 'fcntl'
+require 'tmpdir'
+require 'fileutils'
+$-w = true
+require 'kgio'
+
+class TestAcceptAny < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @tcp = Kgio::TCPServer.new(@host, 0)
+    @tmpdir = Dir.mktmpdir('kgio_accept_any')
+    @path = "#@tmpdir/sock"
+    @unix = Kgio::UNIXServer.new(@path)
+  end
+
+  def teardown
+    @tcp.close
+    @unix.close
+    FileUtils.remove_entry_secure(@tmpdir)
+  end
+
+  def test_accept_any_tcp_and_unix
+    c = TCPSocket.new(@host, @tcp.addr[1])
+    a = Kgio.accept_any([@tcp, @unix], 5000)
+    assert_kind_of Kgio::Socket, a
+    assert_equal @host, a.kgio_addr
+    a.close
+    c.close
+
+    c = UNIXSocket.new(@path)
+    a = Kgio.accept_any([@tcp, @unix], 5000)
+    assert_kind_of Kgio::Socket, a
+    assert_equal Kgio::LOCALHOST, a.kgio_addr
+    a.close
+    c.close
+  end
+
+  def test_accept_any_timeout
+    t0 = Time.now
+    assert_nil Kgio.accept_any([@tcp, @unix], 200)
+    assert((Time.now - t0) >= 0.2)
+    assert_nil Kgio.accept_any([@tcp, @unix], 0)
+  end
+
+  def test_accept_any_class_and_flags
+    klass = Class.new(Kgio::Socket)
+    c = UNIXSocket.new(@path)
+    a = Kgio.accept_any([@unix], nil, klass, 0)
+    assert_instance_of klass, a
+    assert_equal 0, a.fcntl(Fcntl::F_GETFD)
+    a.close
+    c.close
+  end
+
+  def test_accept_any_blocking
+    thr = Thread.new { Kgio.accept_any([@tcp, @unix], nil) }
+    sleep(0.1) until thr.stop?
+    c = UNIXSocket.new(@path)
+    a = thr.value
+    assert_kind_of Kgio::Socket, a
+    a.close
+    c.close
+  end
+end if Kgio.respond_to?(:accept_any)
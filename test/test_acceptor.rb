@@ -0,0 +1,156 @@
+require 'test/unit'
+require 'tmpdir'
+$-w = true
+require 'kgio'
+
+class TestAcceptor < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+    @port = @srv.addr[1]
+    @clients = []
+  end
+
+  def teardown
+    @acc.close if @acc && !@acc.closed?
+    @clients.each { |c| c.close unless c.closed? }
+    @srv.close
+  end
+
+  def drain(n)
+    rv = []
+    while rv.size < n
+      assert Kgio.poll({ @acc => Kgio::POLLIN }, 5000), "timed out"
+      got = @acc.kgio_tryaccept and rv.concat(got)
+    end
+    rv
+  end
+
+  def test_empty
+    @acc = Kgio::Acceptor.new(@srv)
+    assert_kind_of IO, @acc.to_io
+    assert_nil @acc.kgio_tryaccept
+    assert_equal 0, @acc.stats[:queued]
+  end
+
+  def test_accept_batch
+    @acc = Kgio::Acceptor.new(@srv, 2)
+    5.times { @clients << TCPSocket.new(@host, @port) }
+    socks = drain(5)
+    assert_equal 5, socks.size
+    socks.each do |s|
+      assert_kind_of Kgio::Socket, s
+      assert_equal @host, s.kgio_addr
+    end
+
+    @clients[0].write("hi")
+    assert_equal 1, socks.count { |s| s.kgio_tryread(2) == "hi" }
+    stats = @acc.stats
+    assert_equal 5, stats[:accepted]
+    assert_equal 5, stats[:delivered]
+    assert_equal 0, stats[:queued]
+    socks.each(&:close)
+  end
+
+  def test_max_and_klass
+    klass = Class.new(Kgio::Socket)
+    @acc = Kgio::Acceptor.new(@srv, 1, 8)
+    3.times { @clients << TCPSocket.new(@host, @port) }
+    Thread.pass until @acc.stats[:accepted] == 3
+    a = @acc.kgio_tryaccept(2, klass)
+    assert_equal 2, a.size
+    a.each { |s| assert_instance_of klass, s }
+    # still readable for the one left behind
+    assert_equal [ @acc.to_io ], IO.select([ @acc.to_io ], nil, nil, 5)[0]
+    b = @acc.kgio_tryaccept(2)
+    assert_equal 1, b.size
+    (a + b).each(&:close)
+  end
+
+  def test_backpressure
+    @acc = Kgio::Acceptor.new(@srv, 1, 2)
+    6.times { @clients << TCPSocket.new(@host, @port) }
+    socks = drain(6)
+    assert_equal 6, socks.size
+    socks.each(&:close)
+  end
+
+  def test_close
+    @acc = Kgio::Acceptor.new(@srv)
+    @clients << TCPSocket.new(@host, @port)
+    Thread.pass until @acc.stats[:accepted] == 1
+    io = @acc.to_io
+    assert_nil @acc.close
+    assert @acc.closed?
+    assert io.closed?
+    assert_raises(IOError) { @acc.kgio_tryaccept }
+    assert_nil @clients[0].read(1)
+
+    # server still works after the acceptor is gone
+    @clients << TCPSocket.new(@host, @port)
+    IO.select([@srv], nil, nil, 5)
+    assert_kind_of Kgio::Socket, @srv.kgio_tryaccept
+  end
+
+  def test_to_io_closed_first
+    @acc = Kgio::Acceptor.new(@srv)
+    io = @acc.to_io
+    fd = io.fileno
+    io.close
+    GC.start
+    @clients << TCPSocket.new(@host, @port)
+    Thread.pass until @acc.stats[:accepted] == 1
+    assert_equal 1, @acc.kgio_tryaccept.size
+    @acc.close
+    assert_raises(Errno::EBADF) { IO.for_fd(fd, autoclose: false).stat }
+  end
+
+  def test_close_concurrent
+    @acc = Kgio::Acceptor.new(@srv, 4)
+    thrs = 4.times.map { Thread.new { @acc.close } }
+    thrs.each { |t| assert_nil t.value }
+    assert @acc.closed?
+    assert_nil @acc.close
+  end
+
+  def test_unix
+    path = "#{Dir.tmpdir}/kgio-acceptor-#{$$}-#{rand}"
+    srv = Kgio::UNIXServer.new(path)
+    acc = Kgio::Acceptor.new(srv)
+    c = UNIXSocket.new(path)
+    IO.select([acc], nil, nil, 5)
+    socks = acc.kgio_tryaccept
+    assert_equal Kgio::LOCALHOST, socks[0].kgio_addr
+    socks[0].close
+    c.close
+  ensure
+    acc.close if acc
+    srv.close if srv
+    File.unlink(path) rescue nil
+  end
+
+  def test_per_cpu
+    @acc = Kgio::Acceptor.new(@srv, 1, 16, true)
+    ncpu = @acc.cpus
+    assert_operator ncpu, :>=, 1
+    assert_raises(ArgumentError) { @acc.to_io(ncpu) }
+    assert_raises(ArgumentError) { @acc.kgio_tryaccept(1, nil, -1) }
+    3.times { @clients << TCPSocket.new(@host, @port) }
+    Thread.pass until @acc.stats[:accepted] == 3
+    socks = []
+    ncpu.times do |cpu|
+      got = @acc.kgio_tryaccept(64, nil, cpu) or next
+      got.each do |s|
+        assert_equal cpu, s.kgio_incoming_cpu % ncpu
+      end
+      socks.concat(got)
+    end
+    assert_equal 3, socks.size
+    socks.each(&:close)
+  end
+
+  def test_bad_args
+    assert_raises(ArgumentError) { Kgio::Acceptor.new(@srv, 0) }
+    assert_raises(ArgumentError) { Kgio::Acceptor.new(@srv, 1, 0) }
+  end
+end if defined?(Kgio::Acceptor)
@@ -0,0 +1,182 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+class TestAdmission < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+    @port = @srv.addr[1]
+    @clients = []
+  end
+
+  def teardown
+    @clients.each { |c| c.close unless c.closed? }
+    @srv.close
+  end
+
+  def connect
+    c = TCPSocket.new(@host, @port)
+    @clients << c
+    IO.select([@srv], nil, nil, 5)
+    c
+  end
+
+  def test_no_policy
+    assert_nil @srv.kgio_admission
+    connect
+    assert_kind_of Kgio::Socket, @srv.kgio_tryaccept
+  end
+
+  def test_type_check
+    assert_raises(TypeError) { @srv.kgio_admission = Object.new }
+    assert_raises(ArgumentError) { Kgio::Admission.new(1, 0) }
+    assert_raises(ArgumentError) { Kgio::Admission.new(nil, 1, 0) }
+  end
+
+  def test_rate_limit
+    adm = Kgio::Admission.new(0.001, 2)
+    @srv.kgio_admission = adm
+    assert_equal adm, @srv.kgio_admission
+
+    2.times do
+      connect
+      io = @srv.kgio_tryaccept
+      assert_kind_of Kgio::Socket, io
+      io.close
+    end
+    c = connect
+    assert_nil @srv.kgio_tryaccept
+    assert_nil c.read(1)
+
+    stats = adm.stats
+    assert_equal 2, stats[:admitted]
+    assert_equal 1, stats[:rate_limited]
+    assert_equal 0, stats[:over_capacity]
+    assert_equal 0, stats[:active]
+  end
+
+  def test_max_conns
+    adm = Kgio::Admission.new(nil, 1, 1)
+    @srv.kgio_admission = adm
+    connect
+    a = @srv.kgio_tryaccept
+    assert_kind_of Kgio::Socket, a
+
+    c = connect
+    assert_nil @srv.kgio_tryaccept
+    assert_nil c.read(1)
+    assert_equal 1, adm.stats[:over_capacity]
+
+    a.close
+    assert_equal 0, adm.stats[:active]
+    connect
+    b = @srv.kgio_tryaccept
+    assert_kind_of Kgio::Socket, b
+    assert_equal 2, adm.stats[:admitted]
+    b.close
+  end
+
+  def accept_and_drop
+    connect
+    assert_kind_of Kgio::Socket, @srv.kgio_tryaccept
+    nil
+  end
+
+  def test_garbage_collected
+    adm = Kgio::Admission.new(nil, 1, 1)
+    @srv.kgio_admission = adm
+    accept_and_drop
+    assert_equal 1, adm.stats[:active]
+    GC.start
+    connect
+    b = @srv.kgio_tryaccept
+    assert_kind_of Kgio::Socket, b
+    assert_equal 0, adm.stats[:over_capacity]
+    assert_equal 1, adm.stats[:active]
+    b.close
+  end
+
+  def test_closed_by_another_io
+    adm = Kgio::Admission.new(nil, 1, 1)
+    @srv.kgio_admission = adm
+    connect
+    a = @srv.kgio_tryaccept
+    a.autoclose = false
+    IO.for_fd(a.fileno).close
+    assert_equal 0, adm.stats[:active]
+  end
+
+  def test_proxy_pending
+    adm = Kgio::Admission.new(0.001, 1)
+    @srv.kgio_admission = adm
+    @srv.kgio_proxy_protocol = true
+    ios = %w(192.0.2.1 192.0.2.1 192.0.2.2).map do |ip|
+      c = connect
+      c.write("PROXY TCP4 #{ip} ")
+      io = @srv.kgio_tryaccept
+      assert_equal true, io.kgio_proxy_pending?
+      c.write("127.0.0.1 1 2\r\n")
+      IO.select([ io ], nil, nil, 5)
+      io
+    end
+    assert_equal 0, adm.stats[:admitted]
+
+    assert_equal ios[0], ios[0].kgio_tryproxy
+    assert_nil ios[1].kgio_tryproxy
+    assert_predicate ios[1], :closed?
+    assert_equal ios[2], ios[2].kgio_tryproxy
+    stats = adm.stats
+    assert_equal 2, stats[:admitted]
+    assert_equal 1, stats[:rate_limited]
+    assert_equal 2, stats[:active]
+  ensure
+    ios.each(&:close) if ios
+  end
+
+  def test_release_while_open
+    adm = Kgio::Admission.new(nil, 1, 2)
+    @srv.kgio_admission = adm
+    connect
+    a = @srv.kgio_tryaccept
+    connect
+    b = @srv.kgio_tryaccept
+    assert_equal 2, adm.stats[:active]
+
+    assert_equal adm, adm.release(a)
+    assert_equal 1, adm.stats[:active]
+    adm.release(a)
+    a.close
+    assert_equal 1, adm.stats[:active]
+
+    Kgio::Admission.new(nil, 1).release(b)
+    assert_equal 1, adm.stats[:active]
+    b.close
+    assert_equal 0, adm.stats[:active]
+  end
+
+  def test_undo_on_error
+    adm = Kgio::Admission.new(nil, 1, 1)
+    @srv.kgio_admission = adm
+    connect
+    assert_raises(TypeError) { @srv.kgio_tryaccept(:not_a_class) }
+    assert_equal 0, adm.stats[:active]
+    assert_equal 0, adm.stats[:admitted]
+  end
+
+  def test_shared_between_servers
+    adm = Kgio::Admission.new(nil, 1, 1)
+    srv2 = Kgio::TCPServer.new(@host, 0)
+    @srv.kgio_admission = srv2.kgio_admission = adm
+    connect
+    assert_kind_of Kgio::Socket, @srv.kgio_tryaccept
+    c = TCPSocket.new(@host, srv2.addr[1])
+    @clients << c
+    IO.select([srv2], nil, nil, 5)
+    assert_nil srv2.kgio_tryaccept
+    assert_equal 1, adm.stats[:over_capacity]
+  ensure
+    srv2.close if srv2
+  end
+end
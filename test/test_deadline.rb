@@ -0,0 +1,118 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestDeadline < Test::Unit::TestCase
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def teardown
+    [ @r, @w, @srv ].each { |io| io.close if io && !io.closed? }
+  end
+
+  def test_accessors
+    @r, @w = Kgio::Pipe.new
+    assert_nil @r.kgio_deadline
+    t = now + 1
+    @r.kgio_deadline = t
+    assert_equal t, @r.kgio_deadline
+    @r.kgio_deadline = 1
+    assert_kind_of Float, @r.kgio_deadline
+    @r.kgio_deadline = nil
+    assert_nil @r.kgio_deadline
+  end
+
+  def test_read_timeout
+    @r, @w = Kgio::UNIXSocket.pair
+    @r.kgio_deadline = now + 0.05
+    t0 = now
+    assert_equal :timeout, @r.kgio_read(5)
+    assert_operator now - t0, :>=, 0.04
+    @w.kgio_write "hi"
+    assert_equal "hi", @r.kgio_read(5)
+  end
+
+  def test_read_past_deadline
+    @r, @w = Kgio::Pipe.new
+    @r.kgio_deadline = now - 1
+    assert_equal :timeout, @r.kgio_read(5)
+    @w.kgio_write "x"
+    assert_equal "x", @r.kgio_read(5)
+  end
+
+  def test_write_timeout
+    @r, @w = Kgio::Pipe.new
+    @w.kgio_deadline = now + 0.05
+    buf = "*" * (1 << 20)
+    rest = @w.kgio_write(buf)
+    assert_kind_of String, rest
+    assert_operator rest.size, :>, 0
+    assert_operator rest.size, :<, buf.size
+
+    # the pipe is still full, nothing could be written this time
+    assert_equal :timeout, @w.kgio_write(buf)
+    assert_equal buf.size - rest.size, @r.kgio_tryread(buf.size).size
+  end
+
+  def test_writev_timeout
+    @r, @w = Kgio::Pipe.new
+    @w.kgio_deadline = now + 0.05
+    ary = [ "*" * (1 << 20), "." ]
+    rest = @w.kgio_writev(ary)
+    assert_kind_of Array, rest
+    assert_equal ".", rest[-1]
+    assert_operator rest.inject(0) { |n, s| n + s.size }, :<, (1 << 20) + 1
+    assert_equal :timeout, @w.kgio_writev(ary)
+  end
+
+  def test_accept_timeout
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    @srv.kgio_deadline = now + 0.05
+    assert_equal :timeout, @srv.kgio_accept
+    c = Kgio::TCPSocket.new('127.0.0.1', @srv.addr[1])
+    @srv.kgio_deadline = now + 5
+    s = @srv.kgio_accept
+    assert_kind_of Kgio::Socket, s
+    s.close
+    c.close
+  end
+
+  def test_connect_deadline
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    t = now + 5
+    c = Kgio::TCPSocket.new('127.0.0.1', @srv.addr[1], t)
+    assert_kind_of Kgio::TCPSocket, c
+    assert_equal t, c.kgio_deadline
+    c.close
+  end
+
+  def test_connect_past_deadline
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    assert_equal :timeout, Kgio::TCPSocket.new('127.0.0.1', @srv.addr[1], 0.0)
+  end
+
+  def test_nil_deadline_blocks
+    @r, @w = Kgio::Pipe.new
+    @r.kgio_deadline = now - 1
+    @r.kgio_deadline = nil
+    th = Thread.new { sleep 0.05; @w.kgio_write "ok" }
+    assert_equal "ok", @r.kgio_read(5)
+    th.join
+  end
+
+  def test_overridden_waiter_gets_remaining
+    klass = Class.new(Kgio::Pipe) do
+      attr_reader :waited
+      def kgio_wait_readable(timeout = nil)
+        (@waited ||= []) << timeout
+        super
+      end
+    end
+    @r, @w = klass.new
+    @r.kgio_deadline = now + 0.05
+    assert_equal :timeout, @r.kgio_read(5)
+    assert_kind_of Float, @r.waited[0]
+    assert_operator @r.waited[0], :<=, 0.05
+  end
+end
@@ -0,0 +1,114 @@
+require 'test/unit'
+require 'io/wait'
+require 'tmpdir'
+$-w = true
+require 'kgio'
+
+class TestFdPass < Test::Unit::TestCase
+  def setup
+    @a, @b = Kgio::UNIXSocket.pair
+    @to_close = [ @a, @b ]
+  end
+
+  def teardown
+    @to_close.each { |io| io.close unless io.closed? }
+  end
+
+  def test_wait_readable_and_eof
+    assert_equal :wait_readable, @b.kgio_tryrecvmsg(16, 4)
+    @a.close
+    assert_nil @b.kgio_tryrecvmsg(16, 4)
+  end
+
+  def test_data_only
+    assert_nil @a.kgio_trysendmsg("hello", [])
+    assert_equal [ "hello", [] ], @b.kgio_tryrecvmsg(16, 4)
+  end
+
+  def test_many_fds
+    pipes = Array.new(100) { IO.pipe }
+    @to_close.concat(pipes.flatten)
+    assert_nil @a.kgio_trysendmsg("x", pipes.map { |r, _| r })
+    data, ios = @b.kgio_tryrecvmsg(16, 253)
+    @to_close.concat(ios)
+    assert_equal "x", data
+    assert_equal 100, ios.size
+    ios.each_with_index do |io, i|
+      assert_instance_of IO, io
+      assert io.close_on_exec?
+      pipes[i][1].syswrite("#{i}")
+      assert_equal "#{i}", io.readpartial(10)
+    end
+  end
+
+  def test_sockets_and_listeners
+    srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    c = Kgio::TCPSocket.new('127.0.0.1', srv.addr[1])
+    s = srv.kgio_accept
+    @to_close.concat([ srv, c, s ])
+
+    assert_nil @a.kgio_trysendmsg("handoff", [ s, srv ])
+    s.close
+    data, ios = @b.kgio_tryrecvmsg(16, 4)
+    @to_close.concat(ios)
+    assert_equal "handoff", data
+    client, listener = ios
+    assert_kind_of Kgio::SocketMethods, client
+    assert_equal '127.0.0.1', client.kgio_addr
+    assert_instance_of Kgio::TCPServer, listener
+    assert_equal srv.addr[1], listener.addr[1]
+
+    c.kgio_write "hi"
+    assert_equal "hi", client.kgio_read(2)
+    c2 = Kgio::TCPSocket.new('127.0.0.1', srv.addr[1])
+    @to_close << c2
+    s2 = listener.kgio_accept
+    @to_close << s2
+    assert_equal '127.0.0.1', s2.kgio_addr
+  end
+
+  def test_unix_listener
+    Dir.mktmpdir do |dir|
+      srv = Kgio::UNIXServer.new("#{dir}/sock")
+      @to_close << srv
+      assert_nil @a.kgio_trysendmsg(".", [ srv ])
+      _, ios = @b.kgio_tryrecvmsg(1, 1)
+      @to_close.concat(ios)
+      assert_instance_of Kgio::UNIXServer, ios[0]
+    end
+  end
+
+  def test_send_io_compat
+    r, w = IO.pipe
+    @to_close.concat([ r, w ])
+    @a.send_io(r)
+    data, ios = @b.kgio_tryrecvmsg(16, 1)
+    @to_close.concat(ios)
+    assert_equal 1, ios.size
+    assert_equal 1, data.size
+
+    assert_nil @a.kgio_trysendmsg("z", [ w ])
+    io = @b.recv_io
+    @to_close << io
+    io.syswrite "ok"
+    assert_equal "ok", r.readpartial(2)
+  end
+
+  def test_wait_writable
+    buf = "." * 65536
+    rv = nil
+    1000.times do
+      rv = @a.kgio_trysendmsg(buf, [])
+      break if rv
+    end
+    assert(rv == :wait_writable || String === rv, rv.inspect)
+    assert_equal :wait_writable, @a.kgio_trysendmsg(buf, [])
+  end
+
+  def test_bad_args
+    assert_raises(ArgumentError) { @a.kgio_trysendmsg("", [ @a ]) }
+    assert_raises(ArgumentError) { @a.kgio_trysendmsg("x", [ @a ] * 254) }
+    assert_raises(ArgumentError) { @b.kgio_tryrecvmsg(0, 1) }
+    assert_raises(ArgumentError) { @b.kgio_tryrecvmsg(1, 254) }
+  end
+end
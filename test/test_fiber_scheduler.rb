@@ -0,0 +1,175 @@
+require 'test/unit'
+require 'io/nonblock'
+$-w = true
+require 'kgio'
+
+# just enough of a Fiber scheduler to run the tests below
+class TestFiberSchedulerImpl
+  attr_reader :waits
+
+  def initialize
+    @readable = {}
+    @writable = {}
+    @deadlines = {}
+    @ready = []
+    @waits = []
+  end
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def fiber(&blk)
+    f = Fiber.new(blocking: false, &blk)
+    f.resume
+    f
+  end
+
+  def io_wait(io, events, timeout)
+    @waits << io
+    f = Fiber.current
+    if (events & IO::READABLE) != 0
+      @readable[io] = f
+    else
+      @writable[io] = f
+    end
+    @deadlines[f] = now + timeout if timeout
+    Fiber.yield
+  end
+
+  def kernel_sleep(duration = nil)
+    @deadlines[Fiber.current] = now + duration if duration
+    Fiber.yield
+  end
+
+  def block(blocker, timeout = nil)
+    @deadlines[Fiber.current] = now + timeout if timeout
+    Fiber.yield
+  end
+
+  def unblock(blocker, fiber)
+    @ready << fiber
+  end
+
+  def close
+    run
+  end
+
+  def forget(f)
+    @readable.delete_if { |_, x| x == f }
+    @writable.delete_if { |_, x| x == f }
+    @deadlines.delete(f)
+  end
+
+  def run
+    until @readable.empty? && @writable.empty? && @deadlines.empty? &&
+          @ready.empty?
+      timeout = @deadlines.values.min
+      timeout = timeout ? [ timeout - now, 0 ].max : nil
+      timeout = 0 unless @ready.empty?
+      r, w = IO.select(@readable.keys, @writable.keys, nil, timeout)
+      (r || []).each do |io|
+        f = @readable[io] or next
+        forget(f)
+        f.resume(IO::READABLE)
+      end
+      (w || []).each do |io|
+        f = @writable[io] or next
+        forget(f)
+        f.resume(IO::WRITABLE)
+      end
+      t = now
+      @deadlines.select { |_, d| d <= t }.each_key do |f|
+        forget(f)
+        f.resume(false)
+      end
+      ready, @ready = @ready, []
+      ready.each(&:resume)
+    end
+  end
+end
+
+class TestFiberScheduler < Test::Unit::TestCase
+  def setup
+    Fiber.respond_to?(:set_scheduler) or
+      return skip("Fiber scheduler not supported")
+    @sched = TestFiberSchedulerImpl.new
+  end
+
+  def scheduled
+    Thread.new do
+      Fiber.set_scheduler(@sched)
+      yield
+    end.join
+  end
+
+  def test_read_write
+    a, b = Kgio::UNIXSocket.pair
+    order = []
+    scheduled do
+      Fiber.schedule { order << a.kgio_read(5) }
+      Fiber.schedule { order << :write; b.kgio_write("hello") }
+    end
+    assert_equal [ :write, "hello" ], order
+    assert_equal [ a ], @sched.waits
+  ensure
+    a.close
+    b.close
+  end
+
+  def test_wait_timeout
+    a, b = Kgio::UNIXSocket.pair
+    rv = :unset
+    scheduled do
+      Fiber.schedule { rv = a.kgio_wait_readable(0.01) }
+    end
+    assert_nil rv
+    assert_equal [ a ], @sched.waits
+  ensure
+    a.close
+    b.close
+  end
+
+  def test_wait_writable
+    a, b = Kgio::UNIXSocket.pair
+    rv = nil
+    scheduled do
+      Fiber.schedule { rv = a.kgio_wait_writable(1) }
+    end
+    assert_equal a, rv
+  ensure
+    a.close
+    b.close
+  end
+
+  def test_blocking_accept
+    srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    srv.nonblock = false
+    port = srv.addr[1]
+    accepted = client = nil
+    scheduled do
+      Fiber.schedule { accepted = srv.kgio_accept }
+      Fiber.schedule { client = Kgio::TCPSocket.new('127.0.0.1', port) }
+    end
+    assert_kind_of Kgio::Socket, accepted
+    assert_kind_of Kgio::TCPSocket, client
+    assert_equal [ srv ], @sched.waits.grep(Kgio::TCPServer)
+  ensure
+    srv.close
+    accepted.close if accepted
+    client.close if client
+  end
+
+  def test_blocking_fiber_bypasses_scheduler
+    a, b = Kgio::UNIXSocket.pair
+    rv = :unset
+    scheduled do
+      Fiber.new(blocking: true) { rv = a.kgio_wait_readable(0.01) }.resume
+    end
+    assert_nil rv
+    assert_equal [], @sched.waits
+  ensure
+    a.close
+    b.close
+  end
+end
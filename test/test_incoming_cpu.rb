@@ -0,0 +1,38 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestIncomingCpu < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+  end
+
+  def teardown
+    @srv.close
+  end
+
+  def test_incoming_cpu
+    c = TCPSocket.new(@host, @srv.addr[1])
+    c.write("a")
+    a = @srv.kgio_accept
+    cpu = a.kgio_incoming_cpu
+    if cpu
+      assert_kind_of Integer, cpu
+      assert_operator cpu, :>=, 0
+      assert_same cpu, a.kgio_incoming_cpu
+    end
+    a.close
+    c.close
+  end
+
+  def test_recorded_at_accept
+    c = TCPSocket.new(@host, @srv.addr[1])
+    a = @srv.kgio_accept
+    cpu = a.instance_variable_get(:@kgio_incoming_cpu)
+    assert_kind_of Integer, cpu if cpu
+    assert_equal cpu, a.kgio_incoming_cpu if cpu
+    a.close
+    c.close
+  end
+end if Kgio::SocketMethods.method_defined?(:kgio_incoming_cpu)
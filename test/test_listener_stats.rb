@@ -0,0 +1,73 @@
+require 'test/unit'
+require 'tmpdir'
+$-w = true
+require 'kgio'
+
+class TestListenerStats < Test::Unit::TestCase
+  def setup
+    @clients = []
+  end
+
+  def teardown
+    @clients.each { |c| c.close unless c.closed? }
+    @srv.close if defined?(@srv) && ! @srv.closed?
+  end
+
+  def test_tcp
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    @srv.listen(7)
+    port = @srv.addr[1]
+    stats = @srv.kgio_listener_stats
+    assert_equal({ :queued => 0, :backlog => 7 }, stats)
+
+    stats = @srv.kgio_listener_stats(true)
+    assert_equal 0, stats[:queued]
+    assert_equal 7, stats[:backlog]
+    assert_equal 0, stats[:syn_queued]
+    if File.readable?('/proc/net/netstat')
+      assert_kind_of Integer, stats[:overflows]
+      assert_kind_of Integer, stats[:drops]
+    end
+
+    3.times { @clients << Kgio::TCPSocket.new('127.0.0.1', port) }
+    assert_equal 3, wait_queued(3)
+    @srv.kgio_accept.close
+    assert_equal 2, @srv.kgio_listener_stats[:queued]
+  end if Kgio::TCPServer.method_defined?(:kgio_listener_stats)
+
+  def test_tcp_not_listening
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    c = Kgio::TCPSocket.new('127.0.0.1', @srv.addr[1])
+    @clients << c
+    assert_raises(NoMethodError) { c.kgio_listener_stats }
+  end
+
+  def test_unix
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/sock"
+      @srv = Kgio::UNIXServer.new(path)
+      @srv.listen(5)
+      begin
+        stats = @srv.kgio_listener_stats
+      rescue Errno::ENOENT, Errno::EPROTONOSUPPORT, Errno::EACCES => e
+        warn "skipping #{__method__}: #{e.message}"
+        return
+      end
+      assert_equal 0, stats[:queued]
+      assert_equal 5, stats[:backlog]
+      2.times { @clients << Kgio::UNIXSocket.new(path) }
+      assert_equal 2, @srv.kgio_listener_stats[:queued]
+      @srv.kgio_accept.close
+      assert_equal 1, @srv.kgio_listener_stats[:queued]
+    end
+  end if Kgio::UNIXServer.method_defined?(:kgio_listener_stats)
+
+  def wait_queued(n)
+    50.times do
+      q = @srv.kgio_listener_stats[:queued]
+      return q if q >= n
+      sleep 0.01
+    end
+    @srv.kgio_listener_stats[:queued]
+  end
+end
@@ -0,0 +1,106 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+# large transfers are done without the GVL, make sure they still behave
+class TestNogvl < Test::Unit::TestCase
+  def setup
+    @orig = Kgio.nogvl_threshold
+    Kgio.nogvl_threshold = 0
+  end
+
+  def teardown
+    Kgio.nogvl_threshold = @orig
+    [ @r, @w ].each { |io| io.close if io && !io.closed? }
+  end
+
+  def test_accessors
+    Kgio.nogvl_threshold = @orig
+    assert_equal 65536, Kgio.nogvl_threshold
+    Kgio.nogvl_threshold = nil
+    assert_nil Kgio.nogvl_threshold
+    Kgio.nogvl_threshold = 4096
+    assert_equal 4096, Kgio.nogvl_threshold
+    assert_raises(ArgumentError) { Kgio.nogvl_threshold = -1 }
+  end
+
+  def reader(io, bytes)
+    Thread.new do
+      buf = ''.b
+      tmp = ''.b
+      while buf.bytesize < bytes && io.kgio_read(65536, tmp)
+        buf << tmp
+      end
+      buf
+    end
+  end
+
+  def big
+    (0..255).map(&:chr).join('').b * 16384
+  end
+
+  def test_pipe_write
+    @r, @w = Kgio::Pipe.new
+    str = big
+    th = reader(@r, str.bytesize)
+    assert_nil @w.kgio_write(str)
+    assert_equal str, th.value
+    assert ! str.frozen?
+    str << "still mutable"
+  end
+
+  def test_socket_write
+    @r, @w = Kgio::UNIXSocket.pair
+    str = big
+    th = reader(@r, str.bytesize)
+    assert_nil @w.kgio_write(str)
+    assert_equal str, th.value
+  end
+
+  def test_trywrite_remainder
+    @r, @w = Kgio::Pipe.new
+    str = big
+    rest = @w.kgio_trywrite(str)
+    assert_kind_of String, rest
+    assert ! rest.frozen?
+    th = reader(@r, str.bytesize)
+    assert_nil @w.kgio_write(rest)
+    assert_equal str, th.value
+  end
+
+  def test_writev
+    @r, @w = Kgio::Pipe.new
+    ary = (1..2000).map { |i| "#{i}," * 100 }
+    expect = ary.join('')
+    th = reader(@r, expect.bytesize)
+    assert_nil @w.kgio_writev(ary)
+    assert_equal expect, th.value
+    assert ary.none?(&:frozen?)
+  end
+
+  def test_read_buffer_unlocked
+    @r, @w = Kgio::UNIXSocket.pair
+    @w.kgio_write "hello"
+    buf = ''.b
+    assert_same buf, @r.kgio_read(5, buf)
+    assert_equal "hello", buf
+    buf << " world"
+    @w.close
+    assert_nil @r.kgio_read(5, buf)
+    buf.replace "modifiable"
+  end
+
+  def test_cross_thread_close_while_waiting
+    @r, @w = Kgio::Pipe.new
+    th = Thread.new do
+      begin
+        @r.kgio_read(1 << 20)
+      rescue => e
+        e
+      end
+    end
+    sleep(0.01) until th.stop?
+    @r.close
+    assert_kind_of IOError, th.value
+  end
+end
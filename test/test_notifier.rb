@@ -0,0 +1,50 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestNotifier < Test::Unit::TestCase
+  def setup
+    defined?(Kgio::Notifier) or return skip("eventfd not available")
+    @n = Kgio::Notifier.new
+  end
+
+  def teardown
+    @n.close if @n && !@n.closed?
+  end
+
+  def test_empty
+    assert_kind_of IO, @n
+    assert_equal :wait_readable, @n.trydrain
+    assert_nil Kgio.poll({ @n => :wait_readable }, 0)
+  end
+
+  def test_notify_coalesces
+    assert_nil @n.notify
+    assert_nil @n.notify
+    assert_nil @n.notify(3)
+    assert_equal({ @n => Kgio::POLLIN }, Kgio.poll({ @n => :wait_readable }))
+    assert_equal 5, @n.trydrain
+    assert_equal :wait_readable, @n.trydrain
+  end
+
+  def test_cross_thread_wakeup
+    th = Thread.new { sleep 0.05; @n.notify }
+    res = Kgio.poll({ @n => :wait_readable }, 5000)
+    assert_equal [ @n ], res.keys
+    assert_equal 1, @n.trydrain
+    th.join
+  end
+
+  def test_overflow
+    assert_nil @n.notify(0xfffffffffffffffe)
+    assert_equal :wait_writable, @n.notify
+    assert_equal 0xfffffffffffffffe, @n.trydrain
+  end
+
+  def test_invalid
+    assert_raises(RangeError) { @n.notify(0) }
+    @n.close
+    assert_raises(IOError) { @n.notify }
+    assert_raises(IOError) { @n.trydrain }
+  end
+end
@@ -0,0 +1,209 @@
+require 'test/unit'
+require 'tmpdir'
+$-w = true
+require 'kgio'
+
+class TestProxyProtocol < Test::Unit::TestCase
+  V2_SIG = "\r\n\r\n\0\r\nQUIT\n".b
+
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+    @srv.kgio_proxy_protocol = true
+    @port = @srv.addr[1]
+    @clients = []
+  end
+
+  def teardown
+    @clients.each { |c| c.close unless c.closed? }
+    @srv.close
+  end
+
+  def connect(data)
+    c = TCPSocket.new(@host, @port)
+    @clients << c
+    c.write(data)
+    IO.select([@srv], nil, nil, 5)
+    c
+  end
+
+  # unread data in the receive queue turns close into a reset
+  def assert_closed(c)
+    assert_nil c.read(1)
+  rescue Errno::ECONNRESET
+  end
+
+  def v2(cmd, fam, body)
+    V2_SIG + [ 0x20 | cmd, fam, body.bytesize ].pack("CCn") + body
+  end
+
+  def test_toggle
+    assert_equal true, @srv.kgio_proxy_protocol
+    @srv.kgio_proxy_protocol = false
+    assert_equal false, @srv.kgio_proxy_protocol
+  end
+
+  def test_v1_tcp4
+    connect("PROXY TCP4 192.0.2.1 198.51.100.2 56324 443\r\nGET /")
+    io = @srv.kgio_tryaccept
+    assert_kind_of Kgio::Socket, io
+    assert_equal "192.0.2.1", io.kgio_addr
+    assert_equal Socket.pack_sockaddr_in(56324, "192.0.2.1"), io.kgio_sockaddr
+    assert_equal "GET /", io.kgio_read(5)
+    io.close
+  end
+
+  def test_v1_tcp6
+    connect("PROXY TCP6 2001:db8::1 2001:db8::2 4000 80\r\nhi")
+    io = @srv.kgio_tryaccept
+    assert_equal "2001:db8::1", io.kgio_addr
+    assert_equal "hi", io.kgio_read(2)
+    io.close
+  end
+
+  def test_v1_unknown
+    connect("PROXY UNKNOWN\r\nhi")
+    io = @srv.kgio_tryaccept
+    assert_equal @host, io.kgio_addr
+    assert_nil io.kgio_sockaddr
+    assert_equal "hi", io.kgio_read(2)
+    io.close
+  end
+
+  def test_v2_tcp4
+    body = [ 203, 0, 113, 7, 10, 0, 0, 1, 1234, 80 ].pack("C8nn")
+    connect(v2(1, 0x11, body) + "payload")
+    io = @srv.kgio_tryaccept
+    assert_equal "203.0.113.7", io.kgio_addr
+    assert_equal Socket.pack_sockaddr_in(1234, "203.0.113.7"), io.kgio_sockaddr
+    assert_equal "payload", io.kgio_read(7)
+    io.close
+  end
+
+  def test_v2_tcp6_with_tlv
+    body = [ 0x20010db8, 0, 0, 7 ].pack("N4") + ([ 0 ] * 4).pack("N4") + [ 9999, 443 ].pack("nn")
+    body << [ 0x4, 3 ].pack("Cn") << "abc" # PP2_TYPE_NOOP TLV
+    connect(v2(1, 0x21, body) + "x")
+    io = @srv.kgio_tryaccept
+    assert_equal "2001:db8::7", io.kgio_addr
+    assert_equal "x", io.kgio_read(1)
+    io.close
+  end
+
+  def test_v2_local
+    connect(v2(0, 0, "") + "ok")
+    io = @srv.kgio_tryaccept
+    assert_equal @host, io.kgio_addr
+    assert_equal "ok", io.kgio_read(2)
+    io.close
+  end
+
+  def test_invalid_header
+    c = connect("GET / HTTP/1.0\r\n\r\n")
+    assert_nil @srv.kgio_tryaccept
+    assert_closed(c)
+  end
+
+  def test_split_header
+    c = connect("PROXY TCP4 192.0.2.9")
+    t0 = Time.now
+    io = @srv.kgio_tryaccept
+    assert_operator Time.now - t0, :<, 0.5
+    assert_equal true, io.kgio_proxy_pending?
+    assert_equal @host, io.kgio_addr
+    assert_equal :wait_readable, io.kgio_tryproxy
+    c.write(" 192.0.2.10 1 2\r\ndata")
+    IO.select([ io ], nil, nil, 5)
+    assert_equal io, io.kgio_tryproxy
+    assert_equal false, io.kgio_proxy_pending?
+    assert_equal "192.0.2.9", io.kgio_addr
+    assert_equal Socket.pack_sockaddr_in(1, "192.0.2.9"), io.kgio_sockaddr
+    assert_equal "data", io.kgio_read(4)
+    io.close
+  end
+
+  def test_split_header_tryaccept_read
+    c = connect("PROXY TCP4 1.2.3.4 ")
+    io, data = @srv.kgio_tryaccept_read(100)
+    assert_equal :wait_readable, data
+    assert_equal true, io.kgio_proxy_pending?
+    c.write("5.6.7.8 1234 80\r\nGET /")
+    IO.select([ io ], nil, nil, 5)
+    assert_equal io, io.kgio_tryproxy
+    assert_equal "1.2.3.4", io.kgio_addr
+    assert_equal "GET /", io.kgio_read(100)
+    io.close
+  end
+
+  def test_split_header_tryaccept_sniff
+    table = { "\x16\x03".b => Class.new(Kgio::Socket) }
+    c = connect("PROXY TCP4 1.2.3.4 ")
+    io = @srv.kgio_tryaccept_sniff(table, Kgio::Socket)
+    assert_equal true, io.kgio_proxy_pending?
+    assert_equal true, io.kgio_sniff_pending?
+    assert_equal :wait_readable, io.kgio_trysniff(table)
+    c.write("5.6.7.8 1234 80\r\n\x16\x03\x01")
+    IO.select([ io ], nil, nil, 5)
+    assert_equal table.values[0], io.kgio_trysniff(table)
+    assert_equal false, io.kgio_proxy_pending?
+    assert_equal false, io.kgio_sniff_pending?
+    assert_equal "1.2.3.4", io.kgio_addr
+    assert_equal "\x16\x03\x01".b, io.kgio_read(3)
+    io.close
+  end
+
+  def test_silent_client_does_not_block
+    connect("")
+    io = @srv.kgio_tryaccept
+    assert_equal true, io.kgio_proxy_pending?
+    assert_equal :wait_readable, io.kgio_tryproxy
+    @clients[0].close
+    IO.select([ io ], nil, nil, 5)
+    assert_nil io.kgio_tryproxy
+    io.close
+  end
+
+  def test_pending_then_invalid
+    c = connect("PROXY")
+    io = @srv.kgio_tryaccept
+    c.write(" BOGUS\r\n")
+    IO.select([ io ], nil, nil, 5)
+    assert_raises(Errno::EPROTO) { io.kgio_tryproxy }
+    io.close
+  end
+
+  def test_tryproxy_without_pending
+    connect("PROXY UNKNOWN\r\n")
+    io = @srv.kgio_tryaccept
+    assert_equal false, io.kgio_proxy_pending?
+    assert_equal io, io.kgio_tryproxy
+    io.close
+  end
+
+  def test_v2_large_tlv
+    body = [ 192, 0, 2, 77, 10, 0, 0, 1, 5, 6 ].pack("C8nn")
+    body << [ 0x4, 1000 ].pack("Cn") << ("z" * 1000)
+    connect(v2(1, 0x11, body) + "after")
+    io = @srv.kgio_tryaccept
+    assert_equal false, io.kgio_proxy_pending?
+    assert_equal "192.0.2.77", io.kgio_addr
+    assert_equal "after", io.kgio_read(5)
+    io.close
+  end
+
+  def test_unix_server
+    path = "#{Dir.tmpdir}/kgio-proxy-#{$$}-#{rand}"
+    srv = Kgio::UNIXServer.new(path)
+    srv.kgio_proxy_protocol = true
+    c = UNIXSocket.new(path)
+    c.write("PROXY TCP4 192.0.2.1 192.0.2.2 1 2\r\nhi")
+    io = srv.kgio_accept
+    assert_equal "192.0.2.1", io.kgio_addr
+    assert_equal "hi", io.kgio_read(2)
+    io.close
+    c.close
+  ensure
+    srv.close if srv
+    File.unlink(path) rescue nil
+  end
+end
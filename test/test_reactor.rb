@@ -0,0 +1,119 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestReactor < Test::Unit::TestCase
+  def setup
+    @reactor = Kgio::Reactor.new
+    @a, @b = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    @reactor.close rescue nil
+    @a.close unless @a.closed?
+    @b.close unless @b.closed?
+  end
+
+  def run_events(timeout = 1000, maxlen = nil)
+    events = []
+    @reactor.run_once(timeout, maxlen) { |io, data| events << [ io, data ] }
+    events
+  end
+
+  def test_timeout
+    @reactor.add(@a)
+    assert_equal 1, @reactor.size
+    assert_equal [], run_events(0)
+  end
+
+  def test_read_and_eof
+    @reactor.add(@a)
+    @b.kgio_write "hello"
+    assert_equal [ [ @a, "hello" ] ], run_events
+    @b.kgio_write "x" * 10
+    assert_equal [ [ @a, "xxxx" ] ], run_events(1000, 4)
+    assert_equal [ [ @a, "x" * 6 ] ], run_events
+    @b.close
+    assert_equal [ [ @a, nil ] ], run_events
+    assert_equal 0, @reactor.size
+  end
+
+  def test_pipe
+    r, w = IO.pipe
+    @reactor.add(r)
+    w.syswrite "pipe"
+    assert_equal [ [ r, "pipe" ] ], run_events
+  ensure
+    r.close
+    w.close
+  end
+
+  def test_write_queue
+    @reactor.add(@a)
+    assert_nil @reactor.write(@a, "immediate")
+    assert_equal "immediate", @b.kgio_read(100)
+
+    big = "." * (1024 * 1024)
+    assert_equal :queued, @reactor.write(@a, big)
+    assert_equal :queued, @reactor.write(@a, "tail")
+    received = ""
+    thr = Thread.new do
+      while received.size < big.size + 4
+        received << @b.kgio_read(65536)
+      end
+    end
+    flushed = false
+    until flushed
+      run_events.each do |io, data|
+        assert_same @a, io
+        flushed = true if data == :flushed
+      end
+    end
+    thr.join
+    assert_equal big + "tail", received
+  end
+
+  def test_delete_in_block
+    c, d = Kgio::UNIXSocket.pair
+    @reactor.add(@a)
+    @reactor.add(c)
+    @b.kgio_write "1"
+    d.kgio_write "2"
+    seen = []
+    @reactor.run_once(1000) do |io, data|
+      seen << data
+      @reactor.delete(io == @a ? c : @a)
+    end
+    assert_equal 1, seen.size
+    assert_equal 1, @reactor.size
+  ensure
+    c.close
+    d.close
+  end
+
+  def test_error
+    @reactor.add(@a)
+    big = "." * (1024 * 1024)
+    assert_equal :queued, @reactor.write(@a, big)
+    @b.close
+    events = run_events
+    assert_equal 1, events.size
+    io, err = events[0]
+    assert_same @a, io
+    assert_kind_of SystemCallError, err
+    assert_equal 0, @reactor.size
+  end
+
+  def test_errors
+    assert_raises(LocalJumpError) { @reactor.run_once(0) }
+    assert_raises(ArgumentError) { @reactor.write(@a, "x") }
+    assert_nil @reactor.delete(@a)
+    @reactor.add(@a)
+    assert_raises(RuntimeError) do
+      @b.kgio_write "."
+      @reactor.run_once(1000) { @reactor.run_once(0) {} }
+    end
+    @reactor.close
+    assert_raises(IOError) { @reactor.add(@a) }
+  end
+end if defined?(Kgio::Reactor)
@@ -0,0 +1,114 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+require 'io/nonblock'
+
+class TestReserveFd < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+  end
+
+  def teardown
+    @srv.close
+    Kgio.reserve_fd = false
+  end
+
+  def test_toggle
+    assert_equal false, Kgio.reserve_fd
+    Kgio.reserve_fd = true
+    assert_equal true, Kgio.reserve_fd
+    Kgio.reserve_fd = :reset
+    assert_equal :reset, Kgio.reserve_fd
+    Kgio.reserve_fd = false
+    assert_equal false, Kgio.reserve_fd
+    assert_kind_of Integer, Kgio.shed_count
+  end
+
+  # fills the descriptor table of a child process and checks that
+  # the pending connection is shed instead of raising EMFILE
+  def shed_in_child(mode, accept_method)
+    rd, wr = IO.pipe
+    go_rd, go_wr = IO.pipe
+    pid = fork do
+      rd.close
+      go_wr.close
+      Kgio.reserve_fd = mode
+      Process.setrlimit(Process::RLIMIT_NOFILE, 256)
+      ios = []
+      begin
+        loop { ios << File.open("/dev/null") }
+      rescue Errno::EMFILE
+      end
+      wr.syswrite("ready\n")
+      # do not reset the client while it is still inside connect(),
+      # TCPSocket.new would swallow the error with SO_ERROR
+      go_rd.gets
+      IO.select([@srv])
+      rv = @srv.__send__(accept_method)
+      wr.syswrite("#{rv.inspect} #{Kgio.shed_count}\n")
+
+      begin
+        File.open("/dev/null")
+        wr.syswrite("opened\n")
+      rescue Errno::EMFILE
+        wr.syswrite("EMFILE\n")
+      end
+      exit!(0)
+    end
+    wr.close
+    go_rd.close
+    assert_equal "ready\n", rd.gets
+    c = TCPSocket.new(@host, @srv.addr[1])
+    go_wr.syswrite("go\n")
+    yield rd.gets, c
+    assert_equal "EMFILE\n", rd.gets
+    _, status = Process.waitpid2(pid)
+    assert status.success?
+    c.close
+    rd.close
+    go_wr.close
+  end
+
+  def test_shed_close
+    shed_in_child(true, :kgio_tryaccept) do |line, c|
+      assert_equal "nil 1\n", line
+      assert_nil c.read(1)
+    end
+  end
+
+  def test_shed_keeps_listener_blocking
+    rd, wr = IO.pipe
+    pid = fork do
+      rd.close
+      Kgio.reserve_fd = true
+      @srv.nonblock = false
+      Process.setrlimit(Process::RLIMIT_NOFILE, 256)
+      ios = []
+      begin
+        loop { ios << File.open("/dev/null") }
+      rescue Errno::EMFILE
+      end
+      Thread.new { @srv.kgio_accept }
+      wr.syswrite("ready\n")
+      500.times { Kgio.shed_count > 0 ? break : sleep(0.01) }
+      wr.syswrite("#{Kgio.shed_count} #{@srv.nonblock?}\n")
+      exit!(0)
+    end
+    wr.close
+    assert_equal "ready\n", rd.gets
+    c = TCPSocket.new(@host, @srv.addr[1])
+    assert_equal "1 false\n", rd.gets
+    assert_nil c.read(1)
+    Process.waitpid2(pid)
+    c.close
+    rd.close
+  end
+
+  def test_shed_reset
+    shed_in_child(:reset, :kgio_tryaccept) do |line, c|
+      assert_equal "nil 1\n", line
+      assert_raises(Errno::ECONNRESET) { c.read(1) }
+    end
+  end
+end if Process.respond_to?(:setrlimit)
@@ -0,0 +1,74 @@
+require 'test/unit'
+require 'socket'
+$-w = true
+require 'kgio'
+
+class TestReuseportGroup < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @group = nil
+  end
+
+  def teardown
+    @group.each { |srv| srv.close unless srv.closed? } if @group
+  end
+
+  def accept_any(group)
+    ready, _, _ = IO.select(group, nil, nil, 5)
+    assert ready
+    ready[0].kgio_tryaccept
+  end
+
+  def test_group
+    @group = Kgio::TCPServer.reuseport_group(@host, 0, 3)
+    assert_equal 3, @group.size
+    ports = @group.map { |srv| srv.addr[1] }.uniq
+    assert_equal 1, ports.size
+    @group.each { |srv| assert_kind_of Kgio::TCPServer, srv }
+
+    clients = (1..12).map { TCPSocket.new(@host, ports[0]) }
+    accepted = clients.map { accept_any(@group) }
+    accepted.each do |a|
+      assert_kind_of Kgio::Socket, a
+      assert_equal @host, a.kgio_addr
+      a.close
+    end
+    clients.each { |c| c.close }
+  end
+
+  def test_group_cpu_steering
+    begin
+      @group = Kgio::TCPServer.reuseport_group(@host, 0, 2, true)
+    rescue Errno::ENOSYS, Errno::ENOPROTOOPT, Errno::EINVAL
+      warn "SO_ATTACH_REUSEPORT_CBPF not supported"
+      return
+    end
+    c = TCPSocket.new(@host, @group[0].addr[1])
+    a = accept_any(@group)
+    assert_kind_of Kgio::Socket, a
+    a.close
+    c.close
+  end if RUBY_PLATFORM =~ /linux/
+
+  def test_partial_failure_closes
+    pid = fork do
+      GC.disable
+      before = Dir.entries('/proc/self/fd').size
+      Process.setrlimit(Process::RLIMIT_NOFILE, before + 5)
+      begin
+        Kgio::TCPServer.reuseport_group(@host, 0, 10)
+        exit!(1)
+      rescue Errno::EMFILE
+      end
+      exit!(Dir.entries('/proc/self/fd').size == before ? 0 : 2)
+    end
+    _, status = Process.waitpid2(pid)
+    assert_equal 0, status.exitstatus
+  end if File.directory?('/proc/self/fd') && Process.respond_to?(:setrlimit)
+
+  def test_invalid_count
+    assert_raises(ArgumentError) do
+      Kgio::TCPServer.reuseport_group(@host, 0, 0)
+    end
+  end
+end if Kgio::TCPServer.respond_to?(:reuseport_group)
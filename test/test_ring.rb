@@ -0,0 +1,158 @@
+require 'test/unit'
+require 'socket'
+require 'io/wait'
+$-w = true
+require 'kgio'
+
+class TestRing < Test::Unit::TestCase
+  def setup
+    defined?(Kgio::Ring) && Kgio::Ring.available? or
+      return skip("io_uring not available")
+    @ring = Kgio::Ring.new(8)
+    @a, @b = Kgio::UNIXSocket.pair
+  end
+
+  def teardown
+    @ring.close rescue nil if @ring
+    [ @a, @b, @srv ].each { |io| io.close if io && !io.closed? }
+  end
+
+  def test_send_recv
+    @ring.send(@a, "hello", :send)
+    @ring.recv(@b, 100, :recv)
+    assert_equal 2, @ring.pending
+    res = @ring.wait(2, 1000)
+    assert_equal [ [ :recv, "hello" ], [ :send, nil ] ], res.sort_by(&:to_s)
+    assert_equal 0, @ring.pending
+  end
+
+  def test_default_tag_and_eof
+    @b.close
+    @ring.recv(@a, 100)
+    assert_equal [ [ @a, nil ] ], @ring.wait(1, 1000)
+  end
+
+  def test_writev
+    @ring.writev(@a, %w(a bb ccc), :w)
+    assert_equal [ [ :w, nil ] ], @ring.wait(1, 1000)
+    assert_equal "abbccc", @b.kgio_tryread(100)
+  end
+
+  def test_writev_to_str
+    obj = Object.new
+    def obj.to_str; "hello"; end
+    @ring.writev(@a, [ obj, "!" ], :w)
+    assert_equal [ [ :w, nil ] ], @ring.wait(1, 1000)
+    assert_equal "hello!", @b.kgio_tryread(100)
+  end
+
+  def test_fixed_buffers
+    @ring.register_buffers(2, 4)
+    @ring.send(@a, "fixed", :send)
+    @ring.recv(@b, 100, :recv)
+    res = @ring.wait(2, 1000).sort_by(&:to_s)
+    assert_equal [ [ :recv, "fixe" ], [ :send, nil ] ], res
+    assert_equal "d", @b.kgio_tryread(100)
+    assert_raises(RuntimeError) { @ring.register_buffers(2, 4) }
+  end
+
+  def test_timeout_and_nonblocking_reap
+    @ring.recv(@b, 100)
+    assert_equal [], @ring.wait(1, 10)
+    assert_equal [], @ring.wait(0)
+    @a.kgio_write "x"
+    IO.select([ @ring.to_io ], nil, nil, 1)
+    assert_equal [ [ @b, "x" ] ], @ring.wait(0)
+  end
+
+  def test_error
+    @b.close
+    @ring.send(@a, "x")
+    res = @ring.wait(1, 1000)
+    assert_equal 1, res.size
+    assert_equal @a, res[0][0]
+    assert_kind_of Errno::EPIPE, res[0][1]
+  end
+
+  def test_accept_and_connect
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    port = @srv.addr[1]
+    @ring.accept(@srv)
+    s = Socket.new(:INET, :STREAM)
+    @ring.connect(s, Socket.pack_sockaddr_in(port, '127.0.0.1'), :conn)
+    res = @ring.wait(2, 1000)
+    assert_equal 2, res.size
+    assert_equal [ :conn, nil ], res.assoc(:conn)
+    client = res.assoc(@srv)[1]
+    assert_kind_of Kgio::Socket, client
+    assert_equal "127.0.0.1", client.kgio_addr
+    client.close
+    s.close
+  end
+
+  def test_multishot_accept_and_cancel
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    port = @srv.addr[1]
+    @ring.accept(@srv, :acc, true)
+    clients = (1..3).map { Kgio::TCPSocket.new('127.0.0.1', port) }
+    accepted = []
+    while accepted.size < 3
+      res = @ring.wait(1, 1000)
+      assert_not_equal [], res
+      accepted.concat(res)
+    end
+    accepted.each do |tag, io|
+      assert_equal :acc, tag
+      assert_kind_of Kgio::Socket, io
+      assert_equal "127.0.0.1", io.kgio_addr
+      io.close
+    end
+    assert_equal 1, @ring.pending
+    @ring.cancel(@srv)
+    res = @ring.wait(1, 1000)
+    assert_equal [ [ :acc, Errno::ECANCELED ] ],
+                 res.map { |tag, exc| [ tag, exc.class ] }
+    assert_equal 0, @ring.pending
+    clients.each(&:close)
+  end
+
+  def test_close_with_pending
+    @srv = Kgio::TCPServer.new('127.0.0.1', 0)
+    @ring.recv(@b, 100)
+    @ring.accept(@srv)
+    @ring.submit
+    io = @ring.to_io
+    assert_nil @ring.close
+    assert io.closed?
+    assert_raises(IOError) { @ring.pending }
+    assert_nil @b.kgio_trywrite("still usable")
+    assert_nil @srv.kgio_tryaccept
+  end
+
+  def test_cancel_one_io
+    @ring.recv(@a, 100, :a)
+    @ring.recv(@b, 100, :b)
+    @ring.submit
+    @ring.cancel(@b)
+    res = @ring.wait(1, 1000)
+    assert_equal [ [ :b, Errno::ECANCELED ] ],
+                 res.map { |tag, exc| [ tag, exc.class ] }
+    assert_equal 1, @ring.pending
+    @b.kgio_write("x")
+    assert_equal [ [ :a, "x" ] ], @ring.wait(1, 1000)
+  end
+
+  def test_fiber_scheduler_style
+    r, w = Kgio::Pipe.new
+    th = Thread.new do
+      @ring.recv(r, 100, :pipe)
+      @ring.submit
+      @ring.to_io.wait_readable(5)
+      @ring.wait(0)
+    end
+    w.kgio_write "fiber"
+    assert_equal [ [ :pipe, "fiber" ] ], th.value
+    r.close
+    w.close
+  end
+end
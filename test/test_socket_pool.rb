@@ -0,0 +1,174 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestSocketPool < Test::Unit::TestCase
+  class MySocket < Kgio::Socket; end
+
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+    @port = @srv.addr[1]
+    Kgio.socket_pool_max = 4
+  end
+
+  def teardown
+    Kgio.socket_pool_max = 0
+    @srv.close
+  end
+
+  def accept_one(klass = nil)
+    c = TCPSocket.new(@host, @port)
+    IO.select([@srv], nil, nil, 5)
+    [ @srv.kgio_tryaccept(klass), c ]
+  end
+
+  def test_settings
+    assert_equal 4, Kgio.socket_pool_max
+    assert_raises(ArgumentError) { Kgio.socket_pool_max = -1 }
+    assert_kind_of Hash, Kgio.socket_pool_stats
+  end
+
+  def test_reuse
+    a, c = accept_one
+    assert_equal true, a.kgio_release
+    assert a.closed?
+    assert_nil c.read(1)
+    c.close
+
+    stats = Kgio.socket_pool_stats
+    assert_equal 1, stats[:pooled]
+
+    b, c = accept_one
+    assert_same a, b
+    refute b.closed?
+    assert_equal @host, b.kgio_addr
+    assert_equal 5, c.write("hello")
+    assert_equal "hello", b.kgio_read(5)
+    assert_equal :wait_readable, b.kgio_tryread(1)
+    b.kgio_write("world")
+    assert_equal "world", c.read(5)
+
+    after = Kgio.socket_pool_stats
+    assert_equal stats[:allocated], after[:allocated]
+    assert_equal stats[:reused] + 1, after[:reused]
+    assert_equal 0, after[:pooled]
+    b.close
+    c.close
+  end
+
+  def test_autopush_reset
+    enabled = Kgio.autopush?
+    a, c = accept_one
+    a.kgio_autopush = true
+    assert_equal true, a.kgio_release
+    c.close
+
+    # with autopush off, accept leaves the client state alone
+    Kgio.autopush = false
+    b, c = accept_one
+    assert_same a, b
+    assert ! b.kgio_autopush?
+    b.close
+    c.close
+  ensure
+    Kgio.autopush = enabled
+  end if Kgio::SocketMethods.method_defined?(:kgio_autopush?)
+
+  def test_proxy_pending_reset
+    @srv.kgio_proxy_protocol = true
+    a, c = accept_one
+    assert_equal true, a.kgio_proxy_pending?
+    assert_equal true, a.kgio_release
+    c.close
+
+    @srv.kgio_proxy_protocol = false
+    b, c = accept_one
+    assert_same a, b
+    assert_equal false, b.kgio_proxy_pending?
+    c.write("hi")
+    IO.select([ b ], nil, nil, 5)
+    assert_equal "hi", b.kgio_tryread(2)
+    b.close
+    c.close
+  end
+
+  def test_deadline_reset
+    a, c = accept_one
+    a.kgio_deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) - 1
+    assert_equal :timeout, a.kgio_read(1)
+    assert_equal true, a.kgio_release
+    c.close
+
+    b, c = accept_one
+    assert_same a, b
+    assert_nil b.kgio_deadline
+    c.write("hi")
+    assert_equal "hi", b.kgio_read(2)
+    b.close
+    c.close
+  end
+
+  def test_admission_reset
+    adm = Kgio::Admission.new(nil, 1, 1)
+    @srv.kgio_admission = adm
+    @srv.kgio_proxy_protocol = true
+    a, c = accept_one
+    assert_equal true, a.kgio_proxy_pending?
+    assert_equal true, a.kgio_release
+    c.close
+
+    # the pending admission must not follow the object to a new client
+    @srv.kgio_admission = nil
+    b, c = accept_one
+    assert_same a, b
+    c.write("PROXY TCP4 192.0.2.1 192.0.2.2 1 2\r\n")
+    IO.select([ b ], nil, nil, 5)
+    assert_equal b, b.kgio_tryproxy
+    assert_equal 0, adm.stats[:admitted]
+    b.close
+    c.close
+
+    @srv.kgio_admission = adm
+    @srv.kgio_proxy_protocol = false
+    a, c = accept_one
+    assert_equal 1, adm.stats[:active]
+    assert_equal true, a.kgio_release
+    assert_equal 0, adm.stats[:active]
+    c.close
+  end
+
+  def test_pool_per_class
+    a, c = accept_one(MySocket)
+    assert_equal true, a.kgio_release
+    c.close
+    b, c = accept_one
+    assert_instance_of Kgio::Socket, b
+    refute_same a, b
+    d, c2 = accept_one(MySocket)
+    assert_same a, d
+    [ b, c, d, c2 ].each(&:close)
+  end
+
+  def test_not_pooled
+    a, c = accept_one
+    def a.foo; end
+    assert_equal false, a.kgio_release
+    assert a.closed?
+    c.close
+
+    Kgio.socket_pool_max = 0
+    a, c = accept_one
+    assert_equal false, a.kgio_release
+    assert a.closed?
+    c.close
+  end
+
+  def test_pool_full
+    Kgio.socket_pool_max = 1
+    pairs = [ accept_one, accept_one ]
+    assert_equal true, pairs[0][0].kgio_release
+    assert_equal false, pairs[1][0].kgio_release
+    pairs.each { |_, c| c.close }
+  end
+end
@@ -0,0 +1,57 @@
+require 'test/unit'
+require 'socket'
+$-w = true
+require 'kgio'
+
+class TestTCPServerTune < Test::Unit::TestCase
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+  end
+
+  def teardown
+    @srv.close if defined?(@srv) && ! @srv.closed?
+  end
+
+  def test_new_without_options
+    @srv = Kgio::TCPServer.new(@host, 0)
+    assert_kind_of Kgio::TCPServer, @srv
+  end
+
+  def test_defer_accept
+    @srv = Kgio::TCPServer.new(@host, 0, :defer_accept => 5, :backlog => 8)
+    val = @srv.getsockopt(Socket::IPPROTO_TCP, Socket::TCP_DEFER_ACCEPT)
+    assert val.int > 0
+    port = @srv.addr[1]
+
+    c = TCPSocket.new(@host, port)
+    assert_nil @srv.kgio_tryaccept, "woken before data arrived"
+    c.write "GET"
+    assert IO.select([@srv], nil, nil, 5)
+    a = @srv.kgio_tryaccept
+    assert_kind_of Kgio::Socket, a
+    assert_equal "GET", a.kgio_tryread(3)
+    a.close
+    c.close
+  end if defined?(Socket::TCP_DEFER_ACCEPT)
+
+  def test_fastopen
+    @srv = Kgio::TCPServer.new(@host, 0)
+    assert_equal @srv, @srv.kgio_tune(:fastopen => 16)
+    val = @srv.getsockopt(Socket::IPPROTO_TCP, Kgio::TCP_FASTOPEN)
+    assert_equal 16, val.int
+  end if defined?(Kgio::TCP_FASTOPEN) && RUBY_PLATFORM =~ /linux/
+
+  def test_unknown_option
+    @srv = Kgio::TCPServer.new(@host, 0)
+    assert_raises(ArgumentError) { @srv.kgio_tune(:bogus => 1) }
+  end
+
+  def test_tune_stats
+    @srv = Kgio::TCPServer.new(@host, 0)
+    stats = @srv.kgio_tune_stats or return
+    %w(fastopen_passive fastopen_passive_fail fastopen_listen_overflow
+       defer_accept_drop).each do |key|
+      assert_kind_of Integer, stats[key.to_sym]
+    end
+  end if Kgio::TCPServer.method_defined?(:kgio_tune_stats)
+end
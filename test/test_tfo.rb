@@ -21,6 +21,68 @@ class TestTFO < Test::Unit::TestCase
     end
   end
 
+  def fastopen_client_ok?
+    if RUBY_PLATFORM =~ /linux/
+      (File.read("/proc/sys/net/ipv4/tcp_fastopen").to_i & 1) == 1
+    else
+      false
+    end
+  end
+
+  def test_tryfastopen
+    unless fastopen_client_ok?
+      warn "TCP Fast Open not enabled on this system (check kernel docs)"
+      return
+    end
+    addr = '127.0.0.1'
+    s = Kgio::TCPServer.new(addr, 0)
+    s.setsockopt(:TCP, Kgio::TCP_FASTOPEN, 1024) rescue nil
+    port = s.local_address.ip_port
+    addr = Socket.pack_sockaddr_in(port, addr)
+    c = Kgio::Socket.new(:INET, :STREAM)
+    buf = "HELLO"
+    while buf
+      rv = c.kgio_tryfastopen(buf, addr)
+      case rv
+      when :wait_writable
+        assert_equal c, c.kgio_wait_writable(5)
+      when String
+        buf = rv
+      else
+        assert_nil rv
+        buf = nil
+      end
+    end
+    a = s.kgio_accept
+    assert_equal "HELLO", a.kgio_read(5)
+
+    # already connected, behaves like kgio_trywrite
+    assert_nil c.kgio_tryfastopen("WORLD", addr)
+    assert_equal "WORLD", a.kgio_read(5)
+    c.close
+    a.close
+  end if defined?(Addrinfo) && defined?(Kgio::MSG_FASTOPEN)
+
+  def test_start_fastopen_connect
+    unless fastopen_client_ok?
+      warn "TCP Fast Open not enabled on this system (check kernel docs)"
+      return
+    end
+    addr = '127.0.0.1'
+    s = Kgio::TCPServer.new(addr, 0)
+    s.setsockopt(:TCP, Kgio::TCP_FASTOPEN, 1024) rescue nil
+    port = s.local_address.ip_port
+    c = Kgio::TCPSocket.start(addr, port, true)
+    assert_kind_of Kgio::TCPSocket, c
+    assert_nil c.kgio_write("HELLO")
+    a = s.kgio_accept
+    assert_equal "HELLO", a.kgio_read(5)
+    assert_nil a.kgio_write("WORLD")
+    assert_equal "WORLD", c.kgio_read(5)
+    c.close
+    a.close
+  end if defined?(Kgio::TCP_FASTOPEN_CONNECT)
+
   def test_tfo_client_server
     unless fastopen_ok?
       warn "TCP Fast Open not enabled on this system (check kernel docs)"
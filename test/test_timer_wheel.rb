@@ -0,0 +1,131 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestTimerWheel < Test::Unit::TestCase
+  def setup
+    @wheel = Kgio::TimerWheel.new(5, 64)
+    @rd, @wr = IO.pipe
+  end
+
+  def teardown
+    [ @rd, @wr ].each { |io| io.close unless io.closed? }
+  end
+
+  def test_empty
+    assert_nil @wheel.next_timeout
+    assert_equal [], @wheel.expire
+    assert_equal 0, @wheel.size
+  end
+
+  def test_arm_and_expire
+    assert_equal @wheel, @wheel.arm(@rd, 20)
+    assert @wheel.armed?(@rd)
+    assert_equal 1, @wheel.size
+    assert_operator @wheel.next_timeout, :<=, 25
+    assert_equal [], @wheel.expire
+    sleep 0.03
+    assert_equal 0, @wheel.next_timeout
+    assert_equal [ @rd ], @wheel.expire
+    assert ! @wheel.armed?(@rd)
+    assert_nil @wheel.next_timeout
+  end
+
+  def test_expire_order
+    @wheel.arm(@wr, 10)
+    @wheel.arm(@rd, 0)
+    sleep 0.02
+    assert_equal [ @rd, @wr ], @wheel.expire
+  end
+
+  def test_rearm_and_cancel
+    assert_nil @wheel.rearm(@rd)
+    assert_nil @wheel.cancel(@rd)
+    @wheel.arm(@rd, 30)
+    sleep 0.02
+    assert_equal @rd, @wheel.rearm(@rd)
+    sleep 0.02
+    assert_equal [], @wheel.expire
+    assert_equal @rd, @wheel.cancel(@rd)
+    assert_equal 0, @wheel.size
+    sleep 0.04
+    assert_equal [], @wheel.expire
+  end
+
+  def test_rearm_with_new_timeout
+    @wheel.arm(@rd, 10_000)
+    @wheel.arm(@rd, 0)
+    assert_equal 1, @wheel.size
+    sleep 0.01
+    assert_equal [ @rd ], @wheel.expire
+  end
+
+  def test_beyond_one_revolution
+    @wheel.arm(@rd, 500) # 64 slots * 5ms == 320ms per revolution
+    assert_operator @wheel.next_timeout, :<=, 505
+    sleep 0.35
+    assert_equal [], @wheel.expire
+    assert_operator @wheel.next_timeout, :<=, 160
+    sleep 0.2
+    assert_equal [ @rd ], @wheel.expire
+  end
+
+  def test_poll
+    @wheel.arm(@rd, 20)
+    t0 = Time.now
+    res = Kgio.poll({ @rd => :wait_readable }, nil, @wheel)
+    assert_operator Time.now - t0, :>=, 0.015
+    assert_equal({ @rd => :timeout }, res)
+    assert_equal 0, @wheel.size
+  end
+
+  def test_poll_ready_and_expired
+    rd2, wr2 = IO.pipe
+    @wheel.arm(rd2, 0)
+    @wr.syswrite '.'
+    sleep 0.01
+    res = Kgio.poll({ @rd => :wait_readable, @wr => :wait_readable }, 1000,
+                    @wheel)
+    assert_equal({ @rd => Kgio::POLLIN, rd2 => :timeout }, res)
+  ensure
+    rd2.close
+    wr2.close
+  end
+
+  def test_poll_ready_keeps_timer
+    @wheel.arm(@rd, 0)
+    @wr.syswrite '.'
+    sleep 0.01
+    res = Kgio.poll({ @rd => :wait_readable }, 1000, @wheel)
+    assert_equal({ @rd => Kgio::POLLIN }, res)
+    assert @wheel.armed?(@rd)
+
+    # not rearmed: it expires on the next call unless ready again
+    @rd.sysread(1)
+    t0 = Time.now
+    res = Kgio.poll({ @rd => :wait_readable }, 1000, @wheel)
+    assert_operator Time.now - t0, :<, 0.5
+    assert_equal({ @rd => :timeout }, res)
+    assert ! @wheel.armed?(@rd)
+  end
+
+  def test_poll_ready_rearm
+    @wheel.arm(@rd, 0)
+    @wr.syswrite '.'
+    sleep 0.01
+    Kgio.poll({ @rd => :wait_readable }, 1000, @wheel)
+    assert_equal @rd, @wheel.rearm(@rd)
+  end
+
+  def test_poll_user_timeout_wins
+    @wheel.arm(@rd, 10_000)
+    assert_nil Kgio.poll({ @rd => :wait_readable }, 10, @wheel)
+    assert @wheel.armed?(@rd)
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) { Kgio::TimerWheel.new(0) }
+    assert_raises(ArgumentError) { @wheel.arm(@rd, -1) }
+    assert_raises(TypeError) { Kgio.poll({}, 0, Object.new) }
+  end
+end
@@ -0,0 +1,131 @@
+require 'test/unit'
+require 'fcntl'
+require 'tmpdir'
+require 'fileutils'
+$-w = true
+require 'kgio'
+
+module LibTryacceptRead
+  def test_no_connection
+    assert_nil @srv.kgio_tryaccept_read(16384)
+  end
+
+  def test_no_data_yet
+    c = client_connect
+    IO.select([@srv])
+    a, data = @srv.kgio_tryaccept_read(16384)
+    assert_kind_of Kgio::Socket, a
+    assert_equal @host, a.kgio_addr
+    assert_equal :wait_readable, data
+    a.close
+    c.close
+  end
+
+  def test_with_data
+    c = client_connect
+    c.write "GET / HTTP/1.0\r\n\r\n"
+    IO.select([@srv])
+    sleep 0.05
+    a, data = @srv.kgio_tryaccept_read(16384)
+    assert_kind_of Kgio::Socket, a
+    assert_equal "GET / HTTP/1.0\r\n\r\n", data
+    assert_equal :wait_readable, a.kgio_tryread(1)
+    a.close
+    c.close
+  end
+
+  def test_short_and_large_maxlen
+    c = client_connect
+    c.write "HELLO WORLD"
+    IO.select([@srv])
+    sleep 0.05
+    a, data = @srv.kgio_tryaccept_read(5)
+    assert_equal "HELLO", data
+    assert_equal " WORLD", a.kgio_tryread(100)
+    a.close
+    c.close
+
+    c = client_connect
+    c.write "HELLO"
+    IO.select([@srv])
+    sleep 0.05
+    a, data = @srv.kgio_tryaccept_read(1024 * 1024)
+    assert_equal "HELLO", data
+    a.close
+    c.close
+  end
+
+  def test_eof
+    c = client_connect
+    c.close
+    IO.select([@srv])
+    sleep 0.05
+    a, data = @srv.kgio_tryaccept_read(16384)
+    assert_kind_of Kgio::Socket, a
+    assert_nil data
+    a.close
+  end
+
+  def test_bad_maxlen_keeps_client
+    c = client_connect
+    c.write "HI"
+    IO.select([@srv])
+    sleep 0.05
+    assert_raises(ArgumentError) { @srv.kgio_tryaccept_read(-1) }
+    assert_raises(TypeError) { @srv.kgio_tryaccept_read("16") }
+    a, data = @srv.kgio_tryaccept_read(16384)
+    assert_kind_of Kgio::Socket, a
+    assert_equal "HI", data
+    a.close
+    c.close
+  end
+
+  def test_class_and_flags
+    klass = Class.new(Kgio::Socket)
+    c = client_connect
+    IO.select([@srv])
+    a, data = @srv.kgio_tryaccept_read(16384, klass, 0)
+    assert_instance_of klass, a
+    assert_equal 0, a.fcntl(Fcntl::F_GETFD)
+    assert_equal :wait_readable, data
+    a.close
+    c.close
+  end
+end
+
+class TestTCPTryacceptRead < Test::Unit::TestCase
+  include LibTryacceptRead
+
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+  end
+
+  def teardown
+    @srv.close
+  end
+
+  def client_connect
+    TCPSocket.new(@host, @srv.addr[1])
+  end
+end
+
+class TestUNIXTryacceptRead < Test::Unit::TestCase
+  include LibTryacceptRead
+
+  def setup
+    @host = Kgio::LOCALHOST
+    @tmpdir = Dir.mktmpdir('kgio_tryaccept_read')
+    @path = "#@tmpdir/sock"
+    @srv = Kgio::UNIXServer.new(@path)
+  end
+
+  def teardown
+    @srv.close
+    FileUtils.remove_entry_secure(@tmpdir)
+  end
+
+  def client_connect
+    UNIXSocket.new(@path)
+  end
+end
@@ -0,0 +1,160 @@
+require 'test/unit'
+require 'tmpdir'
+$-w = true
+require 'kgio'
+
+class TestTryacceptSniff < Test::Unit::TestCase
+  class TLS < Kgio::Socket; end
+  class H2 < Kgio::Socket; end
+  class H1 < Kgio::Socket; end
+
+  TABLE = {
+    "\x16\x03".b => TLS,
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" => H2,
+  }
+
+  def setup
+    @host = ENV["TEST_HOST"] || '127.0.0.1'
+    @srv = Kgio::TCPServer.new(@host, 0)
+    @port = @srv.addr[1]
+    @clients = []
+  end
+
+  def teardown
+    @clients.each { |c| c.close unless c.closed? }
+    @srv.close
+  end
+
+  def connect(data)
+    c = TCPSocket.new(@host, @port)
+    @clients << c
+    c.write(data) if data
+    IO.select([@srv], nil, nil, 5)
+    c
+  end
+
+  def test_nothing_to_accept
+    assert_nil @srv.kgio_tryaccept_sniff(TABLE, H1)
+  end
+
+  def test_match
+    connect("\x16\x03\x01\x02\x00")
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_instance_of TLS, io
+    assert_equal @host, io.kgio_addr
+    assert_equal "\x16\x03", io.kgio_read(2)
+    io.close
+
+    connect("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n")
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_instance_of H2, io
+    io.close
+  end
+
+  def test_default
+    connect("GET / HTTP/1.1\r\n\r\n")
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_instance_of H1, io
+    assert_equal false, io.kgio_sniff_pending?
+    assert_equal "GET", io.kgio_read(3)
+    io.close
+
+    connect("GET / HTTP/1.1\r\n\r\n")
+    assert_instance_of Kgio::Socket, @srv.kgio_tryaccept_sniff(TABLE)
+  end
+
+  def test_partial_then_complete
+    c = connect("PRI * HTTP")
+    t0 = Time.now
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_operator Time.now - t0, :<, 0.5
+    assert_instance_of H1, io
+    assert_equal :wait_readable, io.kgio_trysniff(TABLE)
+    c.write("/2.0\r\n\r\nSM\r\n\r\n")
+    IO.select([ io ], nil, nil, 5)
+    assert_equal H2, io.kgio_trysniff(TABLE)
+    assert_equal "PRI", io.kgio_read(3)
+    io.close
+  end
+
+  def test_split_prefix
+    c = connect("\x16".b)
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_instance_of H1, io
+    assert_equal true, io.kgio_sniff_pending?
+    assert_equal :wait_readable, io.kgio_trysniff(TABLE)
+    assert_equal true, io.kgio_sniff_pending?
+    c.write("\x03\x01".b)
+    IO.select([ io ], nil, nil, 5)
+    assert_equal TLS, io.kgio_trysniff(TABLE)
+    assert_equal false, io.kgio_sniff_pending?
+    io.close
+  end
+
+  def test_silent_client
+    c = connect(nil)
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_instance_of H1, io
+    assert_equal :wait_readable, io.kgio_trysniff(TABLE)
+    c.close
+    IO.select([ io ], nil, nil, 5)
+    assert_nil io.kgio_trysniff(TABLE)
+    io.close
+  end
+
+  def test_trysniff_no_match
+    connect("GET / HTTP/1.1\r\n\r\n")
+    io = @srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_nil io.kgio_trysniff(TABLE)
+    io.close
+  end
+
+  def test_earlier_prefix_wins
+    table = { "ABCD" => TLS, "A" => H2 }
+    c = connect("AB")
+    io = @srv.kgio_tryaccept_sniff(table, H1)
+    assert_instance_of H1, io
+    assert_equal :wait_readable, io.kgio_trysniff(table)
+    c.write("CD")
+    IO.select([ io ], nil, nil, 5)
+    assert_equal TLS, io.kgio_trysniff(table)
+    io.close
+
+    connect("AX")
+    assert_instance_of H2, @srv.kgio_tryaccept_sniff(table, H1)
+  end
+
+  def test_partial_then_eof
+    table = { "ABCD" => TLS, "A" => H2 }
+    c = connect("AB")
+    io = @srv.kgio_tryaccept_sniff(table, H1)
+    c.close
+    IO.select([ io ], nil, nil, 5)
+    assert_equal H2, io.kgio_trysniff(table)
+    io.close
+  end
+
+  def test_bad_table
+    assert_raises(TypeError) { @srv.kgio_tryaccept_sniff([]) }
+    assert_raises(TypeError) { @srv.kgio_tryaccept_sniff({ 1 => H1 }) }
+    assert_raises(ArgumentError) do
+      @srv.kgio_tryaccept_sniff({ "x" * 257 => H1 })
+    end
+  end
+
+  def test_unix_server
+    path = "#{Dir.tmpdir}/kgio-sniff-#{$$}-#{rand}"
+    srv = Kgio::UNIXServer.new(path)
+    c = UNIXSocket.new(path)
+    c.write("\x16\x03")
+    IO.select([srv], nil, nil, 5)
+    io = srv.kgio_tryaccept_sniff(TABLE, H1)
+    assert_instance_of TLS, io
+    assert_equal Kgio::LOCALHOST, io.kgio_addr
+    io.close
+    c.close
+  ensure
+    srv.close if srv
+    File.unlink(path) rescue nil
+  end
+end
@@ -0,0 +1,119 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestUDPMmsg < Test::Unit::TestCase
+  def setup
+    @srv = Kgio::UDPSocket.new
+    @srv.bind('127.0.0.1', 0)
+    @cli = Kgio::UDPSocket.new
+    @cli.bind('127.0.0.1', 0)
+    @srv_addr = Socket.pack_sockaddr_in(@srv.addr[1], '127.0.0.1')
+  end
+
+  def teardown
+    @srv.close
+    @cli.close
+  end
+
+  def test_class
+    assert_kind_of UDPSocket, @srv
+    assert_kind_of Kgio::SocketMethods, @srv
+  end
+
+  def test_wait_readable
+    assert_equal :wait_readable, @srv.kgio_tryrecvmmsg(8, 100)
+  end
+
+  def test_batch_roundtrip
+    msgs = (0...150).map { |i| [ "msg#{i}", @srv_addr ] }
+    assert_nil @cli.kgio_trysendmmsg(msgs)
+    got = []
+    while got.size < 150
+      rv = @srv.kgio_tryrecvmmsg(128, 100)
+      if rv == :wait_readable
+        IO.select([ @srv ], nil, nil, 5) or break
+        next
+      end
+      assert_operator rv.size, :<=, 128
+      got.concat(rv)
+    end
+    assert_equal (0...150).map { |i| "msg#{i}" }, got.map { |data, _| data }
+    port, host = Socket.unpack_sockaddr_in(got[0][1])
+    assert_equal [ @cli.addr[1], '127.0.0.1' ], [ port, host ]
+
+    # reply to every sender in one call
+    replies = got.map { |data, addr| [ data.upcase, addr ] }
+    assert_nil @srv.kgio_trysendmmsg(replies)
+    IO.select([ @cli ], nil, nil, 5)
+    rv = @cli.kgio_tryrecvmmsg(1, 100)
+    assert_equal [ [ "MSG0", @srv_addr ] ], rv
+  end
+
+  def test_truncated
+    assert_nil @cli.kgio_trysendmmsg([ [ "hello world", @srv_addr ] ])
+    IO.select([ @srv ], nil, nil, 5)
+    rv = @srv.kgio_tryrecvmmsg(4, 5)
+    assert_equal "hello", rv[0][0]
+  end
+
+  def test_scratch_reused
+    [ [ 1, 10 ], [ 64, 65536 ], [ 2, 10 ], [ 1, 65536 ] ].each do |n, len|
+      msgs = (0...n).map { |i| [ "#{len}-#{i}", @srv_addr ] }
+      assert_nil @cli.kgio_trysendmmsg(msgs)
+      got = []
+      while got.size < n
+        rv = @srv.kgio_tryrecvmmsg(n, len)
+        if rv == :wait_readable
+          IO.select([ @srv ], nil, nil, 5) or break
+          next
+        end
+        got.concat(rv)
+      end
+      assert_equal msgs.map(&:first), got.map(&:first)
+      got.each { |data, _| data.replace("clobbered") }
+    end
+    assert_equal :wait_readable, @srv.kgio_tryrecvmmsg(8, 100)
+  end
+
+  def test_converted_strings_retained
+    msgs = (0...4).map do |i|
+      data = Object.new
+      data.instance_variable_set :@i, i
+      def data.to_str
+        GC.start
+        "converted#@i" * 100
+      end
+      [ data, @srv_addr ]
+    end
+    assert_nil @cli.kgio_trysendmmsg(msgs)
+    got = []
+    while got.size < 4
+      IO.select([ @srv ], nil, nil, 5) or break
+      rv = @srv.kgio_tryrecvmmsg(4, 2000)
+      got.concat(rv) if Array === rv
+    end
+    assert_equal (0...4).map { |i| "converted#{i}" * 100 },
+                 got.map { |data, _| data }
+  end
+
+  def test_connected
+    @cli.connect('127.0.0.1', @srv.addr[1])
+    assert_nil @cli.kgio_trysendmmsg([ [ "a" ], [ "b", nil ] ])
+    IO.select([ @srv ], nil, nil, 5)
+    sleep 0.01
+    rv = @srv.kgio_tryrecvmmsg(4, 5)
+    assert_equal %w(a b), rv.map { |data, _| data }
+  end
+
+  def test_empty
+    assert_nil @cli.kgio_trysendmmsg([])
+  end
+
+  def test_bad_args
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(0, 10) }
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(1025, 10) }
+    assert_raises(ArgumentError) { @srv.kgio_tryrecvmmsg(1, 0) }
+    assert_raises(TypeError) { @cli.kgio_trysendmmsg([ [ 1, @srv_addr ] ]) }
+  end
+end
@@ -0,0 +1,66 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+class TestUDPOffload < Test::Unit::TestCase
+  def setup
+    @srv = Kgio::UDPSocket.new
+    @srv.bind('127.0.0.1', 0)
+    @cli = Kgio::UDPSocket.new
+    @cli.bind('127.0.0.1', 0)
+    @srv_addr = Socket.pack_sockaddr_in(@srv.addr[1], '127.0.0.1')
+  end
+
+  def teardown
+    @srv.close
+    @cli.close
+  end
+
+  def recv_all(io, n)
+    got = []
+    while got.size < n
+      IO.select([ io ], nil, nil, 5) or break
+      rv = io.kgio_tryrecvmmsg(64, 65536)
+      got.concat(rv) if Array === rv
+    end
+    got
+  end
+
+  def gso_send(msgs, segsize)
+    @cli.kgio_trysendmmsg(msgs, segsize)
+  rescue Errno::EINVAL, Errno::EIO, Errno::ENOPROTOOPT => e
+    omit "UDP_SEGMENT not supported: #{e.message}"
+  end
+
+  def test_segment
+    buf = (0...7).map { |i| i.to_s * 1000 }.join[0, 6500]
+    assert_nil gso_send([ [ buf, @srv_addr ], [ "tiny", @srv_addr ] ], 1000)
+    got = recv_all(@srv, 8)
+    assert_equal 8, got.size
+    assert_equal buf.scan(/.{1,1000}/m) + %w(tiny), got.map { |d, _| d }
+    got.each { |m| assert_equal 2, m.size }
+  end
+
+  def test_gro
+    @srv.kgio_gro = true
+    assert_equal true, @srv.kgio_gro
+    buf = "a" * 1000 + "b" * 1000 + "c" * 500
+    assert_nil gso_send([ [ buf, @srv_addr ] ], 1000)
+    got = recv_all(@srv, 1)
+    data = got.map { |d, _| d }.join
+    assert_equal buf, data
+    if got.size == 1
+      assert_equal [ buf, Socket.pack_sockaddr_in(@cli.addr[1], '127.0.0.1'),
+                     1000 ], got[0]
+    end
+    @srv.kgio_gro = false
+    assert_equal false, @srv.kgio_gro
+  rescue Errno::ENOPROTOOPT => e
+    omit "UDP_GRO not supported: #{e.message}"
+  end
+
+  def test_bad_segsize
+    assert_raises(ArgumentError) { @cli.kgio_trysendmmsg([], 0) }
+    assert_raises(ArgumentError) { @cli.kgio_trysendmmsg([], 65536) }
+  end
+end if RUBY_PLATFORM =~ /linux/
@@ -0,0 +1,100 @@
+require 'test/unit'
+require 'tmpdir'
+require 'fileutils'
+$-w = true
+require 'kgio'
+
+class TestUnixSeqpacket < Test::Unit::TestCase
+  def setup
+    @tmpdir = Dir.mktmpdir('kgio_seqpacket')
+    @path = "#{@tmpdir}/sock"
+    @srv = Kgio::UNIXServer.new(@path, :SEQPACKET)
+    @to_close = [ @srv ]
+  end
+
+  def teardown
+    @to_close.each { |io| io.close unless io.closed? }
+    FileUtils.remove_entry(@tmpdir)
+  end
+
+  def test_type
+    assert_instance_of Kgio::UNIXServer, @srv
+    assert_equal Socket::SOCK_SEQPACKET,
+                 @srv.getsockopt(:SOCKET, :TYPE).int
+    assert_equal @path, @srv.path
+    c = Kgio::UNIXSocket.new(@path, Socket::SOCK_SEQPACKET)
+    @to_close << c
+    assert_equal Socket::SOCK_SEQPACKET, c.getsockopt(:SOCKET, :TYPE).int
+  end
+
+  def test_message_boundaries
+    c = Kgio::UNIXSocket.new(@path, :SEQPACKET)
+    s = @srv.kgio_accept
+    @to_close.concat([ c, s ])
+    assert_equal Socket::SOCK_SEQPACKET, s.getsockopt(:SOCKET, :TYPE).int
+    assert_equal '127.0.0.1', s.kgio_addr
+
+    assert_nil c.kgio_trywrite("hello")
+    assert_nil c.kgio_trywrite("world")
+    c.kgio_write("!")
+    assert_equal "hello", s.kgio_tryread(100)
+    assert_equal "world", s.kgio_read(100)
+    assert_equal "!", s.kgio_tryread(100)
+    assert_equal :wait_readable, s.kgio_tryread(100)
+
+    # messages are never merged nor split
+    s.kgio_write("a" * 10)
+    assert_equal "a" * 10, c.kgio_tryread(10)
+    assert_equal :wait_readable, c.kgio_tryread(10)
+
+    c.close
+    assert_nil s.kgio_tryread(100)
+  end
+
+  def test_truncation_raises
+    c = Kgio::UNIXSocket.new(@path, :SEQPACKET)
+    s = @srv.kgio_accept
+    @to_close.concat([ c, s ])
+
+    s.kgio_write("a" * 10)
+    s.kgio_write("b" * 10)
+    buf = ''
+    assert_raises(Errno::EMSGSIZE) { c.kgio_tryread(5, buf) }
+    assert_equal "", buf
+    assert_equal "b" * 10, c.kgio_tryread(10)
+
+    s.kgio_write("c" * 10)
+    assert_raises(Errno::EMSGSIZE) { c.kgio_read(9) }
+    s.kgio_write("d" * 10)
+    assert_raises(Errno::EMSGSIZE) { c.kgio_read!(9) }
+    assert_equal :wait_readable, c.kgio_tryread(10)
+  end
+
+  def test_start
+    c = Kgio::UNIXSocket.start(@path, :SEQPACKET)
+    @to_close << c
+    s = @srv.kgio_tryaccept
+    @to_close << s
+    assert_kind_of Kgio::Socket, s
+  end
+
+  def test_stream_unchanged
+    path = "#{@tmpdir}/stream"
+    srv = Kgio::UNIXServer.new(path, :STREAM)
+    c = Kgio::UNIXSocket.new(path)
+    @to_close.concat([ srv, c ])
+    assert_equal Socket::SOCK_STREAM, srv.getsockopt(:SOCKET, :TYPE).int
+    assert_equal Socket::SOCK_STREAM, c.getsockopt(:SOCKET, :TYPE).int
+  end
+
+  def test_bad_type
+    assert_raises(ArgumentError) { Kgio::UNIXSocket.new(@path, :DGRAM) }
+    assert_raises(ArgumentError) do
+      Kgio::UNIXServer.new("#{@tmpdir}/x", Socket::SOCK_DGRAM)
+    end
+  end
+
+  def test_mismatch
+    assert_raises(Errno::EPROTOTYPE) { Kgio::UNIXSocket.new(@path) }
+  end
+end if defined?(Socket::SOCK_SEQPACKET)
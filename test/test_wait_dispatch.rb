@@ -0,0 +1,127 @@
+require 'test/unit'
+$-w = true
+require 'kgio'
+
+# make sure overridden waiters are honored no matter when or how
+# they are defined
+class TestWaitDispatch < Test::Unit::TestCase
+  module Recorder
+    def kgio_wait_readable(*args)
+      @waited = true
+      super
+    end
+  end
+
+  # returns true if the overridden waiter was called
+  def waited?(r, w)
+    th = Thread.new { sleep 0.05; w.syswrite('.') }
+    assert_equal '.', r.kgio_read(1)
+    r.instance_variable_defined?(:@waited)
+  ensure
+    th.join
+    r.close
+    w.close
+  end
+
+  def test_default
+    klass = Class.new(Kgio::Pipe)
+    assert_equal false, waited?(*klass.new)
+    assert_equal false, waited?(*klass.new)
+  end
+
+  def test_subclass
+    klass = Class.new(Kgio::Pipe) { include Recorder }
+    assert_equal true, waited?(*klass.new)
+    assert_equal true, waited?(*klass.new)
+  end
+
+  def test_method_added_after_use
+    klass = Class.new(Kgio::Pipe)
+    assert_equal false, waited?(*klass.new)
+    klass.class_eval do
+      def kgio_wait_readable(*args)
+        @waited = true
+        super
+      end
+    end
+    assert_equal true, waited?(*klass.new)
+    klass.__send__(:remove_method, :kgio_wait_readable)
+    assert_equal false, waited?(*klass.new)
+  end
+
+  def test_include_after_use
+    klass = Class.new(Kgio::Pipe)
+    assert_equal false, waited?(*klass.new)
+    klass.__send__(:include, Recorder)
+    assert_equal true, waited?(*klass.new)
+  end
+
+  def test_prepend_after_use
+    klass = Class.new(Kgio::Pipe)
+    assert_equal false, waited?(*klass.new)
+    klass.__send__(:prepend, Recorder)
+    assert_equal true, waited?(*klass.new)
+  end
+
+  def test_included_module_changed_after_use
+    mod = Module.new
+    klass = Class.new(Kgio::Pipe) { include mod }
+    sub = Class.new(klass)
+    assert_equal false, waited?(*sub.new)
+    mod.module_eval do
+      def kgio_wait_readable(*args)
+        @waited = true
+        super
+      end
+    end
+    assert_equal true, waited?(*sub.new)
+  end
+
+  def test_singleton
+    klass = Class.new(Kgio::Pipe)
+    assert_equal false, waited?(*klass.new)
+    r, w = klass.new
+    r.extend(Recorder)
+    assert_equal true, waited?(r, w)
+  end
+
+  def test_method_added_hook_without_super
+    klass = Class.new(Kgio::Pipe) do
+      def self.method_added(m); end
+    end
+    assert_equal false, waited?(*klass.new)
+    klass.class_eval do
+      def kgio_wait_readable(*args)
+        @waited = true
+        super
+      end
+    end
+    assert_equal true, waited?(*klass.new)
+  end
+
+  def test_no_side_effects
+    klass = Class.new(Kgio::Pipe)
+    before = klass.singleton_class.ancestors
+    assert_equal false, waited?(*klass.new)
+    assert_equal before, klass.singleton_class.ancestors
+    assert_equal [], klass.instance_variables
+  end
+
+  def test_writable
+    klass = Class.new(Kgio::Pipe) do
+      def kgio_wait_writable(*args)
+        @wr_waits = (@wr_waits || 0) + 1
+        @peer.kgio_tryread(1 << 20)
+      end
+      attr_reader :wr_waits
+      attr_writer :peer
+    end
+    r, w = klass.new
+    w.peer = r
+    assert_nil w.kgio_write("*" * (1 << 20))
+    assert_operator w.wr_waits, :>, 0
+  ensure
+    r.close
+    w.close
+  end
+end
@@ -0,0 +1,1088 @@
+#include "kgio.h"
+#include "missing_accept4.h"
+#include "my_fileno.h"
+#include "nonblock.h"
+
+static VALUE localhost;
+static VALUE cClientSocket;
+static VALUE cKgio_Socket;
+static VALUE mSocketMethods;
+static VALUE iv_kgio_addr;
+static VALUE iv_kgio_sockaddr;
+static VALUE iv_kgio_incoming_cpu;
+static VALUE sym_wait_readable, sym_timeout;
+
+#if defined(__linux__) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+static int accept4_flags = SOCK_CLOEXEC;
+#else /* ! linux */
+static int accept4_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+#endif /* ! linux */
+
+struct accept_args {
+	int fd;
+	int flags;
+	struct sockaddr *addr;
+	socklen_t *addrlen;
+	VALUE accept_io;
+	VALUE accepted_class;
+	VALUE sniff_table; /* Qfalse unless sniffing */
+	VALUE sniff_default;
+};
+
+/*
+ * Sets the default class for newly accepted sockets.  This is
+ * legacy behavior, kgio_accept and kgio_tryaccept now take optional
+ * class arguments to override this value.
+ */
+static VALUE set_accepted(VALUE klass, VALUE aclass)
+{
+	VALUE tmp;
+
+	if (NIL_P(aclass))
+		aclass = cKgio_Socket;
+
+	tmp = rb_funcall(aclass, rb_intern("included_modules"), 0, 0);
+	tmp = rb_funcall(tmp, rb_intern("include?"), 1, mSocketMethods);
+
+	if (tmp != Qtrue)
+		rb_raise(rb_eTypeError,
+		         "class must include Kgio::SocketMethods");
+
+	cClientSocket = aclass;
+
+	return aclass;
+}
+
+/*
+ * Returns the default class for newly accepted sockets when kgio_accept
+ * or kgio_tryaccept are not passed arguments
+ */
+static VALUE get_accepted(VALUE klass)
+{
+	return cClientSocket;
+}
+
+/*
+ * accept() wrapper that'll fall back on accept() if we were built on
+ * a system with accept4() but run on a system without accept4()
+ */
+static VALUE xaccept(void *ptr)
+{
+	struct accept_args *a = ptr;
+	int rv;
+
+	rv = accept_fn(a->fd, a->addr, a->addrlen, a->flags);
+	if (rv < 0 && errno == ENOSYS && accept_fn != my_accept4) {
+		accept_fn = my_accept4;
+		rv = accept_fn(a->fd, a->addr, a->addrlen, a->flags);
+	}
+
+	return (VALUE)rv;
+}
+
+#ifdef KGIO_HAVE_THREAD_CALL_WITHOUT_GVL
+#  include <time.h>
+#  include "blocking_io_region.h"
+static int thread_accept(struct accept_args *a, int force_nonblock)
+{
+	if (force_nonblock)
+		set_nonblocking(a->fd);
+	return (int)rb_thread_io_blocking_region(xaccept, a, a->fd);
+}
+
+#else /* ! KGIO_HAVE_THREAD_CALL_WITHOUT_GVL */
+#  include <rubysig.h>
+static int thread_accept(struct accept_args *a, int force_nonblock)
+{
+	int rv;
+
+	/* always use non-blocking accept() under 1.8 for green threads */
+	set_nonblocking(a->fd);
+
+	/* created sockets are always non-blocking under 1.8, too */
+	a->flags |= SOCK_NONBLOCK;
+
+	TRAP_BEG;
+	rv = (int)xaccept(a);
+	TRAP_END;
+	return rv;
+}
+#endif /* ! KGIO_HAVE_THREAD_CALL_WITHOUT_GVL */
+
+static void
+prepare_accept(struct accept_args *a, VALUE self, int argc, const VALUE *argv)
+{
+	a->fd = my_fileno(self);
+	a->accept_io = self;
+	a->sniff_table = Qfalse;
+
+	switch (argc) {
+	case 2:
+		a->flags = NUM2INT(argv[1]);
+		a->accepted_class = NIL_P(argv[0]) ? cClientSocket : argv[0];
+		return;
+	case 0: /* default, legacy behavior */
+		a->flags = accept4_flags;
+		a->accepted_class = cClientSocket;
+		return;
+	case 1:
+		a->flags = accept4_flags;
+		a->accepted_class = NIL_P(argv[0]) ? cClientSocket : argv[0];
+		return;
+	}
+
+	rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+}
+
+static VALUE in_addr_set(VALUE io, struct sockaddr_storage *addr, socklen_t len)
+{
+	VALUE host;
+	int host_len, rc;
+	char *host_ptr;
+
+	switch (addr->ss_family) {
+	case AF_INET:
+		host_len = (long)INET_ADDRSTRLEN;
+		break;
+	case AF_INET6:
+		host_len = (long)INET6_ADDRSTRLEN;
+		break;
+	default:
+		rb_raise(rb_eRuntimeError,
+		         "unsupported address family: ss_family=%lu (socklen=%ld)",
+			 (unsigned long)addr->ss_family, (long)len);
+	}
+	host = rb_str_new(NULL, host_len);
+	host_ptr = RSTRING_PTR(host);
+	rc = getnameinfo((struct sockaddr *)addr, len,
+			 host_ptr, host_len, NULL, 0, NI_NUMERICHOST);
+	if (rc != 0)
+		rb_raise(rb_eRuntimeError, "getnameinfo: %s", gai_strerror(rc));
+	rb_str_set_len(host, strlen(host_ptr));
+	return rb_ivar_set(io, iv_kgio_addr, host);
+}
+
+#if defined(__linux__)
+#  define post_accept kgio_autopush_accept
+#else
+#  define post_accept(a,b) for(;0;)
+#endif
+
+#ifdef SO_INCOMING_CPU
+/* records the CPU which received the first packets of a new client */
+static void incoming_cpu_set(VALUE io, int fd)
+{
+	socklen_t len = sizeof(int);
+	int cpu;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+	    cpu >= 0)
+		rb_ivar_set(io, iv_kgio_incoming_cpu, INT2FIX(cpu));
+}
+#else /* !SO_INCOMING_CPU */
+#  define incoming_cpu_set(io,fd) for(;0;)
+#endif /* !SO_INCOMING_CPU */
+
+/* flags set by Kgio.accept_cloexec= and Kgio.accept_nonblock= */
+int kgio_accept_flags(void)
+{
+	return accept4_flags;
+}
+
+/*
+ * wraps a newly accepted descriptor in a +klass+ object (the default
+ * accept class if nil) with kgio_addr set from +addr+
+ */
+VALUE kgio_client_new(VALUE accept_io, VALUE klass, int fd,
+                      struct sockaddr *addr, socklen_t addrlen)
+{
+	VALUE client_io;
+
+	if (NIL_P(klass))
+		klass = cClientSocket;
+	client_io = kgio_sock_for_fd(klass, fd);
+	post_accept(accept_io, client_io);
+	kgio_addr_set(client_io, addr, addrlen);
+	return client_io;
+}
+
+/* sets kgio_addr of +io+ from +addr+, Kgio::LOCALHOST if NULL or AF_UNIX */
+void kgio_addr_set(VALUE io, struct sockaddr *addr, socklen_t addrlen)
+{
+	if (addr && addr->sa_family != AF_UNIX)
+		in_addr_set(io, (struct sockaddr_storage *)addr, addrlen);
+	else
+		rb_ivar_set(io, iv_kgio_addr, localhost);
+}
+
+/*
+ * sacrifices the reserved descriptor to accept and close one
+ * connection, returns false with errno set if nothing was shed.
+ * The accept() is non-blocking and made without releasing the GVL,
+ * so no other thread may take the freed descriptor or shed again
+ * before the spare is reacquired.  A blocking listener is only made
+ * non-blocking for this one accept() so kgio_accept keeps sleeping
+ * in accept() afterwards.
+ */
+static int shed_one(struct accept_args *a)
+{
+	int fd, saved_errno = errno;
+	int flags = fcntl(a->fd, F_GETFL);
+
+	if (flags == -1) {
+		errno = saved_errno;
+		return 0;
+	}
+	if (!kgio_reserve_fd_release())
+		return 0;
+	if (!(flags & O_NONBLOCK) &&
+	    fcntl(a->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		errno = saved_errno;
+		kgio_reserve_fd_shed(-1);
+		return 0;
+	}
+	fd = (int)xaccept(a);
+	if (!(flags & O_NONBLOCK)) {
+		saved_errno = errno;
+		(void)fcntl(a->fd, F_SETFL, flags);
+		errno = saved_errno;
+	}
+	kgio_reserve_fd_shed(fd);
+	return fd >= 0;
+}
+
+static VALUE
+my_accept(struct accept_args *a, int force_nonblock)
+{
+	int client_fd;
+	VALUE client_io, adm, klass;
+	int retried = 0, nonblock = force_nonblock;
+	int sniff_pending = 0;
+	VALUE deadline = force_nonblock ? Qnil : kgio_deadline(a->accept_io);
+	struct sockaddr_storage proxy_addr;
+	socklen_t proxy_len, addrlen;
+	int proxy_pending;
+	struct sockaddr *addr;
+
+	/*
+	 * a blocking accept would stall every Fiber of this Thread
+	 * or ignore the deadline
+	 */
+	if (!NIL_P(deadline) || (!nonblock && kgio_scheduler_active()))
+		nonblock = 1;
+retry:
+	client_fd = thread_accept(a, nonblock);
+	if (client_fd < 0) {
+		if ((errno == EMFILE || errno == ENFILE) &&
+		    shed_one(a)) {
+			a->fd = my_fileno(a->accept_io);
+			goto retry;
+		}
+		switch (errno) {
+		case EAGAIN:
+			if (force_nonblock)
+				return Qnil;
+			a->fd = my_fileno(a->accept_io);
+			errno = EAGAIN;
+			if (!NIL_P(deadline)) {
+				if (!kgio_wait_deadline(a->accept_io, 0,
+				                        deadline))
+					return sym_timeout;
+			} else if (!nonblock ||
+			    kgio_scheduler_wait(a->accept_io, 0, Qnil) < 0) {
+				(void)rb_io_wait_readable(a->fd);
+			}
+			/* fall-through to EINTR case */
+#ifdef ECONNABORTED
+		case ECONNABORTED:
+#endif /* ECONNABORTED */
+#ifdef EPROTO
+		case EPROTO:
+#endif /* EPROTO */
+		case EINTR:
+			/* raise IOError if closed during sleep */
+			a->fd = my_fileno(a->accept_io);
+			goto retry;
+		case EMFILE:
+		case ENFILE:
+			if (kgio_reserve_fd_enabled())
+				rb_sys_fail("accept");
+			/* fall-through */
+		case ENOMEM:
+#ifdef ENOBUFS
+		case ENOBUFS:
+#endif /* ENOBUFS */
+			if (!retried && !kgio_reserve_fd_enabled()) {
+				retried = 1;
+				errno = 0;
+				rb_gc();
+				goto retry;
+			}
+		default:
+			rb_sys_fail("accept");
+		}
+	}
+	addr = a->addr;
+	addrlen = a->addrlen ? *a->addrlen : 0;
+	proxy_pending = kgio_proxy_accept(a->accept_io, client_fd,
+	                                  &proxy_addr, &proxy_len);
+	if (proxy_pending < 0) {
+		a->fd = my_fileno(a->accept_io);
+		goto retry;
+	}
+	if (proxy_len) {
+		addr = (struct sockaddr *)&proxy_addr;
+		addrlen = proxy_len;
+	}
+	/* the address of the load balancer must not be charged */
+	adm = proxy_pending ? Qnil :
+	      kgio_admit(a->accept_io, client_fd, addr, addrlen);
+	if (adm == Qfalse) {
+		a->fd = my_fileno(a->accept_io);
+		goto retry;
+	}
+	/* the PROXY header is in the way, sniffing is up to the caller */
+	klass = a->accepted_class;
+	if (a->sniff_table != Qfalse) {
+		klass = proxy_pending ? Qundef :
+		        kgio_sniff(a->sniff_table, a->sniff_default, client_fd);
+		sniff_pending = klass == Qundef;
+		if (sniff_pending)
+			klass = a->sniff_default;
+	}
+	client_io = kgio_admitted_new(adm, a->accept_io, klass,
+	                              client_fd, addr, addrlen);
+	incoming_cpu_set(client_io, client_fd);
+	if (sniff_pending)
+		kgio_sniff_defer(client_io);
+	if (proxy_pending) {
+		kgio_proxy_defer(client_io);
+		kgio_admission_defer(a->accept_io, client_io);
+	} else if (proxy_len)
+		rb_ivar_set(client_io, iv_kgio_sockaddr,
+		            rb_str_new((const char *)&proxy_addr, proxy_len));
+	return client_io;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_addr! => refreshes the given sock address
+ */
+static VALUE addr_bang(VALUE io)
+{
+	int fd = my_fileno(io);
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(struct sockaddr_storage);
+
+	if (getpeername(fd, (struct sockaddr *)&addr, &len) != 0)
+		rb_sys_fail("getpeername");
+
+	if (addr.ss_family == AF_UNIX)
+		return rb_ivar_set(io, iv_kgio_addr, localhost);
+
+	return in_addr_set(io, &addr, len);
+}
+
+#ifdef SO_INCOMING_CPU
+/*
+ * call-seq:
+ *
+ *	io.kgio_incoming_cpu	-> Integer or nil
+ *
+ * Returns the CPU which processed the packets received for this
+ * socket (SO_INCOMING_CPU), or nil if unknown or unsupported by the
+ * kernel.  Handling a client on this CPU improves cache locality.
+ *
+ * Clients from kgio_accept, kgio_tryaccept and Kgio::Acceptor with
+ * per-CPU queues return the value recorded at accept time, even if
+ * later packets are processed elsewhere.  For other sockets, every
+ * call queries the kernel.
+ */
+static VALUE incoming_cpu(VALUE io)
+{
+	VALUE rv = rb_attr_get(io, iv_kgio_incoming_cpu);
+	socklen_t len = sizeof(int);
+	int cpu;
+
+	if (!NIL_P(rv))
+		return rv;
+	if (getsockopt(my_fileno(io), SOL_SOCKET, SO_INCOMING_CPU,
+	               &cpu, &len) != 0) {
+		if (errno == ENOPROTOOPT)
+			return Qnil;
+		rb_sys_fail("getsockopt(SO_INCOMING_CPU)");
+	}
+	return cpu < 0 ? Qnil : INT2FIX(cpu);
+}
+#endif /* SO_INCOMING_CPU */
+
+/*
+ * call-seq:
+ *
+ *	server = Kgio::TCPServer.new('0.0.0.0', 80)
+ *	server.kgio_tryaccept -> Kgio::Socket or nil
+ *	server.kgio_tryaccept(klass = MySocket) -> MySocket or nil
+ *	server.kgio_tryaccept(nil, flags) -> Kgio::Socket or nil
+ *
+ * Initiates a non-blocking accept and returns a generic Kgio::Socket
+ * object with the kgio_addr attribute set to the IP address of the
+ * connected client on success.
+ *
+ * Returns nil on EAGAIN, and raises on other errors.
+ *
+ * An optional +klass+ argument may be specified to override the
+ * Kgio::Socket-class on a successful return value.
+ *
+ * An optional +flags+ argument may also be specified.
+ * +flags+ is a bitmask that may contain any combination of:
+ *
+ * - Kgio::SOCK_CLOEXEC - close-on-exec flag (enabled by default)
+ * - Kgio::SOCK_NONBLOCK - non-blocking flag (unimportant)
+ */
+static VALUE tcp_tryaccept(int argc, VALUE *argv, VALUE self)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+	struct accept_args a;
+
+	a.addr = (struct sockaddr *)&addr;
+	a.addrlen = &addrlen;
+	prepare_accept(&a, self, argc, argv);
+	return my_accept(&a, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	server = Kgio::TCPServer.new('0.0.0.0', 80)
+ *	server.kgio_accept -> Kgio::Socket or nil
+ *	server.kgio_tryaccept -> Kgio::Socket or nil
+ *	server.kgio_tryaccept(klass = MySocket) -> MySocket or nil
+ *
+ * Initiates a blocking accept and returns a generic Kgio::Socket
+ * object with the kgio_addr attribute set to the IP address of
+ * the client on success.
+ *
+ * On Ruby implementations using native threads, this can use a blocking
+ * accept(2) (or accept4(2)) system call to avoid thundering herds.
+ * Non-blocking accept is used instead if a kgio_deadline is set, and
+ * :timeout is returned once the deadline passes.
+ *
+ * An optional +klass+ argument may be specified to override the
+ * Kgio::Socket-class on a successful return value.
+ *
+ * An optional +flags+ argument may also be specified.
+ * +flags+ is a bitmask that may contain any combination of:
+ *
+ * - Kgio::SOCK_CLOEXEC - close-on-exec flag (enabled by default)
+ * - Kgio::SOCK_NONBLOCK - non-blocking flag (unimportant)
+ */
+static VALUE tcp_accept(int argc, VALUE *argv, VALUE self)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+	struct accept_args a;
+
+	a.addr = (struct sockaddr *)&addr;
+	a.addrlen = &addrlen;
+	prepare_accept(&a, self, argc, argv);
+	return my_accept(&a, 0);
+}
+
+/*
+ * call-seq:
+ *
+ *	server = Kgio::UNIXServer.new("/path/to/unix/socket")
+ *	server.kgio_tryaccept -> Kgio::Socket or nil
+ *	server.kgio_tryaccept(klass = MySocket) -> MySocket or nil
+ *	server.kgio_tryaccept(nil, flags) -> Kgio::Socket or nil
+ *
+ * Initiates a non-blocking accept and returns a generic Kgio::Socket
+ * object with the kgio_addr attribute set (to the value of
+ * Kgio::LOCALHOST) on success.
+ *
+ * An optional +klass+ argument may be specified to override the
+ * Kgio::Socket-class on a successful return value.
+ *
+ * An optional +flags+ argument may also be specified.
+ * +flags+ is a bitmask that may contain any combination of:
+ *
+ * - Kgio::SOCK_CLOEXEC - close-on-exec flag (enabled by default)
+ * - Kgio::SOCK_NONBLOCK - non-blocking flag (unimportant)
+ */
+static VALUE unix_tryaccept(int argc, VALUE *argv, VALUE self)
+{
+	struct accept_args a;
+
+	a.addr = NULL;
+	a.addrlen = NULL;
+	prepare_accept(&a, self, argc, argv);
+	return my_accept(&a, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	server = Kgio::UNIXServer.new("/path/to/unix/socket")
+ *	server.kgio_accept -> Kgio::Socket or nil
+ *	server.kgio_accept(klass = MySocket) -> MySocket or nil
+ *	server.kgio_accept(nil, flags) -> Kgio::Socket or nil
+ *
+ * Initiates a blocking accept and returns a generic Kgio::Socket
+ * object with the kgio_addr attribute set (to the value of
+ * Kgio::LOCALHOST) on success.
+ *
+ * On Ruby implementations using native threads, this can use a blocking
+ * accept(2) (or accept4(2)) system call to avoid thundering herds.
+ * Non-blocking accept is used instead if a kgio_deadline is set, and
+ * :timeout is returned once the deadline passes.
+ *
+ * An optional +klass+ argument may be specified to override the
+ * Kgio::Socket-class on a successful return value.
+ *
+ * An optional +flags+ argument may also be specified.
+ * +flags+ is a bitmask that may contain any combination of:
+ *
+ * - Kgio::SOCK_CLOEXEC - close-on-exec flag (enabled by default)
+ * - Kgio::SOCK_NONBLOCK - non-blocking flag (unimportant)
+ */
+static VALUE unix_accept(int argc, VALUE *argv, VALUE self)
+{
+	struct accept_args a;
+
+	a.addr = NULL;
+	a.addrlen = NULL;
+	prepare_accept(&a, self, argc, argv);
+	return my_accept(&a, 0);
+}
+
+/*
+ * scratch space for the first read of kgio_tryaccept_read, the
+ * non-blocking recv() runs with the GVL held so it may be shared.
+ */
+static char first_read_buf[16384];
+
+static VALUE first_read(VALUE client_io, long len)
+{
+	char *ptr = first_read_buf;
+	VALUE buf = Qnil;
+	int fd = my_fileno(client_io);
+	ssize_t n;
+
+	if (len > (long)sizeof(first_read_buf)) {
+		buf = rb_str_new(NULL, len);
+		ptr = RSTRING_PTR(buf);
+	}
+retry:
+#ifdef MSG_DONTWAIT
+	n = recv(fd, ptr, len, MSG_DONTWAIT);
+#else
+	set_nonblocking(fd);
+	n = read(fd, ptr, len);
+#endif
+	if (n < 0) {
+		switch (errno) {
+		case EINTR:
+			fd = my_fileno(client_io);
+			goto retry;
+		case EAGAIN:
+			return sym_wait_readable;
+		case ECONNRESET: /* treat like EOF, it never sent anything */
+			errno = 0;
+			return Qnil;
+		}
+		rb_sys_fail("recv");
+	}
+	if (n == 0 && len > 0)
+		return Qnil;
+	if (NIL_P(buf))
+		return rb_str_new(ptr, n);
+	rb_str_set_len(buf, n);
+	return buf;
+}
+
+static VALUE
+tryaccept_read(struct accept_args *a, int argc, VALUE *argv, VALUE self)
+{
+	VALUE client_io;
+	long maxlen;
+
+	if (argc < 1)
+		rb_raise(rb_eArgError, "wrong number of arguments (0 for 1)");
+
+	/* raise before a client is accepted, not after */
+	maxlen = NUM2LONG(argv[0]);
+	if (maxlen < 0)
+		rb_raise(rb_eArgError, "negative length %ld given", maxlen);
+	prepare_accept(a, self, argc - 1, argv + 1);
+	client_io = my_accept(a, 1);
+	if (NIL_P(client_io))
+		return Qnil;
+
+	/* the PROXY header is in the way, reading is up to the caller */
+	if (kgio_proxy_pending(client_io))
+		return rb_assoc_new(client_io, sym_wait_readable);
+	return rb_assoc_new(client_io, first_read(client_io, maxlen));
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_read(maxlen) -> [ Kgio::Socket, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, klass) -> [ klass, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, nil, flags) -> [ Kgio::Socket, data ] or nil
+ *
+ * Like kgio_tryaccept, but also attempts a non-blocking read of up
+ * to +maxlen+ bytes from the new socket within the same call.  This
+ * is useful for protocols where clients speak first, especially with
+ * TCP_DEFER_ACCEPT where the request is usually already buffered.
+ *
+ * Returns nil if there is no connection to accept.  Otherwise
+ * returns a two-element Array of the accepted socket and the data
+ * read, :wait_readable if nothing has arrived, yet, or nil if the
+ * client disconnected without sending anything.
+ *
+ * The +klass+ and +flags+ arguments behave as they do for
+ * kgio_tryaccept.
+ *
+ * With kgio_proxy_protocol enabled, nothing is read from clients
+ * whose PROXY header has not fully arrived, yet; they are returned
+ * with :wait_readable and kgio_proxy_pending? set.  Call
+ * kgio_tryproxy on them before reading.
+ */
+static VALUE tcp_tryaccept_read(int argc, VALUE *argv, VALUE self)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+	struct accept_args a;
+
+	a.addr = (struct sockaddr *)&addr;
+	a.addrlen = &addrlen;
+	return tryaccept_read(&a, argc, argv, self);
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_read(maxlen) -> [ Kgio::Socket, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, klass) -> [ klass, data ] or nil
+ *	srv.kgio_tryaccept_read(maxlen, nil, flags) -> [ Kgio::Socket, data ] or nil
+ *
+ * Same as Kgio::TCPServer#kgio_tryaccept_read, except the
+ * kgio_addr attribute is always Kgio::LOCALHOST.
+ */
+static VALUE unix_tryaccept_read(int argc, VALUE *argv, VALUE self)
+{
+	struct accept_args a;
+
+	a.addr = NULL;
+	a.addrlen = NULL;
+	return tryaccept_read(&a, argc, argv, self);
+}
+
+static VALUE
+tryaccept_sniff(struct accept_args *a, int argc, VALUE *argv, VALUE self)
+{
+	VALUE table, args[2];
+
+	rb_scan_args(argc, argv, "12", &table, &args[0], &args[1]);
+	table = kgio_sniff_table(table);
+	prepare_accept(a, self, NIL_P(args[1]) ? 1 : 2, args);
+	a->sniff_table = table;
+	a->sniff_default = a->accepted_class;
+	return my_accept(a, 1);
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_sniff(table) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass, flags) -> socket or nil
+ *
+ * Like kgio_tryaccept, but picks the class of the accepted socket
+ * by peeking at the first bytes sent by the client.  +table+ is a
+ * Hash mapping byte prefixes to classes, checked in insertion order:
+ *
+ *	table = {
+ *	  "\x16\x03" => TLSClient,
+ *	  "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" => H2Client,
+ *	}
+ *	client = srv.kgio_tryaccept_sniff(table, HTTPClient)
+ *
+ * The peeked data is not consumed.  Only data which already arrived
+ * is looked at, this never waits for more.  Clients matching no
+ * prefix get +klass+, which defaults to Kgio.accept_class.  So do
+ * clients which have not sent enough to decide, yet (nothing at all,
+ * or a partial match for a prefix ahead of any full match), so one
+ * slow client cannot hold up the others, but those also have
+ * Kgio::SocketMethods#kgio_sniff_pending? set.  Once such a client is
+ * readable, Kgio::SocketMethods#kgio_trysniff with the same +table+
+ * tells which class it would have gotten.  Prefixes may be up to 256
+ * bytes long.
+ *
+ * With kgio_proxy_protocol enabled, clients whose PROXY header has not
+ * fully arrived, yet, are not sniffed either and get +klass+ with
+ * both kgio_proxy_pending? and kgio_sniff_pending? set.  kgio_trysniff
+ * consumes the header before looking at the payload.
+ *
+ * Returns nil if there is no connection to accept.
+ */
+static VALUE tcp_tryaccept_sniff(int argc, VALUE *argv, VALUE self)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+	struct accept_args a;
+
+	a.addr = (struct sockaddr *)&addr;
+	a.addrlen = &addrlen;
+	return tryaccept_sniff(&a, argc, argv, self);
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_tryaccept_sniff(table) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass) -> socket or nil
+ *	srv.kgio_tryaccept_sniff(table, klass, flags) -> socket or nil
+ *
+ * Same as Kgio::TCPServer#kgio_tryaccept_sniff, except the
+ * kgio_addr attribute is always Kgio::LOCALHOST.
+ */
+static VALUE unix_tryaccept_sniff(int argc, VALUE *argv, VALUE self)
+{
+	struct accept_args a;
+
+	a.addr = NULL;
+	a.addrlen = NULL;
+	return tryaccept_sniff(&a, argc, argv, self);
+}
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+#include <sys/epoll.h>
+#include "broken_system_compat.h"
+#ifndef EPOLLEXCLUSIVE
+#  define EPOLLEXCLUSIVE (1U << 28) /* Linux 4.5+, ignored by older */
+#endif
+
+struct accept_any_args {
+	VALUE servers;
+	int epfd;
+	int timeout;
+	struct timespec deadline;
+	struct epoll_event ev;
+	struct accept_args a;
+};
+
+static VALUE nogvl_epoll_wait(void *ptr)
+{
+	struct accept_any_args *x = ptr;
+
+	return (VALUE)epoll_wait(x->epfd, &x->ev, 1, x->timeout);
+}
+
+/* updates x->timeout with the milliseconds left until x->deadline */
+static void accept_any_timeout(struct accept_any_args *x)
+{
+	struct timespec now;
+	long ms;
+
+	if (x->timeout <= 0)
+		return;
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	ms = (x->deadline.tv_sec - now.tv_sec) * 1000;
+	ms += (x->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	x->timeout = ms < 0 ? 0 : (int)ms;
+}
+
+static VALUE accept_any_wait(VALUE ptr)
+{
+	struct accept_any_args *x = (struct accept_any_args *)ptr;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	long i, n = RARRAY_LEN(x->servers);
+
+	for (i = 0; i < n; i++) {
+		int fd = my_fileno(rb_ary_entry(x->servers, i));
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.u64 = (uint64_t)i;
+		if (epoll_ctl(x->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			rb_sys_fail("epoll_ctl");
+	}
+
+	for (;;) {
+		long nr = (long)rb_thread_blocking_region(nogvl_epoll_wait, x,
+		                                          RUBY_UBF_IO, 0);
+		VALUE rv;
+
+		if (nr < 0) {
+			if (errno != EINTR)
+				rb_sys_fail("epoll_wait");
+			accept_any_timeout(x);
+			continue;
+		}
+		if (nr == 0)
+			return Qnil;
+
+		i = (long)x->ev.data.u64;
+		if (i >= RARRAY_LEN(x->servers))
+			rb_raise(rb_eRuntimeError, "servers modified during wait");
+		x->a.accept_io = rb_ary_entry(x->servers, i);
+		x->a.fd = my_fileno(x->a.accept_io);
+		addrlen = sizeof(struct sockaddr_storage);
+		x->a.addr = (struct sockaddr *)&addr;
+		x->a.addrlen = &addrlen;
+
+		/* another process may have won the race for this client */
+		rv = my_accept(&x->a, 1);
+		if (!NIL_P(rv))
+			return rv;
+		accept_any_timeout(x);
+	}
+}
+
+static VALUE accept_any_close(VALUE ptr)
+{
+	struct accept_any_args *x = (struct accept_any_args *)ptr;
+
+	(void)close(x->epfd);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.accept_any([tcp_srv, unix_srv], 1000) -> Kgio::Socket or nil
+ *	Kgio.accept_any(servers, timeout, klass = MySocket) -> MySocket or nil
+ *	Kgio.accept_any(servers, timeout, nil, flags) -> Kgio::Socket or nil
+ *
+ * Waits on every listener in the +servers+ Array at once and accepts
+ * a connection from whichever is ready first.  The returned socket
+ * has the kgio_addr attribute set like kgio_accept would.
+ *
+ * On Linux 4.5+, listeners are registered with EPOLLEXCLUSIVE, so
+ * only one of many processes waiting on the same listeners is woken
+ * for each new connection, avoiding thundering herds.  The wait is
+ * done without holding the GVL.
+ *
+ * Timeout is specified in Integer milliseconds like Kgio.poll, nil
+ * waits forever.  Returns nil if +timeout+ expires.
+ *
+ * The optional +klass+ and +flags+ arguments behave like they do for
+ * kgio_accept.
+ */
+static VALUE s_accept_any(int argc, VALUE *argv, VALUE mod)
+{
+	struct accept_any_args x;
+	VALUE timeout, klass, flags;
+
+	rb_scan_args(argc, argv, "13", &x.servers, &timeout, &klass, &flags);
+	Check_Type(x.servers, T_ARRAY);
+	x.timeout = NIL_P(timeout) ? -1 : NUM2INT(timeout);
+	if (x.timeout > 0) {
+		clock_gettime(hopefully_CLOCK_MONOTONIC, &x.deadline);
+		x.deadline.tv_sec += x.timeout / 1000;
+		x.deadline.tv_nsec += (x.timeout % 1000) * 1000000;
+		if (x.deadline.tv_nsec >= 1000000000) {
+			x.deadline.tv_sec++;
+			x.deadline.tv_nsec -= 1000000000;
+		}
+	}
+	x.a.flags = NIL_P(flags) ? accept4_flags : NUM2INT(flags);
+	x.a.accepted_class = NIL_P(klass) ? cClientSocket : klass;
+	x.a.sniff_table = Qfalse;
+
+	x.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (x.epfd < 0)
+		rb_sys_fail("epoll_create1");
+
+	return rb_ensure(accept_any_wait, (VALUE)&x,
+	                 accept_any_close, (VALUE)&x);
+}
+#endif /* HAVE_SYS_EPOLL_H && KGIO_HAVE_THREAD_CALL_WITHOUT_GVL */
+
+/*
+ * call-seq:
+ *
+ *	Kgio.accept_cloexec? -> true or false
+ *
+ * Returns true if newly accepted Kgio::Sockets are created with the
+ * FD_CLOEXEC file descriptor flag, false if not.
+ *
+ * Deprecated, use the per-socket flags for kgio_*accept instead.
+ */
+static VALUE get_cloexec(VALUE mod)
+{
+	return (accept4_flags & SOCK_CLOEXEC) == SOCK_CLOEXEC ? Qtrue : Qfalse;
+}
+
+/*
+ *
+ * call-seq:
+ *
+ *	Kgio.accept_nonblock? -> true or false
+ *
+ * Returns true if newly accepted Kgio::Sockets are created with the
+ * O_NONBLOCK file status flag, false if not.
+ *
+ * Deprecated, use the per-socket flags for kgio_*accept instead.
+ */
+static VALUE get_nonblock(VALUE mod)
+{
+	return (accept4_flags & SOCK_NONBLOCK)==SOCK_NONBLOCK ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.accept_cloexec = true
+ *	Kgio.accept_cloexec = false
+ *
+ * Sets whether or not Kgio::Socket objects created by
+ * TCPServer#kgio_accept,
+ * TCPServer#kgio_tryaccept,
+ * UNIXServer#kgio_accept,
+ * and UNIXServer#kgio_tryaccept
+ * default to being created with the FD_CLOEXEC file descriptor flag.
+ *
+ * This is on by default, as there is little reason to deal to enable
+ * it for client sockets on a socket server.
+ *
+ * Deprecated, use the per-socket flags for kgio_*accept instead.
+ */
+static VALUE set_cloexec(VALUE mod, VALUE boolean)
+{
+	switch (TYPE(boolean)) {
+	case T_TRUE:
+		accept4_flags |= SOCK_CLOEXEC;
+		return boolean;
+	case T_FALSE:
+		accept4_flags &= ~SOCK_CLOEXEC;
+		return boolean;
+	}
+	rb_raise(rb_eTypeError, "not true or false");
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.accept_nonblock = true
+ *	Kgio.accept_nonblock = false
+ *
+ * Sets whether or not Kgio::Socket objects created by
+ * TCPServer#kgio_accept,
+ * TCPServer#kgio_tryaccept,
+ * UNIXServer#kgio_accept,
+ * and UNIXServer#kgio_tryaccept
+ * are created with the O_NONBLOCK file status flag.
+ *
+ * This defaults to +false+ for GNU/Linux where MSG_DONTWAIT is
+ * available (and on newer GNU/Linux, accept4() may also set
+ * the non-blocking flag.  This defaults to +true+ on non-GNU/Linux
+ * systems.
+ *
+ * This is always true on Ruby implementations using user-space threads.
+ *
+ * Deprecated, use the per-socket flags for kgio_*accept instead.
+ */
+static VALUE set_nonblock(VALUE mod, VALUE boolean)
+{
+	switch (TYPE(boolean)) {
+	case T_TRUE:
+		accept4_flags |= SOCK_NONBLOCK;
+		return boolean;
+	case T_FALSE:
+		accept4_flags &= ~SOCK_NONBLOCK;
+		return boolean;
+	}
+	rb_raise(rb_eTypeError, "not true or false");
+	return Qnil;
+}
+
+void init_kgio_accept(void)
+{
+	VALUE cUNIXServer, cTCPServer;
+	VALUE mKgio = rb_define_module("Kgio");
+
+	/*
+	 * Maps to the SOCK_NONBLOCK constant in Linux for setting
+	 * the non-blocking flag on newly accepted sockets.  This is
+	 * usually unnecessary as sockets are made non-blocking
+	 * whenever non-blocking methods are used.
+	 */
+	rb_define_const(mKgio, "SOCK_NONBLOCK", INT2NUM(SOCK_NONBLOCK));
+
+	/*
+	 * Maps to the SOCK_CLOEXEC constant in Linux for setting
+	 * the close-on-exec flag on newly accepted descriptors.  This
+	 * is enabled by default, and there is usually no reason to
+	 * disable close-on-exec for accepted sockets.
+	 */
+	rb_define_const(mKgio, "SOCK_CLOEXEC", INT2NUM(SOCK_CLOEXEC));
+
+	localhost = rb_const_get(mKgio, rb_intern("LOCALHOST"));
+	cKgio_Socket = rb_const_get(mKgio, rb_intern("Socket"));
+	cClientSocket = cKgio_Socket;
+	mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	rb_define_method(mSocketMethods, "kgio_addr!", addr_bang, 0);
+#ifdef SO_INCOMING_CPU
+	rb_define_method(mSocketMethods, "kgio_incoming_cpu", incoming_cpu, 0);
+#endif
+
+	rb_define_singleton_method(mKgio, "accept_cloexec?", get_cloexec, 0);
+	rb_define_singleton_method(mKgio, "accept_cloexec=", set_cloexec, 1);
+	rb_define_singleton_method(mKgio, "accept_nonblock?", get_nonblock, 0);
+	rb_define_singleton_method(mKgio, "accept_nonblock=", set_nonblock, 1);
+	rb_define_singleton_method(mKgio, "accept_class=", set_accepted, 1);
+	rb_define_singleton_method(mKgio, "accept_class", get_accepted, 0);
+#if defined(HAVE_SYS_EPOLL_H) && defined(KGIO_HAVE_THREAD_CALL_WITHOUT_GVL)
+	if (check_clock() >= 0)
+		rb_define_singleton_method(mKgio, "accept_any",
+		                           s_accept_any, -1);
+#endif
+
+	/*
+	 * Document-class: Kgio::UNIXServer
+	 *
+	 * Kgio::UNIXServer should be used in place of the plain UNIXServer
+	 * when kgio_accept and kgio_tryaccept methods are needed.
+	 */
+	cUNIXServer = rb_const_get(rb_cObject, rb_intern("UNIXServer"));
+	cUNIXServer = rb_define_class_under(mKgio, "UNIXServer", cUNIXServer);
+	rb_define_method(cUNIXServer, "kgio_tryaccept", unix_tryaccept, -1);
+	rb_define_method(cUNIXServer, "kgio_accept", unix_accept, -1);
+	rb_define_method(cUNIXServer, "kgio_tryaccept_read",
+	                 unix_tryaccept_read, -1);
+	rb_define_method(cUNIXServer, "kgio_tryaccept_sniff",
+	                 unix_tryaccept_sniff, -1);
+	rb_define_method(cUNIXServer, "kgio_deadline=", kgio_set_deadline, 1);
+	rb_define_method(cUNIXServer, "kgio_deadline", kgio_deadline, 0);
+
+	/*
+	 * Document-class: Kgio::TCPServer
+	 *
+	 * Kgio::TCPServer should be used in place of the plain TCPServer
+	 * when kgio_accept and kgio_tryaccept methods are needed.
+	 */
+	cTCPServer = rb_const_get(rb_cObject, rb_intern("TCPServer"));
+	cTCPServer = rb_define_class_under(mKgio, "TCPServer", cTCPServer);
+
+	rb_define_method(cTCPServer, "kgio_tryaccept", tcp_tryaccept, -1);
+	rb_define_method(cTCPServer, "kgio_accept", tcp_accept, -1);
+	rb_define_method(cTCPServer, "kgio_tryaccept_read",
+	                 tcp_tryaccept_read, -1);
+	rb_define_method(cTCPServer, "kgio_tryaccept_sniff",
+	                 tcp_tryaccept_sniff, -1);
+	rb_define_method(cTCPServer, "kgio_deadline=", kgio_set_deadline, 1);
+	rb_define_method(cTCPServer, "kgio_deadline", kgio_deadline, 0);
+	iv_kgio_addr = rb_intern("@kgio_addr");
+	iv_kgio_sockaddr = rb_intern("@kgio_sockaddr");
+	iv_kgio_incoming_cpu = rb_intern("@kgio_incoming_cpu");
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+	sym_timeout = ID2SYM(rb_intern("timeout"));
+}
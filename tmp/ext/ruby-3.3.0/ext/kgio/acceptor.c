@@ -0,0 +1,634 @@
+/*
+ * Kgio::Acceptor runs accept4() on native threads which never touch
+ * the GVL.  Accepted descriptors are handed to Ruby through bounded
+ * lock-free rings (Dmitry Vyukov's MPMC queue), each with an eventfd
+ * which becomes readable whenever the ring is non-empty.  There is
+ * either one ring, or one ring per CPU when dispatching clients by
+ * SO_INCOMING_CPU.
+ */
+#include "kgio.h"
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_GCC_ATOMIC_BUILTINS) && defined(SOCK_NONBLOCK)
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include "my_fileno.h"
+#include "nonblock.h"
+
+struct slot {
+	size_t seq;
+	int fd;
+	int cpu; /* -1 if unknown */
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+struct ring {
+	VALUE io; /* IO wrapping efd, which it does not own */
+	int efd; /* readable while the ring is non-empty */
+	size_t mask;
+	size_t head; /* written by producers */
+	size_t tail; /* written by Ruby under the GVL */
+	unsigned long accepted;
+	unsigned long delivered;
+	struct slot *slots;
+};
+
+struct acceptor {
+	VALUE server;
+	int stop_efd; /* readable once we're shutting down */
+	int listen_fd; /* dup of server's descriptor */
+	int nthreads;
+	int running;
+	int per_cpu;
+	int nrings;
+	pthread_t *threads;
+	struct ring *rings;
+};
+
+static VALUE cAcceptor;
+static ID id_for_fd, id_autoclose_set, iv_kgio_incoming_cpu;
+static VALUE sym_accepted, sym_delivered, sym_queued;
+
+#define LOAD(p,o) __atomic_load_n((p),__ATOMIC_##o)
+#define STORE(p,v,o) __atomic_store_n((p),(v),__ATOMIC_##o)
+
+/* returns false if the ring is full */
+static int ring_push(struct ring *r, const struct slot *in)
+{
+	size_t pos = LOAD(&r->head, RELAXED);
+	struct slot *s;
+
+	for (;;) {
+		intptr_t diff;
+
+		s = &r->slots[pos & r->mask];
+		diff = (intptr_t)LOAD(&s->seq, ACQUIRE) - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos,
+			                                pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = LOAD(&r->head, RELAXED);
+		}
+	}
+	s->fd = in->fd;
+	s->cpu = in->cpu;
+	s->addrlen = in->addrlen;
+	memcpy(&s->addr, &in->addr, in->addrlen);
+	STORE(&s->seq, pos + 1, RELEASE);
+	return 1;
+}
+
+/* only called by Ruby with the GVL, so there is a single consumer */
+static int ring_shift(struct ring *r, struct slot *out)
+{
+	size_t pos = r->tail;
+	struct slot *s = &r->slots[pos & r->mask];
+
+	if (LOAD(&s->seq, ACQUIRE) != pos + 1)
+		return 0;
+	out->fd = s->fd;
+	out->cpu = s->cpu;
+	out->addrlen = s->addrlen;
+	memcpy(&out->addr, &s->addr, s->addrlen);
+	STORE(&s->seq, pos + r->mask + 1, RELEASE);
+	STORE(&r->tail, pos + 1, RELAXED);
+	return 1;
+}
+
+static int ring_empty(struct ring *r)
+{
+	return LOAD(&r->slots[r->tail & r->mask].seq, ACQUIRE) != r->tail + 1;
+}
+
+static void efd_signal(int efd)
+{
+	uint64_t one = 1;
+
+	while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+/* sleeps for +ms+, returns true if we should stop */
+static int nap(struct acceptor *acc, int ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = acc->stop_efd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, ms) > 0;
+}
+
+static void *acceptor_thread(void *ptr)
+{
+	struct acceptor *acc = ptr;
+	struct pollfd pfd[2];
+	struct slot s;
+	struct ring *r;
+
+	pfd[0].fd = acc->listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = acc->stop_efd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		s.addrlen = sizeof(s.addr);
+		s.fd = accept4(acc->listen_fd, (struct sockaddr *)&s.addr,
+		               &s.addrlen, SOCK_CLOEXEC);
+		if (s.fd < 0) {
+			switch (errno) {
+			case EMFILE:
+			case ENFILE:
+			case ENOBUFS:
+			case ENOMEM:
+				if (nap(acc, 10))
+					return NULL;
+			}
+			continue; /* EAGAIN, ECONNABORTED, etc... */
+		}
+		if (s.addrlen > sizeof(s.addr))
+			s.addrlen = sizeof(s.addr);
+		s.cpu = -1;
+		r = acc->rings;
+#ifdef SO_INCOMING_CPU
+		if (acc->per_cpu) {
+			socklen_t len = sizeof(int);
+
+			if (getsockopt(s.fd, SOL_SOCKET, SO_INCOMING_CPU,
+			               &s.cpu, &len) == 0 && s.cpu >= 0)
+				r += s.cpu % acc->nrings;
+			else
+				s.cpu = -1;
+		}
+#endif /* SO_INCOMING_CPU */
+
+		/* Ruby is behind, let the rest wait in the listen queue */
+		while (!ring_push(r, &s)) {
+			if (nap(acc, 1)) {
+				(void)close(s.fd);
+				return NULL;
+			}
+		}
+		__atomic_fetch_add(&r->accepted, 1, __ATOMIC_RELAXED);
+		efd_signal(r->efd);
+	}
+	return NULL;
+}
+
+/*
+ * always called with the GVL held, so concurrent closes (or a close
+ * racing the GC) see +running+ cleared and only one of them joins.
+ * The threads exit as soon as stop_efd is readable, so the GVL is not
+ * held for long.
+ */
+static void stop_threads(struct acceptor *acc)
+{
+	int i;
+
+	if (!acc->running)
+		return;
+	acc->running = 0;
+	efd_signal(acc->stop_efd);
+	for (i = 0; i < acc->nthreads; i++)
+		pthread_join(acc->threads[i], NULL);
+}
+
+static void acceptor_release(struct acceptor *acc)
+{
+	struct slot s;
+	int i;
+
+	stop_threads(acc);
+	for (i = 0; acc->rings && i < acc->nrings; i++) {
+		struct ring *r = &acc->rings[i];
+
+		if (r->slots) {
+			while (ring_shift(r, &s))
+				(void)close(s.fd);
+			xfree(r->slots);
+			r->slots = NULL;
+		}
+		/* only now that no thread may signal it */
+		if (r->efd >= 0) {
+			(void)close(r->efd);
+			r->efd = -1;
+		}
+	}
+	if (acc->threads) {
+		xfree(acc->threads);
+		acc->threads = NULL;
+	}
+	if (acc->stop_efd >= 0) {
+		(void)close(acc->stop_efd);
+		acc->stop_efd = -1;
+	}
+	if (acc->listen_fd >= 0) {
+		(void)close(acc->listen_fd);
+		acc->listen_fd = -1;
+	}
+}
+
+static void acceptor_mark(void *ptr)
+{
+	struct acceptor *acc = ptr;
+	int i;
+
+	rb_gc_mark(acc->server);
+	for (i = 0; acc->rings && i < acc->nrings; i++)
+		rb_gc_mark(acc->rings[i].io);
+}
+
+static void acceptor_free(void *ptr)
+{
+	struct acceptor *acc = ptr;
+
+	acceptor_release(acc);
+	if (acc->rings)
+		xfree(acc->rings);
+	xfree(acc);
+}
+
+static VALUE acceptor_alloc(VALUE klass)
+{
+	struct acceptor *acc;
+	VALUE self = Data_Make_Struct(klass, struct acceptor, acceptor_mark,
+	                              acceptor_free, acc);
+
+	memset(acc, 0, sizeof(struct acceptor));
+	acc->server = Qnil;
+	acc->stop_efd = acc->listen_fd = -1;
+	return self;
+}
+
+static struct acceptor *acceptor_of(VALUE self)
+{
+	struct acceptor *acc;
+
+	Data_Get_Struct(self, struct acceptor, acc);
+	if (acc->listen_fd < 0)
+		rb_raise(rb_eIOError, "closed acceptor");
+	return acc;
+}
+
+static int new_efd(void)
+{
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fd < 0) {
+		rb_gc();
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			rb_sys_fail("eventfd");
+	}
+	rb_update_max_fd(fd);
+	return fd;
+}
+
+static void start_threads(struct acceptor *acc)
+{
+	sigset_t all, old;
+	int i, rc = 0;
+
+	/* signals must be handled by Ruby threads, not ours */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < acc->nthreads; i++) {
+		rc = pthread_create(&acc->threads[i], NULL,
+		                    acceptor_thread, acc);
+		if (rc)
+			break;
+		acc->running = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		acc->nthreads = i;
+		acceptor_release(acc);
+		errno = rc;
+		rb_sys_fail("pthread_create");
+	}
+}
+
+static void ring_init(struct ring *r, long cap)
+{
+	long i;
+
+	r->efd = new_efd();
+
+	/*
+	 * the threads write to efd until they are joined, so the IO
+	 * must not close it if it is closed or garbage-collected first
+	 */
+	r->io = rb_funcall(rb_cIO, id_for_fd, 1, INT2NUM(r->efd));
+	rb_funcall(r->io, id_autoclose_set, 1, Qfalse);
+	r->mask = (size_t)cap - 1;
+	r->slots = ALLOC_N(struct slot, cap);
+	for (i = 0; i < cap; i++)
+		r->slots[i].seq = (size_t)i;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Acceptor.new(server)				-> acceptor
+ *	Kgio::Acceptor.new(server, nthreads)			-> acceptor
+ *	Kgio::Acceptor.new(server, nthreads, ring_size)		-> acceptor
+ *	Kgio::Acceptor.new(server, nthreads, ring_size, per_cpu)	-> acceptor
+ *
+ * Starts +nthreads+ (default: 1) native threads accepting clients
+ * from +server+ (a Kgio::TCPServer or Kgio::UNIXServer) without the
+ * GVL.  Up to +ring_size+ (default: 1024, rounded up to a power of
+ * two) accepted clients are queued for Ruby; beyond that, clients
+ * are left in the listen queue until Ruby catches up.
+ *
+ * If +per_cpu+ is true, there is one queue per CPU and each client
+ * is queued for the CPU which received its packets according to
+ * SO_INCOMING_CPU (clients where this is unknown go to CPU 0).  The
+ * CPU is recorded at accept time and returned by
+ * Kgio::SocketMethods#kgio_incoming_cpu without another system call.
+ * Workers pinned to a CPU should pass it to to_io and kgio_tryaccept.
+ * NotImplementedError is raised if the system lacks SO_INCOMING_CPU.
+ *
+ * The listen socket is made non-blocking.  The acceptor should be
+ * closed before +server+ is.  Clients accepted here bypass
+ * kgio_proxy_protocol, but not kgio_admission.
+ */
+static VALUE acceptor_init(int argc, VALUE *argv, VALUE self)
+{
+	struct acceptor *acc;
+	VALUE server, nthreads, ring_size, per_cpu;
+	long n, size = 1024, cap = 1;
+	int fd, i;
+
+	Data_Get_Struct(self, struct acceptor, acc);
+	if (acc->listen_fd >= 0)
+		rb_raise(rb_eRuntimeError, "already initialized");
+	rb_scan_args(argc, argv, "13", &server, &nthreads, &ring_size,
+	             &per_cpu);
+	n = NIL_P(nthreads) ? 1 : NUM2LONG(nthreads);
+	if (n < 1 || n > 1024)
+		rb_raise(rb_eArgError, "nthreads must be between 1 and 1024");
+	if (!NIL_P(ring_size))
+		size = NUM2LONG(ring_size);
+	if (size < 1 || size > (1L << 20))
+		rb_raise(rb_eArgError, "ring_size must be between 1 and %ld",
+		         1L << 20);
+	while (cap < size)
+		cap <<= 1;
+#ifndef SO_INCOMING_CPU
+	if (RTEST(per_cpu))
+		rb_raise(rb_eNotImpError, "per-CPU queues need SO_INCOMING_CPU");
+#endif
+
+	fd = my_fileno(server);
+	set_nonblocking(fd);
+	fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+		rb_sys_fail("fcntl(F_DUPFD_CLOEXEC)");
+	acc->listen_fd = fd;
+	rb_update_max_fd(fd);
+	acc->server = server;
+	acc->stop_efd = new_efd();
+	acc->nthreads = (int)n;
+
+	acc->per_cpu = RTEST(per_cpu);
+	if (acc->per_cpu) {
+		long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+		acc->nrings = ncpu > 0 ? (int)ncpu : 1;
+	} else {
+		acc->nrings = 1;
+	}
+	acc->rings = ALLOC_N(struct ring, acc->nrings);
+	MEMZERO(acc->rings, struct ring, acc->nrings);
+	for (i = 0; i < acc->nrings; i++) {
+		acc->rings[i].io = Qnil;
+		acc->rings[i].efd = -1;
+	}
+	for (i = 0; i < acc->nrings; i++)
+		ring_init(&acc->rings[i], cap);
+	acc->threads = ALLOC_N(pthread_t, acc->nthreads);
+	start_threads(acc);
+	return self;
+}
+
+static struct ring *ring_of(struct acceptor *acc, VALUE cpu)
+{
+	long i;
+
+	if (NIL_P(cpu))
+		return acc->rings;
+	i = NUM2LONG(cpu);
+	if (i < 0 || i >= acc->nrings)
+		rb_raise(rb_eArgError, "cpu=%ld out of range (0...%d)",
+		         i, acc->nrings);
+	return &acc->rings[i];
+}
+
+/*
+ * call-seq:
+ *
+ *	acceptor.to_io		-> IO
+ *	acceptor.to_io(cpu)	-> IO
+ *
+ * Returns an IO object which is readable while clients are queued
+ * (for the given +cpu+ if per-CPU queues are used), suitable for
+ * IO.select and Kgio.poll.  Without per-CPU queues, the acceptor
+ * itself may be passed to Kgio.poll.  The IO does not own its
+ * descriptor, Kgio::Acceptor#close closes it.
+ */
+static VALUE acceptor_to_io(int argc, VALUE *argv, VALUE self)
+{
+	struct acceptor *acc = acceptor_of(self);
+	VALUE cpu;
+
+	rb_scan_args(argc, argv, "01", &cpu);
+	return ring_of(acc, cpu)->io;
+}
+
+/*
+ * call-seq:
+ *
+ *	acceptor.cpus	-> Integer
+ *
+ * Returns the number of per-CPU queues, or 1 if per-CPU queues
+ * are not used.
+ */
+static VALUE acceptor_cpus(VALUE self)
+{
+	return INT2NUM(acceptor_of(self)->nrings);
+}
+
+/*
+ * call-seq:
+ *
+ *	acceptor.kgio_tryaccept			-> [ Kgio::Socket, ... ] or nil
+ *	acceptor.kgio_tryaccept(max)		-> [ Kgio::Socket, ... ] or nil
+ *	acceptor.kgio_tryaccept(max, klass)	-> [ klass, ... ] or nil
+ *	acceptor.kgio_tryaccept(max, klass, cpu)	-> [ klass, ... ] or nil
+ *
+ * Returns an Array of up to +max+ (default: 64) clients accepted
+ * by the native threads, or nil if none are queued.  +klass+
+ * defaults to Kgio.accept_class and the kgio_addr attribute of each
+ * client is set as for Kgio::TCPServer#kgio_tryaccept.  With per-CPU
+ * queues, +cpu+ selects the queue to take clients from (default: 0).
+ */
+static VALUE acceptor_tryaccept(int argc, VALUE *argv, VALUE self)
+{
+	struct acceptor *acc = acceptor_of(self);
+	VALUE max, klass, cpu, rv = Qnil;
+	struct ring *r;
+	struct slot s;
+	uint64_t cnt;
+	long i, n;
+
+	rb_scan_args(argc, argv, "03", &max, &klass, &cpu);
+	n = NIL_P(max) ? 64 : NUM2LONG(max);
+	if (n <= 0)
+		rb_raise(rb_eArgError, "max must be positive");
+	r = ring_of(acc, cpu);
+
+	/* clear before draining, producers signal again after each push */
+	while (read(r->efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+		;
+	for (i = 0; i < n; i++) {
+		VALUE io, adm;
+
+		if (!ring_shift(r, &s))
+			break;
+		r->delivered++;
+		adm = kgio_admit(acc->server, s.fd,
+		                 (struct sockaddr *)&s.addr, s.addrlen);
+		if (adm == Qfalse)
+			continue;
+		if (NIL_P(rv))
+			rv = rb_ary_new();
+		io = kgio_admitted_new(adm, acc->server, klass, s.fd,
+		                       (struct sockaddr *)&s.addr, s.addrlen);
+		if (s.cpu >= 0)
+			rb_ivar_set(io, iv_kgio_incoming_cpu, INT2FIX(s.cpu));
+		rb_ary_push(rv, io);
+	}
+	/* stay readable for whatever we left behind */
+	if (i == n && !ring_empty(r))
+		efd_signal(r->efd);
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	acceptor.stats	-> Hash
+ *
+ * Returns counters for this acceptor, summed over all queues:
+ *
+ * - :accepted - clients accepted by the native threads
+ * - :delivered - clients taken from the queues by kgio_tryaccept
+ * - :queued - clients waiting in the queues
+ */
+static VALUE acceptor_stats(VALUE self)
+{
+	struct acceptor *acc = acceptor_of(self);
+	unsigned long accepted = 0, delivered = 0;
+	VALUE rv = rb_hash_new();
+	int i;
+
+	for (i = 0; i < acc->nrings; i++) {
+		accepted += LOAD(&acc->rings[i].accepted, RELAXED);
+		delivered += acc->rings[i].delivered;
+	}
+	rb_hash_aset(rv, sym_accepted, ULONG2NUM(accepted));
+	rb_hash_aset(rv, sym_delivered, ULONG2NUM(delivered));
+	rb_hash_aset(rv, sym_queued, ULONG2NUM(accepted - delivered));
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	acceptor.close	-> nil
+ *
+ * Stops the native threads and closes any clients still queued.
+ * This does not close the server.  Closing an acceptor which is
+ * already closed (or being closed by another thread) does nothing.
+ */
+static VALUE acceptor_close(VALUE self)
+{
+	struct acceptor *acc;
+	int i;
+
+	Data_Get_Struct(self, struct acceptor, acc);
+	if (acc->listen_fd < 0)
+		return Qnil;
+	acceptor_release(acc);
+	for (i = 0; i < acc->nrings; i++)
+		rb_io_close(acc->rings[i].io);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	acceptor.closed?	-> true or false
+ */
+static VALUE acceptor_closed_p(VALUE self)
+{
+	struct acceptor *acc;
+
+	Data_Get_Struct(self, struct acceptor, acc);
+	return acc->listen_fd < 0 ? Qtrue : Qfalse;
+}
+
+void init_kgio_acceptor(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+
+	id_for_fd = rb_intern("for_fd");
+	id_autoclose_set = rb_intern("autoclose=");
+	iv_kgio_incoming_cpu = rb_intern("@kgio_incoming_cpu");
+	sym_accepted = ID2SYM(rb_intern("accepted"));
+	sym_delivered = ID2SYM(rb_intern("delivered"));
+	sym_queued = ID2SYM(rb_intern("queued"));
+
+	/*
+	 * Document-class: Kgio::Acceptor
+	 *
+	 * Accepts clients of a listening socket on native threads
+	 * running without the GVL, for servers where Ruby threads
+	 * reacquiring the GVL after every accept is a bottleneck.
+	 *
+	 *	acceptor = Kgio::Acceptor.new(server, 2)
+	 *	loop do
+	 *	  Kgio.poll({ acceptor => Kgio::POLLIN })
+	 *	  clients = acceptor.kgio_tryaccept or next
+	 *	  clients.each { |c| ... }
+	 *	end
+	 */
+	cAcceptor = rb_define_class_under(mKgio, "Acceptor", rb_cObject);
+	rb_define_alloc_func(cAcceptor, acceptor_alloc);
+	rb_define_method(cAcceptor, "initialize", acceptor_init, -1);
+	rb_define_method(cAcceptor, "to_io", acceptor_to_io, -1);
+	rb_define_method(cAcceptor, "cpus", acceptor_cpus, 0);
+	rb_define_method(cAcceptor, "kgio_tryaccept", acceptor_tryaccept, -1);
+	rb_define_method(cAcceptor, "stats", acceptor_stats, 0);
+	rb_define_method(cAcceptor, "close", acceptor_close, 0);
+	rb_define_method(cAcceptor, "closed?", acceptor_closed_p, 0);
+}
+#else /* !eventfd || !pthreads || !atomics */
+void init_kgio_acceptor(void)
+{
+}
+#endif
@@ -0,0 +1,549 @@
+/*
+ * Admission control for accepted connections.  A Kgio::Admission
+ * object holds a token bucket per peer address and a cap on
+ * concurrently admitted connections.  Servers consult it right
+ * after accept(), so rejected clients are closed before any Ruby
+ * object is allocated for them.
+ *
+ * Slots held by admitted clients are tracked by descriptor and the
+ * identity (st_dev/st_ino) of the socket behind it, so a slot is
+ * given back whenever its socket is closed, however that happens
+ * (IO#close, garbage collection, or another IO sharing the
+ * descriptor).  Closed sockets are noticed lazily, when the cap is
+ * reached or the stats are read.
+ *
+ * All of the state here is protected by the GVL.
+ */
+#include "kgio.h"
+#include <time.h>
+#include <sys/stat.h>
+#include "my_fileno.h"
+#include "broken_system_compat.h"
+
+/* must be a power-of-two */
+#define BUCKET_TABLE_SIZE 4096
+#define BUCKET_PROBES 4
+
+struct bucket {
+	unsigned char key[16];
+	double tokens;
+	double last; /* 0 means unused */
+};
+
+/* identifies the socket an admitted descriptor referred to */
+struct slot {
+	dev_t dev;
+	ino_t ino; /* 0 means unused */
+};
+
+struct admission {
+	double rate;
+	double burst;
+	unsigned long max_conns; /* 0: unlimited */
+	unsigned long active; /* used entries in slots */
+	struct slot *slots; /* indexed by descriptor */
+	long nr_slots;
+	unsigned long admitted;
+	unsigned long rate_limited;
+	unsigned long over_capacity;
+	unsigned long seed;
+	struct bucket table[BUCKET_TABLE_SIZE];
+};
+
+static VALUE cAdmission;
+static ID id_admission, id_admitted, id_admission_pending;
+static VALUE sym_admitted, sym_rate_limited, sym_over_capacity, sym_active;
+
+static double now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/*
+ * flattens the peer address into a 16-byte key, IPv4 addresses are
+ * mapped into IPv6 and IPv6 addresses are truncated to their /64
+ * prefix since a single client usually controls an entire /64.
+ * Returns false for non-IP addresses (which have no per-peer limits)
+ */
+static int
+addr_key(unsigned char key[16], const struct sockaddr *addr, socklen_t len)
+{
+	if (!addr)
+		return 0;
+
+	memset(key, 0, 16);
+	switch (addr->sa_family) {
+	case AF_INET:
+		if (len < sizeof(struct sockaddr_in))
+			return 0;
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12,
+		       &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		return 1;
+	case AF_INET6:
+		if (len < sizeof(struct sockaddr_in6))
+			return 0;
+		memcpy(key,
+		       &((const struct sockaddr_in6 *)addr)->sin6_addr, 8);
+		return 1;
+	}
+	return 0;
+}
+
+/* FNV-1a */
+static unsigned long
+key_hash(const struct admission *adm, const unsigned char key[16])
+{
+	unsigned long h = 2166136261UL ^ adm->seed;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		h ^= key[i];
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+/*
+ * finds the bucket for +key+, the least recently used of the probed
+ * slots is recycled if none match
+ */
+static struct bucket *
+bucket_for(struct admission *adm, const unsigned char key[16], double now)
+{
+	unsigned long h = key_hash(adm, key);
+	struct bucket *b, *victim = NULL;
+	int i;
+
+	for (i = 0; i < BUCKET_PROBES; i++) {
+		b = &adm->table[(h + i) & (BUCKET_TABLE_SIZE - 1)];
+		if (b->last != 0 && memcmp(b->key, key, 16) == 0)
+			return b;
+		if (!victim || b->last < victim->last)
+			victim = b;
+	}
+	memcpy(victim->key, key, 16);
+	victim->tokens = adm->burst;
+	victim->last = now;
+	return victim;
+}
+
+static int take_token(struct admission *adm, const unsigned char key[16])
+{
+	double now = now_sec();
+	struct bucket *b = bucket_for(adm, key, now);
+
+	b->tokens += (now - b->last) * adm->rate;
+	if (b->tokens > adm->burst)
+		b->tokens = adm->burst;
+	b->last = now;
+	if (b->tokens < 1.0)
+		return 0;
+	b->tokens -= 1.0;
+	return 1;
+}
+
+static struct admission *admission_of(VALUE self)
+{
+	struct admission *adm;
+
+	Data_Get_Struct(self, struct admission, adm);
+	return adm;
+}
+
+static int slot_stat(int fd, struct slot *id)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return 0;
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	return id->ino != 0;
+}
+
+/* takes a slot for the newly admitted +fd+ */
+static void slot_take(struct admission *adm, int fd)
+{
+	struct slot id;
+	struct slot *s;
+
+	if (!slot_stat(fd, &id))
+		return; /* cannot be tracked, so it is not counted */
+	if (fd >= adm->nr_slots) {
+		long n = adm->nr_slots ? adm->nr_slots : 64;
+
+		while (n <= fd)
+			n *= 2;
+		REALLOC_N(adm->slots, struct slot, n);
+		memset(adm->slots + adm->nr_slots, 0,
+		       (n - adm->nr_slots) * sizeof(struct slot));
+		adm->nr_slots = n;
+	}
+	s = &adm->slots[fd];
+
+	/* accept returned +fd+, so whatever held it before was closed */
+	if (s->ino == 0)
+		adm->active++;
+	*s = id;
+}
+
+static void slot_drop(struct admission *adm, int fd)
+{
+	if (fd < adm->nr_slots && adm->slots[fd].ino != 0) {
+		adm->slots[fd].ino = 0;
+		adm->active--;
+	}
+}
+
+/* gives back the slots of every admitted socket which was closed */
+static void slots_reap(struct admission *adm)
+{
+	struct slot id;
+	long fd;
+
+	for (fd = 0; fd < adm->nr_slots && adm->active > 0; fd++) {
+		struct slot *s = &adm->slots[fd];
+
+		if (s->ino == 0)
+			continue;
+		if (!slot_stat((int)fd, &id) ||
+		    id.ino != s->ino || id.dev != s->dev)
+			slot_drop(adm, (int)fd);
+	}
+}
+
+static int at_capacity(struct admission *adm)
+{
+	if (!adm->max_conns || adm->active < adm->max_conns)
+		return 0;
+	slots_reap(adm);
+	return adm->active >= adm->max_conns;
+}
+
+/*
+ * admits +fd+ connected to the peer at +addr+ under +adm+, returns
+ * false if it is rejected
+ */
+static int admit(struct admission *adm, int fd,
+                 const struct sockaddr *addr, socklen_t len)
+{
+	unsigned char key[16];
+
+	if (at_capacity(adm)) {
+		adm->over_capacity++;
+		return 0;
+	}
+	if (adm->rate > 0 && addr_key(key, addr, len) &&
+	    !take_token(adm, key)) {
+		adm->rate_limited++;
+		return 0;
+	}
+	slot_take(adm, fd);
+	adm->admitted++;
+	return 1;
+}
+
+/*
+ * called by accept with the newly accepted descriptor before any Ruby
+ * object is created for it.  Returns Qfalse if the connection was
+ * rejected, in which case +fd+ is already closed.  Otherwise returns
+ * the policy which admitted it (or nil if there is none), to be
+ * passed to kgio_admitted_new.
+ */
+VALUE
+kgio_admit(VALUE srv, int fd, const struct sockaddr *addr, socklen_t len)
+{
+	VALUE val = rb_attr_get(srv, id_admission);
+
+	if (NIL_P(val))
+		return Qnil;
+	if (admit(admission_of(val), fd, addr, len))
+		return val;
+	(void)close(fd);
+	return Qfalse;
+}
+
+struct client_args {
+	VALUE srv;
+	VALUE klass;
+	int fd;
+	struct sockaddr *addr;
+	socklen_t addrlen;
+};
+
+static VALUE client_new(VALUE ptr)
+{
+	struct client_args *a = (struct client_args *)ptr;
+
+	return kgio_client_new(a->srv, a->klass, a->fd, a->addr, a->addrlen);
+}
+
+/*
+ * kgio_client_new for a descriptor admitted by +val+ (the return value
+ * of kgio_admit), the admission is undone if the client object cannot
+ * be created
+ */
+VALUE kgio_admitted_new(VALUE val, VALUE srv, VALUE klass, int fd,
+                        struct sockaddr *addr, socklen_t addrlen)
+{
+	struct client_args a;
+	struct admission *adm;
+	VALUE io;
+	int state;
+
+	if (NIL_P(val))
+		return kgio_client_new(srv, klass, fd, addr, addrlen);
+	a.srv = srv;
+	a.klass = klass;
+	a.fd = fd;
+	a.addr = addr;
+	a.addrlen = addrlen;
+	io = rb_protect(client_new, (VALUE)&a, &state);
+	if (state) {
+		adm = admission_of(val);
+		slot_drop(adm, fd);
+		adm->admitted--;
+		rb_jump_tag(state);
+	}
+	rb_ivar_set(io, id_admitted, val);
+	return io;
+}
+
+/*
+ * called by accept instead of kgio_admit for clients whose PROXY
+ * header is still pending, admission waits for the real address
+ * (see kgio_admission_resume)
+ */
+void kgio_admission_defer(VALUE srv, VALUE io)
+{
+	VALUE val = rb_attr_get(srv, id_admission);
+
+	if (!NIL_P(val))
+		rb_ivar_set(io, id_admission_pending, val);
+}
+
+/*
+ * admits +io+ deferred by kgio_admission_defer now that the real
+ * client address is known, +addrlen+ is zero if the proxy did not
+ * send one.  Returns false if +io+ was rejected, the caller closes it.
+ */
+int kgio_admission_resume(VALUE io, struct sockaddr_storage *addr,
+                          socklen_t addrlen)
+{
+	VALUE val = rb_attr_get(io, id_admission_pending);
+	int fd;
+
+	if (NIL_P(val))
+		return 1;
+	rb_ivar_set(io, id_admission_pending, Qnil);
+	fd = my_fileno(io);
+	if (!addrlen) {
+		addrlen = sizeof(struct sockaddr_storage);
+		if (getpeername(fd, (struct sockaddr *)addr, &addrlen) != 0)
+			addrlen = 0;
+	}
+	if (!admit(admission_of(val), fd, (struct sockaddr *)addr, addrlen))
+		return 0;
+	rb_ivar_set(io, id_admitted, val);
+	return 1;
+}
+
+/*
+ * gives back the slot held by +io+ if it was admitted by a policy
+ * and has not given it back already, and forgets any deferred
+ * admission
+ */
+void kgio_admission_done(VALUE io)
+{
+	VALUE val = rb_attr_get(io, id_admitted);
+
+	if (rb_ivar_defined(io, id_admission_pending))
+		rb_ivar_set(io, id_admission_pending, Qnil);
+	if (!NIL_P(val)) {
+		struct admission *adm = admission_of(val);
+		struct slot id;
+		rb_io_t *fptr = RFILE(io)->fptr;
+		int fd = fptr ? FPTR_TO_FD(fptr) : -1;
+
+		rb_ivar_set(io, id_admitted, Qnil);
+
+		/* closed sockets are left to slots_reap */
+		if (fd >= 0 && fd < adm->nr_slots && slot_stat(fd, &id) &&
+		    adm->slots[fd].ino == id.ino &&
+		    adm->slots[fd].dev == id.dev)
+			slot_drop(adm, fd);
+	}
+}
+
+static void admission_free(void *ptr)
+{
+	struct admission *adm = ptr;
+
+	xfree(adm->slots);
+	xfree(adm);
+}
+
+static VALUE admission_alloc(VALUE klass)
+{
+	struct admission *adm;
+	VALUE self = Data_Make_Struct(klass, struct admission,
+	                              NULL, admission_free, adm);
+
+	memset(adm, 0, sizeof(struct admission));
+	adm->seed = (unsigned long)getpid() ^ (unsigned long)adm;
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Admission.new(rate, burst)		-> admission
+ *	Kgio::Admission.new(rate, burst, max_conns)	-> admission
+ *
+ * Creates a new admission policy allowing each peer address to open
+ * +rate+ connections per second, with bursts of up to +burst+
+ * connections.  IPv6 peers are grouped by their /64 prefix.  A +rate+
+ * of zero or +nil+ disables per-peer limits.
+ *
+ * If +max_conns+ is given, no more than +max_conns+ admitted
+ * connections may be active at once; each connection counts
+ * until its socket is closed (explicitly, by kgio_release or by
+ * the garbage collector), or until Kgio::Admission#release is
+ * called for it.
+ *
+ * With kgio_proxy_protocol enabled, clients whose PROXY header has not
+ * fully arrived at accept time are admitted by kgio_tryproxy once the
+ * header is parsed, so they are limited by their real address.
+ *
+ * Use Kgio::TCPServer#kgio_admission= to attach a policy to one
+ * or more servers.
+ */
+static VALUE admission_init(int argc, VALUE *argv, VALUE self)
+{
+	struct admission *adm = admission_of(self);
+	VALUE rate, burst, max_conns;
+
+	rb_scan_args(argc, argv, "21", &rate, &burst, &max_conns);
+	adm->rate = NIL_P(rate) ? 0 : NUM2DBL(rate);
+	adm->burst = NUM2DBL(burst);
+	if (adm->rate > 0 && adm->burst < 1.0)
+		rb_raise(rb_eArgError, "burst must be at least 1");
+	if (!NIL_P(max_conns)) {
+		long n = NUM2LONG(max_conns);
+
+		if (n <= 0)
+			rb_raise(rb_eArgError, "max_conns must be positive");
+		adm->max_conns = (unsigned long)n;
+	}
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	admission.release(io)	-> admission
+ *
+ * Marks the connection admitted for +io+ as finished while +io+ stays
+ * open, allowing another to be admitted when +max_conns+ is in effect.
+ * Closing +io+ does this automatically, and releasing the same +io+
+ * again, a closed +io+ or a socket admitted by another policy does
+ * nothing.
+ */
+static VALUE admission_release(VALUE self, VALUE io)
+{
+	if (rb_attr_get(io, id_admitted) == self)
+		kgio_admission_done(io);
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	admission.stats	-> Hash
+ *
+ * Returns a hash of counters for this policy:
+ *
+ * - :admitted - connections admitted
+ * - :rate_limited - connections closed for exceeding the peer rate
+ * - :over_capacity - connections closed for exceeding +max_conns+
+ * - :active - admitted connections not yet closed or released
+ */
+static VALUE admission_stats(VALUE self)
+{
+	struct admission *adm = admission_of(self);
+	VALUE rv = rb_hash_new();
+
+	slots_reap(adm);
+	rb_hash_aset(rv, sym_admitted, ULONG2NUM(adm->admitted));
+	rb_hash_aset(rv, sym_rate_limited, ULONG2NUM(adm->rate_limited));
+	rb_hash_aset(rv, sym_over_capacity, ULONG2NUM(adm->over_capacity));
+	rb_hash_aset(rv, sym_active, ULONG2NUM(adm->active));
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_admission = admission
+ *	srv.kgio_admission = nil
+ *
+ * Attaches a Kgio::Admission policy to this server.  Clients rejected
+ * by the policy are closed inside kgio_accept and kgio_tryaccept
+ * before any Ruby object is created for them, and the accept
+ * continues with the next pending client.  A policy may be shared
+ * by several servers.
+ */
+static VALUE set_admission(VALUE srv, VALUE val)
+{
+	if (!NIL_P(val) && rb_obj_is_kind_of(val, cAdmission) != Qtrue)
+		rb_raise(rb_eTypeError, "not a Kgio::Admission");
+	rb_ivar_set(srv, id_admission, val);
+	return val;
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_admission	-> admission or nil
+ *
+ * Returns the Kgio::Admission policy attached to this server
+ */
+static VALUE get_admission(VALUE srv)
+{
+	return rb_attr_get(srv, id_admission);
+}
+
+void init_kgio_admission(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cTCPServer = rb_const_get(mKgio, rb_intern("TCPServer"));
+
+	check_clock();
+	/* hidden from Ruby so it can only hold a Kgio::Admission */
+	id_admission = rb_intern("kgio_admission");
+	id_admitted = rb_intern("kgio_admitted");
+	id_admission_pending = rb_intern("kgio_admission_pending");
+	sym_admitted = ID2SYM(rb_intern("admitted"));
+	sym_rate_limited = ID2SYM(rb_intern("rate_limited"));
+	sym_over_capacity = ID2SYM(rb_intern("over_capacity"));
+	sym_active = ID2SYM(rb_intern("active"));
+
+	/*
+	 * Document-class: Kgio::Admission
+	 *
+	 * A native per-peer rate limit and connection cap which
+	 * Kgio::TCPServer consults before creating client sockets.
+	 */
+	cAdmission = rb_define_class_under(mKgio, "Admission", rb_cObject);
+	rb_define_alloc_func(cAdmission, admission_alloc);
+	rb_define_method(cAdmission, "initialize", admission_init, -1);
+	rb_define_method(cAdmission, "release", admission_release, 1);
+	rb_define_method(cAdmission, "stats", admission_stats, 0);
+
+	rb_define_method(cTCPServer, "kgio_admission=", set_admission, 1);
+	rb_define_method(cTCPServer, "kgio_admission", get_admission, 0);
+}
@@ -0,0 +1,280 @@
+/*
+ * Passing descriptors over UNIX sockets with SCM_RIGHTS, many at a
+ * time.  Intended for handing accepted clients and listeners between
+ * a master and its workers, or across hot restarts, without paying
+ * for one UNIXSocket#send_io call (and one message) per descriptor.
+ */
+#include "kgio.h"
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "my_fileno.h"
+#include "nonblock.h"
+
+/* SCM_MAX_FD in the Linux kernel, other systems are similar or higher */
+#define FDPASS_MAX 253
+
+#ifndef MSG_CMSG_CLOEXEC
+#  define MSG_CMSG_CLOEXEC 0
+#endif
+
+union fdpass_cmsg {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int) * FDPASS_MAX)];
+};
+
+static VALUE sym_wait_readable, sym_wait_writable;
+#ifndef HAVE_RB_STR_SUBSEQ
+#define rb_str_subseq rb_str_substr
+#endif
+static VALUE cTCPServer, cUNIXServer;
+static ID id_for_fd;
+
+/*
+ * call-seq:
+ *
+ *	sock.kgio_trysendmsg(data, ios)	-> nil, String or :wait_writable
+ *
+ * Sends +data+ along with the descriptors of every IO object in the
+ * +ios+ Array as a single message.  The receiving process gets its
+ * own copies of the descriptors, so +ios+ may be closed as soon as
+ * this returns anything but :wait_writable.  Up to 253 descriptors may
+ * be passed at once, and +data+ may not be empty if +ios+ is not.
+ *
+ * Returns nil if the message was sent in full.
+ *
+ * Returns a String containing the unsent portion of +data+ if EAGAIN
+ * was encountered after sending some of it.  The descriptors were
+ * already sent with the first portion, so the remainder should be
+ * sent with an empty +ios+ Array (or kgio_trywrite).
+ *
+ * Returns :wait_writable if EAGAIN is encountered and nothing
+ * was sent.
+ */
+static VALUE kgio_trysendmsg(VALUE io, VALUE data, VALUE ios)
+{
+	union fdpass_cmsg cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	long i, nfds;
+	ssize_t n;
+	int fd;
+
+	StringValue(data);
+	ios = rb_convert_type(ios, T_ARRAY, "Array", "to_ary");
+	nfds = RARRAY_LEN(ios);
+	if (nfds > FDPASS_MAX)
+		rb_raise(rb_eArgError, "too many IOs (%ld > %d)",
+		         nfds, FDPASS_MAX);
+	if (nfds > 0 && RSTRING_LEN(data) == 0)
+		rb_raise(rb_eArgError, "data must not be empty with IOs");
+
+	memset(&msg, 0, sizeof(msg));
+	if (nfds > 0) {
+		int *fds = (int *)CMSG_DATA(&cmsg.hdr);
+
+		memset(&cmsg, 0, sizeof(cmsg));
+		for (i = 0; i < nfds; i++)
+			fds[i] = my_fileno(rb_ary_entry(ios, i));
+		cmsg.hdr.cmsg_level = SOL_SOCKET;
+		cmsg.hdr.cmsg_type = SCM_RIGHTS;
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	}
+	fd = my_fileno(io);
+	set_nonblocking(fd);
+retry:
+	iov.iov_base = RSTRING_PTR(data);
+	iov.iov_len = RSTRING_LEN(data);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	n = sendmsg(fd, &msg, 0);
+	if (n < 0) {
+		if (errno == EINTR) {
+			fd = my_fileno(io);
+			goto retry;
+		}
+		if (errno == EAGAIN)
+			return sym_wait_writable;
+		rb_sys_fail("sendmsg");
+	}
+	if (n == RSTRING_LEN(data))
+		return Qnil;
+	return rb_str_subseq(data, n, RSTRING_LEN(data) - n);
+}
+
+/*
+ * wraps a descriptor received from another process: listeners become
+ * Kgio::TCPServer or Kgio::UNIXServer, other sockets are wrapped like
+ * newly accepted clients and anything else becomes a plain IO
+ */
+static VALUE fd_wrap(VALUE io, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	struct stat st;
+	int listening = 0;
+	socklen_t len = sizeof(listening);
+
+	if (fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return rb_funcall(rb_cIO, id_for_fd, 1, INT2NUM(fd));
+
+#ifdef SO_ACCEPTCONN
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0)
+		listening = 0;
+#endif
+	if (listening && getsockname(fd, (struct sockaddr *)&addr,
+	                             &addrlen) == 0) {
+		switch (addr.ss_family) {
+		case AF_INET:
+		case AF_INET6:
+			return kgio_sock_for_fd(cTCPServer, fd);
+		case AF_UNIX:
+			return kgio_sock_for_fd(cUNIXServer, fd);
+		}
+	}
+	addrlen = sizeof(addr);
+	if (getpeername(fd, (struct sockaddr *)&addr, &addrlen) < 0)
+		addrlen = 0;
+	return kgio_client_new(io, Qnil, fd,
+	                       addrlen ? (struct sockaddr *)&addr : NULL,
+	                       addrlen);
+}
+
+struct wrap_args {
+	VALUE io;
+	VALUE ios;
+	int *fds;
+	long nfds;
+	long i;
+};
+
+static VALUE wrap_all(VALUE ptr)
+{
+	struct wrap_args *w = (struct wrap_args *)ptr;
+
+	while (w->i < w->nfds) {
+		int fd = w->fds[w->i++];
+
+		rb_ary_push(w->ios, fd_wrap(w->io, fd));
+	}
+	return w->ios;
+}
+
+/*
+ * call-seq:
+ *
+ *	sock.kgio_tryrecvmsg(maxlen, maxfds)	-> [ data, ios ]
+ *	sock.kgio_tryrecvmsg(maxlen, maxfds)	-> nil
+ *	sock.kgio_tryrecvmsg(maxlen, maxfds)	-> :wait_readable
+ *
+ * Receives a message of at most +maxlen+ bytes together with up to
+ * +maxfds+ (at most 253) descriptors sent by kgio_trysendmsg or
+ * UNIXSocket#send_io.  Returns a two-element Array with the data and
+ * an Array of IO objects for the received descriptors, which is empty
+ * if the message carried none.  Descriptors beyond +maxfds+ are
+ * discarded by the kernel.
+ *
+ * Received listening sockets are Kgio::TCPServer or Kgio::UNIXServer
+ * objects, other sockets are wrapped like accepted clients, in
+ * instances of Kgio.accept_class with kgio_addr set to their peer.
+ * Other descriptors are returned as IO objects.  All of them have
+ * close-on-exec set where supported.
+ *
+ * Returns nil on EOF and :wait_readable if nothing is available.
+ */
+static VALUE kgio_tryrecvmsg(VALUE io, VALUE maxlen, VALUE maxfds)
+{
+	union fdpass_cmsg cmsg;
+	struct cmsghdr *hdr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct wrap_args w;
+	int fds[FDPASS_MAX];
+	long i, len = NUM2LONG(maxlen);
+	int nfds = NUM2INT(maxfds);
+	VALUE buf, ios;
+	ssize_t n;
+	int fd, state = 0;
+
+	if (len <= 0)
+		rb_raise(rb_eArgError, "maxlen must be positive");
+	if (nfds < 0 || nfds > FDPASS_MAX)
+		rb_raise(rb_eArgError, "maxfds must be between 0 and %d",
+		         FDPASS_MAX);
+
+	buf = rb_str_new(NULL, len);
+	fd = my_fileno(io);
+	set_nonblocking(fd);
+retry:
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = RSTRING_PTR(buf);
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		msg.msg_control = cmsg.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	}
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0) {
+		if (errno == EINTR) {
+			fd = my_fileno(io);
+			goto retry;
+		}
+		if (errno == EAGAIN)
+			return sym_wait_readable;
+		rb_sys_fail("recvmsg");
+	}
+
+	w.nfds = 0;
+	for (hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr)) {
+		const unsigned char *data = CMSG_DATA(hdr);
+		long count;
+
+		if (hdr->cmsg_level != SOL_SOCKET ||
+		    hdr->cmsg_type != SCM_RIGHTS)
+			continue;
+		count = (hdr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < count && w.nfds < FDPASS_MAX; i++)
+			memcpy(&fds[w.nfds++], data + i * sizeof(int),
+			       sizeof(int));
+	}
+	for (i = 0; i < w.nfds; i++) {
+		rb_update_max_fd(fds[i]);
+		if (!MSG_CMSG_CLOEXEC)
+			rb_fd_fix_cloexec(fds[i]);
+	}
+
+	/* do not leak the rest if wrapping one of them raises */
+	w.io = io;
+	w.ios = rb_ary_new();
+	w.fds = fds;
+	w.i = 0;
+	rb_protect(wrap_all, (VALUE)&w, &state);
+	if (state) {
+		while (w.i < w.nfds)
+			(void)close(fds[w.i++]);
+		rb_jump_tag(state);
+	}
+	ios = w.ios;
+	if (n == 0 && RARRAY_LEN(ios) == 0)
+		return Qnil;
+	rb_str_set_len(buf, n);
+	return rb_assoc_new(buf, ios);
+}
+
+void init_kgio_fdpass(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cUNIXSocket = rb_const_get(mKgio, rb_intern("UNIXSocket"));
+
+	cTCPServer = rb_const_get(mKgio, rb_intern("TCPServer"));
+	cUNIXServer = rb_const_get(mKgio, rb_intern("UNIXServer"));
+	id_for_fd = rb_intern("for_fd");
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+	sym_wait_writable = ID2SYM(rb_intern("wait_writable"));
+
+	rb_define_method(cUNIXSocket, "kgio_trysendmsg", kgio_trysendmsg, 2);
+	rb_define_method(cUNIXSocket, "kgio_tryrecvmsg", kgio_tryrecvmsg, 2);
+}
@@ -0,0 +1,121 @@
+/*
+ * Kgio::Notifier wraps an eventfd(2) counter so another thread (or a
+ * native one) can wake up a thread blocked in Kgio.poll with a single
+ * write(2), without the second descriptor or the buffered bytes of a
+ * self-pipe.  Notifications made before the waiter drains the counter
+ * coalesce into one wakeup.
+ */
+#include "kgio.h"
+#if defined(HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#include "my_fileno.h"
+
+static VALUE sym_wait_readable, sym_wait_writable;
+
+/*
+ * call-seq:
+ *
+ *	Kgio::Notifier.new	-> notifier
+ *
+ * Creates a new notifier with its counter at zero.  Notifiers are
+ * IO objects, so they may be used as keys for Kgio.poll and IO.select
+ * and must be closed like any other IO.
+ */
+static VALUE notifier_init(VALUE self)
+{
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	VALUE arg;
+
+	if (fd < 0) {
+		rb_gc();
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			rb_sys_fail("eventfd");
+	}
+	rb_update_max_fd(fd);
+	arg = INT2NUM(fd);
+	return rb_call_super(1, &arg);
+}
+
+/*
+ * call-seq:
+ *
+ *	notifier.notify		-> nil or :wait_writable
+ *	notifier.notify(n)	-> nil or :wait_writable
+ *
+ * Adds +n+ (default: 1) to the counter, making the notifier readable.
+ * Returns +nil+ on success and :wait_writable only if the counter
+ * would overflow because nobody drains it.
+ */
+static VALUE notifier_notify(int argc, VALUE *argv, VALUE self)
+{
+	VALUE n;
+	uint64_t val;
+	int fd = my_fileno(self);
+
+	rb_scan_args(argc, argv, "01", &n);
+	val = NIL_P(n) ? 1 : NUM2ULL(n);
+	if (val == 0 || val == ~(uint64_t)0)
+		rb_raise(rb_eRangeError, "notify count out of range");
+	while (write(fd, &val, sizeof(val)) < 0) {
+		if (errno == EAGAIN)
+			return sym_wait_writable;
+		if (errno != EINTR)
+			rb_sys_fail("write");
+	}
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *
+ *	notifier.trydrain	-> Integer or :wait_readable
+ *
+ * Resets the counter to zero and returns the sum of the counts
+ * notified since the last drain.  Returns :wait_readable if there
+ * were no notifications.
+ */
+static VALUE notifier_trydrain(VALUE self)
+{
+	uint64_t val;
+	int fd = my_fileno(self);
+
+	while (read(fd, &val, sizeof(val)) < 0) {
+		if (errno == EAGAIN)
+			return sym_wait_readable;
+		if (errno != EINTR)
+			rb_sys_fail("read");
+	}
+	return ULL2NUM(val);
+}
+
+void init_kgio_notifier(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE cNotifier;
+
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+	sym_wait_writable = ID2SYM(rb_intern("wait_writable"));
+
+	/*
+	 * Document-class: Kgio::Notifier
+	 *
+	 * A cross-thread wakeup using one eventfd(2) descriptor:
+	 *
+	 *	notifier = Kgio::Notifier.new
+	 *	Thread.new { jobs << job; notifier.notify }
+	 *	ready = Kgio.poll({ notifier => :wait_readable, ... })
+	 *	notifier.trydrain if ready.include?(notifier)
+	 *
+	 * This class is only available on Linux.
+	 */
+	cNotifier = rb_define_class_under(mKgio, "Notifier", rb_cIO);
+	rb_define_method(cNotifier, "initialize", notifier_init, 0);
+	rb_define_method(cNotifier, "notify", notifier_notify, -1);
+	rb_define_method(cNotifier, "trydrain", notifier_trydrain, 0);
+}
+#else /* !HAVE_SYS_EVENTFD_H */
+void init_kgio_notifier(void)
+{
+}
+#endif /* !HAVE_SYS_EVENTFD_H */
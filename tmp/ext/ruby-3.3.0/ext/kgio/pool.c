@@ -0,0 +1,189 @@
+/*
+ * Opt-in recycling of client socket objects.  Sockets explicitly
+ * released with kgio_release are kept in a per-class pool and re-armed
+ * with the next accepted descriptor, so steady-state accept needs no
+ * new Ruby objects.
+ *
+ * All of the state here is protected by the GVL.
+ */
+#include "kgio.h"
+#include "sock_for_fd.h"
+
+static long pool_max;
+static long pooled;
+static unsigned long allocated, reused, released;
+static VALUE pool; /* { klass => [ io, ... ] } */
+static ID iv_kgio_addr, iv_kgio_sockaddr, iv_kgio_incoming_cpu;
+static ID id_proxy_pending, id_sniff_pending, id_deadline;
+static VALUE sym_allocated, sym_reused, sym_released, sym_pooled;
+
+/*
+ * called by accept in place of sock_for_fd, takes a socket from the
+ * pool for +klass+ if there is one
+ */
+VALUE kgio_sock_for_fd(VALUE klass, int fd)
+{
+#if SOCK_FOR_FD == 19
+	if (pooled > 0) {
+		VALUE ary = rb_hash_lookup(pool, klass);
+
+		if (!NIL_P(ary) && RARRAY_LEN(ary) > 0) {
+			pooled--;
+			reused++;
+			return sock_set_fd(rb_ary_pop(ary), fd);
+		}
+	}
+#endif /* SOCK_FOR_FD == 19 */
+	allocated++;
+	return sock_for_fd(klass, fd);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_release	-> true or false
+ *
+ * Closes the socket and hands the object back to kgio so a later
+ * kgio_accept or kgio_tryaccept for the same class may reuse it for
+ * a new client.  Returns +true+ if the object was pooled, +false+ if
+ * it was only closed (pooling is disabled or the pool is full).
+ *
+ * The object must not be used in any way after it is released,
+ * since it may already represent another client.  Only the kgio_addr,
+ * kgio_sockaddr, kgio_incoming_cpu, kgio_proxy_pending?,
+ * kgio_sniff_pending? and kgio_deadline attributes, the autopush
+ * (TCP_CORK/TCP_NOPUSH) state and any Kgio::Admission slot are reset,
+ * applications subclassing Kgio::Socket are responsible for any of
+ * their own state.
+ * Objects with singleton methods and frozen objects are never pooled.
+ *
+ * See Kgio.socket_pool_max=
+ */
+static VALUE kgio_release(VALUE io)
+{
+#if SOCK_FOR_FD == 19
+	VALUE klass, ary;
+
+	kgio_admission_done(io);
+	rb_io_close(io);
+	if (pooled >= pool_max || OBJ_FROZEN(io))
+		return Qfalse;
+	klass = rb_obj_class(io);
+	if (CLASS_OF(io) != klass)
+		return Qfalse;
+
+	rb_ivar_set(io, iv_kgio_addr, Qnil);
+	if (rb_ivar_defined(io, iv_kgio_sockaddr))
+		rb_ivar_set(io, iv_kgio_sockaddr, Qnil);
+	if (rb_ivar_defined(io, iv_kgio_incoming_cpu))
+		rb_ivar_set(io, iv_kgio_incoming_cpu, Qnil);
+	if (rb_ivar_defined(io, id_proxy_pending))
+		rb_ivar_set(io, id_proxy_pending, Qfalse);
+	if (rb_ivar_defined(io, id_sniff_pending))
+		rb_ivar_set(io, id_sniff_pending, Qfalse);
+	if (rb_ivar_defined(io, id_deadline))
+		rb_ivar_set(io, id_deadline, Qnil);
+	kgio_autopush_reset(io);
+
+	ary = rb_hash_lookup(pool, klass);
+	if (NIL_P(ary)) {
+		ary = rb_ary_new();
+		rb_hash_aset(pool, klass, ary);
+	}
+	rb_ary_push(ary, io);
+	pooled++;
+	released++;
+	return Qtrue;
+#else
+	kgio_admission_done(io);
+	rb_io_close(io);
+	return Qfalse;
+#endif /* SOCK_FOR_FD == 19 */
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.socket_pool_max = 1024
+ *
+ * Sets the maximum number of released sockets kept for reuse by
+ * accept, see Kgio::SocketMethods#kgio_release.  Zero (the default)
+ * disables pooling and empties the pool.  Pooling is only supported
+ * on MRI 1.9.3 and later, elsewhere kgio_release only closes.
+ */
+static VALUE set_pool_max(VALUE mod, VALUE val)
+{
+	long n = NUM2LONG(val);
+
+	if (n < 0)
+		rb_raise(rb_eArgError, "socket_pool_max must not be negative");
+	pool_max = n;
+	if (pooled > pool_max) {
+		rb_hash_clear(pool);
+		pooled = 0;
+	}
+	return val;
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.socket_pool_max	-> Integer
+ *
+ * Returns the maximum number of released sockets kept for reuse
+ */
+static VALUE get_pool_max(VALUE mod)
+{
+	return LONG2NUM(pool_max);
+}
+
+/*
+ * call-seq:
+ *
+ *	Kgio.socket_pool_stats	-> Hash
+ *
+ * Returns counters for client socket objects created by accept:
+ *
+ * - :allocated - new objects allocated
+ * - :reused - pooled objects re-armed with a new client
+ * - :released - objects added to the pool by kgio_release
+ * - :pooled - objects currently waiting in the pool
+ *
+ * A server in steady state with pooling enabled should see
+ * :allocated stay constant while :reused grows.
+ */
+static VALUE pool_stats(VALUE mod)
+{
+	VALUE rv = rb_hash_new();
+
+	rb_hash_aset(rv, sym_allocated, ULONG2NUM(allocated));
+	rb_hash_aset(rv, sym_reused, ULONG2NUM(reused));
+	rb_hash_aset(rv, sym_released, ULONG2NUM(released));
+	rb_hash_aset(rv, sym_pooled, LONG2NUM(pooled));
+	return rv;
+}
+
+void init_kgio_pool(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	init_sock_for_fd();
+	pool = rb_hash_new();
+	rb_global_variable(&pool);
+	iv_kgio_addr = rb_intern("@kgio_addr");
+	iv_kgio_sockaddr = rb_intern("@kgio_sockaddr");
+	iv_kgio_incoming_cpu = rb_intern("@kgio_incoming_cpu");
+	id_proxy_pending = rb_intern("kgio_proxy_pending");
+	id_sniff_pending = rb_intern("kgio_sniff_pending");
+	id_deadline = rb_intern("kgio_deadline");
+	sym_allocated = ID2SYM(rb_intern("allocated"));
+	sym_reused = ID2SYM(rb_intern("reused"));
+	sym_released = ID2SYM(rb_intern("released"));
+	sym_pooled = ID2SYM(rb_intern("pooled"));
+
+	rb_define_method(mSocketMethods, "kgio_release", kgio_release, 0);
+	rb_define_singleton_method(mKgio, "socket_pool_max=", set_pool_max, 1);
+	rb_define_singleton_method(mKgio, "socket_pool_max", get_pool_max, 0);
+	rb_define_singleton_method(mKgio, "socket_pool_stats", pool_stats, 0);
+}
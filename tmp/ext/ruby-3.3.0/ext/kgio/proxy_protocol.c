@@ -0,0 +1,428 @@
+/*
+ * HAProxy PROXY protocol (v1 and v2) support for accepted sockets.
+ * When enabled on a listener, the header is read with MSG_PEEK, parsed
+ * and only then consumed, so the client socket is left positioned at
+ * the application payload and kgio_addr reflects the real client.
+ * Accept never waits for the header: clients whose header has not
+ * fully arrived are handed back with it pending, see kgio_tryproxy.
+ *
+ * See http://www.haproxy.org/download/1.8/doc/proxy-protocol.txt
+ */
+#include "kgio.h"
+#include "my_fileno.h"
+
+#define V1_MAX 107
+#define V2_HDR 16
+#define PEEK_MAX 256 /* enough for everything but v2 with large TLVs */
+
+static const char v1_sig[] = "PROXY ";
+static const char v2_sig[] = "\r\n\r\n\0\r\nQUIT\n";
+
+static ID id_proxy_protocol, id_proxy_pending, iv_kgio_sockaddr;
+static VALUE sym_wait_readable;
+
+/* 1: matches so far, 0: cannot match */
+static int sig_prefix(const char *buf, size_t len, const char *sig, size_t n)
+{
+	return memcmp(buf, sig, len < n ? len : n) == 0;
+}
+
+static int v1_addr(const char *host, const char *port, int family,
+                   struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	char *end;
+	long p = strtol(port, &end, 10);
+
+	if (end == port || *end || p < 0 || p > 0xffff)
+		return -1;
+
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if (family == AF_INET) {
+		struct sockaddr_in *in = (struct sockaddr_in *)addr;
+
+		if (inet_pton(AF_INET, host, &in->sin_addr) != 1)
+			return -1;
+		in->sin_family = AF_INET;
+		in->sin_port = htons((unsigned short)p);
+		*addrlen = sizeof(struct sockaddr_in);
+	} else {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+		if (inet_pton(AF_INET6, host, &in6->sin6_addr) != 1)
+			return -1;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons((unsigned short)p);
+		*addrlen = sizeof(struct sockaddr_in6);
+	}
+	return 0;
+}
+
+/* "PROXY TCP4 1.2.3.4 5.6.7.8 1234 80\r\n" */
+static long v1_parse(const char *buf, size_t len,
+                     struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	char line[V1_MAX + 1];
+	char *tok[6];
+	char *save = NULL;
+	const char *crlf;
+	size_t n;
+	int i, family;
+
+	crlf = memchr(buf, '\n', len < V1_MAX ? len : V1_MAX);
+	if (!crlf)
+		return len < V1_MAX ? 0 : -1;
+	n = crlf - buf + 1;
+	if (n < 2 || buf[n - 2] != '\r')
+		return -1;
+
+	memcpy(line, buf, n - 2);
+	line[n - 2] = 0;
+	for (i = 0; i < 6; i++) {
+		tok[i] = strtok_r(i ? NULL : line, " ", &save);
+		if (!tok[i])
+			break;
+	}
+	if (i < 2)
+		return -1;
+	if (!strcmp(tok[1], "UNKNOWN")) {
+		*addrlen = 0;
+		return (long)n;
+	}
+	if (!strcmp(tok[1], "TCP4"))
+		family = AF_INET;
+	else if (!strcmp(tok[1], "TCP6"))
+		family = AF_INET6;
+	else
+		return -1;
+	if (i < 6 || strtok_r(NULL, " ", &save))
+		return -1;
+	if (v1_addr(tok[2], tok[4], family, addr, addrlen) < 0)
+		return -1;
+	return (long)n;
+}
+
+static long v2_parse(const unsigned char *buf, size_t len,
+                     struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	size_t n;
+
+	if (len < V2_HDR)
+		return 0;
+	if ((buf[12] & 0xf0) != 0x20)
+		return -1;
+	n = V2_HDR + ((size_t)buf[14] << 8 | buf[15]);
+	if (len < n)
+		return 0;
+
+	*addrlen = 0;
+	switch (buf[12] & 0x0f) {
+	case 0x0: /* LOCAL, e.g. health checks from the proxy itself */
+		return (long)n;
+	case 0x1: /* PROXY */
+		break;
+	default:
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	switch (buf[13] >> 4) {
+	case 0x1: { /* AF_INET */
+		struct sockaddr_in *in = (struct sockaddr_in *)addr;
+
+		if (n < V2_HDR + 12)
+			return -1;
+		in->sin_family = AF_INET;
+		memcpy(&in->sin_addr, buf + V2_HDR, 4);
+		memcpy(&in->sin_port, buf + V2_HDR + 8, 2);
+		*addrlen = sizeof(struct sockaddr_in);
+		break;
+	}
+	case 0x2: { /* AF_INET6 */
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+		if (n < V2_HDR + 36)
+			return -1;
+		in6->sin6_family = AF_INET6;
+		memcpy(&in6->sin6_addr, buf + V2_HDR, 16);
+		memcpy(&in6->sin6_port, buf + V2_HDR + 32, 2);
+		*addrlen = sizeof(struct sockaddr_in6);
+		break;
+	}
+	case 0x3: /* AF_UNIX */
+		addr->ss_family = AF_UNIX;
+		*addrlen = sizeof(sa_family_t);
+		break;
+	default: /* AF_UNSPEC */
+		break;
+	}
+	return (long)n;
+}
+
+/*
+ * parses a PROXY protocol header from +buf+, returning the length of
+ * the header, zero if more data is needed, or -1 if invalid.  +addrlen+
+ * is set to zero if the header carries no usable client address.
+ */
+static long proxy_parse(const char *buf, size_t len,
+                        struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	if (len == 0)
+		return 0;
+	if (buf[0] == 'P') {
+		if (!sig_prefix(buf, len, v1_sig, sizeof(v1_sig) - 1))
+			return -1;
+		return len < sizeof(v1_sig) - 1 ? 0 :
+		       v1_parse(buf, len, addr, addrlen);
+	}
+	if (!sig_prefix(buf, len, v2_sig, sizeof(v2_sig) - 1))
+		return -1;
+	return v2_parse((const unsigned char *)buf, len, addr, addrlen);
+}
+
+static ssize_t peek(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	do {
+		n = recv(fd, buf, len, MSG_PEEK | MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+/* consumes the header we peeked at */
+static int drain(int fd, char *buf, long n)
+{
+	while (n > 0) {
+		ssize_t r = recv(fd, buf, n, MSG_DONTWAIT);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			return -1;
+		n -= r;
+	}
+	return 0;
+}
+
+/*
+ * peeks at the header of +fd+ once without blocking and consumes it
+ * if it has fully arrived.  Returns 1 if it was consumed, 0 if it is
+ * incomplete, -1 if it is invalid, and -2 on EOF (errno is zero) or
+ * errors.
+ */
+static int proxy_try(int fd, struct sockaddr_storage *addr,
+                     socklen_t *addrlen)
+{
+	char small[PEEK_MAX];
+	char *buf = small;
+	VALUE tmp = 0;
+	ssize_t n = peek(fd, buf, sizeof(small));
+	long hdrlen;
+	int rv;
+
+	if (n <= 0) {
+		if (n == 0)
+			errno = 0;
+		return n < 0 && errno == EAGAIN ? 0 : -2;
+	}
+	hdrlen = proxy_parse(buf, n, addr, addrlen);
+
+	/* a v2 header with TLVs which do not fit in small[] */
+	if (hdrlen == 0 && n == sizeof(small)) {
+		const unsigned char *u = (const unsigned char *)small;
+		size_t need = V2_HDR + ((size_t)u[14] << 8 | u[15]);
+
+		buf = ALLOCV(tmp, need);
+		n = peek(fd, buf, need);
+		if (n <= 0) {
+			if (n == 0)
+				errno = 0;
+			rv = n < 0 && errno == EAGAIN ? 0 : -2;
+			goto out;
+		}
+		hdrlen = proxy_parse(buf, n, addr, addrlen);
+	}
+	if (hdrlen <= 0)
+		rv = (int)hdrlen;
+	else
+		rv = drain(fd, buf, hdrlen) == 0 ? 1 : -2;
+out:
+	if (tmp)
+		ALLOCV_END(tmp);
+	return rv;
+}
+
+/*
+ * called by accept with the new descriptor when the listener has
+ * kgio_proxy_protocol enabled, before any Ruby object is created for
+ * the client.  Returns -1 if the client was rejected, in which case
+ * +fd+ is already closed, and 1 if the header has not fully arrived,
+ * yet (see kgio_proxy_defer).  Otherwise, +addrlen+ is the length of
+ * the real client address stored in +addr+, or zero if the proxy did
+ * not send one.
+ */
+int kgio_proxy_accept(VALUE srv, int fd,
+                      struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	int rc;
+
+	*addrlen = 0;
+	if (!RTEST(rb_attr_get(srv, id_proxy_protocol)))
+		return 0;
+
+	rc = proxy_try(fd, addr, addrlen);
+	if (rc >= 0)
+		return !rc;
+	(void)close(fd);
+	*addrlen = 0;
+	return -1;
+}
+
+/* marks +client+ as still having its header pending */
+void kgio_proxy_defer(VALUE client)
+{
+	rb_ivar_set(client, id_proxy_pending, Qtrue);
+}
+
+/* true if the PROXY header of +io+ was still incomplete at accept */
+int kgio_proxy_pending(VALUE io)
+{
+	return RTEST(rb_attr_get(io, id_proxy_pending));
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_proxy_pending?	-> true or false
+ *
+ * Returns true if +io+ was accepted by a server with
+ * kgio_proxy_protocol enabled before its PROXY header fully arrived.
+ * kgio_tryproxy must succeed before any data is read from +io+.
+ */
+static VALUE proxy_pending_p(VALUE io)
+{
+	return kgio_proxy_pending(io) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_tryproxy	-> io, :wait_readable or nil
+ *
+ * Consumes the PROXY header which was still pending when +io+ was
+ * accepted and updates kgio_addr and kgio_sockaddr, just like accept
+ * does for complete headers.  Returns +io+ once the header is
+ * consumed (or if none was pending), :wait_readable if it is still
+ * incomplete, and nil on EOF.  Raises Errno::EPROTO if the header is
+ * invalid.  This never blocks.
+ *
+ * If the server has a Kgio::Admission policy, +io+ is only admitted
+ * once its header is consumed, so the real client address is
+ * checked.  Rejected clients are closed and nil is returned.
+ */
+VALUE kgio_tryproxy(VALUE io)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = 0;
+	int fd;
+
+	if (!kgio_proxy_pending(io))
+		return io;
+	fd = my_fileno(io);
+	switch (proxy_try(fd, &addr, &addrlen)) {
+	case 0:
+		return sym_wait_readable;
+	case -1:
+		errno = EPROTO;
+		rb_sys_fail("kgio_tryproxy");
+	case -2:
+		if (errno == 0)
+			return Qnil;
+		rb_sys_fail("recv");
+	}
+	rb_ivar_set(io, id_proxy_pending, Qfalse);
+	if (!kgio_admission_resume(io, &addr, addrlen)) {
+		rb_io_close(io);
+		return Qnil;
+	}
+	if (addrlen) {
+		kgio_addr_set(io, (struct sockaddr *)&addr, addrlen);
+		rb_ivar_set(io, iv_kgio_sockaddr,
+		            rb_str_new((const char *)&addr, addrlen));
+	}
+	return io;
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_proxy_protocol = true
+ *	srv.kgio_proxy_protocol = false
+ *
+ * Expects every client accepted by this server to start with a
+ * PROXY protocol (version 1 or 2) header, as sent by HAProxy and
+ * other load balancers.  The header is parsed and consumed inside
+ * kgio_accept and kgio_tryaccept, kgio_addr is set to the address of
+ * the real client and kgio_sockaddr to its packed sockaddr.
+ *
+ * Accept only looks at what already arrived and never waits for the
+ * rest of a header, so a slow client cannot hold up the listener.
+ * Such clients are returned with kgio_proxy_pending? set, and
+ * kgio_tryproxy must be called on them (typically once they are
+ * readable) before reading.  Clients sending an invalid header are
+ * closed and accept moves on to the next client.  Headers with the
+ * LOCAL command (or UNKNOWN in version 1) leave the address of the
+ * proxy in place.
+ */
+static VALUE set_proxy_protocol(VALUE srv, VALUE val)
+{
+	rb_ivar_set(srv, id_proxy_protocol, RTEST(val) ? Qtrue : Qfalse);
+	return val;
+}
+
+/*
+ * call-seq:
+ *
+ *	srv.kgio_proxy_protocol	-> true or false
+ *
+ * Returns whether PROXY protocol parsing is enabled for this server.
+ */
+static VALUE get_proxy_protocol(VALUE srv)
+{
+	return RTEST(rb_attr_get(srv, id_proxy_protocol)) ? Qtrue : Qfalse;
+}
+
+void init_kgio_proxy_protocol(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+	VALUE cTCPServer = rb_const_get(mKgio, rb_intern("TCPServer"));
+	VALUE cUNIXServer = rb_const_get(mKgio, rb_intern("UNIXServer"));
+
+	/* hidden from Ruby so they can only hold true or false */
+	id_proxy_protocol = rb_intern("kgio_proxy_protocol");
+	id_proxy_pending = rb_intern("kgio_proxy_pending");
+	iv_kgio_sockaddr = rb_intern("@kgio_sockaddr");
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+
+	rb_define_method(cTCPServer, "kgio_proxy_protocol=",
+	                 set_proxy_protocol, 1);
+	rb_define_method(cTCPServer, "kgio_proxy_protocol",
+	                 get_proxy_protocol, 0);
+	rb_define_method(cUNIXServer, "kgio_proxy_protocol=",
+	                 set_proxy_protocol, 1);
+	rb_define_method(cUNIXServer, "kgio_proxy_protocol",
+	                 get_proxy_protocol, 0);
+
+	/*
+	 * the packed sockaddr of the real client, only set for sockets
+	 * accepted by servers with kgio_proxy_protocol enabled
+	 */
+	rb_define_attr(mSocketMethods, "kgio_sockaddr", 1, 0);
+	rb_define_method(mSocketMethods, "kgio_tryproxy", kgio_tryproxy, 0);
+	rb_define_method(mSocketMethods, "kgio_proxy_pending?",
+	                 proxy_pending_p, 0);
+}
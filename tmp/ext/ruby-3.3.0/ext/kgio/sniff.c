@@ -0,0 +1,191 @@
+/*
+ * Protocol sniffing for accepted sockets.  The first bytes sent by
+ * the client are read with MSG_PEEK and matched against a table of
+ * prefixes to pick the class of the new socket, leaving the data in
+ * the socket for the application to read.  Sniffing never waits for
+ * more data, clients which have not sent enough to tell are marked
+ * kgio_sniff_pending? for the caller to classify later with
+ * kgio_trysniff.
+ */
+#include "kgio.h"
+#include "my_fileno.h"
+#ifdef HAVE_POLL
+#  include <poll.h>
+#endif
+
+#define SNIFF_MAX 256
+
+struct sniff_match {
+	const char *buf;
+	long len;
+	VALUE klass; /* first full match */
+	int partial; /* an earlier prefix may still match */
+};
+
+static VALUE sym_wait_readable;
+static ID id_sniff_pending;
+
+static int match_i(VALUE prefix, VALUE klass, VALUE arg)
+{
+	struct sniff_match *m = (struct sniff_match *)arg;
+	long plen;
+
+	/* the table was checked before accept, but may have changed */
+	if (TYPE(prefix) != T_STRING)
+		return ST_CONTINUE;
+	plen = RSTRING_LEN(prefix);
+	if (memcmp(m->buf, RSTRING_PTR(prefix),
+	           plen < m->len ? plen : m->len) != 0)
+		return ST_CONTINUE;
+	if (plen > m->len) {
+		m->partial = 1;
+		return ST_CONTINUE;
+	}
+	m->klass = klass;
+	return ST_STOP;
+}
+
+/* no more data will arrive, so a partial match is as good as it gets */
+static int peer_closed(int fd)
+{
+#if defined(HAVE_POLL) && defined(POLLRDHUP)
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLRDHUP;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP|POLLHUP));
+#else
+	return 0;
+#endif
+}
+
+/*
+ * peeks at the first bytes sent to +fd+ once without blocking and
+ * matches them against the +table+ Hash of prefixes to classes, in
+ * insertion order.  Returns the class of the first prefix matching
+ * in full unless an earlier prefix may still match, Qnil if no prefix
+ * can match (or the client disconnected before sending anything),
+ * and Qundef if more data is needed to decide.
+ */
+static VALUE sniff_once(VALUE table, int fd)
+{
+	char buf[SNIFF_MAX];
+	struct sniff_match m;
+	ssize_t n;
+
+	do {
+		n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+	if (n == 0)
+		return Qnil;
+	if (n < 0)
+		return errno == EAGAIN ? Qundef : Qnil;
+
+	m.buf = buf;
+	m.len = (long)n;
+	m.klass = Qundef;
+	m.partial = 0;
+	rb_hash_foreach(table, match_i, (VALUE)&m);
+	if (!m.partial || peer_closed(fd))
+		return m.klass == Qundef ? Qnil : m.klass;
+	return Qundef;
+}
+
+/*
+ * picks the class for the accepted client +fd+ from +table+, +dflt+
+ * if no prefix matches, or Qundef if the client has not sent enough
+ * to decide, yet.  This never waits for more data.
+ */
+VALUE kgio_sniff(VALUE table, VALUE dflt, int fd)
+{
+	VALUE klass = sniff_once(table, fd);
+
+	return klass == Qnil ? dflt : klass;
+}
+
+/* marks +client+ as not classified, yet */
+void kgio_sniff_defer(VALUE client)
+{
+	rb_ivar_set(client, id_sniff_pending, Qtrue);
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_sniff_pending?	-> true or false
+ *
+ * Returns true if +io+ was accepted by kgio_tryaccept_sniff before it
+ * sent enough to pick its class, so it got the default class instead.
+ * This stays true until kgio_trysniff returns a class or +nil+.
+ */
+static VALUE sniff_pending_p(VALUE io)
+{
+	return RTEST(rb_attr_get(io, id_sniff_pending)) ? Qtrue : Qfalse;
+}
+
+static int check_i(VALUE prefix, VALUE klass, VALUE arg)
+{
+	StringValue(prefix);
+	if (RSTRING_LEN(prefix) > SNIFF_MAX)
+		rb_raise(rb_eArgError, "prefix longer than %d bytes",
+		         SNIFF_MAX);
+	return ST_CONTINUE;
+}
+
+/* raises if +table+ is unusable for kgio_sniff, returns it as a Hash */
+VALUE kgio_sniff_table(VALUE table)
+{
+	table = rb_convert_type(table, T_HASH, "Hash", "to_hash");
+	rb_hash_foreach(table, check_i, 0);
+	return table;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_trysniff(table)	-> class, nil or :wait_readable
+ *
+ * Classifies +io+ with the same +table+ of prefixes given to
+ * kgio_tryaccept_sniff, by peeking at the data it received without
+ * consuming it.  Returns the class of the matching prefix, +nil+ if
+ * no prefix can match, or :wait_readable if the data received so far
+ * is not enough to decide.  This never blocks, call it again once
+ * +io+ is readable.
+ *
+ * If the PROXY header of +io+ is still pending (see
+ * Kgio::SocketMethods#kgio_proxy_pending?), it is consumed with
+ * kgio_tryproxy first so only the application payload is looked at,
+ * and whatever kgio_tryproxy returns other than +io+ is returned.
+ *
+ * kgio_sniff_pending? is cleared once this returns a class or +nil+.
+ */
+static VALUE trysniff(VALUE io, VALUE table)
+{
+	VALUE klass;
+
+	table = kgio_sniff_table(table);
+	if (kgio_proxy_pending(io)) {
+		klass = kgio_tryproxy(io);
+		if (klass != io)
+			return klass;
+	}
+	klass = sniff_once(table, my_fileno(io));
+	if (klass == Qundef)
+		return sym_wait_readable;
+	if (rb_ivar_defined(io, id_sniff_pending))
+		rb_ivar_set(io, id_sniff_pending, Qfalse);
+	return klass;
+}
+
+void init_kgio_sniff(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+	id_sniff_pending = rb_intern("kgio_sniff_pending");
+	rb_define_method(mSocketMethods, "kgio_trysniff", trysniff, 1);
+	rb_define_method(mSocketMethods, "kgio_sniff_pending?",
+	                 sniff_pending_p, 0);
+}
@@ -0,0 +1,448 @@
+/*
+ * Kgio::UDPSocket moves many datagrams per system call with
+ * recvmmsg(2) and sendmmsg(2) (falling back to one recvmsg(2) or
+ * sendmsg(2) per datagram where those are missing).  The message
+ * headers and the receive buffer share one scratch String kept with
+ * each socket, grown as needed and reused by later calls.  It is only
+ * touched while holding the GVL.  Sending allocates its headers per
+ * call.
+ *
+ * On Linux, UDP_SEGMENT (GSO) and UDP_GRO allow a single buffer to
+ * carry many equal-sized datagrams through the stack.
+ */
+#include "kgio.h"
+#include <sys/uio.h>
+#include <stdint.h>
+#include "my_fileno.h"
+
+/* UIO_MAXIOV, the most recvmmsg and sendmmsg handle at once on Linux */
+#define UDP_BATCH_MAX 1024
+#define UDP_MAXLEN 65536
+
+#ifdef __linux__
+#  ifndef SOL_UDP
+#    define SOL_UDP 17
+#  endif
+#  ifndef UDP_SEGMENT
+#    define UDP_SEGMENT 103 /* Linux 4.18+ */
+#  endif
+#  ifndef UDP_GRO
+#    define UDP_GRO 104 /* Linux 5.0+ */
+#  endif
+#endif /* __linux__ */
+
+#if !defined(HAVE_RECVMMSG) && !defined(HAVE_SENDMMSG)
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+#ifndef HAVE_RECVMMSG
+static int recvmmsg(int fd, struct mmsghdr *msgs, unsigned n, int flags,
+                    struct timespec *timeout)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		ssize_t r = recvmsg(fd, &msgs[i].msg_hdr, flags);
+
+		if (r < 0)
+			return i ? (int)i : -1;
+		msgs[i].msg_len = (unsigned)r;
+	}
+	return (int)n;
+}
+#endif /* !HAVE_RECVMMSG */
+
+#ifndef HAVE_SENDMMSG
+static int sendmmsg(int fd, struct mmsghdr *msgs, unsigned n, int flags)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		ssize_t r = sendmsg(fd, &msgs[i].msg_hdr, flags);
+
+		if (r < 0)
+			return i ? (int)i : -1;
+		msgs[i].msg_len = (unsigned)r;
+	}
+	return (int)n;
+}
+#endif /* !HAVE_SENDMMSG */
+
+/* per-message scratch space, allocated after the mmsghdr array */
+struct udp_slot {
+	struct iovec iov;
+	struct sockaddr_storage addr;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl; /* UDP_SEGMENT on send, UDP_GRO on receive */
+};
+
+static VALUE sym_wait_readable, sym_wait_writable;
+static ID id_recv_buf;
+
+#ifndef HAVE_RB_ARY_SUBSEQ
+static inline VALUE my_ary_subseq(VALUE ary, long idx, long len)
+{
+	VALUE args[2] = {LONG2FIX(idx), LONG2FIX(len)};
+	return rb_ary_aref(2, args, ary);
+}
+#define rb_ary_subseq my_ary_subseq
+#endif
+
+#ifdef MSG_DONTWAIT
+#  define udp_nonblock(fd) (MSG_DONTWAIT)
+#else
+#  include "nonblock.h"
+static int udp_nonblock(int fd)
+{
+	set_nonblocking(fd);
+	return 0;
+}
+#endif
+
+/* bytes needed for +n+ message headers followed by their slots */
+#define BATCH_SIZE(n) \
+	((size_t)(n) * (sizeof(struct mmsghdr) + sizeof(struct udp_slot)))
+
+/* returns the segment size of a buffer coalesced by UDP_GRO, or zero */
+static int gro_segsize(struct msghdr *mh)
+{
+#ifdef __linux__
+	struct cmsghdr *hdr;
+
+	for (hdr = CMSG_FIRSTHDR(mh); hdr; hdr = CMSG_NXTHDR(mh, hdr)) {
+		if (hdr->cmsg_level == SOL_UDP && hdr->cmsg_type == UDP_GRO) {
+			int segsize;
+
+			memcpy(&segsize, CMSG_DATA(hdr), sizeof(int));
+			return segsize;
+		}
+	}
+#endif /* __linux__ */
+	return 0;
+}
+
+/*
+ * call-seq:
+ *
+ *	sock.kgio_tryrecvmmsg(max_msgs, maxlen)	-> [ [ data, addr ], ... ]
+ *	sock.kgio_tryrecvmmsg(max_msgs, maxlen)	-> :wait_readable
+ *
+ * Receives up to +max_msgs+ (at most 1024) datagrams which are
+ * already queued on the socket, in one system call where supported.
+ * Each datagram is returned as a two-element Array of its data and
+ * the packed sockaddr of the sender, which may be given to
+ * Socket.unpack_sockaddr_in or passed back to kgio_trysendmmsg
+ * as-is.  Datagrams longer than +maxlen+ bytes are truncated.
+ *
+ * With kgio_gro enabled, the kernel may coalesce consecutive
+ * datagrams from the same sender into one buffer.  Those are returned
+ * as three-element Arrays of [ data, addr, segsize ], where +data+ is
+ * the concatenation of datagrams which are all +segsize+ bytes long
+ * except the last one, which may be shorter.  +maxlen+ should be
+ * 65536 when using kgio_gro, since coalesced buffers which do not
+ * fit are truncated.
+ *
+ * The socket keeps the +max_msgs+ * +maxlen+ bytes of scratch space
+ * for the largest call made so far, so polling loops do not allocate
+ * it each time.
+ *
+ * Returns :wait_readable if no datagram is queued.
+ */
+static VALUE kgio_tryrecvmmsg(VALUE io, VALUE max_msgs, VALUE maxlen)
+{
+	long nmsgs = NUM2LONG(max_msgs);
+	long len = NUM2LONG(maxlen);
+	int i, n, fd, flags;
+	char *buf;
+	struct mmsghdr *msgs;
+	struct udp_slot *slots;
+	size_t size;
+	VALUE rv, scratch;
+
+	if (nmsgs <= 0 || nmsgs > UDP_BATCH_MAX)
+		rb_raise(rb_eArgError, "max_msgs must be between 1 and %d",
+		         UDP_BATCH_MAX);
+	if (len <= 0 || len > UDP_MAXLEN)
+		rb_raise(rb_eArgError, "maxlen must be between 1 and %d",
+		         UDP_MAXLEN);
+
+	fd = my_fileno(io);
+	flags = udp_nonblock(fd);
+	size = BATCH_SIZE(nmsgs) + (size_t)nmsgs * len;
+	scratch = rb_attr_get(io, id_recv_buf);
+	if (NIL_P(scratch)) {
+		scratch = rb_str_new(NULL, (long)size);
+		rb_ivar_set(io, id_recv_buf, scratch);
+	} else if ((size_t)RSTRING_LEN(scratch) < size) {
+		rb_str_resize(scratch, (long)size);
+	}
+	msgs = (struct mmsghdr *)RSTRING_PTR(scratch);
+	slots = (struct udp_slot *)(msgs + nmsgs);
+	buf = (char *)(slots + nmsgs);
+retry:
+	for (i = 0; i < nmsgs; i++) {
+		struct msghdr *mh = &msgs[i].msg_hdr;
+
+		slots[i].iov.iov_base = buf + (size_t)i * len;
+		slots[i].iov.iov_len = len;
+		memset(mh, 0, sizeof(*mh));
+		mh->msg_name = &slots[i].addr;
+		mh->msg_namelen = sizeof(slots[i].addr);
+		mh->msg_iov = &slots[i].iov;
+		mh->msg_iovlen = 1;
+		mh->msg_control = slots[i].ctrl.buf;
+		mh->msg_controllen = sizeof(slots[i].ctrl.buf);
+	}
+	n = recvmmsg(fd, msgs, (unsigned)nmsgs, flags, NULL);
+	if (n < 0) {
+		if (errno == EINTR) {
+			fd = my_fileno(io);
+			goto retry;
+		}
+		if (errno == EAGAIN)
+			return sym_wait_readable;
+		rb_sys_fail("recvmmsg");
+	}
+
+	rv = rb_ary_new2(n);
+	for (i = 0; i < n; i++) {
+		struct msghdr *mh = &msgs[i].msg_hdr;
+		VALUE data = rb_str_new(slots[i].iov.iov_base,
+		                        msgs[i].msg_len);
+		VALUE addr = mh->msg_namelen ?
+		             rb_str_new(mh->msg_name, mh->msg_namelen) : Qnil;
+		int segsize = gro_segsize(mh);
+
+		if (segsize > 0)
+			rb_ary_push(rv, rb_ary_new3(3, data, addr,
+			                            INT2FIX(segsize)));
+		else
+			rb_ary_push(rv, rb_assoc_new(data, addr));
+	}
+	RB_GC_GUARD(scratch); /* on the stack, so GC compaction won't move it */
+	return rv;
+}
+
+/* asks the kernel to split the data of +mh+ into +segsize+ chunks */
+static void
+set_segsize(struct msghdr *mh, struct udp_slot *slot, int segsize)
+{
+#ifdef __linux__
+	struct cmsghdr *hdr = &slot->ctrl.hdr;
+	uint16_t val = (uint16_t)segsize;
+
+	memset(&slot->ctrl, 0, sizeof(slot->ctrl));
+	hdr->cmsg_level = SOL_UDP;
+	hdr->cmsg_type = UDP_SEGMENT;
+	hdr->cmsg_len = CMSG_LEN(sizeof(val));
+	memcpy(CMSG_DATA(hdr), &val, sizeof(val));
+	mh->msg_control = slot->ctrl.buf;
+	mh->msg_controllen = CMSG_SPACE(sizeof(val));
+#endif /* __linux__ */
+}
+
+/*
+ * converts every element of +ary+ to a [ data, addr ] pair of Strings
+ * (or nil addr) up front, so no Ruby code runs while a batch is being
+ * filled and the converted Strings stay referenced until we return
+ */
+static VALUE convert_msgs(VALUE ary)
+{
+	long i, total = RARRAY_LEN(ary);
+	VALUE pairs = rb_ary_new2(total);
+
+	for (i = 0; i < total; i++) {
+		VALUE msg = rb_ary_entry(ary, i);
+		VALUE data, addr;
+
+		msg = rb_convert_type(msg, T_ARRAY, "Array", "to_ary");
+		data = rb_ary_entry(msg, 0);
+		addr = rb_ary_entry(msg, 1);
+		StringValue(data);
+		if (!NIL_P(addr))
+			StringValue(addr);
+		rb_ary_push(pairs, rb_assoc_new(data, addr));
+	}
+	return pairs;
+}
+
+/* fills the message header +mh+ from a [ data, addr ] pair */
+static void
+prepare_send(struct msghdr *mh, struct udp_slot *slot, VALUE pair, int segsize)
+{
+	VALUE data = rb_ary_entry(pair, 0);
+	VALUE addr = rb_ary_entry(pair, 1);
+
+	memset(mh, 0, sizeof(*mh));
+	if (!NIL_P(addr)) {
+		mh->msg_name = RSTRING_PTR(addr);
+		mh->msg_namelen = (socklen_t)RSTRING_LEN(addr);
+	}
+	slot->iov.iov_base = RSTRING_PTR(data);
+	slot->iov.iov_len = RSTRING_LEN(data);
+	mh->msg_iov = &slot->iov;
+	mh->msg_iovlen = 1;
+	if (segsize > 0 && slot->iov.iov_len > (size_t)segsize)
+		set_segsize(mh, slot, segsize);
+}
+
+/*
+ * call-seq:
+ *
+ *	sock.kgio_trysendmmsg([ [ data, addr ], ... ])	-> nil
+ *	sock.kgio_trysendmmsg([ [ data, addr ], ... ])	-> Array
+ *	sock.kgio_trysendmmsg([ [ data, addr ], ... ])	-> :wait_writable
+ *	sock.kgio_trysendmmsg([ [ data, addr ], ... ], segsize) -> ...
+ *
+ * Sends each +data+ String as one datagram to the packed sockaddr
+ * +addr+ (as returned by Socket.pack_sockaddr_in or
+ * kgio_tryrecvmmsg), or to the connected peer if +addr+ is nil.
+ * Up to 1024 datagrams are sent per system call where supported.
+ *
+ * Returns nil if every datagram was sent.
+ *
+ * Returns an Array of the unsent elements if EAGAIN was encountered
+ * after sending some of them.
+ *
+ * Returns :wait_writable if EAGAIN is encountered and nothing
+ * was sent.
+ *
+ * If +segsize+ is given (Linux 4.18+), each +data+ longer than
+ * +segsize+ bytes is handed to the kernel as a single buffer and split
+ * into datagrams of +segsize+ bytes (the last one may be shorter) by
+ * UDP segmentation offload (UDP_SEGMENT), so many datagrams cost one
+ * trip through the stack.  The kernel limits each such buffer to 64
+ * segments and 64KB.  Receivers may use kgio_gro to get the segments
+ * back in one buffer.
+ */
+static VALUE kgio_trysendmmsg(int argc, VALUE *argv, VALUE io)
+{
+	long off = 0, total;
+	int n, fd, flags, segsize = 0;
+	struct mmsghdr *msgs;
+	struct udp_slot *slots;
+	VALUE ary, seg, pairs, tmp = 0;
+
+	rb_scan_args(argc, argv, "11", &ary, &seg);
+	if (!NIL_P(seg)) {
+#ifndef __linux__
+		rb_raise(rb_eNotImpError,
+		         "UDP segmentation offload not supported");
+#endif
+		segsize = NUM2INT(seg);
+		if (segsize <= 0 || segsize > 0xffff)
+			rb_raise(rb_eArgError, "invalid segsize: %d", segsize);
+	}
+	ary = rb_convert_type(ary, T_ARRAY, "Array", "to_ary");
+	pairs = convert_msgs(ary);
+	total = RARRAY_LEN(pairs);
+	if (total == 0)
+		return Qnil;
+	fd = my_fileno(io);
+	flags = udp_nonblock(fd);
+	n = total < UDP_BATCH_MAX ? (int)total : UDP_BATCH_MAX;
+	msgs = ALLOCV(tmp, BATCH_SIZE(n));
+	slots = (struct udp_slot *)(msgs + n);
+
+	while (off < total) {
+		long i, nmsgs = total - off;
+
+		if (nmsgs > UDP_BATCH_MAX)
+			nmsgs = UDP_BATCH_MAX;
+		for (i = 0; i < nmsgs; i++)
+			prepare_send(&msgs[i].msg_hdr, &slots[i],
+			             rb_ary_entry(pairs, off + i), segsize);
+		n = sendmmsg(fd, msgs, (unsigned)nmsgs, flags);
+		if (n < 0) {
+			if (errno == EINTR) {
+				fd = my_fileno(io);
+				continue;
+			}
+			if (errno == EAGAIN)
+				break;
+			rb_sys_fail("sendmmsg");
+		}
+		off += n;
+	}
+	ALLOCV_END(tmp);
+	RB_GC_GUARD(pairs);
+	if (off == total)
+		return Qnil;
+	if (off == 0)
+		return sym_wait_writable;
+	return rb_ary_subseq(ary, off, total - off);
+}
+
+#ifdef __linux__
+/*
+ * call-seq:
+ *
+ *	sock.kgio_gro = true or false
+ *
+ * Enables or disables UDP generic receive offload (UDP_GRO, Linux
+ * 5.0+) on the socket.  When enabled, consecutive datagrams from the
+ * same sender may be delivered as one coalesced buffer, see
+ * kgio_tryrecvmmsg for how they are returned.
+ */
+static VALUE set_gro(VALUE io, VALUE val)
+{
+	int on = RTEST(val);
+
+	if (setsockopt(my_fileno(io), SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+		rb_sys_fail("setsockopt(UDP_GRO)");
+	return val;
+}
+
+/*
+ * call-seq:
+ *
+ *	sock.kgio_gro	-> true or false
+ *
+ * Returns whether UDP generic receive offload is enabled
+ */
+static VALUE get_gro(VALUE io)
+{
+	int on = 0;
+	socklen_t len = sizeof(on);
+
+	if (getsockopt(my_fileno(io), SOL_UDP, UDP_GRO, &on, &len) < 0)
+		rb_sys_fail("getsockopt(UDP_GRO)");
+	return on ? Qtrue : Qfalse;
+}
+#endif /* __linux__ */
+
+void init_kgio_udp(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mSocketMethods = rb_const_get(mKgio, rb_intern("SocketMethods"));
+	VALUE cUDPSocket;
+
+	sym_wait_readable = ID2SYM(rb_intern("wait_readable"));
+	sym_wait_writable = ID2SYM(rb_intern("wait_writable"));
+	/* hidden from Ruby, kgio_tryrecvmmsg is its only user */
+	id_recv_buf = rb_intern("kgio_recv_buf");
+
+	/*
+	 * Document-class: Kgio::UDPSocket
+	 *
+	 * Kgio::UDPSocket should be used in place of the plain UDPSocket
+	 * when kgio_* methods are needed.  In addition to the
+	 * Kgio::SocketMethods used with connected sockets, it may move
+	 * many datagrams at once with kgio_tryrecvmmsg and
+	 * kgio_trysendmmsg.
+	 */
+	cUDPSocket = rb_const_get(rb_cObject, rb_intern("UDPSocket"));
+	cUDPSocket = rb_define_class_under(mKgio, "UDPSocket", cUDPSocket);
+	rb_include_module(cUDPSocket, mSocketMethods);
+	rb_define_method(cUDPSocket, "kgio_tryrecvmmsg", kgio_tryrecvmmsg, 2);
+	rb_define_method(cUDPSocket, "kgio_trysendmmsg", kgio_trysendmmsg, -1);
+#ifdef __linux__
+	rb_define_method(cUDPSocket, "kgio_gro=", set_gro, 1);
+	rb_define_method(cUDPSocket, "kgio_gro", get_gro, 0);
+#endif
+}
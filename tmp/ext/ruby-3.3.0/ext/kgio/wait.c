@@ -0,0 +1,286 @@
+#include "kgio.h"
+#include "my_fileno.h"
+#include "broken_system_compat.h"
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#  include <ruby/fiber/scheduler.h>
+#endif
+static ID id_wait_rd, id_wait_wr, id_deadline;
+
+/* no need to look for deadlines until one was set */
+static int deadlines_used;
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+/* true if the current Fiber is non-blocking and has a scheduler */
+int kgio_scheduler_active(void)
+{
+	return !NIL_P(rb_fiber_scheduler_current());
+}
+
+/*
+ * waits for +io+ with the Fiber scheduler's io_wait hook, returns -1
+ * if there is no scheduler and 0 if +timeout+ expired
+ */
+int kgio_scheduler_wait(VALUE io, int write_p, VALUE timeout)
+{
+	VALUE sched = rb_fiber_scheduler_current();
+	VALUE events;
+
+	if (NIL_P(sched))
+		return -1;
+	events = INT2NUM(write_p ? RB_WAITFD_OUT : RB_WAITFD_IN);
+	return RTEST(rb_fiber_scheduler_io_wait(sched, io, events, timeout));
+}
+#else /* ! HAVE_RB_FIBER_SCHEDULER_CURRENT */
+int kgio_scheduler_active(void)
+{
+	return 0;
+}
+
+int kgio_scheduler_wait(VALUE io, int write_p, VALUE timeout)
+{
+	return -1;
+}
+#endif /* ! HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+#if defined(HAVE_RB_TIME_INTERVAL) && defined(HAVE_RB_WAIT_FOR_SINGLE_FD)
+static int kgio_timedwait(VALUE self, VALUE timeout, int write_p)
+{
+	struct timeval tv = rb_time_interval(timeout);
+	int events = write_p ? RB_WAITFD_OUT : RB_WAITFD_IN;
+
+	return rb_wait_for_single_fd(my_fileno(self), events, &tv);
+}
+#else  /* ! (HAVE_RB_TIME_INTERVAL && HAVE_RB_WAIT_FOR_SINGLE_FD) */
+static int kgio_timedwait(VALUE self, VALUE timeout, int write_p)
+{
+	VALUE argv[4];
+	VALUE set = rb_ary_new3(1, self);
+
+	argv[0] = write_p ? Qnil : set;
+	argv[1] = write_p ? set : Qnil;
+	argv[2] = Qnil;
+	argv[3] = timeout;
+
+	set = rb_funcall2(rb_cIO, rb_intern("select"), 4, argv);
+	return NIL_P(set) ? 0 : 1;
+}
+#endif /* ! (HAVE_RB_TIME_INTERVAL && HAVE_RB_WAIT_FOR_SINGLE_FD) */
+
+static int kgio_wait(int argc, VALUE *argv, VALUE self, int write_p)
+{
+	int fd, rc;
+	VALUE timeout;
+
+	rb_scan_args(argc, argv, "01", &timeout);
+	fd = my_fileno(self); /* raises IOError if closed */
+	rc = kgio_scheduler_wait(self, write_p, timeout);
+	if (rc >= 0)
+		return rc;
+	if (!NIL_P(timeout))
+		return kgio_timedwait(self, timeout, write_p);
+
+	errno = EAGAIN;
+	write_p ? rb_io_wait_writable(fd) : rb_io_wait_readable(fd);
+	return 1;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_wait_readable           -> IO
+ *	io.kgio_wait_readable(timeout)  -> IO or nil
+ *
+ * Blocks the running Thread indefinitely until the IO object is readable
+ * or if +timeout+ expires.  If +timeout+ is specified and expires, +nil+
+ * is returned.
+ *
+ * This method is automatically called (without timeout argument) by default
+ * whenever kgio_read needs to block on input.
+ *
+ * If the current Fiber is non-blocking and its Thread has a
+ * Fiber scheduler, the scheduler's io_wait hook is called directly.
+ * Users of alternative threading/fiber libraries are
+ * encouraged to override this method in their subclasses or modules to
+ * work with their threading/blocking methods.
+ */
+static VALUE kgio_wait_readable(int argc, VALUE *argv, VALUE self)
+{
+	int r = kgio_wait(argc, argv, self, 0);
+
+	if (r < 0) rb_sys_fail("kgio_wait_readable");
+	return r == 0 ? Qnil : self;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_wait_writable           -> IO
+ *	io.kgio_wait_writable(timeout)  -> IO or nil
+ *
+ * Blocks the running Thread indefinitely until the IO object is writable
+ * or if +timeout+ expires.  If +timeout+ is specified and expires, +nil+
+ * is returned.
+ *
+ * This method is automatically called (without timeout argument) by default
+ * whenever kgio_write needs to block on output.
+ *
+ * If the current Fiber is non-blocking and its Thread has a
+ * Fiber scheduler, the scheduler's io_wait hook is called directly.
+ * Users of alternative threading/fiber libraries are
+ * encouraged to override this method in their subclasses or modules to
+ * work with their threading/blocking methods.
+ */
+static VALUE kgio_wait_writable(int argc, VALUE *argv, VALUE self)
+{
+	int r = kgio_wait(argc, argv, self, 1);
+
+	if (r < 0) rb_sys_fail("kgio_wait_writable");
+	return r == 0 ? Qnil : self;
+}
+
+static double monotonic_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(hopefully_CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 5
+ *	io.kgio_deadline = nil
+ *
+ * Sets an absolute deadline, in seconds on the monotonic clock used
+ * by Process.clock_gettime(Process::CLOCK_MONOTONIC), for the
+ * blocking kgio_read, kgio_peek, kgio_write and kgio_writev methods
+ * (and kgio_accept on listeners).  Once the deadline passes, they
+ * return :timeout instead of waiting any longer.  If kgio_write or
+ * kgio_writev already wrote some data, they return the unwritten
+ * portion (like kgio_trywrite and kgio_trywritev) instead of :timeout,
+ * so callers know how much was sent.  The deadline is tracked
+ * natively across every EINTR and EAGAIN retry and stays in effect
+ * until it is changed, +nil+ (the default) waits forever.
+ *
+ * Overridden kgio_wait_readable and kgio_wait_writable methods are
+ * called with the seconds left if they take an argument.
+ */
+VALUE kgio_set_deadline(VALUE io, VALUE deadline)
+{
+	if (!NIL_P(deadline)) {
+		deadline = DBL2NUM(NUM2DBL(deadline));
+		deadlines_used = 1;
+	}
+	rb_ivar_set(io, id_deadline, deadline);
+	return deadline;
+}
+
+/*
+ * call-seq:
+ *
+ *	io.kgio_deadline	-> Float or nil
+ *
+ * Returns the deadline set with kgio_deadline=
+ */
+VALUE kgio_deadline(VALUE io)
+{
+	return deadlines_used ? rb_attr_get(io, id_deadline) : Qnil;
+}
+
+/* waits up to +left+ seconds without a Ruby timeout object */
+static int wait_left(VALUE io, int write_p, double left)
+{
+	VALUE timeout;
+	int rc;
+
+#ifdef HAVE_RB_WAIT_FOR_SINGLE_FD
+	if (!kgio_scheduler_active()) {
+		struct timeval tv;
+
+		tv.tv_sec = (time_t)left;
+		tv.tv_usec = (long)((left - (double)tv.tv_sec) * 1e6);
+		return rb_wait_for_single_fd(my_fileno(io), write_p ?
+		                             RB_WAITFD_OUT : RB_WAITFD_IN, &tv);
+	}
+#endif /* HAVE_RB_WAIT_FOR_SINGLE_FD */
+	timeout = DBL2NUM(left);
+	rc = kgio_scheduler_wait(io, write_p, timeout);
+	return rc >= 0 ? rc : kgio_timedwait(io, timeout, write_p);
+}
+
+/*
+ * waits for +io+ until +deadline+ (from kgio_deadline) passes,
+ * returns false if it did
+ */
+int kgio_wait_deadline(VALUE io, int write_p, VALUE deadline)
+{
+	double left = NUM2DBL(deadline) - monotonic_now();
+	ID id = write_p ? id_wait_wr : id_wait_rd;
+
+	if (left <= 0)
+		return 0;
+	if (rb_respond_to(io, id)) {
+		if (rb_obj_method_arity(io, id) == 0)
+			rb_funcall(io, id, 0);
+		else
+			rb_funcall(io, id, 1, DBL2NUM(left));
+		return 1;
+	}
+	return wait_left(io, write_p, left) != 0;
+}
+
+/* returns Qundef if the deadline of +io+ passed */
+VALUE kgio_call_wait_writable(VALUE io)
+{
+	VALUE deadline = kgio_deadline(io);
+
+	if (!NIL_P(deadline))
+		return kgio_wait_deadline(io, 1, deadline) ? io : Qundef;
+	return rb_funcall(io, id_wait_wr, 0, 0);
+}
+
+/* returns Qundef if the deadline of +io+ passed */
+VALUE kgio_call_wait_readable(VALUE io)
+{
+	VALUE deadline = kgio_deadline(io);
+
+	if (!NIL_P(deadline))
+		return kgio_wait_deadline(io, 0, deadline) ? io : Qundef;
+	return rb_funcall(io, id_wait_rd, 0, 0);
+}
+
+void init_kgio_wait(void)
+{
+	VALUE mKgio = rb_define_module("Kgio");
+	VALUE mWaiters, mod;
+
+	/*
+	 * Document-module: Kgio::DefaultWaiters
+	 *
+	 * This module contains default kgio_wait_readable and
+	 * kgio_wait_writable methods that block indefinitely (in a
+	 * thread-safe manner) until an IO object is read or writable.
+	 * This module is included in the Kgio::PipeMethods and
+	 * Kgio::SocketMethods modules used by all bundled IO-derived
+	 * objects.
+	 */
+	mWaiters = rb_define_module_under(mKgio, "DefaultWaiters");
+
+	id_wait_rd = rb_intern("kgio_wait_readable");
+	id_wait_wr = rb_intern("kgio_wait_writable");
+	id_deadline = rb_intern("kgio_deadline");
+	check_clock();
+
+	rb_define_method(mWaiters, "kgio_wait_readable",
+	                 kgio_wait_readable, -1);
+	rb_define_method(mWaiters, "kgio_wait_writable",
+	                 kgio_wait_writable, -1);
+
+	mod = rb_define_module_under(mKgio, "PipeMethods");
+	rb_define_method(mod, "kgio_deadline=", kgio_set_deadline, 1);
+	rb_define_method(mod, "kgio_deadline", kgio_deadline, 0);
+	mod = rb_define_module_under(mKgio, "SocketMethods");
+	rb_define_method(mod, "kgio_deadline=", kgio_set_deadline, 1);
+	rb_define_method(mod, "kgio_deadline", kgio_deadline, 0);
+}